@@ -0,0 +1,96 @@
+#include "rate_control.h"
+
+#ifdef _DEBUG
+#define Assert(Cond) do { if (!(Cond)) __debugbreak(); } while (0)
+#else
+#define Assert(Cond) (void)(Cond)
+#endif
+
+// queue is congested when any of these is reached, this is well below where rtmp stream starts dropping frames
+#define RATE_CONGESTED_DELAY 400 // msec
+#define RATE_CONGESTED_USAGE 20  // percent
+
+// queue is clear when all of these are below, gap between clear & congested values gives hysteresis
+#define RATE_CLEAR_DELAY 100 // msec
+#define RATE_CLEAR_USAGE 5   // percent
+
+#define RATE_DECREASE_PERCENT  75   // multiply bitrate by this when congested
+#define RATE_DECREASE_INTERVAL 1000 // msec, min time between decreases so previous change can take effect
+#define RATE_INCREASE_PERCENT  5    // add this much of bitrate when clear
+#define RATE_INCREASE_MIN      50   // kbit/s, smallest increase
+#define RATE_INCREASE_HOLD     5000 // msec queue must stay clear after any change before increasing
+#define RATE_BANDWIDTH_PERCENT 85   // max bitrate relative to estimated bandwidth
+
+void RateControl_Init(RateControl* Control, uint32_t Bitrate, uint32_t MinBitrate, uint32_t MaxBitrate)
+{
+	Assert(MinBitrate <= Bitrate && Bitrate <= MaxBitrate);
+
+	LARGE_INTEGER Frequency;
+	QueryPerformanceFrequency(&Frequency);
+
+	Control->Bitrate = Bitrate;
+	Control->MinBitrate = MinBitrate;
+	Control->MaxBitrate = MaxBitrate;
+	Control->Dropped = 0;
+	Control->ChangeTime = 0;
+	Control->ClearTime = 0;
+	Control->Frequency = Frequency.QuadPart;
+}
+
+uint32_t RateControl_Update(RateControl* Control, const RtmpNetworkStats* Stats)
+{
+	LARGE_INTEGER Now;
+	QueryPerformanceCounter(&Now);
+
+	bool Dropped = Stats->Dropped != Control->Dropped;
+	Control->Dropped = Stats->Dropped;
+
+	// bandwidth estimate is 0 until it is known
+	uint32_t Limit = Control->MaxBitrate;
+	if (Stats->Bandwidth != 0)
+	{
+		uint32_t Bandwidth = (uint32_t)((uint64_t)Stats->Bandwidth * 8 / 1000 * RATE_BANDWIDTH_PERCENT / 100);
+		Limit = max(min(Limit, Bandwidth), Control->MinBitrate);
+	}
+
+	uint64_t SinceChange = (Now.QuadPart - Control->ChangeTime) * 1000 / Control->Frequency;
+	uint32_t Bitrate = Control->Bitrate;
+
+	if (Dropped || Stats->QueueDelay >= RATE_CONGESTED_DELAY || Stats->QueueUsage >= RATE_CONGESTED_USAGE)
+	{
+		Control->ClearTime = 0;
+		if (SinceChange >= RATE_DECREASE_INTERVAL)
+		{
+			Bitrate = Bitrate * RATE_DECREASE_PERCENT / 100;
+		}
+	}
+	else if (Stats->QueueDelay < RATE_CLEAR_DELAY && Stats->QueueUsage < RATE_CLEAR_USAGE)
+	{
+		if (Control->ClearTime == 0)
+		{
+			Control->ClearTime = Now.QuadPart;
+		}
+
+		uint64_t SinceClear = (Now.QuadPart - Control->ClearTime) * 1000 / Control->Frequency;
+		if (SinceClear >= RATE_INCREASE_HOLD && SinceChange >= RATE_INCREASE_HOLD)
+		{
+			Bitrate = Bitrate + max(Bitrate * RATE_INCREASE_PERCENT / 100, RATE_INCREASE_MIN);
+		}
+	}
+	else
+	{
+		// in between, keep current bitrate
+		Control->ClearTime = 0;
+	}
+
+	// bandwidth limit applies in every state, also when estimate drops while queue is not yet growing
+	Bitrate = max(min(Bitrate, Limit), Control->MinBitrate);
+	if (Bitrate == Control->Bitrate)
+	{
+		return 0;
+	}
+
+	Control->Bitrate = Bitrate;
+	Control->ChangeTime = Now.QuadPart;
+	return Bitrate;
+}
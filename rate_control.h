@@ -0,0 +1,25 @@
+#pragma once
+
+#include "rtmp_stream.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// adaptive bitrate controller, decides video encoder bitrate from state of outgoing rtmp queue
+// bitrate is decreased quickly once queue starts to grow or frames are dropped
+// and increased slowly only after queue has stayed empty for a while
+typedef struct {
+	uint32_t Bitrate;    // kbit/s, current target
+	uint32_t MinBitrate;
+	uint32_t MaxBitrate;
+	uint32_t Dropped;    // dropped frame count at previous update, any change counts as congestion
+	uint64_t ChangeTime; // QPC value of last bitrate change
+	uint64_t ClearTime;  // QPC value since when queue has been clear, 0 if it is not clear
+	uint64_t Frequency;
+} RateControl;
+
+void RateControl_Init(RateControl* Control, uint32_t Bitrate, uint32_t MinBitrate, uint32_t MaxBitrate);
+
+// call periodically with stats of stream, for multiple destinations pass worst values of them
+// returns new bitrate in kbit/s when it should be changed, or 0 when it stays same
+uint32_t RateControl_Update(RateControl* Control, const RtmpNetworkStats* Stats);
@@ -0,0 +1,371 @@
+#pragma once
+
+// minimal Win32 compatibility layer for building rtmp_stream.c on Linux
+// only what shared protocol engine uses, socket & resolver code has its own Linux implementation
+
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <errno.h>
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+typedef int32_t LONG;
+typedef int64_t LONG64;
+typedef int64_t LONGLONG;
+typedef uint32_t DWORD;
+typedef uint32_t ULONG;
+typedef uintptr_t ULONG_PTR;
+typedef int BOOL;
+typedef void* LPVOID;
+typedef int SOCKET;
+
+typedef union {
+	struct {
+		DWORD LowPart;
+		LONG HighPart;
+	};
+	LONGLONG QuadPart;
+} LARGE_INTEGER;
+
+#define TRUE  1
+#define FALSE 0
+#define WINAPI
+#define INFINITE      0xFFFFFFFF
+#define WAIT_OBJECT_0 0
+#define WAIT_TIMEOUT  258
+#define WAIT_FAILED   0xFFFFFFFF
+#define INVALID_SOCKET (-1)
+
+#define ARRAYSIZE(Array) (sizeof(Array) / sizeof((Array)[0]))
+
+#ifndef min
+#define min(a, b) (((a) < (b)) ? (a) : (b))
+#endif
+#ifndef max
+#define max(a, b) (((a) > (b)) ? (a) : (b))
+#endif
+
+#define CopyMemory(Dst, Src, Size) memcpy((Dst), (Src), (Size))
+#define MoveMemory(Dst, Src, Size) memmove((Dst), (Src), (Size))
+#define ZeroMemory(Dst, Size)      memset((Dst), 0, (Size))
+
+#define StrCmpNA(a, b, Count) strncmp((a), (b), (Count))
+#define StrCatA(Dst, Src) strcat((Dst), (Src))
+
+static inline char* StrCpyNA(char* Dst, const char* Src, int Count)
+{
+	// same as Win32, copies at most Count-1 characters & always terminates
+	if (Count > 0)
+	{
+		size_t Length = strnlen(Src, Count - 1);
+		memcpy(Dst, Src, Length);
+		Dst[Length] = 0;
+	}
+	return Dst;
+}
+
+#define __debugbreak() __builtin_trap()
+
+static inline unsigned char _BitScanReverse(unsigned long* Index, unsigned long Mask)
+{
+	*Index = Mask ? (unsigned long)(63 - __builtin_clzl(Mask)) : 0;
+	return Mask != 0;
+}
+
+static inline unsigned char _BitScanReverse64(unsigned long* Index, uint64_t Mask)
+{
+	*Index = Mask ? (unsigned long)(63 - __builtin_clzll(Mask)) : 0;
+	return Mask != 0;
+}
+
+// atomics, Interlocked* are full barriers & return new value, except Exchange/CompareExchange which return old one
+
+#define InterlockedIncrement(Ptr)            __atomic_add_fetch((Ptr), 1, __ATOMIC_SEQ_CST)
+#define InterlockedDecrement(Ptr)            __atomic_sub_fetch((Ptr), 1, __ATOMIC_SEQ_CST)
+#define InterlockedAdd(Ptr, Value)           __atomic_add_fetch((Ptr), (Value), __ATOMIC_SEQ_CST)
+#define InterlockedExchange(Ptr, Value)      __atomic_exchange_n((Ptr), (Value), __ATOMIC_SEQ_CST)
+#define InterlockedExchange64(Ptr, Value)    __atomic_exchange_n((Ptr), (Value), __ATOMIC_SEQ_CST)
+#define InterlockedIncrementNoFence(Ptr)     __atomic_add_fetch((Ptr), 1, __ATOMIC_RELAXED)
+#define InterlockedIncrementNoFence64(Ptr)   __atomic_add_fetch((Ptr), 1, __ATOMIC_RELAXED)
+#define InterlockedAddNoFence64(Ptr, Value)  __atomic_add_fetch((Ptr), (Value), __ATOMIC_RELAXED)
+
+static inline LONG InterlockedCompareExchange(volatile LONG* Ptr, LONG Exchange, LONG Comparand)
+{
+	__atomic_compare_exchange_n(Ptr, &Comparand, Exchange, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+	return Comparand;
+}
+
+static inline LONG InterlockedCompareExchangeNoFence(volatile LONG* Ptr, LONG Exchange, LONG Comparand)
+{
+	__atomic_compare_exchange_n(Ptr, &Comparand, Exchange, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+	return Comparand;
+}
+
+static inline LONG64 InterlockedCompareExchange64(volatile LONG64* Ptr, LONG64 Exchange, LONG64 Comparand)
+{
+	__atomic_compare_exchange_n(Ptr, &Comparand, Exchange, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+	return Comparand;
+}
+
+#define ReadNoFence(Ptr)                  __atomic_load_n((Ptr), __ATOMIC_RELAXED)
+#define ReadNoFence64(Ptr)                __atomic_load_n((Ptr), __ATOMIC_RELAXED)
+#define ReadAcquire(Ptr)                  __atomic_load_n((Ptr), __ATOMIC_ACQUIRE)
+#define ReadULongPtrAcquire(Ptr)          __atomic_load_n((Ptr), __ATOMIC_ACQUIRE)
+#define WriteNoFence(Ptr, Value)          __atomic_store_n((Ptr), (Value), __ATOMIC_RELAXED)
+#define WriteNoFence64(Ptr, Value)        __atomic_store_n((Ptr), (Value), __ATOMIC_RELAXED)
+#define WriteRelease(Ptr, Value)          __atomic_store_n((Ptr), (Value), __ATOMIC_RELEASE)
+#define WriteULongPtrRelease(Ptr, Value)  __atomic_store_n((Ptr), (Value), __ATOMIC_RELEASE)
+
+// time, same 10MHz frequency as QPC on current Windows versions
+
+static inline BOOL QueryPerformanceFrequency(LARGE_INTEGER* Frequency)
+{
+	Frequency->QuadPart = 10000000;
+	return TRUE;
+}
+
+static inline BOOL QueryPerformanceCounter(LARGE_INTEGER* Counter)
+{
+	struct timespec Time;
+	clock_gettime(CLOCK_MONOTONIC, &Time);
+	Counter->QuadPart = (LONGLONG)Time.tv_sec * 10000000 + Time.tv_nsec / 100;
+	return TRUE;
+}
+
+static inline void Sleep(DWORD Milliseconds)
+{
+	struct timespec Time = { .tv_sec = Milliseconds / 1000, .tv_nsec = (Milliseconds % 1000) * 1000000L };
+	while (nanosleep(&Time, &Time) != 0 && errno == EINTR);
+}
+
+// memory, size is kept in front of allocation so it can be unmapped
+
+#define MEM_COMMIT     0x1000
+#define MEM_RESERVE    0x2000
+#define MEM_RELEASE    0x8000
+#define PAGE_READWRITE 0x04
+
+static inline void* VirtualAlloc(void* Address, size_t Size, DWORD Type, DWORD Protect)
+{
+	size_t Page = (size_t)sysconf(_SC_PAGESIZE);
+	uint8_t* Memory = mmap(Address, Size + Page, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (Memory == MAP_FAILED)
+	{
+		return NULL;
+	}
+	*(size_t*)Memory = Size + Page;
+	return Memory + Page;
+}
+
+static inline BOOL VirtualFree(void* Address, size_t Size, DWORD Type)
+{
+	size_t Page = (size_t)sysconf(_SC_PAGESIZE);
+	uint8_t* Memory = (uint8_t*)Address - Page;
+	return munmap(Memory, *(size_t*)Memory) == 0;
+}
+
+typedef struct {
+	DWORD dwPageSize;
+	DWORD dwAllocationGranularity;
+} SYSTEM_INFO;
+
+static inline void GetSystemInfo(SYSTEM_INFO* Info)
+{
+	// keep same granularity as Windows, so ring buffer sizes are same on both
+	Info->dwPageSize = (DWORD)sysconf(_SC_PAGESIZE);
+	Info->dwAllocationGranularity = max(Info->dwPageSize, 65536);
+}
+
+// locks
+
+typedef pthread_rwlock_t SRWLOCK;
+
+#define InitializeSRWLock(Lock)       pthread_rwlock_init((Lock), NULL)
+#define AcquireSRWLockExclusive(Lock) pthread_rwlock_wrlock(Lock)
+#define ReleaseSRWLockExclusive(Lock) pthread_rwlock_unlock(Lock)
+#define AcquireSRWLockShared(Lock)    pthread_rwlock_rdlock(Lock)
+#define ReleaseSRWLockShared(Lock)    pthread_rwlock_unlock(Lock)
+
+// events & timers are file descriptors, so they can be waited with poll or epoll together with sockets
+// events are eventfd, waitable timers are timerfd, thread handle is joined by WaitForSingleObject
+
+typedef DWORD WINAPI RtmpThread_Callback(LPVOID Arg);
+
+typedef struct {
+	int Fd;            // eventfd or timerfd, -1 for thread
+	bool ManualReset;  // stays signaled after wait, otherwise wait consumes it
+	pthread_t Thread;
+	RtmpThread_Callback* Callback;
+	LPVOID Arg;
+} RtmpHandle;
+
+typedef RtmpHandle* HANDLE;
+
+#define CREATE_WAITABLE_TIMER_HIGH_RESOLUTION 0x2
+#define TIMER_ALL_ACCESS 0
+
+static inline HANDLE CreateEventW(void* Attributes, BOOL ManualReset, BOOL InitialState, const void* Name)
+{
+	HANDLE Handle = calloc(1, sizeof(*Handle));
+	Handle->Fd = eventfd(InitialState ? 1 : 0, EFD_NONBLOCK | EFD_CLOEXEC);
+	Handle->ManualReset = ManualReset;
+	return Handle;
+}
+
+static inline BOOL SetEvent(HANDLE Event)
+{
+	uint64_t Value = 1;
+	return write(Event->Fd, &Value, sizeof(Value)) == sizeof(Value) || errno == EAGAIN;
+}
+
+static inline BOOL ResetEvent(HANDLE Event)
+{
+	uint64_t Value;
+	while (read(Event->Fd, &Value, sizeof(Value)) == sizeof(Value));
+	return TRUE;
+}
+
+static inline HANDLE CreateWaitableTimerExW(void* Attributes, const void* Name, DWORD Flags, DWORD Access)
+{
+	// Win32 timers created without manual reset flag are synchronization timers, wait consumes them
+	HANDLE Handle = calloc(1, sizeof(*Handle));
+	Handle->Fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	Handle->ManualReset = false;
+	return Handle;
+}
+
+// only relative due time is supported (negative, in 100nsec units), period is in msec
+static inline BOOL SetWaitableTimer(HANDLE Timer, const LARGE_INTEGER* DueTime, LONG Period, void* Routine, void* Arg, BOOL Resume)
+{
+	uint64_t Due = DueTime->QuadPart < 0 ? (uint64_t)-DueTime->QuadPart * 100 : 1;
+	struct itimerspec Spec =
+	{
+		.it_value = { .tv_sec = Due / 1000000000, .tv_nsec = Due % 1000000000 },
+		.it_interval = { .tv_sec = Period / 1000, .tv_nsec = (Period % 1000) * 1000000L },
+	};
+	if (Spec.it_value.tv_sec == 0 && Spec.it_value.tv_nsec == 0)
+	{
+		// zero would disarm timer
+		Spec.it_value.tv_nsec = 1;
+	}
+	return timerfd_settime(Timer->Fd, 0, &Spec, NULL) == 0;
+}
+
+static inline BOOL CancelWaitableTimer(HANDLE Timer)
+{
+	struct itimerspec Spec = { 0 };
+	return timerfd_settime(Timer->Fd, 0, &Spec, NULL) == 0;
+}
+
+static inline void* RTMP__PosixThread(void* Arg)
+{
+	HANDLE Handle = Arg;
+	Handle->Callback(Handle->Arg);
+	return NULL;
+}
+
+static inline HANDLE CreateThread(void* Attributes, size_t StackSize, RtmpThread_Callback* Callback, LPVOID Arg, DWORD Flags, DWORD* ThreadId)
+{
+	HANDLE Handle = calloc(1, sizeof(*Handle));
+	Handle->Fd = -1;
+	Handle->Callback = Callback;
+	Handle->Arg = Arg;
+	if (pthread_create(&Handle->Thread, NULL, &RTMP__PosixThread, Handle) != 0)
+	{
+		free(Handle);
+		return NULL;
+	}
+	return Handle;
+}
+
+static inline BOOL CloseHandle(HANDLE Handle)
+{
+	if (Handle->Fd >= 0)
+	{
+		close(Handle->Fd);
+	}
+	free(Handle);
+	return TRUE;
+}
+
+// consumes signaled state of auto-reset event or timer, returns false if other waiter got it first
+static inline bool RTMP__PosixConsume(HANDLE Handle)
+{
+	if (Handle->ManualReset)
+	{
+		return true;
+	}
+	uint64_t Value;
+	return read(Handle->Fd, &Value, sizeof(Value)) == sizeof(Value);
+}
+
+// waits for any one of handles, only events & timers can be waited this way
+static inline DWORD WaitForMultipleObjects(DWORD Count, const HANDLE* Handles, BOOL WaitAll, DWORD Milliseconds)
+{
+	struct pollfd Fds[64];
+	for (DWORD i = 0; i < Count; i++)
+	{
+		Fds[i] = (struct pollfd){ .fd = Handles[i]->Fd, .events = POLLIN };
+	}
+
+	struct timespec Start;
+	clock_gettime(CLOCK_MONOTONIC, &Start);
+
+	for (;;)
+	{
+		int Timeout = -1;
+		if (Milliseconds != INFINITE)
+		{
+			struct timespec Now;
+			clock_gettime(CLOCK_MONOTONIC, &Now);
+			int64_t Elapsed = (Now.tv_sec - Start.tv_sec) * 1000 + (Now.tv_nsec - Start.tv_nsec) / 1000000;
+			Timeout = (int)max((int64_t)Milliseconds - Elapsed, 0);
+		}
+
+		int Ready = poll(Fds, Count, Timeout);
+		if (Ready < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			return WAIT_FAILED;
+		}
+		if (Ready == 0)
+		{
+			return WAIT_TIMEOUT;
+		}
+
+		for (DWORD i = 0; i < Count; i++)
+		{
+			if ((Fds[i].revents & POLLIN) && RTMP__PosixConsume(Handles[i]))
+			{
+				return WAIT_OBJECT_0 + i;
+			}
+		}
+	}
+}
+
+static inline DWORD WaitForSingleObject(HANDLE Handle, DWORD Milliseconds)
+{
+	if (Handle->Fd < 0)
+	{
+		// thread handle, only waiting until it finishes is supported
+		pthread_join(Handle->Thread, NULL);
+		return WAIT_OBJECT_0;
+	}
+	return WaitForMultipleObjects(1, &Handle, FALSE, Milliseconds);
+}
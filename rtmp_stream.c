@@ -1,9 +1,14 @@
 #define WIN32_LEAN_AND_MEAN
 #include "rtmp_stream.h"
 
+#ifdef _WIN32
 #include <winsock2.h>
 #include <ws2tcpip.h>
+#include <mstcpip.h>
 #include <shlwapi.h>
+#define SCHANNEL_USE_BLACKLISTS
+#include <subauth.h>
+#include <schannel.h>
 
 #include <stdarg.h>
 #include <intrin.h>
@@ -12,6 +17,22 @@
 #pragma comment (lib, "shlwapi.lib")
 #pragma comment (lib, "ws2_32.lib")
 #pragma comment (lib, "wininet.lib")
+#pragma comment (lib, "secur32.lib")
+#else
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <linux/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#define closesocket close
+#define WSAGetLastError() errno
+#endif
 
 #ifdef _DEBUG
 #define Assert(Cond) do { if (!(Cond)) __debugbreak(); } while (0)
@@ -40,9 +61,32 @@
 
 #define RTMP_HANDSHAKE_RANDOM_SIZE 1528
 #define RTMP_DEFAULT_PORT 1935
+#define RTMPS_DEFAULT_PORT 443
 
 #define RTMP_OUT_CHUNK_SIZE 65536   // RTMP outgoing chunk payload max size, 64 KiB
-#define RTMP_OUT_ACK_SIZE (1 << 30) // RTMP outgoing data ACK size, 1 GiB (this code does not care about ACK's)
+#define RTMP_MIN_CHUNK_SIZE 1024    // smallest chunk size chosen for interleaving audio with video
+#define RTMP_AAC_FRAME_SAMPLES 1024 // samples in one AAC packet
+#define RTMP_OPUS_FRAME_SAMPLES 960 // samples in one 20 msec Opus packet at 48 kHz
+#define RTMP_OUT_ACK_SIZE (256 * 1024) // server sends Acknowledgement after receiving this many bytes, used for bytes in flight
+#define RTMP_STATS_INTERVAL 1000       // msec between pings & network estimate updates
+#define RTMP_STATS_SMOOTHING 8         // bandwidth estimate moves 1/N towards each new sample
+
+// bandwidth probe
+#define RTMP_PROBE_STEP     250       // msec how long each rate is sent
+#define RTMP_PROBE_INTERVAL 10        // msec between queueing padding messages
+#define RTMP_PROBE_PACKET   (8 * 1024) // max size of one padding message
+#define RTMP_PROBE_GROWTH   150       // percent, rate increase for next step
+#define RTMP_PROBE_DRAINED  90        // percent of queued data that must be sent during step to go to higher rate
+#define RTMP_PROBE_HEADROOM 75        // percent of measured rate recommended for encoder
+
+// video drop policy, values are outgoing buffer usage in percent
+#define RTMP_DROP_DISPOSABLE_USAGE 50 // start dropping B-frames
+#define RTMP_DROP_GOP_USAGE        75 // start dropping everything until next keyframe
+#define RTMP_DROP_RESUME_USAGE     25 // stop dropping
+
+#define RTMP_DROP_NONE       0
+#define RTMP_DROP_DISPOSABLE 1
+#define RTMP_DROP_GOP        2
 
 // value probably is not important, they just need to be unique
 #define RTMP_TRANSACTION_CONNECT       1
@@ -59,6 +103,7 @@
 // these must use RTMP_CHANNEL_CONTROL
 #define RTMP_PACKET_SET_CHUNK_SIZE  1
 #define RTMP_PACKET_ACK             3
+#define RTMP_PACKET_USER_CONTROL    4
 #define RTMP_PACKET_SET_WINDOW_SIZE 5
 #define RTMP_PACKET_SET_PEER_BW     6
 
@@ -69,6 +114,26 @@
 #define RTMP_PACKET_AUDIO           8 // RTMP_CHANNEL_AUDIO
 #define RTMP_PACKET_VIDEO           9 // RTMP_CHANNEL_VIDEO
 
+// user control message events
+#define RTMP_USER_PING_REQUEST  6
+#define RTMP_USER_PING_RESPONSE 7
+
+// Enhanced RTMP video packet types
+#define RTMP_VIDEO_SEQUENCE_START 0
+#define RTMP_VIDEO_CODED_FRAMES   1
+#define RTMP_VIDEO_CODED_FRAMES_X 3 // CodedFrames with implicit zero composition time offset
+
+#define RTMP_VIDEO_MAX_HEADER 8 // max size of FLV video tag header before codec data
+
+// Enhanced RTMP audio packet types
+#define RTMP_AUDIO_SEQUENCE_START 0
+#define RTMP_AUDIO_CODED_FRAMES   1
+
+#define RTMP_AUDIO_EX_HEADER 9  // SoundFormat value that marks ExAudioTagHeader
+#define RTMP_AUDIO_MAX_HEADER 5 // max size of FLV audio tag header before codec data
+
+#define RTMP_FOURCC(a, b, c, d) (((uint32_t)(a) << 24) | ((uint32_t)(b) << 16) | ((uint32_t)(c) << 8) | (uint32_t)(d))
+
 // returns smallest Pow2 multiple that is >= Value
 #define CEIL_POW2(Value, Pow2) (((Value) + (Pow2) - 1) & ~((Pow2) - 1))
 
@@ -228,6 +293,11 @@
 	BE_PUT4(Ptr, Count);               \
 } while (0)
 
+#define AMF_STRICT_ARRAY(Ptr, Count) do { \
+	BE_PUT1(Ptr, 10);                     \
+	BE_PUT4(Ptr, Count);                  \
+} while (0)
+
 #define AMF_OBJ_BEGIN(Ptr) do { \
 	BE_PUT1(Ptr, 3);            \
 } while (0)
@@ -256,7 +326,7 @@
 	}                          \
 } while (0)
 
-#ifdef _DEBUG
+#if defined(_DEBUG) && defined(_WIN32)
 static void RTMP_DEBUG(const char* Message, ...)
 {
 	va_list Args;
@@ -269,12 +339,26 @@ static void RTMP_DEBUG(const char* Message, ...)
 
 	va_end(Args);
 }
+#elif defined(_DEBUG)
+static void RTMP_DEBUG(const char* Message, ...)
+{
+	va_list Args;
+	va_start(Args, Message);
+
+	fputs("RTMP: ", stderr);
+	vfprintf(stderr, Message, Args);
+	fputs("\n", stderr);
+
+	va_end(Args);
+}
 #else
 #define RTMP_DEBUG(...) (void)(__VA_ARGS__)
 #endif
 
 // RingBuffer stuff
 
+#ifdef _WIN32
+
 static void RB_Init(RtmpRingBuffer* RingBuffer, uint32_t Size)
 {
 	// Scenario 1 from Examples at https://docs.microsoft.com/en-us/windows/win32/api/memoryapi/nf-memoryapi-virtualalloc2
@@ -310,6 +394,41 @@ static void RB_Done(RtmpRingBuffer* RingBuffer)
 	VirtualFree(RingBuffer->Buffer, 0, MEM_RELEASE);
 }
 
+#else
+
+static void RB_Init(RtmpRingBuffer* RingBuffer, uint32_t Size)
+{
+	// same memory mapped twice next to each other, reserve both halves first & then map over them
+	int Memory = memfd_create("rtmp_ring", MFD_CLOEXEC);
+	Assert(Memory >= 0);
+
+	int Error = ftruncate(Memory, Size);
+	Assert(Error == 0);
+
+	uint8_t* Placeholder = mmap(NULL, 2 * (size_t)Size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	Assert(Placeholder != MAP_FAILED);
+
+	uint8_t* View1 = mmap(Placeholder, Size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, Memory, 0);
+	Assert(View1 == Placeholder);
+
+	uint8_t* View2 = mmap(Placeholder + Size, Size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, Memory, 0);
+	Assert(View2 == Placeholder + Size);
+
+	close(Memory);
+
+	RingBuffer->Buffer = View1;
+	RingBuffer->Size = Size;
+	RingBuffer->Read = 0;
+	RingBuffer->Write = 0;
+}
+
+static void RB_Done(RtmpRingBuffer* RingBuffer)
+{
+	munmap(RingBuffer->Buffer, 2 * RingBuffer->Size);
+}
+
+#endif
+
 static uint32_t RB_GetUsed(const RtmpRingBuffer* RingBuffer)
 {
 	return (uint32_t)(RingBuffer->Write - RingBuffer->Read);
@@ -354,1135 +473,5139 @@ static void RB_EndWrite(RtmpRingBuffer* RingBuffer, uint32_t Size)
 	RingBuffer->Write += Size;
 }
 
-// socket send handling
-
-static void RTMP__BeginSend(SOCKET Socket, RtmpStream* Stream)
+static uint8_t* RB_GetPointer(RtmpRingBuffer* RingBuffer, size_t Position)
 {
-	uint32_t used = RB_GetUsed(&Stream->Send);
-	WSABUF Buffer = { .buf = RB_BeginRead(&Stream->Send), .len = used };
-	DWORD Error = WSASend(Socket, &Buffer, 1, NULL, 0, &Stream->SendOv, NULL);
-	if (Error == SOCKET_ERROR)
-	{
-		Error = WSAGetLastError();
-		if (Error == WSA_IO_PENDING)
-		{
-			// send is happening in background
-		}
-		else if (Error == WSAECONNRESET)
-		{
-			Assert(!"TODO: connection closed, disconnect");
-		}
-		else
-		{
-			Assert(!"TODO: socket error, disconnect");
-		}
-	}
-
-	Stream->Sending = true;
+	size_t Offset = Position & (RingBuffer->Size - 1);
+	return RingBuffer->Buffer + Offset;
 }
 
-static void RTMP__EndSend(SOCKET Socket, RtmpStream* Stream)
-{
-	DWORD Transferred;
-	DWORD Flags;
-	BOOL Ok = WSAGetOverlappedResult(Socket, &Stream->SendOv, &Transferred, TRUE, &Flags);
-	ResetEvent(Stream->SendOv.hEvent);
-	Assert(Ok);
+// outgoing message queue
+//
+// lock-free multi-producer, single-consumer queue:
+// 1) producer atomically reserves message slot together with space in Send ring buffer,
+//    both are packed in one 64-bit value so they are always reserved in same order
+// 2) producer fills reserved space without holding any lock
+// 3) producer commits message by publishing its Sequence, consumer takes only committed messages in order
+// this way producer never waits on other producers, slow producer only delays sending of messages after it
+
+#define RTMP_RESERVE(Index, Position) (((LONG64)(Index) << 32) | (uint32_t)(Position))
+#define RTMP_RESERVE_INDEX(Reserve)    (uint32_t)((uint64_t)(Reserve) >> 32)
+#define RTMP_RESERVE_POSITION(Reserve) (uint32_t)(Reserve)
+
+// statistics
 
-	Stream->Sending = false;
+// network thread is only writer of these counters, so relaxed load & store is enough
+#define RTMP_STAT_ADD(Counter, Value) WriteNoFence64(&(Counter), ReadNoFence64(&(Counter)) + (Value))
 
-	Assert(Transferred <= RB_GetUsed(&Stream->Send));
-	RB_EndRead(&Stream->Send, Transferred);
+static uint32_t RTMP__GetTrack(uint32_t MessageType)
+{
+	return MessageType == RTMP_PACKET_VIDEO ? RTMP_TRACK_VIDEO : RTMP_TRACK_AUDIO;
 }
 
-// RTMP protocol stuff
+// can be called from any thread
+static void RTMP__CountDrop(RtmpStream* Stream, uint32_t MessageType, uint32_t Reason)
+{
+	InterlockedIncrementNoFence64(&Stream->Tracks[RTMP__GetTrack(MessageType)].Dropped[Reason]);
+}
 
-// fmt=0 chunk size, should fit into one payload, always use timestamp=0
-static bool RTMP__WriteChunk(RtmpRingBuffer* Buffer, uint32_t ChunkStreamId, uint32_t MessageType, uint32_t MessageStreamId, const uint8_t* Message, uint32_t MessageSize)
+// called from network thread once media message is fully given to socket
+static void RTMP__CountSent(RtmpStream* Stream, const RtmpMessage* Entry, uint64_t Now)
 {
-	Assert(ChunkStreamId >= 2 && ChunkStreamId < 64);
-	Assert(MessageSize <= 0xffffff);
-	uint32_t Timestamp = 0;
+	RtmpTrackCounters* Track = &Stream->Tracks[RTMP__GetTrack(Entry->MessageType)];
+	RTMP_STAT_ADD(Track->SentBytes, Entry->Size + Entry->DataSize);
+	RTMP_STAT_ADD(Track->SentMessages, 1);
 
-	uint32_t Available = RB_GetFree(Buffer);
-	if (Available < 1 + 3 + 3 + 1 + 4 + MessageSize)
+	uint64_t Delay = Now > Entry->Time ? (Now - Entry->Time) * 1000 / Stream->Frequency : 0;
+	uint32_t Bucket = 0;
+	if (Delay != 0)
 	{
-		return false;
+		unsigned long Index;
+		_BitScanReverse64(&Index, Delay);
+		Bucket = min(Index + 1, RTMP_DELAY_BUCKETS - 1);
 	}
+	RTMP_STAT_ADD(Stream->DelayHistogram[Bucket], 1);
+}
 
-	uint8_t* Begin = RB_BeginWrite(Buffer);
-	uint8_t* Ptr = Begin;
+// outgoing buffer
+
+// returns NULL if there is no more space in outgoing buffer
+// Session is what caller validated message against, it is not read again so message cannot move to newer connection
+static RtmpMessage* RTMP__BeginMessage(RtmpStream* Stream, LONG Session, uint32_t Size)
+{
+	LONG64 Reserve = ReadNoFence64(&Stream->SendReserve);
+	for (;;)
+	{
+		uint32_t Index = RTMP_RESERVE_INDEX(Reserve);
+		uint32_t Position = RTMP_RESERVE_POSITION(Reserve);
 
-	BE_PUT1(Ptr, ChunkStreamId);
-	BE_PUT3(Ptr, Timestamp);
-	BE_PUT3(Ptr, MessageSize);
-	BE_PUT1(Ptr, MessageType);
-	LE_PUT4(Ptr, MessageStreamId); // lol, little endian for some reason
-	CopyMemory(Ptr, Message, MessageSize);
-	Ptr += MessageSize;
+		uint32_t MessageRead = ReadAcquire((volatile LONG*)&Stream->MessageRead);
+		uint32_t SendRead = (uint32_t)ReadULongPtrAcquire((volatile ULONG_PTR*)&Stream->Send.Read);
 
-	RB_EndWrite(Buffer, (uint32_t)(Ptr - Begin));
-	return true;
+		if (Index - MessageRead == RTMP_MAX_MESSAGES || Size > Stream->Send.Size - (Position - SendRead))
+		{
+			return NULL;
+		}
+
+		LONG64 Reserved = InterlockedCompareExchange64(&Stream->SendReserve, RTMP_RESERVE(Index + 1, Position + Size), Reserve);
+		if (Reserved == Reserve)
+		{
+			LONG Used = (LONG)(Position + Size - SendRead);
+			LONG HighWater = ReadNoFence(&Stream->SendHighWater);
+			while (Used > HighWater)
+			{
+				LONG Previous = InterlockedCompareExchangeNoFence(&Stream->SendHighWater, Used, HighWater);
+				if (Previous == HighWater)
+				{
+					break;
+				}
+				HighWater = Previous;
+			}
+
+			RtmpMessage* Entry = &Stream->Messages[Index & (RTMP_MAX_MESSAGES - 1)];
+			*Entry = (RtmpMessage)
+			{
+				.Sequence = Index, // not committed yet
+				.Offset = Position,
+				.Size = Size,
+				.Session = Session,
+			};
+			return Entry;
+		}
+		Reserve = Reserved;
+	}
 }
 
-// fmt=1 chunk, split into extra fmt=3 chunks
-static bool RTMP__SendDeltaChunk(RtmpStream* Stream, uint32_t ChunkStreamId, uint32_t TimestampDelta, uint32_t MessageType, const uint8_t* Extra, uint32_t ExtraSize, const uint8_t* Message, uint32_t MessageSize)
+static void RTMP__EndMessage(RtmpStream* Stream, RtmpMessage* Entry)
 {
-	uint32_t TotalSize = ExtraSize + MessageSize;
-
-	Assert(ChunkStreamId >= 2 && ChunkStreamId < 64);
-	Assert(TotalSize <= 0xffffff);
-	Assert(TimestampDelta < 0xffffff);
-	Assert(ExtraSize < RTMP_OUT_CHUNK_SIZE);
+	// message with Index is committed when its Sequence is Index+1
+	WriteRelease(&Entry->Sequence, Entry->Sequence + 1);
+}
 
-	AcquireSRWLockExclusive(&Stream->Lock);
+static bool RTMP__IsCommitted(RtmpStream* Stream, uint32_t Index)
+{
+	RtmpMessage* Entry = &Stream->Messages[Index & (RTMP_MAX_MESSAGES - 1)];
+	return (uint32_t)ReadAcquire(&Entry->Sequence) == Index + 1;
+}
 
-	uint32_t Required = 1 + 3 + 3 + 1;
-	if (TotalSize <= RTMP_OUT_CHUNK_SIZE)
-	{
-		Required += TotalSize;
-	}
-	else
+// releases outgoing buffer space and caller-owned data of messages up to MessageEnd
+static void RTMP__ReleaseMessages(RtmpStream* Stream, uint32_t MessageEnd)
+{
+	uint32_t Size = 0;
+	for (uint32_t Index = Stream->MessageRead; Index != MessageEnd; Index++)
 	{
-		uint32_t ChunkCount = CEIL_DIV(TotalSize - RTMP_OUT_CHUNK_SIZE, RTMP_OUT_CHUNK_SIZE);
-		Required += ChunkCount; // fmt=3 chunk headers
-		Required += TotalSize; // message payload
+		const RtmpMessage* Entry = &Stream->Messages[Index & (RTMP_MAX_MESSAGES - 1)];
+		if (Entry->Release)
+		{
+			Entry->Release(Entry->ReleaseArg);
+		}
+		Size += Entry->Size;
 	}
-	RtmpRingBuffer* Buffer = &Stream->Send;
 
-	bool Result = false;
-	if (Required <= RB_GetFree(Buffer))
-	{
-		uint8_t* Begin = RB_BeginWrite(Buffer);
-		uint8_t* Ptr = Begin;
+	// only consumer modifies read positions, producers see them after messages are fully released
+	WriteULongPtrRelease((volatile ULONG_PTR*)&Stream->Send.Read, Stream->Send.Read + Size);
+	WriteRelease((volatile LONG*)&Stream->MessageRead, MessageEnd);
+}
 
-		uint32_t ChunkFormat = 1 << 6;
-		BE_PUT1(Ptr, ChunkFormat | ChunkStreamId);
-		BE_PUT3(Ptr, TimestampDelta);
-		BE_PUT3(Ptr, TotalSize);
-		BE_PUT1(Ptr, MessageType);
+// TLS stuff for rtmps urls, Schannel is used for handshake & record encryption
 
-		CopyMemory(Ptr, Extra, ExtraSize);
-		Ptr += ExtraSize;
-		TotalSize -= ExtraSize;
+#define RTMP_TLS_RECV_SIZE (64 * 1024) // received ciphertext buffer, must fit handshake messages with certificate chain
+#define RTMP_TLS_MAX_SEND RTMP_OUT_CHUNK_SIZE // plaintext bytes after which no more chunks are added to one send
+#define RTMP_TLS_CLOSE_TIMEOUT 1000           // msec to wait for close_notify alert to be sent when stopping
 
-		const uint8_t* MessageEnd = Message + MessageSize;
+#ifdef _WIN32
 
-		uint32_t PayloadSize = min(TotalSize, RTMP_OUT_CHUNK_SIZE - ExtraSize);
-		CopyMemory(Ptr, Message, PayloadSize);
-		Ptr += PayloadSize;
-		Message += PayloadSize;
-		TotalSize -= PayloadSize;
+// sends handshake token & waits until it is sent
+static bool RTMP__TlsSendToken(SOCKET Socket, RtmpStream* Stream, SecBuffer* Token)
+{
+	if (Token->cbBuffer == 0 || Token->pvBuffer == NULL)
+	{
+		return true;
+	}
 
-		// make sure first fmt=1 chunk is proper size
-		Assert(Ptr <= Begin + 1 + 3 + 3 + 1 + RTMP_OUT_CHUNK_SIZE);
+	OVERLAPPED* Ov = &Stream->Sends[0].Ov;
+	WSABUF Buffer = { .buf = Token->pvBuffer, .len = Token->cbBuffer };
 
-		// rest of chunks will be fmt=3
-		ChunkFormat = 3 << 6;
-		while (TotalSize != 0)
+	bool Result = false;
+	DWORD Error = WSASend(Socket, &Buffer, 1, NULL, 0, Ov, NULL);
+	if (Error == 0 || WSAGetLastError() == WSA_IO_PENDING)
+	{
+		HANDLE Events[] = { Ov->hEvent, Stream->StopEvent };
+		DWORD Wait = WaitForMultipleObjects(ARRAYSIZE(Events), Events, FALSE, INFINITE);
+		if (Wait == WAIT_OBJECT_0)
 		{
-			BE_PUT1(Ptr, ChunkFormat | ChunkStreamId);
-
-			PayloadSize = min(TotalSize, RTMP_OUT_CHUNK_SIZE);
-			CopyMemory(Ptr, Message, PayloadSize);
-			Ptr += PayloadSize;
-			Message += PayloadSize;
-			TotalSize -= PayloadSize;
+			DWORD Transferred;
+			DWORD Flags;
+			Result = WSAGetOverlappedResult(Socket, Ov, &Transferred, TRUE, &Flags) && Transferred == Token->cbBuffer;
 		}
+		else
+		{
+			// token buffer is freed below, so kernel must be done with it
+			DWORD Transferred;
+			DWORD Flags;
+			CancelIoEx((HANDLE)Socket, Ov);
+			WSAGetOverlappedResult(Socket, Ov, &Transferred, TRUE, &Flags);
+		}
+	}
+	ResetEvent(Ov->hEvent);
 
-		Assert(Message == MessageEnd);
-		Assert(Ptr == Begin + Required);
+	FreeContextBuffer(Token->pvBuffer);
+	Token->pvBuffer = NULL;
+	return Result;
+}
+
+// receives more handshake data after already received ciphertext
+static bool RTMP__TlsRecvToken(SOCKET Socket, RtmpStream* Stream)
+{
+	if (Stream->TlsRecvSize == RTMP_TLS_RECV_SIZE)
+	{
+		RTMP_DEBUG("ERROR: TLS handshake message too large");
+		return false;
+	}
 
-		RB_EndWrite(Buffer, (uint32_t)(Ptr - Begin));
+	OVERLAPPED* Ov = &Stream->RecvOv;
+	WSABUF Buffer = { .buf = Stream->TlsRecv + Stream->TlsRecvSize, .len = RTMP_TLS_RECV_SIZE - Stream->TlsRecvSize };
+	DWORD Flags = 0;
 
-		Result = true;
-		SetEvent(Stream->DataEvent);
+	bool Result = false;
+	DWORD Error = WSARecv(Socket, &Buffer, 1, NULL, &Flags, Ov, NULL);
+	if (Error == 0 || WSAGetLastError() == WSA_IO_PENDING)
+	{
+		HANDLE Events[] = { Ov->hEvent, Stream->StopEvent };
+		DWORD Wait = WaitForMultipleObjects(ARRAYSIZE(Events), Events, FALSE, INFINITE);
+		if (Wait == WAIT_OBJECT_0)
+		{
+			DWORD Transferred;
+			if (WSAGetOverlappedResult(Socket, Ov, &Transferred, TRUE, &Flags) && Transferred != 0)
+			{
+				Stream->TlsRecvSize += Transferred;
+				Result = true;
+			}
+		}
+		else
+		{
+			// receive buffer is freed after failed handshake, so kernel must be done with it
+			DWORD Transferred;
+			CancelIoEx((HANDLE)Socket, Ov);
+			WSAGetOverlappedResult(Socket, Ov, &Transferred, TRUE, &Flags);
+		}
 	}
-	ReleaseSRWLockExclusive(&Stream->Lock);
+	ResetEvent(Ov->hEvent);
 
 	return Result;
 }
 
-static bool RTMP__DoHandshake(SOCKET Socket, RtmpStream* Stream)
+// does TLS client handshake on connected socket, returns false on failure or when quit is requested
+static bool RTMP__TlsConnect(SOCKET Socket, RtmpStream* Stream, const WCHAR* HostName)
 {
-	uint32_t HandshakeSize = 1                // S0
-		+ 4 + 4 + RTMP_HANDSHAKE_RANDOM_SIZE  // S1
-		+ 4 + 4 + RTMP_HANDSHAKE_RANDOM_SIZE; // S2
-
-	uint32_t Available = RB_GetUsed(&Stream->Recv);
-	if (Available < HandshakeSize)
+	SCH_CREDENTIALS Credentials =
 	{
-		// not enough data for handshake
+		.dwVersion = SCH_CREDENTIALS_VERSION,
+		.dwFlags = SCH_USE_STRONG_CRYPTO | SCH_CRED_AUTO_CRED_VALIDATION | SCH_CRED_NO_DEFAULT_CREDS,
+	};
+	SECURITY_STATUS Status = AcquireCredentialsHandleW(NULL, UNISP_NAME_W, SECPKG_CRED_OUTBOUND, NULL, &Credentials, NULL, NULL, &Stream->TlsCredentials, NULL);
+	if (Status != SEC_E_OK)
+	{
+		RTMP_DEBUG("ERROR: AcquireCredentialsHandle failed, 0x%08x", Status);
 		return false;
 	}
 
-	RTMP_DEBUG("Received S0+S1+S2 handshake");
+	Stream->TlsRecv = VirtualAlloc(NULL, RTMP_TLS_RECV_SIZE, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+	Assert(Stream->TlsRecv);
+	Stream->TlsRecvSize = 0;
 
-	// S0+S1+S2 received, reset received byte count to 0 to exclude header bytes
-	Stream->BytesReceived = 0;
+	DWORD Flags = ISC_REQ_SEQUENCE_DETECT | ISC_REQ_REPLAY_DETECT | ISC_REQ_CONFIDENTIALITY | ISC_REQ_ALLOCATE_MEMORY | ISC_REQ_STREAM;
+	bool HasContext = false;
 
-	// C2 response == S1
+	for (;;)
 	{
-		RTMP_DEBUG("Sending C2 handshake");
+		SecBuffer InBuffers[2] =
+		{
+			{ Stream->TlsRecvSize, SECBUFFER_TOKEN, Stream->TlsRecv },
+			{ 0, SECBUFFER_EMPTY, NULL },
+		};
+		SecBuffer OutBuffers[1] =
+		{
+			{ 0, SECBUFFER_TOKEN, NULL },
+		};
+		SecBufferDesc InDesc = { SECBUFFER_VERSION, ARRAYSIZE(InBuffers), InBuffers };
+		SecBufferDesc OutDesc = { SECBUFFER_VERSION, ARRAYSIZE(OutBuffers), OutBuffers };
+
+		DWORD Attributes;
+		Status = InitializeSecurityContextW(&Stream->TlsCredentials, HasContext ? &Stream->TlsContext : NULL, (SEC_WCHAR*)HostName,
+			Flags, 0, 0, HasContext ? &InDesc : NULL, 0, HasContext ? NULL : &Stream->TlsContext, &OutDesc, &Attributes, NULL);
+		if (Status == SEC_E_OK || Status == SEC_I_CONTINUE_NEEDED || Status == SEC_E_INCOMPLETE_MESSAGE)
+		{
+			// on failure of first call context is not created, so it must not be deleted
+			HasContext = true;
+		}
 
-		uint8_t* Handshake = RB_BeginRead(&Stream->Recv);
+		if (Status == SEC_E_INCOMPLETE_MESSAGE)
+		{
+			if (!RTMP__TlsRecvToken(Socket, Stream))
+			{
+				break;
+			}
+			continue;
+		}
 
-		uint32_t HandshakeResponseSize = 4 + 4 + RTMP_HANDSHAKE_RANDOM_SIZE;
-		Assert(HandshakeResponseSize <= RB_GetFree(&Stream->Send));
+		if (Status != SEC_E_OK && Status != SEC_I_CONTINUE_NEEDED)
+		{
+			RTMP_DEBUG("ERROR: TLS handshake failed, 0x%08x", Status);
+			if (OutBuffers[0].pvBuffer)
+			{
+				FreeContextBuffer(OutBuffers[0].pvBuffer);
+			}
+			break;
+		}
 
-		uint8_t* Ptr = RB_BeginWrite(&Stream->Send);
-		CopyMemory(Ptr, Handshake + 1, HandshakeResponseSize);
-		RB_EndWrite(&Stream->Send, HandshakeResponseSize);
+		if (!RTMP__TlsSendToken(Socket, Stream, &OutBuffers[0]))
+		{
+			break;
+		}
 
-		RB_EndRead(&Stream->Recv, HandshakeSize);
-	}
+		// unprocessed data stays for next call, or is first application data after handshake
+		if (InBuffers[1].BufferType == SECBUFFER_EXTRA)
+		{
+			MoveMemory(Stream->TlsRecv, Stream->TlsRecv + Stream->TlsRecvSize - InBuffers[1].cbBuffer, InBuffers[1].cbBuffer);
+			Stream->TlsRecvSize = InBuffers[1].cbBuffer;
+		}
+		else
+		{
+			Stream->TlsRecvSize = 0;
+		}
 
-	// RTMP_PACKET_SET_CHUNK_SIZE
-	{
-		RTMP_DEBUG("Setting SetChunkSize to %u", RTMP_OUT_CHUNK_SIZE);
+		if (Status == SEC_E_OK)
+		{
+			Status = QueryContextAttributesW(&Stream->TlsContext, SECPKG_ATTR_STREAM_SIZES, &Stream->TlsSizes);
+			Assert(Status == SEC_E_OK);
+
+			// each send gets space for max plaintext size split into records, last chunk can go over limit
+			uint32_t RecordSize = Stream->TlsSizes.cbHeader + Stream->TlsSizes.cbMaximumMessage + Stream->TlsSizes.cbTrailer;
+			uint32_t RecordCount = CEIL_DIV(RTMP_TLS_MAX_SEND + RTMP_OUT_CHUNK_SIZE + RTMP_MAX_SEND_HEADERS, Stream->TlsSizes.cbMaximumMessage);
+			uint8_t* Records = VirtualAlloc(NULL, RTMP_MAX_SENDS * RecordCount * RecordSize, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+			Assert(Records);
+			for (uint32_t i = 0; i < RTMP_MAX_SENDS; i++)
+			{
+				Stream->Sends[i].Records = Records + i * RecordCount * RecordSize;
+			}
 
-		uint8_t Payload[4];
-		uint8_t* Ptr = Payload;
+			Stream->Tls = true;
+			return true;
+		}
 
-		BE_PUT4(Ptr, RTMP_OUT_CHUNK_SIZE); // chunk payload size
+		if (Stream->TlsRecvSize == 0 && !RTMP__TlsRecvToken(Socket, Stream))
+		{
+			break;
+		}
+	}
 
-		RTMP__WriteChunk(&Stream->Send, RTMP_CHANNEL_CONTROL, RTMP_PACKET_SET_CHUNK_SIZE, 0, Payload, sizeof(Payload));
+	if (HasContext)
+	{
+		DeleteSecurityContext(&Stream->TlsContext);
 	}
+	FreeCredentialsHandle(&Stream->TlsCredentials);
+	VirtualFree(Stream->TlsRecv, 0, MEM_RELEASE);
+	Stream->TlsRecv = NULL;
+	return false;
+}
 
-	// RTMP_PACKET_SET_WINDOW_SIZE
+// on graceful disconnect sends close_notify alert first, socket must not have any sends in progress
+static void RTMP__TlsDone(SOCKET Socket, RtmpStream* Stream, bool Graceful)
+{
+	if (Stream->Tls)
 	{
-		RTMP_DEBUG("Setting WindowAckSize to %u", RTMP_OUT_ACK_SIZE);
+		if (Graceful)
+		{
+			DWORD Type = SCHANNEL_SHUTDOWN;
+			SecBuffer Control = { sizeof(Type), SECBUFFER_TOKEN, &Type };
+			SecBufferDesc ControlDesc = { SECBUFFER_VERSION, 1, &Control };
 
-		uint8_t Payload[5];
-		uint8_t* Ptr = Payload;
+			SECURITY_STATUS Status = ApplyControlToken(&Stream->TlsContext, &ControlDesc);
+			if (Status == SEC_E_OK)
+			{
+				SecBuffer Token = { 0, SECBUFFER_TOKEN, NULL };
+				SecBufferDesc TokenDesc = { SECBUFFER_VERSION, 1, &Token };
 
-		BE_PUT4(Ptr, RTMP_OUT_ACK_SIZE); // ack size
-		BE_PUT1(Ptr, 2);                 // limit = dynamic
+				DWORD Flags = ISC_REQ_SEQUENCE_DETECT | ISC_REQ_REPLAY_DETECT | ISC_REQ_CONFIDENTIALITY | ISC_REQ_ALLOCATE_MEMORY | ISC_REQ_STREAM;
+				DWORD Attributes;
+				Status = InitializeSecurityContextW(&Stream->TlsCredentials, &Stream->TlsContext, NULL, Flags, 0, 0, NULL, 0, NULL, &TokenDesc, &Attributes, NULL);
+				if ((Status == SEC_E_OK || Status == SEC_I_CONTEXT_EXPIRED) && Token.pvBuffer)
+				{
+					// stop event is already set, so wait only for send itself with short timeout
+					OVERLAPPED* Ov = &Stream->Sends[0].Ov;
+					WSABUF Buffer = { .buf = Token.pvBuffer, .len = Token.cbBuffer };
+					DWORD Error = WSASend(Socket, &Buffer, 1, NULL, 0, Ov, NULL);
+					if (Error == 0 || WSAGetLastError() == WSA_IO_PENDING)
+					{
+						DWORD Transferred, SendFlags;
+						if (WaitForSingleObject(Ov->hEvent, RTMP_TLS_CLOSE_TIMEOUT) != WAIT_OBJECT_0)
+						{
+							CancelIoEx((HANDLE)Socket, Ov);
+						}
+						WSAGetOverlappedResult(Socket, Ov, &Transferred, TRUE, &SendFlags);
+					}
+					ResetEvent(Ov->hEvent);
+				}
+				else
+				{
+					RTMP_DEBUG("ERROR: TLS shutdown failed, 0x%08x", Status);
+				}
+				if (Token.pvBuffer)
+				{
+					FreeContextBuffer(Token.pvBuffer);
+				}
+			}
+			else
+			{
+				RTMP_DEBUG("ERROR: TLS shutdown failed, 0x%08x", Status);
+			}
+		}
 
-		RTMP__WriteChunk(&Stream->Send, RTMP_CHANNEL_CONTROL, RTMP_PACKET_SET_WINDOW_SIZE, 0, Payload, sizeof(Payload));
+		DeleteSecurityContext(&Stream->TlsContext);
+		FreeCredentialsHandle(&Stream->TlsCredentials);
+		VirtualFree(Stream->TlsRecv, 0, MEM_RELEASE);
+		VirtualFree(Stream->Sends[0].Records, 0, MEM_RELEASE);
+		Stream->Tls = false;
 	}
+}
 
-	// RTMP connect() method
-	{
-		RTMP_DEBUG("Invoking RTMP connect() method");
+// encrypts plaintext pieces of one send into TLS records, returns size of ciphertext or 0 on failure
+static uint32_t RTMP__TlsEncrypt(RtmpStream* Stream, RtmpSend* Send, const WSABUF* Buffers, DWORD BufferCount)
+{
+	uint8_t* Ptr = Send->Records;
+	DWORD Index = 0;
+	uint32_t Offset = 0;
 
-		uint8_t Payload[1024];
-		uint8_t* Ptr = Payload;
+	while (Index < BufferCount)
+	{
+		uint8_t* Data = Ptr + Stream->TlsSizes.cbHeader;
+		uint32_t DataSize = 0;
 
-		// path includes '/' as first character, don't need it
-		char StreamPath[RTMP_MAX_URL_LENGTH];
-		int StreamPathLen = WideCharToMultiByte(CP_UTF8, 0, Stream->UrlComponents.lpszUrlPath + 1, Stream->UrlComponents.dwUrlPathLength - 1, StreamPath, sizeof(StreamPath), NULL, NULL);
-		StreamPath[StreamPathLen] = 0;
+		// gather plaintext into one record
+		while (Index < BufferCount && DataSize < Stream->TlsSizes.cbMaximumMessage)
+		{
+			uint32_t Size = min(Buffers[Index].len - Offset, Stream->TlsSizes.cbMaximumMessage - DataSize);
+			CopyMemory(Data + DataSize, Buffers[Index].buf + Offset, Size);
+			DataSize += Size;
+			Offset += Size;
+			if (Offset == Buffers[Index].len)
+			{
+				Index++;
+				Offset = 0;
+			}
+		}
 
-		AMF_PUT_STRING_STATIC(Ptr, "connect");
-		AMF_PUT_NUMBER(Ptr, RTMP_TRANSACTION_CONNECT);
-		AMF_OBJ_BEGIN(Ptr);
-		AMF_PUT_STRING_DATA(Ptr, "app");      AMF_PUT_STRING_DYNAMIC(Ptr, StreamPath);
-		AMF_PUT_STRING_DATA(Ptr, "type");     AMF_PUT_STRING_STATIC(Ptr, "nonprivate");
-		AMF_PUT_STRING_DATA(Ptr, "flashVer"); AMF_PUT_STRING_STATIC(Ptr, "FMLE/3.0 (compatible; wstream)");
-		AMF_PUT_STRING_DATA(Ptr, "tcUrl");    AMF_PUT_STRING_DYNAMIC(Ptr, Stream->StreamUrl);
-		AMF_OBJ_END(Ptr);
+		SecBuffer Record[4] =
+		{
+			{ Stream->TlsSizes.cbHeader, SECBUFFER_STREAM_HEADER, Ptr },
+			{ DataSize, SECBUFFER_DATA, Data },
+			{ Stream->TlsSizes.cbTrailer, SECBUFFER_STREAM_TRAILER, Data + DataSize },
+			{ 0, SECBUFFER_EMPTY, NULL },
+		};
+		SecBufferDesc Desc = { SECBUFFER_VERSION, ARRAYSIZE(Record), Record };
+
+		SECURITY_STATUS Status = EncryptMessage(&Stream->TlsContext, 0, &Desc, 0);
+		if (Status != SEC_E_OK)
+		{
+			RTMP_DEBUG("ERROR: TLS encrypt failed, 0x%08x", Status);
+			Stream->Disconnect = true;
+			return 0;
+		}
 
-		uint32_t PayloadSize = (uint32_t)(Ptr - Payload);
-		RTMP__WriteChunk(&Stream->Send, RTMP_CHANNEL_MISC, RTMP_PACKET_COMMAND_AMF0, 0, Payload, PayloadSize);
+		// actual trailer can be shorter than max size, next record starts right after it
+		Ptr += Record[0].cbBuffer + Record[1].cbBuffer + Record[2].cbBuffer;
 	}
 
-	RTMP__BeginSend(Socket, Stream);
-	Stream->State = RTMP_STATE_STREAM_CONNECTING;
-	RTMP_DEBUG("State ->  RTMP_STATE_STREAM_CONNECTING");
-
-	return true;
+	return (uint32_t)(Ptr - Send->Records);
 }
 
-static void RTMP__DoStreamConnect(SOCKET Socket, RtmpStream* Stream, const uint8_t* Message, uint32_t MessageSize)
+// decrypts received ciphertext into Recv ring buffer, returns amount of plaintext bytes
+static uint32_t RTMP__TlsDecrypt(RtmpStream* Stream)
 {
-	if (MessageSize > 3 && AMF_IS_STRING(Message))
-	{
-		Message++;
-		MessageSize--;
+	uint32_t Total = 0;
 
-		uint32_t StrLen;
-		AMF_GET_STRING_LEN(Message, StrLen);
-		MessageSize -= 2;
-
-		const char* Str = (const char*)Message;
-
-		if (MessageSize >= StrLen && StrCmpNA(Str, "_result", StrLen) == 0)
+	while (Stream->TlsRecvSize != 0)
+	{
+		SecBuffer Buffers[4] =
 		{
-			Message += StrLen;
-			MessageSize -= StrLen;
-
-			RTMP_DEBUG("Received _result() from RTMP connect() method");
+			{ Stream->TlsRecvSize, SECBUFFER_DATA, Stream->TlsRecv },
+			{ 0, SECBUFFER_EMPTY, NULL },
+			{ 0, SECBUFFER_EMPTY, NULL },
+			{ 0, SECBUFFER_EMPTY, NULL },
+		};
+		SecBufferDesc Desc = { SECBUFFER_VERSION, ARRAYSIZE(Buffers), Buffers };
+
+		SECURITY_STATUS Status = DecryptMessage(&Stream->TlsContext, &Desc, 0, NULL);
+		if (Status == SEC_E_INCOMPLETE_MESSAGE)
+		{
+			// need more bytes for full record
+			break;
+		}
+		else if (Status == SEC_I_CONTEXT_EXPIRED)
+		{
+			RTMP_DEBUG("ERROR: server closed TLS connection");
+			Stream->Disconnect = true;
+			break;
+		}
+		else if (Status != SEC_E_OK && Status != SEC_I_RENEGOTIATE)
+		{
+			RTMP_DEBUG("ERROR: TLS decrypt failed, 0x%08x", Status);
+			Stream->Disconnect = true;
+			break;
+		}
 
-			// RTMP createStream() method
+		SecBuffer* Extra = NULL;
+		for (uint32_t i = 1; i < ARRAYSIZE(Buffers); i++)
+		{
+			if (Buffers[i].BufferType == SECBUFFER_DATA)
 			{
-				RTMP_DEBUG("Invoking RTMP createStream() method");
+				Assert(Buffers[i].cbBuffer <= RB_GetFree(&Stream->Recv));
+				CopyMemory(RB_BeginWrite(&Stream->Recv), Buffers[i].pvBuffer, Buffers[i].cbBuffer);
+				RB_EndWrite(&Stream->Recv, Buffers[i].cbBuffer);
+				Total += Buffers[i].cbBuffer;
+			}
+			else if (Buffers[i].BufferType == SECBUFFER_EXTRA)
+			{
+				Extra = &Buffers[i];
+			}
+		}
 
-				uint8_t Payload[128];
-				uint8_t* Ptr = Payload;
+		if (Extra)
+		{
+			MoveMemory(Stream->TlsRecv, Stream->TlsRecv + Stream->TlsRecvSize - Extra->cbBuffer, Extra->cbBuffer);
+			Stream->TlsRecvSize = Extra->cbBuffer;
+		}
+		else
+		{
+			Stream->TlsRecvSize = 0;
+		}
 
-				AMF_PUT_STRING_STATIC(Ptr, "createStream");
-				AMF_PUT_NUMBER(Ptr, RTMP_TRANSACTION_CREATE_STREAM);
-				AMF_PUT_NULL(Ptr);
+		if (Status == SEC_I_RENEGOTIATE)
+		{
+			// post-handshake message like TLS 1.3 session ticket, it is in remaining extra data
+			SecBuffer InBuffers[2] =
+			{
+				{ Stream->TlsRecvSize, SECBUFFER_TOKEN, Stream->TlsRecv },
+				{ 0, SECBUFFER_EMPTY, NULL },
+			};
+			SecBuffer OutBuffers[1] =
+			{
+				{ 0, SECBUFFER_TOKEN, NULL },
+			};
+			SecBufferDesc InDesc = { SECBUFFER_VERSION, ARRAYSIZE(InBuffers), InBuffers };
+			SecBufferDesc OutDesc = { SECBUFFER_VERSION, ARRAYSIZE(OutBuffers), OutBuffers };
+
+			DWORD Flags = ISC_REQ_SEQUENCE_DETECT | ISC_REQ_REPLAY_DETECT | ISC_REQ_CONFIDENTIALITY | ISC_REQ_ALLOCATE_MEMORY | ISC_REQ_STREAM;
+			DWORD Attributes;
+			Status = InitializeSecurityContextW(&Stream->TlsCredentials, &Stream->TlsContext, NULL, Flags, 0, 0, &InDesc, 0, NULL, &OutDesc, &Attributes, NULL);
+			if (Status != SEC_E_OK)
+			{
+				RTMP_DEBUG("ERROR: TLS post-handshake message failed, 0x%08x", Status);
+				if (OutBuffers[0].pvBuffer)
+				{
+					FreeContextBuffer(OutBuffers[0].pvBuffer);
+				}
+				Stream->Disconnect = true;
+				break;
+			}
 
-				uint32_t PayloadSize = (uint32_t)(Ptr - Payload);
-				RTMP__WriteChunk(&Stream->Send, RTMP_CHANNEL_MISC, RTMP_PACKET_COMMAND_AMF0, 0, Payload, PayloadSize);
+			if (OutBuffers[0].pvBuffer)
+			{
+				RTMP_DEBUG("ERROR: TLS renegotiation is not supported");
+				FreeContextBuffer(OutBuffers[0].pvBuffer);
+				Stream->Disconnect = true;
+				break;
 			}
 
-			RTMP__BeginSend(Socket, Stream);
-			Stream->State = RTMP_STATE_STREAM_CREATING;
-			RTMP_DEBUG("State ->  RTMP_STATE_STREAM_CREATING");
-			return;
-		}
-		else if (MessageSize >= StrLen && StrCmpNA(Str, "_error", StrLen) == 0)
-		{
-			RTMP_DEBUG("Error received from RTMP connect() method");
-			Assert(!"TODO: RTMP connect() failed, disconnect");
+			if (InBuffers[1].BufferType == SECBUFFER_EXTRA)
+			{
+				MoveMemory(Stream->TlsRecv, Stream->TlsRecv + Stream->TlsRecvSize - InBuffers[1].cbBuffer, InBuffers[1].cbBuffer);
+				Stream->TlsRecvSize = InBuffers[1].cbBuffer;
+			}
+			else
+			{
+				Stream->TlsRecvSize = 0;
+			}
 		}
 	}
+
+	return Total;
 }
 
-static void RTMP__DoStreamCreate(SOCKET Socket, RtmpStream* Stream, const uint8_t* Message, uint32_t MessageSize)
+#endif
+
+// socket send handling
+
+#define RTMP_MAX_CHUNK_HEADER (1 + 3 + 3 + 1 + 4 + 4) // fmt=0 chunk header with extended timestamp
+#define RTMP_MAX_LOOKAHEAD 64                   // how many queued messages to check for audio while sending video
+
+// decides if media message that is not yet sent should be dropped because it waited in queue for too long
+static bool RTMP__IsExpired(RtmpStream* Stream, const RtmpMessage* Entry, uint64_t Now)
 {
-	if (MessageSize > 3 && AMF_IS_STRING(Message))
+	if (Entry->ChunkFormat != 1)
 	{
-		Message++;
-		MessageSize--;
-
-		uint32_t StrLen;
-		AMF_GET_STRING_LEN(Message, StrLen);
-		MessageSize -= 2;
+		// only audio & video messages are evicted, config & control messages are always sent
+		return false;
+	}
 
-		const char* Str = (const char*)Message;
-		if (MessageSize >= StrLen + 9 + 1 + 9 && StrCmpNA(Str, "_result", StrLen) == 0)
+	if (Entry->MessageType == RTMP_PACKET_VIDEO)
+	{
+		if (Stream->SkipVideo && !Entry->IsKeyFrame)
 		{
-			Message += StrLen;
-			MessageSize -= StrLen;
+			// previous video frame was evicted, this one cannot be decoded
+			InterlockedIncrement(&Stream->VideoDropped);
+			RTMP__CountDrop(Stream, Entry->MessageType, RTMP_DROP_REASON_EXPIRED);
+			return true;
+		}
+		Stream->SkipVideo = false;
+	}
 
-			double Transaction, StreamId;
-			AMF_GET_NUMBER(Message, Transaction);
-			AMF_GET_NULL(Message);
-			AMF_GET_NUMBER(Message, StreamId);
+	uint64_t MaxQueueLatency = (uint64_t)ReadNoFence64(&Stream->MaxQueueLatency);
+	if (MaxQueueLatency == 0 || Now - Entry->Time <= MaxQueueLatency)
+	{
+		return false;
+	}
 
-			Stream->StreamId = (uint32_t)StreamId;
+	if (Entry->MessageType == RTMP_PACKET_VIDEO)
+	{
+		RTMP_DEBUG("Evicting video frames until next keyframe, queue latency %u ms", (uint32_t)((Now - Entry->Time) * 1000 / Stream->Frequency));
+		InterlockedIncrement(&Stream->VideoDropped);
+		Stream->SkipVideo = true;
+	}
+	RTMP__CountDrop(Stream, Entry->MessageType, RTMP_DROP_REASON_EXPIRED);
+	return true;
+}
 
-			RTMP_DEBUG("Received _result() from RTMP createStream() method, StreamId=%u", Stream->StreamId);
+#ifdef _WIN32
+typedef WSABUF RtmpBuffer;
+#define RTMP_BUFFER(Data, Size) (WSABUF){ .buf = (char*)(Data), .len = (Size) }
+#else
+typedef struct iovec RtmpBuffer;
+#define RTMP_BUFFER(Data, Size) (struct iovec){ .iov_base = (void*)(Data), .iov_len = (Size) }
+#endif
 
-			// RTMP publish() method
-			{
-				RTMP_DEBUG("Invoking RTMP publish() method");
+typedef struct {
+	RtmpBuffer Buffers[RTMP_MAX_SEND_BUFFERS];
+	DWORD BufferCount;
+	uint32_t SendSize;
+	uint8_t* Header;
+	uint8_t* HeaderEnd;
+} RtmpSendBatch;
 
-				uint8_t Payload[1024];
-				uint8_t* Ptr = Payload;
+// chunk needs one header and at most two payload pieces
+static bool RTMP__CanAddChunk(const RtmpSendBatch* Batch)
+{
+	return Batch->BufferCount + 3 <= ARRAYSIZE(Batch->Buffers) && Batch->Header + RTMP_MAX_CHUNK_HEADER <= Batch->HeaderEnd;
+}
 
-				AMF_PUT_STRING_STATIC(Ptr, "publish");
-				AMF_PUT_NUMBER(Ptr, RTMP_TRANSACTION_PUBLISH);
-				AMF_PUT_NULL(Ptr);
-				AMF_PUT_STRING_DYNAMIC(Ptr, Stream->StreamKey);
-				AMF_PUT_STRING_STATIC(Ptr, "live");
+static void RTMP__AddBuffer(RtmpSendBatch* Batch, const void* Data, uint32_t Size)
+{
+	Batch->Buffers[Batch->BufferCount++] = RTMP_BUFFER(Data, Size);
+	Batch->SendSize += Size;
+}
 
-				uint32_t PayloadSize = (uint32_t)(Ptr - Payload);
-				RTMP__WriteChunk(&Stream->Send, RTMP_CHANNEL_MISC, RTMP_PACKET_COMMAND_AMF0, Stream->StreamId, Payload, PayloadSize);
+// adds one chunk of message starting at Sent payload bytes, returns updated Sent value
+// chunk headers are generated here and interleaved with payload pieces that are either in Send ring buffer or in caller-owned memory
+static uint32_t RTMP__AddChunk(RtmpStream* Stream, RtmpSendBatch* Batch, const RtmpMessage* Entry, uint32_t Sent, uint64_t Now)
+{
+	uint32_t MessageSize = Entry->Size + Entry->DataSize;
+	uint32_t ChunkEnd = MessageSize;
+
+	if (Entry->ChunkStreamId != 0)
+	{
+		uint8_t* Ptr = Batch->Header;
+		if (Sent == 0)
+		{
+			// fmt=1 timestamp delta is calculated from message actually sent before on same chunk stream,
+			// so chunk stream state stays valid when messages are evicted from queue
+			uint32_t* LastTimestamp = &Stream->SendTimestamp[Entry->ChunkStreamId];
+			bool* HasTimestamp = &Stream->SendHasTimestamp[Entry->ChunkStreamId];
+			uint32_t Timestamp;
+			if (Entry->ChunkFormat == 0 || !*HasTimestamp)
+			{
+				// first delta after connecting is whole timestamp, it must not be compared with zero,
+				// stream time over 2^31 msec would look like going back
+				Timestamp = Entry->Timestamp;
+				*LastTimestamp = Entry->Timestamp;
+				*HasTimestamp = true;
+			}
+			else if ((int32_t)(Entry->Timestamp - *LastTimestamp) >= 0)
+			{
+				// timestamps are modulo 2^32, so delta is correct also after wrap around
+				Timestamp = Entry->Timestamp - *LastTimestamp;
+				*LastTimestamp = Entry->Timestamp;
+			}
+			else
+			{
+				// never let timestamp on chunk stream go backwards, message is sent with same timestamp as previous one
+				RTMP_DEBUG("Timestamp %u on chunk stream %u is before previous %u", Entry->Timestamp, Entry->ChunkStreamId, *LastTimestamp);
+				Timestamp = 0;
 			}
 
-			RTMP__BeginSend(Socket, Stream);
-			Stream->State = RTMP_STATE_STREAM_PUBLISHING;
-			RTMP_DEBUG("State ->  RTMP_STATE_STREAM_PUBLISHING");
-			return;
+			// values that do not fit into 24 bits go into extended timestamp field, for example first delta after reconnecting to long stream
+			uint32_t Extended = Timestamp >= 0xffffff ? Timestamp : 0;
+			Stream->SendExtended[Entry->ChunkStreamId] = Extended;
+
+			BE_PUT1(Ptr, (Entry->ChunkFormat << 6) | Entry->ChunkStreamId);
+			BE_PUT3(Ptr, Extended ? 0xffffff : Timestamp);
+			BE_PUT3(Ptr, MessageSize);
+			BE_PUT1(Ptr, Entry->MessageType);
+			if (Entry->ChunkFormat == 0)
+			{
+				LE_PUT4(Ptr, Entry->MessageStreamId); // lol, little endian for some reason
+			}
+			if (Extended)
+			{
+				BE_PUT4(Ptr, Extended);
+			}
 		}
-		else if (MessageSize >= StrLen && StrCmpNA(Str, "_error", StrLen) == 0)
+		else
 		{
-			RTMP_DEBUG("Error received from RTMP createStream() method");
-			Assert(!"TODO: RTMP createStream() failed, disconnect");
+			// rest of chunks will be fmt=3, they repeat extended timestamp of first chunk
+			BE_PUT1(Ptr, (3 << 6) | Entry->ChunkStreamId);
+
+			uint32_t Extended = Stream->SendExtended[Entry->ChunkStreamId];
+			if (Extended)
+			{
+				BE_PUT4(Ptr, Extended);
+			}
 		}
-	}
-}
 
-static void RTMP__DoStreamPublish(SOCKET Socket, RtmpStream* Stream, const uint8_t* Message, uint32_t MessageSize)
-{
-	if (MessageSize > 3 && AMF_IS_STRING(Message))
-	{
-		Message++;
-		MessageSize--;
+		RTMP__AddBuffer(Batch, Batch->Header, (uint32_t)(Ptr - Batch->Header));
+		Batch->Header = Ptr;
 
-		uint32_t StrLen;
-		AMF_GET_STRING_LEN(Message, StrLen);
-		MessageSize -= 2;
+		// Sent is always at chunk boundary here
+		ChunkEnd = min(MessageSize, Sent + Stream->SendChunkSize);
+	}
 
-		const char* Str = (const char*)Message;
-		if (MessageSize >= StrLen && StrCmpNA(Str, "onStatus", StrLen) == 0)
-		{
-			Message += StrLen;
-			MessageSize -= StrLen;
+	if (Sent < Entry->Size)
+	{
+		uint32_t PieceEnd = min(ChunkEnd, Entry->Size);
+		RTMP__AddBuffer(Batch, RB_GetPointer(&Stream->Send, Entry->Offset + Sent), PieceEnd - Sent);
+		Sent = PieceEnd;
+	}
 
-			RTMP_DEBUG("Received onStatus() from RTMP publish() method", Stream->StreamId);
+	if (Sent < ChunkEnd)
+	{
+		RTMP__AddBuffer(Batch, Entry->Data + (Sent - Entry->Size), ChunkEnd - Sent);
+		Sent = ChunkEnd;
+	}
 
-			// TODO: this always assumes onStatus means success
-			// real check would be to parse object returned
-			// code="NetStream.Publish.Start"
-			// level="status"
+	if (Sent == MessageSize && Entry->ChunkStreamId == RTMP_CHANNEL_CONTROL && Entry->MessageType == RTMP_PACKET_SET_CHUNK_SIZE)
+	{
+		// new chunk size applies to all chunks sent after this message
+		const uint8_t* Ptr = RB_GetPointer(&Stream->Send, Entry->Offset);
+		BE_GET4(Ptr, Stream->SendChunkSize);
+	}
 
-			Stream->State = RTMP_STATE_STREAM_READY;
-			RTMP_DEBUG("State ->  RTMP_STATE_STREAM_READY");
-			return;
-		}
+	if (Sent == MessageSize && Entry->ChunkFormat == 1)
+	{
+		RTMP__CountSent(Stream, Entry, Now);
 	}
 
-	RTMP_DEBUG("Error received from RTMP publish() method");
-	Assert(!"TODO: RTMP publish() failed, disconnect");
+	return Sent;
 }
 
-static bool RTMP__DoChunk(SOCKET Socket, RtmpStream* Stream)
+// media messages wait for flush when coalescing, control messages are sent immediately
+// checked for every committed entry, so batch or audio lookahead never goes past flush point
+static bool RTMP__IsFlushed(RtmpStream* Stream, uint32_t Index)
 {
-	for (;;)
+	const RtmpMessage* Entry = &Stream->Messages[Index & (RTMP_MAX_MESSAGES - 1)];
+	return ReadNoFence(&Stream->CoalesceSize) == 0 || Entry->ChunkFormat == 0 || (int32_t)(Stream->MessageFlush - Index) > 0;
+}
+
+// finds next audio message queued after video message that is currently being sent, if it fits into one chunk
+static RtmpMessage* RTMP__FindAudio(RtmpStream* Stream, uint64_t Now)
+{
+	for (uint32_t Index = Stream->MessageSend + 1; Index - Stream->MessageSend <= RTMP_MAX_LOOKAHEAD && RTMP__IsCommitted(Stream, Index) && RTMP__IsFlushed(Stream, Index); Index++)
 	{
-		uint32_t Available = RB_GetUsed(&Stream->Recv);
-		if (Available < 1)
+		RtmpMessage* Entry = &Stream->Messages[Index & (RTMP_MAX_MESSAGES - 1)];
+		if (Entry->IsSent || Entry->Session != Stream->Session || Entry->MessageType != RTMP_PACKET_AUDIO)
 		{
-			// need at least one byte for chunk
-			return false;
+			continue;
 		}
 
-		uint8_t* Received = RB_BeginRead(&Stream->Recv);
-
-		uint32_t ChunkStreamId = Received[0] & 0x3f;
-		Assert(ChunkStreamId >= 2); // 0 or 1 would mean large ChunkStreamId, which is not supported here
-
-		uint8_t ChunkFormat = Received[0] >> 6;
-		uint32_t ChunkHeaderSize = ChunkFormat == 0 ? 11 : ChunkFormat == 1 ? 7 : ChunkFormat == 2 ? 3 : 0;
-		if (Available < 1 + ChunkHeaderSize)
+		// audio config must go in order
+		if (Entry->ChunkFormat != 1 || Entry->Size + Entry->DataSize > Stream->SendChunkSize)
 		{
-			// need more bytes to parse chunk header
-			return false;
+			return NULL;
 		}
 
-		RtmpChunk* LastChunk = &Stream->LastChunk[ChunkStreamId];
-
-		uint8_t* Ptr = Received + 1;
+		if (RTMP__IsExpired(Stream, Entry, Now))
+		{
+			Entry->IsSent = true;
+			continue;
+		}
 
-		uint32_t Timestamp;
-		uint32_t MessageLength;
-		uint32_t MessageType;
-		uint32_t MessageStreamId;
+		return Entry;
+	}
+	return NULL;
+}
 
-		if (ChunkFormat == 0)
+// finds acknowledgement or ping response queued after media messages that still wait for flush
+// these go on their own chunk stream with full header and do not change chunk size, so they can be sent ahead of media
+static RtmpMessage* RTMP__FindControl(RtmpStream* Stream)
+{
+	for (uint32_t Index = Stream->MessageSend; Index - Stream->MessageSend <= RTMP_MAX_LOOKAHEAD && RTMP__IsCommitted(Stream, Index); Index++)
+	{
+		RtmpMessage* Entry = &Stream->Messages[Index & (RTMP_MAX_MESSAGES - 1)];
+		if (Entry->IsSent || Entry->Session != Stream->Session || !RTMP__IsFlushed(Stream, Index))
 		{
-			BE_GET3(Ptr, Timestamp);
-			BE_GET3(Ptr, MessageLength);
-			BE_GET1(Ptr, MessageType);
-			LE_GET4(Ptr, MessageStreamId);
-
-			LastChunk->Timestamp = Timestamp;
-			LastChunk->MessageLength = MessageLength;
-			LastChunk->MessageType = MessageType;
-			LastChunk->MessageStreamId = MessageStreamId;
+			continue;
 		}
-		else if (ChunkFormat == 1)
-		{
-			BE_GET3(Ptr, Timestamp); // this is actually TimestampDelta, but this code doesn't care about received timestamps
-			BE_GET3(Ptr, MessageLength);
-			BE_GET1(Ptr, MessageType);
 
-			LastChunk->Timestamp = Timestamp;
-			LastChunk->MessageLength = MessageLength;
-			LastChunk->MessageType = MessageType;
-			MessageStreamId = LastChunk->MessageStreamId;
-		}
-		else if (ChunkFormat == 2)
+		// everything else must go in order
+		if (Entry->ChunkStreamId != RTMP_CHANNEL_CONTROL || Entry->IsPadding
+			|| (Entry->MessageType != RTMP_PACKET_ACK && Entry->MessageType != RTMP_PACKET_USER_CONTROL)
+			|| Entry->Size + Entry->DataSize > Stream->SendChunkSize)
 		{
-			BE_GET3(Ptr, Timestamp); // this is actually TimestampDelta
-
-			LastChunk->Timestamp = Timestamp;
-			MessageLength = LastChunk->MessageLength;
-			MessageType = LastChunk->MessageType;
-			MessageStreamId = LastChunk->MessageStreamId;
+			return NULL;
 		}
-		else if (ChunkFormat == 3)
+
+		return Entry;
+	}
+	return NULL;
+}
+
+// returns how many bytes pacer allows to send now, 0 means wait for pacer timer
+static uint32_t RTMP__PaceLimit(RtmpStream* Stream)
+{
+	// pacing can be changed from other thread, use same rate for whole update
+	uint64_t Rate = (uint64_t)ReadNoFence64(&Stream->PaceRate);
+	if (Rate == 0 || ReadNoFence(&Stream->Probing))
+	{
+		return UINT32_MAX;
+	}
+
+	LARGE_INTEGER Now;
+	QueryPerformanceCounter(&Now);
+
+	// tokens are in bytes multiplied by QPC frequency, to not lose fractions of bytes on every refill
+	uint64_t Elapsed = min(Now.QuadPart - Stream->PaceTime, Stream->Frequency);
+	// burst must fit at least one full chunk, otherwise tokens never reach it and sending stalls
+	uint64_t Burst = min((uint32_t)ReadNoFence(&Stream->PaceBurst), Stream->PeerBandwidth);
+	Burst = max(Burst, Stream->SendChunkSize + RTMP_MAX_CHUNK_HEADER) * Stream->Frequency;
+	Stream->PaceTokens = min(Stream->PaceTokens + (int64_t)(Elapsed * Rate), (int64_t)Burst);
+	Stream->PaceTime = Now.QuadPart;
+
+	if (Stream->PaceTokens <= 0)
+	{
+		if (!Stream->PaceWaiting)
 		{
-			Timestamp = LastChunk->Timestamp; // this is actually TimestampDelta
-			MessageLength = LastChunk->MessageLength;
-			MessageType = LastChunk->MessageType;
-			MessageStreamId = LastChunk->MessageStreamId;
+			Stream->PaceWaiting = true;
+			Stream->PaceBlocked = Now.QuadPart;
 		}
-		Assert(Timestamp < 0xffffff); // otherwise extended timestamp is present
 
-		uint32_t ExtraBytes = 0;
-		if (MessageLength > Stream->ChunkSize)
-		{
-			// message is split between multiple chunks, require all of them to be present here
-			// TODO: ideally this code should handle non-sequential chunk continuations
+		// negative due time is relative, in 100nsec units
+		uint64_t Wait = (-Stream->PaceTokens / Rate) + 1;
+		LARGE_INTEGER DueTime = { .QuadPart = -(LONGLONG)(Wait * 10000000 / Stream->Frequency) - 1 };
+		BOOL Ok = SetWaitableTimer(Stream->PaceTimer, &DueTime, 0, NULL, NULL, FALSE);
+		Assert(Ok);
+		return 0;
+	}
 
-			// how many fmt=3 chunks we expect?
-			uint32_t ExtraChunkCount = CEIL_DIV(MessageLength - Stream->ChunkSize, Stream->ChunkSize);
-			ExtraBytes = ExtraChunkCount; // 1 byte prefix for each extra chunk
+	if (Stream->PaceWaiting)
+	{
+		Stream->PaceWaiting = false;
+		WriteNoFence(&Stream->PaceDelay, (LONG)((Now.QuadPart - Stream->PaceBlocked) * 1000 / Stream->Frequency));
+	}
 
-			if (Available < 1 + ChunkHeaderSize + ExtraBytes)
-			{
-				// not enough bytes for chunks
-				return false;
-			}
+	// last chunk in batch can go over limit, tokens become negative and next send waits longer
+	return (uint32_t)min((uint64_t)Stream->PaceTokens / Stream->Frequency + 1, UINT32_MAX);
+}
 
-			// verify all extra chunks are fmt=3 chunks
-			uint32_t ChunkOffset = Stream->ChunkSize;
-			for (uint32_t Chunk = 0; Chunk < ExtraChunkCount; Chunk++)
-			{
-				if (Ptr[ChunkOffset] != ((3 << 6) | ChunkStreamId))
-				{
-					Assert(!"TODO: non-sequential fmt=3 chunks not supported");
-					// TODO: disconnect
-				}
-				ChunkOffset = 1 + Stream->ChunkSize;
-			}
+// gathers queued messages into one vectored send, at least one chunk is added even if Limit is smaller
+// audio messages are sent between chunks of large video message, they are marked as sent and skipped when reached in queue
+static void RTMP__BeginSend(SOCKET Socket, RtmpStream* Stream, uint32_t Limit)
+{
+	LARGE_INTEGER Now;
+	QueryPerformanceCounter(&Now);
 
-			// un-chunk all data, so it is all sequantial
-			uint8_t* Dst = Ptr + Stream->ChunkSize;
-			uint8_t* Src = Ptr + Stream->ChunkSize + 1;
-			uint32_t UnchunkSize = MessageLength - Stream->ChunkSize;
-			while (UnchunkSize != 0)
-			{
-				uint32_t ChunkSize = min(UnchunkSize, Stream->ChunkSize);
-				MoveMemory(Dst, Src, ChunkSize);
-				Dst += Stream->ChunkSize;
-				Src += Stream->ChunkSize + 1;
-				UnchunkSize -= ChunkSize;
-			}
-		}
-		else
+	RtmpSend* Send = &Stream->Sends[(Stream->SendFirst + Stream->SendActive) % RTMP_MAX_SENDS];
+
+	RtmpSendBatch Batch =
+	{
+		.Header = Send->Headers,
+		.HeaderEnd = Send->Headers + sizeof(Send->Headers),
+	};
+
+	while (RTMP__IsCommitted(Stream, Stream->MessageSend) && RTMP__CanAddChunk(&Batch) && Batch.SendSize < Limit)
+	{
+		RtmpMessage* Entry = &Stream->Messages[Stream->MessageSend & (RTMP_MAX_MESSAGES - 1)];
+
+		if (!RTMP__IsFlushed(Stream, Stream->MessageSend))
 		{
-			if (Available < 1 + ChunkHeaderSize + MessageLength)
+			// media waits for flush, but acknowledgements & ping responses queued after it do not
+			RtmpMessage* Control = RTMP__FindControl(Stream);
+			if (!Control)
 			{
-				// need more bytes for message payload
-				return false;
+				break;
 			}
+			RTMP__AddChunk(Stream, &Batch, Control, 0, Now.QuadPart);
+			Control->IsSent = true;
+			continue;
 		}
 
-		if (MessageType == RTMP_PACKET_SET_WINDOW_SIZE)
+		bool IsStalePadding = Entry->IsPadding && !ReadNoFence(&Stream->Probing);
+		if (Stream->MessageSent == 0 && (Entry->IsSent || IsStalePadding || Entry->Session != Stream->Session || RTMP__IsExpired(Stream, Entry, Now.QuadPart)))
 		{
-			if (MessageLength == 4)
+			// evicted, already sent, leftover probe padding or queued for previous connection message is released together with ones that are sent
+			if (!Entry->IsSent && Entry->Session != Stream->Session && Entry->ChunkFormat == 1)
 			{
-				BE_GET4(Ptr, Stream->WindowSize);
-				RTMP_DEBUG("Received SetWindowSize message: %u", Stream->WindowSize);
+				RTMP__CountDrop(Stream, Entry->MessageType, RTMP_DROP_REASON_SESSION);
 			}
+			Stream->MessageSend++;
+			continue;
 		}
-		else if (MessageType == RTMP_PACKET_SET_CHUNK_SIZE)
+
+		if (Stream->MessageSent != 0 && Entry->MessageType == RTMP_PACKET_VIDEO)
 		{
-			if (MessageLength == 4)
+			// audio has priority over rest of video message
+			RtmpMessage* Audio = RTMP__FindAudio(Stream, Now.QuadPart);
+			if (Audio)
 			{
-				BE_GET4(Ptr, Stream->ChunkSize);
-				RTMP_DEBUG("Received SetChunkSize: %u", Stream->ChunkSize);
+				RTMP__AddChunk(Stream, &Batch, Audio, 0, Now.QuadPart);
+				Audio->IsSent = true;
+				continue;
 			}
 		}
-		else if (MessageType == RTMP_PACKET_SET_PEER_BW)
-		{
-			if (MessageLength == 5)
-			{
-				uint32_t OutgoingBandwidth;
-				uint8_t Limit;
-				BE_GET4(Ptr, OutgoingBandwidth);
-				BE_GET1(Ptr, Limit);
 
-				RTMP_DEBUG("Received SetPeerBandidth: %u, limit %s",
-					OutgoingBandwidth,
-					Limit == 0 ? "hard" : Limit == 1 ? "soft" : Limit == 2 ? "dynamic" : "UNKNOWN");
-			}
-		}
-		else if (MessageType == RTMP_PACKET_COMMAND_AMF0)
+		uint32_t Sent = RTMP__AddChunk(Stream, &Batch, Entry, Stream->MessageSent, Now.QuadPart);
+		if (Sent == Entry->Size + Entry->DataSize)
 		{
-			switch (Stream->State)
-			{
-			case RTMP_STATE_STREAM_CONNECTING:
-				RTMP__DoStreamConnect(Socket, Stream, Ptr, MessageLength);
-				break;
-			case RTMP_STATE_STREAM_CREATING:
-				RTMP__DoStreamCreate(Socket, Stream, Ptr, MessageLength);
-				break;
-			case RTMP_STATE_STREAM_PUBLISHING:
-				RTMP__DoStreamPublish(Socket, Stream, Ptr, MessageLength);
-				break;
-			}
+			Stream->MessageSend++;
+			Stream->MessageSent = 0;
 		}
 		else
 		{
-			// ignore other incoming messages
+			Stream->MessageSent = Sent;
 		}
-
-		RB_EndRead(&Stream->Recv, 1 + ChunkHeaderSize + MessageLength + ExtraBytes);
 	}
-}
-
-// socket recv handling
 
-static void RTMP__BeginRecv(SOCKET Socket, RtmpStream* Stream)
-{
-	uint32_t Count = RB_GetFree(&Stream->Recv);
-	if (Count == 0)
+	if (Batch.BufferCount == 0)
 	{
-		Assert(!"TODO: something fishy is going on, cannot receive more data because receive buffer is full");
-		// need to disconnect socket here
+		if (Stream->SendActive == 0)
+		{
+			// everything committed was evicted, nothing is in progress so it can be released immediately
+			RTMP__ReleaseMessages(Stream, Stream->MessageSend);
+		}
 		return;
 	}
 
-	WSABUF Buffer = { .buf = RB_BeginWrite(&Stream->Recv), .len = Count };
-	DWORD Flags = 0;
-	DWORD Transferred;
-	int Error = WSARecv(Socket, &Buffer, 1, &Transferred, &Flags, &Stream->RecvOv, NULL);
+	uint32_t SendSize = Batch.SendSize;
+#ifdef _WIN32
+	if (Stream->Tls)
+	{
+		SendSize = RTMP__TlsEncrypt(Stream, Send, Batch.Buffers, Batch.BufferCount);
+		if (SendSize == 0)
+		{
+			return;
+		}
+		Batch.Buffers[0] = (WSABUF){ .buf = Send->Records, .len = SendSize };
+		Batch.BufferCount = 1;
+	}
+
+	Stream->SendCalls++;
+	DWORD Error = WSASend(Socket, Batch.Buffers, Batch.BufferCount, NULL, 0, &Send->Ov, NULL);
 	if (Error == SOCKET_ERROR)
 	{
 		Error = WSAGetLastError();
 		if (Error == WSA_IO_PENDING)
 		{
-			// recv is happening in background
-		}
-		else if (Error == WSAECONNRESET)
-		{
-			Assert(!"TODO: connection closed, disconnect");
+			// send is happening in background
 		}
 		else
 		{
-			Assert(!"TODO: socket error, disconnect");
+			RTMP_DEBUG("ERROR: send failed, error %u", Error);
+			Stream->Disconnect = true;
+			return;
 		}
 	}
+#else
+	// nonblocking socket is written by RTMP__WriteSends in same order as sends were started
+	CopyMemory(Send->Buffers, Batch.Buffers, Batch.BufferCount * sizeof(Batch.Buffers[0]));
+	Send->BufferCount = Batch.BufferCount;
+	Send->BufferIndex = 0;
+#endif
+
+	Send->Size = SendSize;
+	Send->MessageEnd = Stream->MessageSend;
+	Stream->SendActive++;
+	Stream->TotalBytesSent += Batch.SendSize;
+
+	if (ReadNoFence64(&Stream->PaceRate) != 0 && !ReadNoFence(&Stream->Probing))
+	{
+		Stream->PaceTokens -= (int64_t)Batch.SendSize * Stream->Frequency;
+	}
 }
 
-static void RTMP__EndRecv(SOCKET Socket, RtmpStream* Stream)
+// finishes oldest send in progress, sends are always finished in same order as they were started
+static void RTMP__EndSend(SOCKET Socket, RtmpStream* Stream)
 {
+	Assert(Stream->SendActive != 0);
+	RtmpSend* Send = &Stream->Sends[Stream->SendFirst];
+
+#ifdef _WIN32
 	DWORD Transferred;
 	DWORD Flags;
-	BOOL Ok = WSAGetOverlappedResult(Socket, &Stream->RecvOv, &Transferred, TRUE, &Flags);
-	DWORD Err = WSAGetLastError();
-	ResetEvent(Stream->RecvOv.hEvent);
-	Assert(Ok);
+	BOOL Ok = WSAGetOverlappedResult(Socket, &Send->Ov, &Transferred, TRUE, &Flags);
+	ResetEvent(Send->Ov.hEvent);
+#else
+	// called only once nonblocking socket has taken all buffers of this send
+	Assert(Send->BufferIndex == Send->BufferCount);
+	DWORD Transferred = Send->Size;
+	BOOL Ok = TRUE;
+#endif
 
-	if (Transferred == 0)
+	Stream->SendFirst = (Stream->SendFirst + 1) % RTMP_MAX_SENDS;
+	Stream->SendActive--;
+
+	if (Stream->Blocked)
 	{
-		Assert(!"TODO: connection closed");
+		LARGE_INTEGER Now;
+		QueryPerformanceCounter(&Now);
+		RTMP_STAT_ADD(Stream->BlockedTime, Now.QuadPart - Stream->BlockedStart);
+		Stream->Blocked = false;
 	}
 
-	Assert(Transferred <= RB_GetFree(&Stream->Recv));
-	RB_EndWrite(&Stream->Recv, Transferred);
-
-	Stream->TotalByteReceived += Transferred;
-	Stream->BytesReceived += Transferred;
-	if (Stream->BytesReceived > Stream->WindowSize / 2)
+	if (!Ok)
 	{
-		uint8_t Payload[4];
-		uint8_t* Ptr = Payload;
+		RTMP_DEBUG("ERROR: send failed, error %u", WSAGetLastError());
+		Stream->Disconnect = true;
+		return;
+	}
 
-		// this truncates total bytes sent to lower 32-bits, spec does not say what to do when total size >4GiB
-		BE_PUT4(Ptr, (uint32_t)Stream->TotalByteReceived);
+	// overlapped send completes fully or fails
+	Assert(Transferred == Send->Size);
 
-		RTMP_DEBUG("Sending ACK control message for %u bytes", (uint32_t)Stream->TotalByteReceived);
+	// all messages that were fully given to socket by this send are now sent, if nothing else is in progress
+	// then also evicted messages queued after it can be released
+	RTMP__ReleaseMessages(Stream, Stream->SendActive == 0 ? Stream->MessageSend : Send->MessageEnd);
+}
 
-		AcquireSRWLockExclusive(&Stream->Lock);
-		if (RTMP__WriteChunk(&Stream->Send, RTMP_CHANNEL_CONTROL, RTMP_PACKET_ACK, 0, Payload, sizeof(Payload)))
-		{
-			Stream->BytesReceived = 0;
-		}
-		ReleaseSRWLockExclusive(&Stream->Lock);
+// wakes up network thread for new media message, with coalescing enabled only once enough bytes are queued
+// or once flush deadline passes since first message that did not wake it up
+static void RTMP__Signal(RtmpStream* Stream, uint32_t Size)
+{
+	// coalescing can be changed from other thread, use same size for whole check
+	uint32_t CoalesceSize = (uint32_t)ReadNoFence(&Stream->CoalesceSize);
+	if (CoalesceSize == 0)
+	{
+		SetEvent(Stream->DataEvent);
+		return;
 	}
 
-	bool Repeat;
-	do
+	uint32_t Pending = (uint32_t)InterlockedAdd(&Stream->CoalescePending, (LONG)Size);
+	if (Pending - Size < CoalesceSize && Pending >= CoalesceSize)
 	{
-		switch (Stream->State)
+		SetEvent(Stream->DataEvent);
+	}
+	else if (Pending == Size)
+	{
+		// negative due time is relative, in 100nsec units
+		LARGE_INTEGER DueTime = { .QuadPart = -(LONGLONG)ReadNoFence(&Stream->CoalesceDelay) * 10 };
+		BOOL Ok = SetWaitableTimer(Stream->CoalesceTimer, &DueTime, 0, NULL, NULL, FALSE);
+		Assert(Ok);
+	}
+}
+
+// allows sending all messages queued so far
+static void RTMP__Flush(RtmpStream* Stream)
+{
+	InterlockedExchange(&Stream->CoalescePending, 0);
+	Stream->MessageFlush = RTMP_RESERVE_INDEX(ReadNoFence64(&Stream->SendReserve));
+}
+
+// starts new sends while there are free send slots & there is something queued & pacer allows it
+static void RTMP__TrySend(SOCKET Socket, RtmpStream* Stream)
+{
+	// limit can be lowered from other thread while more sends are in progress, then no new sends start until they finish
+	uint32_t SendLimit = (uint32_t)ReadNoFence(&Stream->SendLimit);
+
+	while (!Stream->Disconnect && Stream->SendActive < SendLimit && RTMP__IsCommitted(Stream, Stream->MessageSend)
+		&& (RTMP__IsFlushed(Stream, Stream->MessageSend) || RTMP__FindControl(Stream)))
+	{
+		uint32_t Limit = RTMP__PaceLimit(Stream);
+		if (Limit == 0)
 		{
-		case RTMP_STATE_HANDSHAKE:
-			Repeat = RTMP__DoHandshake(Socket, Stream);
+			// pacer timer will call this again
 			break;
-		case RTMP_STATE_STREAM_CONNECTING:
-		case RTMP_STATE_STREAM_CREATING:
-		case RTMP_STATE_STREAM_PUBLISHING:
-		case RTMP_STATE_STREAM_READY:
-		case RTMP_STATE_STREAM_DELETED:
-			Repeat = RTMP__DoChunk(Socket, Stream);
+		}
+
+		uint32_t MessageSend = Stream->MessageSend;
+		uint32_t MessageSent = Stream->MessageSent;
+		uint32_t SendActive = Stream->SendActive;
+
+		if (Stream->Tls)
+		{
+			// ciphertext of one send must fit into its TLS records buffer
+			Limit = min(Limit, RTMP_TLS_MAX_SEND);
+		}
+
+		RTMP__BeginSend(Socket, Stream, Limit);
+		if (Stream->SendActive == SendActive && Stream->MessageSend == MessageSend && Stream->MessageSent == MessageSent)
+		{
+			// nothing was sent or evicted
 			break;
-		default:
-			// remove all received data
-			RB_EndRead(&Stream->Recv, RB_GetUsed(&Stream->Recv));
-			Repeat = false;
 		}
 	}
-	while (Repeat);
+
+	if (!Stream->Blocked && !Stream->Disconnect && Stream->SendActive >= SendLimit && RTMP__IsCommitted(Stream, Stream->MessageSend))
+	{
+		// socket does not take more data, measured until oldest send finishes
+		LARGE_INTEGER Now;
+		QueryPerformanceCounter(&Now);
+		Stream->BlockedStart = Now.QuadPart;
+		Stream->Blocked = true;
+	}
 }
 
-// background processing thread
+// RTMP protocol stuff
 
-static DWORD RTMP__Thread(LPVOID Arg)
+// raw bytes without chunk header, only for handshake
+static bool RTMP__WriteRaw(RtmpStream* Stream, const uint8_t* Data, uint32_t Size)
 {
-	RtmpStream* Stream = Arg;
+	// only network thread changes session, so it is current here
+	RtmpMessage* Entry = RTMP__BeginMessage(Stream, Stream->Session, Size);
+	if (Entry)
+	{
+		CopyMemory(RB_GetPointer(&Stream->Send, Entry->Offset), Data, Size);
+		RTMP__EndMessage(Stream, Entry);
+	}
 
-	// parse url to know hostname/port to connect
-	// ---------------------------------------------------------------------------
+	return Entry != NULL;
+}
 
-	RTMP_DEBUG("parsing url");
+// fmt=0 chunk size, should fit into one payload, always use timestamp=0
+static bool RTMP__WriteChunk(RtmpStream* Stream, uint32_t ChunkStreamId, uint32_t MessageType, uint32_t MessageStreamId, const uint8_t* Message, uint32_t MessageSize)
+{
+	Assert(ChunkStreamId >= 2 && ChunkStreamId < 64);
+	Assert(MessageSize <= RTMP_OUT_CHUNK_SIZE);
 
-	WCHAR StreamUrl[RTMP_MAX_URL_LENGTH];
-	int StreamUrlLength = MultiByteToWideChar(CP_UTF8, 0, Stream->StreamUrl, -1, StreamUrl, ARRAYSIZE(StreamUrl));
+	RtmpMessage* Entry = RTMP__BeginMessage(Stream, Stream->Session, MessageSize);
+	if (Entry)
+	{
+		Entry->ChunkStreamId = ChunkStreamId;
+		Entry->ChunkFormat = 0;
+		Entry->Timestamp = 0;
+		Entry->MessageType = MessageType;
+		Entry->MessageStreamId = MessageStreamId;
+
+		CopyMemory(RB_GetPointer(&Stream->Send, Entry->Offset), Message, MessageSize);
+		RTMP__EndMessage(Stream, Entry);
+	}
 
-	WCHAR UrlScheme[32];
-	WCHAR UrlHost[RTMP_MAX_URL_LENGTH];
-	WCHAR UrlPath[RTMP_MAX_URL_LENGTH];
-	Stream->UrlComponents = (URL_COMPONENTSW)
+	return Entry != NULL;
+}
+
+// returns outgoing buffer usage in percent, either by bytes or by message count - whichever is larger
+static uint32_t RTMP__GetQueueUsage(RtmpStream* Stream)
+{
+	LONG64 Reserve = ReadNoFence64(&Stream->SendReserve);
+	uint32_t MessageRead = ReadAcquire((volatile LONG*)&Stream->MessageRead);
+	uint32_t SendRead = (uint32_t)ReadULongPtrAcquire((volatile ULONG_PTR*)&Stream->Send.Read);
+
+	uint32_t MessageUsage = (RTMP_RESERVE_INDEX(Reserve) - MessageRead) * 100 / RTMP_MAX_MESSAGES;
+	uint32_t SendUsage = (uint32_t)((uint64_t)(RTMP_RESERVE_POSITION(Reserve) - SendRead) * 100 / Stream->Send.Size);
+	return max(MessageUsage, SendUsage);
+}
+
+// decides if new video frame should be dropped, so frames that cannot be decoded are never queued
+static bool RTMP__DropVideo(RtmpStream* Stream, bool IsKeyFrame, bool IsDisposable)
+{
+	uint32_t Usage = RTMP__GetQueueUsage(Stream);
+
+	if (Stream->VideoDrop == RTMP_DROP_GOP)
 	{
-		.dwStructSize = sizeof(Stream->UrlComponents),
-		.lpszScheme = UrlScheme,
-		.dwSchemeLength = ARRAYSIZE(UrlScheme),
-		.lpszHostName = UrlHost,
-		.dwHostNameLength = ARRAYSIZE(UrlHost),
-		.lpszUrlPath = UrlPath,
-		.dwUrlPathLength = ARRAYSIZE(UrlPath),
-	};
-	if (InternetCrackUrlW(StreamUrl, StreamUrlLength, 0, &Stream->UrlComponents) == FALSE || StrCmpW(UrlScheme, L"rtmp") != 0)
+		if (!IsKeyFrame || Usage > RTMP_DROP_RESUME_USAGE)
+		{
+			// rest of GOP depends on frames already dropped, wait for keyframe that fits comfortably
+			return true;
+		}
+		RTMP_DEBUG("Resuming video on keyframe, outgoing buffer %u%% used", Usage);
+		Stream->VideoDrop = RTMP_DROP_NONE;
+	}
+
+	if (Usage >= RTMP_DROP_GOP_USAGE && !IsKeyFrame)
 	{
-		RTMP_DEBUG("ERROR: cannot parse url or not a rtmp protocol");
-		Stream->State = RTMP_STATE_ERROR;
-		RTMP_DEBUG("State ->  RTMP_STATE_ERROR");
-		return 0;
+		RTMP_DEBUG("Dropping video until next keyframe, outgoing buffer %u%% used", Usage);
+		Stream->VideoDrop = RTMP_DROP_GOP;
+		return true;
 	}
 
-	WCHAR UrlPort[32];
-	wsprintfW(UrlPort, L"%u", Stream->UrlComponents.nPort ? Stream->UrlComponents.nPort : RTMP_DEFAULT_PORT);
+	if (Usage >= RTMP_DROP_DISPOSABLE_USAGE)
+	{
+		Stream->VideoDrop = RTMP_DROP_DISPOSABLE;
+	}
+	else if (Usage <= RTMP_DROP_RESUME_USAGE)
+	{
+		Stream->VideoDrop = RTMP_DROP_NONE;
+	}
 
-	RTMP_DEBUG(" * parsed '%S' scheme, '%S' host, %S port, '%S' path", UrlScheme, UrlHost, UrlPort, UrlPath + 1);
+	// nothing depends on disposable frames, they can be dropped individually
+	return Stream->VideoDrop == RTMP_DROP_DISPOSABLE && IsDisposable;
+}
 
-	// do hostname resolving
-	// ---------------------------------------------------------------------------
+// converts Time in TimePeriod units per second to milliseconds without overflowing 64-bit intermediate value
+// every timestamp is rounded down from exact absolute time, so rounding errors never accumulate between messages
+static uint32_t RTMP__GetTimestamp(uint64_t Time, uint64_t TimePeriod)
+{
+	uint64_t Milliseconds = Time / TimePeriod * 1000 + Time % TimePeriod * 1000 / TimePeriod;
 
-	RTMP_DEBUG("resolving '%S' name", UrlHost);
+	// RTMP timestamps are modulo 2^32, wrap around after ~49 days
+	return (uint32_t)Milliseconds;
+}
 
-	Stream->State = RTMP_STATE_RESOLVING;
-	RTMP_DEBUG("State ->  RTMP_STATE_RESOLVING");
+// fmt=1 chunk, split into extra fmt=3 chunks when given to socket, Timestamp is absolute value in milliseconds
+// when Release is set, Message is only referenced and not copied into outgoing buffer
+static bool RTMP__SendDeltaChunk(RtmpStream* Stream, LONG Session, uint32_t ChunkStreamId, uint32_t Timestamp, bool IsKeyFrame, uint32_t MessageType, const uint8_t* Extra, uint32_t ExtraSize, const uint8_t* Message, uint32_t MessageSize, RtmpRelease_Callback* Release, void* ReleaseArg)
+{
+	Assert(ChunkStreamId >= 2 && ChunkStreamId < 64);
+	Assert(ExtraSize + MessageSize <= 0xffffff);
+	Assert(ExtraSize < RTMP_OUT_CHUNK_SIZE);
 
-	ADDRINFOEXW AddressHints =
-	{
-		.ai_family = AF_UNSPEC,
-		.ai_socktype = SOCK_STREAM,
-		.ai_protocol = IPPROTO_TCP,
-	};
-	PADDRINFOEXW Addresses;
+	LARGE_INTEGER Now;
+	QueryPerformanceCounter(&Now);
 
-	HANDLE CancelEvent;
-	int Resolve = GetAddrInfoExW(UrlHost, UrlPort, NS_ALL, NULL, &AddressHints, &Addresses, NULL, &Stream->SendOv, NULL, &CancelEvent);
-	if (Resolve == WSA_IO_PENDING)
+	uint32_t Size = Release ? ExtraSize : ExtraSize + MessageSize;
+
+	// copying payload happens outside of any lock, other producers are not blocked by it
+	RtmpMessage* Entry = RTMP__BeginMessage(Stream, Session, Size);
+	if (Entry)
 	{
-		HANDLE Events[] = { Stream->SendOv.hEvent, Stream->StopEvent };
-		DWORD Wait = WaitForMultipleObjects(ARRAYSIZE(Events), Events, FALSE, INFINITE);
-		if (Wait == WAIT_OBJECT_0)
+		Entry->ChunkStreamId = ChunkStreamId;
+		Entry->ChunkFormat = 1;
+		Entry->Timestamp = Timestamp;
+		Entry->MessageType = MessageType;
+		Entry->IsKeyFrame = IsKeyFrame;
+		Entry->Time = Now.QuadPart;
+
+		uint8_t* Ptr = RB_GetPointer(&Stream->Send, Entry->Offset);
+		CopyMemory(Ptr, Extra, ExtraSize);
+
+		if (Release)
 		{
-			// ok results are available now
-			Resolve = GetAddrInfoExOverlappedResult(&Stream->SendOv);
+			Entry->Data = Message;
+			Entry->DataSize = MessageSize;
+			Entry->Release = Release;
+			Entry->ReleaseArg = ReleaseArg;
 		}
-		else if (Wait == WAIT_OBJECT_0 + 1)
+		else
 		{
-			// quit requested
-			GetAddrInfoExCancel(CancelEvent);
-			Stream->State = RTMP_STATE_NOT_CONNECTED;
-			RTMP_DEBUG("State ->  RTMP_STATE_NOT_CONNECTED");
-			return 0;
+			CopyMemory(Ptr + ExtraSize, Message, MessageSize);
 		}
-		else
+
+		// entry can be sent & reused by network thread as soon as it is committed, do not touch it after that
+		RTMP__EndMessage(Stream, Entry);
+		RTMP__Signal(Stream, ExtraSize + MessageSize);
+
+		RtmpTrackCounters* Track = &Stream->Tracks[RTMP__GetTrack(MessageType)];
+		InterlockedAddNoFence64(&Track->EnqueuedBytes, ExtraSize + MessageSize);
+		InterlockedIncrementNoFence64(&Track->EnqueuedMessages);
+	}
+	else
+	{
+		RTMP__CountDrop(Stream, MessageType, RTMP_DROP_REASON_FULL);
+	}
+
+	return Entry != NULL;
+}
+
+static uint32_t RTMP__GetVideoFourCC(uint32_t Codec)
+{
+	switch (Codec)
+	{
+	case RTMP_VIDEO_CODEC_HEVC: return RTMP_FOURCC('h', 'v', 'c', '1');
+	case RTMP_VIDEO_CODEC_AV1:  return RTMP_FOURCC('a', 'v', '0', '1');
+	default:                    return RTMP_FOURCC('a', 'v', 'c', '1');
+	}
+}
+
+// writes FLV video tag header that goes before codec data, returns its size
+// AVC uses legacy header with codec id 7, other codecs use Enhanced RTMP ExVideoTagHeader with FourCC
+static uint32_t RTMP__WriteVideoHeader(uint8_t* Header, uint32_t Codec, bool IsConfig, bool IsKeyFrame, uint32_t CompositionOffset)
+{
+	uint8_t* Ptr = Header;
+	uint8_t FrameType = IsKeyFrame ? 1 : 2;
+
+	if (Codec == RTMP_VIDEO_CODEC_AVC)
+	{
+		uint8_t CodecByte = (FrameType << 4) | 7;
+		BE_PUT1(Ptr, CodecByte);        // AVC codec
+		BE_PUT1(Ptr, IsConfig ? 0 : 1); // AVC packet type
+		BE_PUT3(Ptr, CompositionOffset);
+	}
+	else
+	{
+		// av01 coded frames never have composition time offset, for hvc1 it is omitted when zero
+		uint8_t PacketType = IsConfig ? RTMP_VIDEO_SEQUENCE_START
+			: Codec == RTMP_VIDEO_CODEC_HEVC && CompositionOffset == 0 ? RTMP_VIDEO_CODED_FRAMES_X
+			: RTMP_VIDEO_CODED_FRAMES;
+
+		uint8_t HeaderByte = 0x80 | (FrameType << 4) | PacketType; // IsExHeader bit
+		BE_PUT1(Ptr, HeaderByte);
+		BE_PUT4(Ptr, RTMP__GetVideoFourCC(Codec));
+		if (Codec == RTMP_VIDEO_CODEC_HEVC && PacketType == RTMP_VIDEO_CODED_FRAMES)
 		{
-			Assert(false);
+			BE_PUT3(Ptr, CompositionOffset);
 		}
 	}
 
-	if (Resolve != NO_ERROR)
+	Assert(Ptr <= Header + RTMP_VIDEO_MAX_HEADER);
+	return (uint32_t)(Ptr - Header);
+}
+
+// writes FLV audio tag header that goes before codec data, returns its size
+// AAC uses legacy header with SoundFormat 10, Opus uses Enhanced RTMP ExAudioTagHeader with FourCC
+static uint32_t RTMP__WriteAudioHeader(uint8_t* Header, uint32_t Codec, bool IsConfig)
+{
+	uint8_t* Ptr = Header;
+
+	if (Codec == RTMP_AUDIO_CODEC_AAC)
 	{
-		RTMP_DEBUG("ERROR: failed to resolve address");
-		Stream->State = RTMP_STATE_ERROR;
-		RTMP_DEBUG("State ->  RTMP_STATE_ERROR");
-		return 0;
+		uint8_t CodecByte = (10 << 4) | (3 << 2) | (1 << 1) | 1;
+		BE_PUT1(Ptr, CodecByte);        // AAC codec
+		BE_PUT1(Ptr, IsConfig ? 0 : 1); // AAC packet type
+	}
+	else
+	{
+		uint8_t HeaderByte = (RTMP_AUDIO_EX_HEADER << 4) | (IsConfig ? RTMP_AUDIO_SEQUENCE_START : RTMP_AUDIO_CODED_FRAMES);
+		BE_PUT1(Ptr, HeaderByte);
+		BE_PUT4(Ptr, RTMP_FOURCC('O', 'p', 'u', 's'));
 	}
 
-	ResetEvent(Stream->SendOv.hEvent);
+	Assert(Ptr <= Header + RTMP_AUDIO_MAX_HEADER);
+	return (uint32_t)(Ptr - Header);
+}
 
-	// create & connect socket
-	// ---------------------------------------------------------------------------
+// keeps copy of video frame in GOP cache, cache starts again on every keyframe
+// tag header is not cached, each destination writes its own once its codec config is known
+static void RTMP__CacheVideo(RtmpGopCache* Gop, uint32_t Timestamp, uint32_t CompositionOffset, bool IsKeyFrame, const uint8_t* Data, uint32_t DataSize)
+{
+	if (IsKeyFrame)
+	{
+		Gop->Size = 0;
+		Gop->Count = 0;
+		Gop->Valid = true;
+	}
 
-	RTMP_DEBUG("connecting...");
+	if (!Gop->Valid || Gop->Count == RTMP_MAX_GOP_FRAMES || DataSize > Gop->Capacity - Gop->Size)
+	{
+		// GOP too long, nothing will be replayed until next keyframe
+		Gop->Valid = false;
+		return;
+	}
 
-	Stream->State = RTMP_STATE_CONNECTING;
-	RTMP_DEBUG("State ->  RTMP_STATE_CONNECTING");
+	RtmpGopFrame* Frame = &Gop->Frames[Gop->Count++];
+	Frame->Offset = Gop->Size;
+	Frame->Size = DataSize;
+	Frame->Timestamp = Timestamp;
+	Frame->CompositionOffset = CompositionOffset;
+	Frame->IsKeyFrame = IsKeyFrame;
+
+	CopyMemory(Gop->Buffer + Gop->Size, Data, DataSize);
+	Gop->Size += DataSize;
+}
+
+// queues all frames in GOP cache, call only when GOP is valid
+// returns false if any frame could not be queued, frames before it stay queued & rest of GOP is dropped
+static bool RTMP__ReplayVideo(RtmpStream* Stream, LONG Session, const RtmpGopCache* Gop)
+{
+	Assert(Gop->Valid);
 
-	ADDRINFOEXW* Address = Addresses;
-	SOCKET Socket = INVALID_SOCKET;
+	RTMP_DEBUG("Replaying %u cached video frames", Gop->Count);
 
-	Assert(Address);
-	while (Address != NULL)
+	for (uint32_t i = 0; i < Gop->Count; i++)
 	{
-		WCHAR AddressText[256];
-		DWORD AddressTextLength = ARRAYSIZE(AddressText);
-		WSAAddressToStringW(Address->ai_addr, (DWORD)Address->ai_addrlen, NULL, AddressText, &AddressTextLength);
+		const RtmpGopFrame* Frame = &Gop->Frames[i];
+
+		uint8_t Extra[RTMP_VIDEO_MAX_HEADER];
+		uint32_t ExtraSize = RTMP__WriteVideoHeader(Extra, Stream->VideoConfig.Codec, false, Frame->IsKeyFrame, Frame->CompositionOffset);
+
+		if (!RTMP__SendDeltaChunk(Stream, Session, RTMP_CHANNEL_VIDEO, Frame->Timestamp, Frame->IsKeyFrame, RTMP_PACKET_VIDEO, Extra, ExtraSize, Gop->Buffer + Frame->Offset, Frame->Size, NULL, NULL))
+		{
+			// rest of GOP cannot be decoded without missing frame
+			RTMP_DEBUG("Replay stopped after %u of %u frames", i, Gop->Count);
+			InterlockedIncrement(&Stream->VideoDropped);
+			Stream->VideoDrop = RTMP_DROP_GOP;
+			return false;
+		}
+	}
+	return true;
+}
+
+// returns msec since connecting started, at least 1 so 0 can mean step is not done
+static LONG RTMP__GetStartupTime(RtmpStream* Stream)
+{
+	LARGE_INTEGER Now;
+	QueryPerformanceCounter(&Now);
+	return (LONG)max((Now.QuadPart - Stream->StartTime) * 1000 / Stream->Frequency, 1);
+}
 
-		RTMP_DEBUG(" * trying %S address", AddressText);
+// queues metadata & codec config messages from last RTMP_SendConfig call
+static void RTMP__WriteConfig(RtmpStream* Stream)
+{
+	const RtmpVideoConfig* VideoConfig = Stream->HasVideoConfig ? &Stream->VideoConfig : NULL;
+	const RtmpAudioConfig* AudioConfig = Stream->HasAudioConfig ? &Stream->AudioConfig : NULL;
 
-		Socket = socket(Address->ai_family, Address->ai_socktype, Address->ai_protocol);
-		Assert(Socket);
+	uint8_t Payload[1024];
+	uint32_t PayloadSize;
+	uint8_t* Ptr;
+	bool ok;
 
-		u_long NonBlocking = 1;
-		int Error = ioctlsocket(Socket, FIONBIO, &NonBlocking);
-		Assert(Error == 0);
+	if (VideoConfig && AudioConfig)
+	{
+		// choose outgoing chunk size so one video chunk takes about as long on wire as one audio packet lasts,
+		// this way audio interleaved between video chunks is not delayed more than its own duration
+		uint32_t FrameSamples = AudioConfig->Codec == RTMP_AUDIO_CODEC_OPUS ? RTMP_OPUS_FRAME_SAMPLES : RTMP_AAC_FRAME_SAMPLES;
+		uint32_t ChunkSize = (uint32_t)((uint64_t)VideoConfig->Bitrate * 1000 / 8 * FrameSamples / AudioConfig->SampleRate);
+		ChunkSize = max(ChunkSize, RTMP_MIN_CHUNK_SIZE);
 
-		Error = WSAEventSelect(Socket, Stream->SendOv.hEvent, FD_CONNECT);
-		Assert(Error == 0);
+		// round down to power of 2
+		unsigned long Index;
+		_BitScanReverse(&Index, ChunkSize);
+		ChunkSize = min(1U << Index, RTMP_OUT_CHUNK_SIZE);
+
+		RTMP_DEBUG("Setting SetChunkSize to %u", ChunkSize);
+
+		Ptr = Payload;
+		BE_PUT4(Ptr, ChunkSize); // chunk payload size
+
+		ok = RTMP__WriteChunk(Stream, RTMP_CHANNEL_CONTROL, RTMP_PACKET_SET_CHUNK_SIZE, 0, Payload, 4);
+		Assert(ok);
+	}
 
-		Error = connect(Socket, Address->ai_addr, (int)Address->ai_addrlen);
-		if (Error != 0)
+	Ptr = Payload;
+	{
+		RTMP_DEBUG("Sending @setDataFrame data packet");
+
+		AMF_PUT_STRING_STATIC(Ptr, "@setDataFrame");
+		AMF_PUT_STRING_STATIC(Ptr, "onMetaData");
+		AMF_OBJ_ARRAY(Ptr, 3 + (VideoConfig ? 5 : 0) + (AudioConfig ? 6 : 0));
+		AMF_PUT_STRING_DATA(Ptr, "duration"); AMF_PUT_NUMBER(Ptr, 0);
+		AMF_PUT_STRING_DATA(Ptr, "filesize"); AMF_PUT_NUMBER(Ptr, 0);
+		AMF_PUT_STRING_DATA(Ptr, "encoder");  AMF_PUT_STRING_STATIC(Ptr, "wstream");
+		if (VideoConfig)
 		{
-			Error = WSAGetLastError();
-			if (Error == WSAEWOULDBLOCK)
-			{
-				HANDLE Events[] = { Stream->SendOv.hEvent, Stream->StopEvent };
-				DWORD Wait = WaitForMultipleObjects(ARRAYSIZE(Events), Events, FALSE, INFINITE);
-				if (Wait == WAIT_OBJECT_0)
-				{
-					// check if it is actually connected
-					int ErrorLen = sizeof(Error);
-					getsockopt(Socket, SOL_SOCKET, SO_ERROR, (char*)&Error, &ErrorLen);
-				}
-				else if (Wait == WAIT_OBJECT_0 + 1)
-				{
-					// quit requested
-					closesocket(Socket);
-					FreeAddrInfoExW(Addresses);
-					Stream->State = RTMP_STATE_NOT_CONNECTED;
-					RTMP_DEBUG("State ->  RTMP_STATE_NOT_CONNECTED");
-					return 0;
-				}
-			}
+			// Enhanced RTMP uses FourCC value as codec id
+			uint32_t CodecId = VideoConfig->Codec == RTMP_VIDEO_CODEC_AVC ? 7 : RTMP__GetVideoFourCC(VideoConfig->Codec);
+			AMF_PUT_STRING_DATA(Ptr, "videocodecid");  AMF_PUT_NUMBER(Ptr, CodecId);
+			AMF_PUT_STRING_DATA(Ptr, "videodatarate"); AMF_PUT_NUMBER(Ptr, VideoConfig->Bitrate);
+			AMF_PUT_STRING_DATA(Ptr, "framerate");     AMF_PUT_NUMBER(Ptr, VideoConfig->FrameRate);
+			AMF_PUT_STRING_DATA(Ptr, "width");         AMF_PUT_NUMBER(Ptr, VideoConfig->Width);
+			AMF_PUT_STRING_DATA(Ptr, "height");        AMF_PUT_NUMBER(Ptr, VideoConfig->Height);
+		}
+		if (AudioConfig)
+		{
+			uint32_t CodecId = AudioConfig->Codec == RTMP_AUDIO_CODEC_AAC ? 10 : RTMP_FOURCC('O', 'p', 'u', 's');
+			AMF_PUT_STRING_DATA(Ptr, "audiocodecid");    AMF_PUT_NUMBER(Ptr, CodecId);
+			AMF_PUT_STRING_DATA(Ptr, "audiodatarate");   AMF_PUT_NUMBER(Ptr, AudioConfig->Bitrate);
+			AMF_PUT_STRING_DATA(Ptr, "audiosamplerate"); AMF_PUT_NUMBER(Ptr, AudioConfig->SampleRate);
+			AMF_PUT_STRING_DATA(Ptr, "audiosamplesize"); AMF_PUT_NUMBER(Ptr, 16);
+			AMF_PUT_STRING_DATA(Ptr, "audiochannels");   AMF_PUT_NUMBER(Ptr, AudioConfig->Channels);
+			AMF_PUT_STRING_DATA(Ptr, "stereo");          AMF_PUT_BOOL(Ptr, (AudioConfig->Channels == 2));
 		}
+		AMF_OBJ_END(Ptr);
+	}
+	PayloadSize = (uint32_t)(Ptr - Payload);
+	ok = RTMP__WriteChunk(Stream, RTMP_CHANNEL_MISC, RTMP_PACKET_DATA_AMF0, Stream->StreamId, Payload, PayloadSize);
+	Assert(ok);
+
+	if (VideoConfig && RTMP_VIDEO_MAX_HEADER + VideoConfig->HeaderSize <= sizeof(Payload))
+	{
+		Ptr = Payload;
+		{
+			RTMP_DEBUG("Sending video config packet");
+
+			Ptr += RTMP__WriteVideoHeader(Ptr, VideoConfig->Codec, true, true, 0);
+			CopyMemory(Ptr, VideoConfig->Header, VideoConfig->HeaderSize);
+			Ptr += VideoConfig->HeaderSize;
+		}
+		PayloadSize = (uint32_t)(Ptr - Payload);
+		ok = RTMP__WriteChunk(Stream, RTMP_CHANNEL_VIDEO, RTMP_PACKET_VIDEO, Stream->StreamId, Payload, PayloadSize);
+		Assert(ok);
+	}
+
+	if (AudioConfig && RTMP_AUDIO_MAX_HEADER + AudioConfig->HeaderSize <= sizeof(Payload))
+	{
+		Ptr = Payload;
+		{
+			RTMP_DEBUG("Sending audio config packet");
+
+			Ptr += RTMP__WriteAudioHeader(Ptr, AudioConfig->Codec, true);
+			CopyMemory(Ptr, AudioConfig->Header, AudioConfig->HeaderSize);
+			Ptr += AudioConfig->HeaderSize;
+		}
+		PayloadSize = (uint32_t)(Ptr - Payload);
+		ok = RTMP__WriteChunk(Stream, RTMP_CHANNEL_AUDIO, RTMP_PACKET_AUDIO, Stream->StreamId, Payload, PayloadSize);
+		Assert(ok);
+	}
+}
+
+// called only from network thread, queues config once per session after stream is published
+// and only then lets media be queued, so config is always first message in every session
+static void RTMP__QueueConfig(SOCKET Socket, RtmpStream* Stream)
+{
+	if (Stream->State != RTMP_STATE_STREAM_READY || ReadAcquire(&Stream->HasConfig) == 0)
+	{
+		return;
+	}
+	if (ReadNoFence(&Stream->ConfigSession) == Stream->Session)
+	{
+		return;
+	}
+
+	RTMP__WriteConfig(Stream);
+	RTMP__TrySend(Socket, Stream);
+	WriteRelease(&Stream->ConfigSession, Stream->Session);
+}
+
+static bool RTMP__DoHandshake(SOCKET Socket, RtmpStream* Stream)
+{
+	uint32_t HandshakeSize = 1                // S0
+		+ 4 + 4 + RTMP_HANDSHAKE_RANDOM_SIZE  // S1
+		+ 4 + 4 + RTMP_HANDSHAKE_RANDOM_SIZE; // S2
+
+	uint32_t Available = RB_GetUsed(&Stream->Recv);
+	if (Available < HandshakeSize)
+	{
+		// not enough data for handshake
+		return false;
+	}
+
+	RTMP_DEBUG("Received S0+S1+S2 handshake");
+
+	// S0+S1+S2 received, reset received byte count to 0 to exclude header bytes
+	Stream->BytesReceived = 0;
+
+	// C2 response == S1
+	{
+		RTMP_DEBUG("Sending C2 handshake");
+
+		uint8_t* Handshake = RB_BeginRead(&Stream->Recv);
+
+		uint32_t HandshakeResponseSize = 4 + 4 + RTMP_HANDSHAKE_RANDOM_SIZE;
+		bool Ok = RTMP__WriteRaw(Stream, Handshake + 1, HandshakeResponseSize);
+		Assert(Ok);
+
+		RB_EndRead(&Stream->Recv, HandshakeSize);
+	}
+
+	// RTMP_PACKET_SET_CHUNK_SIZE
+	{
+		RTMP_DEBUG("Setting SetChunkSize to %u", RTMP_OUT_CHUNK_SIZE);
+
+		uint8_t Payload[4];
+		uint8_t* Ptr = Payload;
+
+		BE_PUT4(Ptr, RTMP_OUT_CHUNK_SIZE); // chunk payload size
+
+		RTMP__WriteChunk(Stream, RTMP_CHANNEL_CONTROL, RTMP_PACKET_SET_CHUNK_SIZE, 0, Payload, sizeof(Payload));
+	}
+
+	// RTMP_PACKET_SET_WINDOW_SIZE
+	{
+		RTMP_DEBUG("Setting WindowAckSize to %u", RTMP_OUT_ACK_SIZE);
+
+		uint8_t Payload[5];
+		uint8_t* Ptr = Payload;
+
+		BE_PUT4(Ptr, RTMP_OUT_ACK_SIZE); // ack size
+		BE_PUT1(Ptr, 2);                 // limit = dynamic
+
+		RTMP__WriteChunk(Stream, RTMP_CHANNEL_CONTROL, RTMP_PACKET_SET_WINDOW_SIZE, 0, Payload, sizeof(Payload));
+	}
+
+	// RTMP connect() method
+	{
+		RTMP_DEBUG("Invoking RTMP connect() method");
+
+		uint8_t Payload[1024];
+		uint8_t* Ptr = Payload;
+
+		AMF_PUT_STRING_STATIC(Ptr, "connect");
+		AMF_PUT_NUMBER(Ptr, RTMP_TRANSACTION_CONNECT);
+		AMF_OBJ_BEGIN(Ptr);
+		AMF_PUT_STRING_DATA(Ptr, "app");      AMF_PUT_STRING_DYNAMIC(Ptr, Stream->StreamApp);
+		AMF_PUT_STRING_DATA(Ptr, "type");     AMF_PUT_STRING_STATIC(Ptr, "nonprivate");
+		AMF_PUT_STRING_DATA(Ptr, "flashVer"); AMF_PUT_STRING_STATIC(Ptr, "FMLE/3.0 (compatible; wstream)");
+		AMF_PUT_STRING_DATA(Ptr, "tcUrl");    AMF_PUT_STRING_DYNAMIC(Ptr, Stream->StreamUrl);
+		// Enhanced RTMP codecs that can be sent
+		AMF_PUT_STRING_DATA(Ptr, "fourCcList");
+		AMF_STRICT_ARRAY(Ptr, 4);
+		AMF_PUT_STRING_STATIC(Ptr, "avc1");
+		AMF_PUT_STRING_STATIC(Ptr, "hvc1");
+		AMF_PUT_STRING_STATIC(Ptr, "av01");
+		AMF_PUT_STRING_STATIC(Ptr, "Opus");
+		AMF_OBJ_END(Ptr);
+
+		uint32_t PayloadSize = (uint32_t)(Ptr - Payload);
+		RTMP__WriteChunk(Stream, RTMP_CHANNEL_MISC, RTMP_PACKET_COMMAND_AMF0, 0, Payload, PayloadSize);
+	}
+
+	RTMP__TrySend(Socket, Stream);
+	Stream->State = RTMP_STATE_STREAM_CONNECTING;
+	RTMP_DEBUG("State ->  RTMP_STATE_STREAM_CONNECTING");
+
+	WriteNoFence(&Stream->HandshakeTime, RTMP__GetStartupTime(Stream));
+
+	return true;
+}
+
+static void RTMP__DoStreamConnect(SOCKET Socket, RtmpStream* Stream, const uint8_t* Message, uint32_t MessageSize)
+{
+	if (MessageSize > 3 && AMF_IS_STRING(Message))
+	{
+		Message++;
+		MessageSize--;
+
+		uint32_t StrLen;
+		AMF_GET_STRING_LEN(Message, StrLen);
+		MessageSize -= 2;
+
+		const char* Str = (const char*)Message;
+
+		if (MessageSize >= StrLen && StrCmpNA(Str, "_result", StrLen) == 0)
+		{
+			Message += StrLen;
+			MessageSize -= StrLen;
+
+			RTMP_DEBUG("Received _result() from RTMP connect() method");
+
+			// RTMP createStream() method
+			{
+				RTMP_DEBUG("Invoking RTMP createStream() method");
+
+				uint8_t Payload[128];
+				uint8_t* Ptr = Payload;
+
+				AMF_PUT_STRING_STATIC(Ptr, "createStream");
+				AMF_PUT_NUMBER(Ptr, RTMP_TRANSACTION_CREATE_STREAM);
+				AMF_PUT_NULL(Ptr);
+
+				uint32_t PayloadSize = (uint32_t)(Ptr - Payload);
+				RTMP__WriteChunk(Stream, RTMP_CHANNEL_MISC, RTMP_PACKET_COMMAND_AMF0, 0, Payload, PayloadSize);
+			}
+
+			RTMP__TrySend(Socket, Stream);
+			Stream->State = RTMP_STATE_STREAM_CREATING;
+			RTMP_DEBUG("State ->  RTMP_STATE_STREAM_CREATING");
+			return;
+		}
+		else if (MessageSize >= StrLen && StrCmpNA(Str, "_error", StrLen) == 0)
+		{
+			RTMP_DEBUG("Error received from RTMP connect() method");
+			Stream->Disconnect = true;
+		}
+	}
+}
+
+static void RTMP__DoStreamCreate(SOCKET Socket, RtmpStream* Stream, const uint8_t* Message, uint32_t MessageSize)
+{
+	if (MessageSize > 3 && AMF_IS_STRING(Message))
+	{
+		Message++;
+		MessageSize--;
+
+		uint32_t StrLen;
+		AMF_GET_STRING_LEN(Message, StrLen);
+		MessageSize -= 2;
+
+		const char* Str = (const char*)Message;
+		if (MessageSize >= StrLen + 9 + 1 + 9 && StrCmpNA(Str, "_result", StrLen) == 0)
+		{
+			Message += StrLen;
+			MessageSize -= StrLen;
+
+			double Transaction, StreamId;
+			AMF_GET_NUMBER(Message, Transaction);
+			AMF_GET_NULL(Message);
+			AMF_GET_NUMBER(Message, StreamId);
+
+			Stream->StreamId = (uint32_t)StreamId;
+
+			RTMP_DEBUG("Received _result() from RTMP createStream() method, StreamId=%u", Stream->StreamId);
+
+			// RTMP publish() method
+			{
+				RTMP_DEBUG("Invoking RTMP publish() method");
+
+				uint8_t Payload[1024];
+				uint8_t* Ptr = Payload;
+
+				AMF_PUT_STRING_STATIC(Ptr, "publish");
+				AMF_PUT_NUMBER(Ptr, RTMP_TRANSACTION_PUBLISH);
+				AMF_PUT_NULL(Ptr);
+				AMF_PUT_STRING_DYNAMIC(Ptr, Stream->StreamKey);
+				AMF_PUT_STRING_STATIC(Ptr, "live");
+
+				uint32_t PayloadSize = (uint32_t)(Ptr - Payload);
+				RTMP__WriteChunk(Stream, RTMP_CHANNEL_MISC, RTMP_PACKET_COMMAND_AMF0, Stream->StreamId, Payload, PayloadSize);
+			}
+
+			RTMP__TrySend(Socket, Stream);
+			Stream->State = RTMP_STATE_STREAM_PUBLISHING;
+			RTMP_DEBUG("State ->  RTMP_STATE_STREAM_PUBLISHING");
+			return;
+		}
+		else if (MessageSize >= StrLen && StrCmpNA(Str, "_error", StrLen) == 0)
+		{
+			RTMP_DEBUG("Error received from RTMP createStream() method");
+			Stream->Disconnect = true;
+		}
+	}
+}
+
+static void RTMP__DoStreamPublish(SOCKET Socket, RtmpStream* Stream, const uint8_t* Message, uint32_t MessageSize)
+{
+	if (MessageSize > 3 && AMF_IS_STRING(Message))
+	{
+		Message++;
+		MessageSize--;
+
+		uint32_t StrLen;
+		AMF_GET_STRING_LEN(Message, StrLen);
+		MessageSize -= 2;
+
+		const char* Str = (const char*)Message;
+		if (MessageSize >= StrLen && StrCmpNA(Str, "onStatus", StrLen) == 0)
+		{
+			Message += StrLen;
+			MessageSize -= StrLen;
+
+			RTMP_DEBUG("Received onStatus() from RTMP publish() method", Stream->StreamId);
+
+			// TODO: this always assumes onStatus means success
+			// real check would be to parse object returned
+			// code="NetStream.Publish.Start"
+			// level="status"
+
+			Stream->State = RTMP_STATE_STREAM_READY;
+			RTMP_DEBUG("State ->  RTMP_STATE_STREAM_READY");
+
+			WriteNoFence(&Stream->PublishTime, RTMP__GetStartupTime(Stream));
+
+			// after reconnect same config as before is sent so media can be accepted right away
+			RTMP__QueueConfig(Socket, Stream);
+			return;
+		}
+	}
+
+	RTMP_DEBUG("Error received from RTMP publish() method");
+	Stream->Disconnect = true;
+}
+
+// returns msec since connecting started, wraps around like RTMP timestamps
+static uint32_t RTMP__GetMilliseconds(RtmpStream* Stream)
+{
+	LARGE_INTEGER Now;
+	QueryPerformanceCounter(&Now);
+	return (uint32_t)((Now.QuadPart - Stream->StartTime) * 1000 / Stream->Frequency);
+}
+
+static void RTMP__DoMessage(SOCKET Socket, RtmpStream* Stream, uint32_t MessageType, const uint8_t* Message, uint32_t MessageLength)
+{
+	const uint8_t* Ptr = Message;
+
+	if (MessageType == RTMP_PACKET_SET_WINDOW_SIZE)
+	{
+		if (MessageLength == 4)
+		{
+			BE_GET4(Ptr, Stream->WindowSize);
+			RTMP_DEBUG("Received SetWindowSize message: %u", Stream->WindowSize);
+		}
+	}
+	else if (MessageType == RTMP_PACKET_SET_CHUNK_SIZE)
+	{
+		if (MessageLength == 4)
+		{
+			uint32_t ChunkSize;
+			BE_GET4(Ptr, ChunkSize);
+			RTMP_DEBUG("Received SetChunkSize: %u", ChunkSize);
+
+			// highest bit must be zero
+			ChunkSize &= 0x7fffffff;
+			if (ChunkSize == 0)
+			{
+				RTMP_DEBUG("ERROR: invalid chunk size");
+				Stream->Disconnect = true;
+				return;
+			}
+			Stream->ChunkSize = ChunkSize;
+		}
+	}
+	else if (MessageType == RTMP_PACKET_ACK)
+	{
+		if (MessageLength == 4)
+		{
+			BE_GET4(Ptr, Stream->AckBytes);
+		}
+	}
+	else if (MessageType == RTMP_PACKET_USER_CONTROL)
+	{
+		if (MessageLength == 6)
+		{
+			uint32_t Event;
+			uint32_t Time;
+			BE_GET2(Ptr, Event);
+			BE_GET4(Ptr, Time);
+
+			if (Event == RTMP_USER_PING_REQUEST)
+			{
+				uint8_t Payload[6];
+				uint8_t* Out = Payload;
+				BE_PUT2(Out, RTMP_USER_PING_RESPONSE);
+				BE_PUT4(Out, Time);
+				RTMP__WriteChunk(Stream, RTMP_CHANNEL_CONTROL, RTMP_PACKET_USER_CONTROL, 0, Payload, sizeof(Payload));
+				RTMP__TrySend(Socket, Stream);
+			}
+			else if (Event == RTMP_USER_PING_RESPONSE)
+			{
+				WriteNoFence(&Stream->PingRtt, RTMP__GetMilliseconds(Stream) - Time);
+			}
+		}
+	}
+	else if (MessageType == RTMP_PACKET_SET_PEER_BW)
+	{
+		if (MessageLength == 5)
+		{
+			uint32_t OutgoingBandwidth;
+			uint8_t Limit;
+			BE_GET4(Ptr, OutgoingBandwidth);
+			BE_GET1(Ptr, Limit);
+
+			RTMP_DEBUG("Received SetPeerBandidth: %u, limit %s",
+				OutgoingBandwidth,
+				Limit == 0 ? "hard" : Limit == 1 ? "soft" : Limit == 2 ? "dynamic" : "UNKNOWN");
+
+			// dynamic limit is treated as hard if previous one was hard, otherwise ignored
+			if (Limit == 2 && Stream->PeerLimit == 0)
+			{
+				Limit = 0;
+			}
+
+			// hard limit replaces current one, soft limit only lowers it
+			if (Limit == 0 || (Limit == 1 && OutgoingBandwidth < Stream->PeerBandwidth))
+			{
+				Stream->PeerBandwidth = OutgoingBandwidth;
+				Stream->PeerLimit = Limit;
+			}
+		}
+	}
+	else if (MessageType == RTMP_PACKET_COMMAND_AMF0)
+	{
+		switch (Stream->State)
+		{
+		case RTMP_STATE_STREAM_CONNECTING:
+			RTMP__DoStreamConnect(Socket, Stream, Ptr, MessageLength);
+			break;
+		case RTMP_STATE_STREAM_CREATING:
+			RTMP__DoStreamCreate(Socket, Stream, Ptr, MessageLength);
+			break;
+		case RTMP_STATE_STREAM_PUBLISHING:
+			RTMP__DoStreamPublish(Socket, Stream, Ptr, MessageLength);
+			break;
+		}
+	}
+	else
+	{
+		// ignore other incoming messages
+	}
+}
+
+// returns state of chunk stream, if it is not tracked yet then least recently used one without partial message is replaced
+static RtmpChunk* RTMP__GetChunk(RtmpStream* Stream, uint32_t ChunkStreamId, bool IsNew)
+{
+	RtmpChunk* Oldest = NULL;
+	for (uint32_t i = 0; i < RTMP_MAX_RECV_STREAMS; i++)
+	{
+		RtmpChunk* Chunk = &Stream->RecvChunks[i];
+		if (Chunk->ChunkStreamId == ChunkStreamId)
+		{
+			Chunk->LastUse = ++Stream->RecvUse;
+			return Chunk;
+		}
+		if (Chunk->Received == 0 && (Oldest == NULL || (int32_t)(Chunk->LastUse - Oldest->LastUse) < 0))
+		{
+			Oldest = Chunk;
+		}
+	}
+
+	if (!IsNew || Oldest == NULL)
+	{
+		// fmt=1,2,3 chunks need previous header on same chunk stream
+		return NULL;
+	}
+
+	ZeroMemory(Oldest, sizeof(*Oldest));
+	Oldest->ChunkStreamId = ChunkStreamId;
+	Oldest->LastUse = ++Stream->RecvUse;
+	return Oldest;
+}
+
+// parses chunks incrementally as they are received, every byte in Recv ring buffer is consumed only once
+// message that fits in one chunk is processed directly from Recv ring buffer, otherwise it is assembled in chunk stream buffer
+static bool RTMP__DoChunk(SOCKET Socket, RtmpStream* Stream)
+{
+	while (!Stream->Disconnect)
+	{
+		uint32_t Available = RB_GetUsed(&Stream->Recv);
+		uint8_t* Received = RB_BeginRead(&Stream->Recv);
+
+		RtmpChunk* Chunk = Stream->RecvChunk;
+		if (Chunk)
+		{
+			// continue with payload of current chunk
+			uint32_t Size = min(Available, Stream->RecvRemaining);
+			if (Size == 0)
+			{
+				return false;
+			}
+
+			if (Chunk->MessageLength <= RTMP_MAX_RECV_MESSAGE)
+			{
+				uint8_t* Buffer = Stream->RecvMessages + (Chunk - Stream->RecvChunks) * RTMP_MAX_RECV_MESSAGE;
+				CopyMemory(Buffer + Chunk->Received, Received, Size);
+			}
+			RB_EndRead(&Stream->Recv, Size);
+
+			Chunk->Received += Size;
+			Stream->RecvRemaining -= Size;
+			if (Stream->RecvRemaining != 0)
+			{
+				return false;
+			}
+			Stream->RecvChunk = NULL;
+
+			if (Chunk->Received == Chunk->MessageLength)
+			{
+				Chunk->Received = 0;
+				if (Chunk->MessageLength <= RTMP_MAX_RECV_MESSAGE)
+				{
+					uint8_t* Buffer = Stream->RecvMessages + (Chunk - Stream->RecvChunks) * RTMP_MAX_RECV_MESSAGE;
+					RTMP__DoMessage(Socket, Stream, Chunk->MessageType, Buffer, Chunk->MessageLength);
+				}
+				else
+				{
+					RTMP_DEBUG("Skipped incoming message type %u with %u bytes", Chunk->MessageType, Chunk->MessageLength);
+				}
+			}
+			continue;
+		}
+
+		// basic header, 1 to 3 bytes
+		if (Available < 1)
+		{
+			return false;
+		}
+
+		uint8_t* Ptr = Received;
+		uint8_t ChunkFormat = Ptr[0] >> 6;
+		uint32_t ChunkStreamId = Ptr[0] & 0x3f;
+		uint32_t BasicHeaderSize = ChunkStreamId == 0 ? 2 : ChunkStreamId == 1 ? 3 : 1;
+		uint32_t MessageHeaderSize = ChunkFormat == 0 ? 11 : ChunkFormat == 1 ? 7 : ChunkFormat == 2 ? 3 : 0;
+		if (Available < BasicHeaderSize + MessageHeaderSize)
+		{
+			return false;
+		}
+		Ptr++;
+
+		if (ChunkStreamId == 0)
+		{
+			ChunkStreamId = 64 + Ptr[0];
+			Ptr += 1;
+		}
+		else if (ChunkStreamId == 1)
+		{
+			ChunkStreamId = 64 + Ptr[0] + (Ptr[1] << 8);
+			Ptr += 2;
+		}
+
+		RtmpChunk* Last = RTMP__GetChunk(Stream, ChunkStreamId, ChunkFormat == 0);
+		if (Last == NULL)
+		{
+			RTMP_DEBUG("ERROR: fmt=%u chunk for unknown chunk stream %u", ChunkFormat, ChunkStreamId);
+			Stream->Disconnect = true;
+			return false;
+		}
+
+		if (Last->Received != 0 && ChunkFormat != 3)
+		{
+			RTMP_DEBUG("ERROR: new message on chunk stream %u before previous one is finished", ChunkStreamId);
+			Stream->Disconnect = true;
+			return false;
+		}
+
+		// message header, 0 to 11 bytes
+		uint32_t Timestamp = 0;
+		uint32_t MessageLength = Last->MessageLength;
+		uint32_t MessageType = Last->MessageType;
+		uint32_t MessageStreamId = Last->MessageStreamId;
+
+		if (ChunkFormat <= 2)
+		{
+			BE_GET3(Ptr, Timestamp);
+		}
+		if (ChunkFormat <= 1)
+		{
+			BE_GET3(Ptr, MessageLength);
+			BE_GET1(Ptr, MessageType);
+		}
+		if (ChunkFormat == 0)
+		{
+			LE_GET4(Ptr, MessageStreamId);
+		}
+
+		// extended timestamp, 0 or 4 bytes
+		bool IsExtended = ChunkFormat == 3 ? Last->IsExtended : Timestamp == 0xffffff;
+		uint32_t HeaderSize = (uint32_t)(Ptr - Received) + (IsExtended ? 4 : 0);
+		if (Available < HeaderSize)
+		{
+			return false;
+		}
+		if (IsExtended)
+		{
+			BE_GET4(Ptr, Timestamp);
+		}
+
+		if (ChunkFormat == 0)
+		{
+			Last->Timestamp = Timestamp;
+			Last->TimestampDelta = 0;
+		}
+		else if (ChunkFormat <= 2)
+		{
+			Last->TimestampDelta = Timestamp;
+			Last->Timestamp += Timestamp;
+		}
+		else if (Last->Received == 0)
+		{
+			// fmt=3 chunk starting new message uses same delta as previous one
+			Last->Timestamp += Last->TimestampDelta;
+		}
+		Last->MessageLength = MessageLength;
+		Last->MessageType = MessageType;
+		Last->MessageStreamId = MessageStreamId;
+		Last->IsExtended = IsExtended;
+
+		uint32_t PayloadSize = min(MessageLength - Last->Received, Stream->ChunkSize);
+		if (Last->Received == 0 && PayloadSize == MessageLength && MessageLength <= RTMP_MAX_RECV_MESSAGE && Available >= HeaderSize + PayloadSize)
+		{
+			// whole message is in one chunk & already received, no need to copy it
+			// too large messages go through payload path below, which skips them same as multi-chunk ones
+			RTMP__DoMessage(Socket, Stream, MessageType, Ptr, MessageLength);
+			RB_EndRead(&Stream->Recv, HeaderSize + PayloadSize);
+			continue;
+		}
+
+		RB_EndRead(&Stream->Recv, HeaderSize);
+		if (PayloadSize == 0)
+		{
+			// empty message
+			RTMP__DoMessage(Socket, Stream, MessageType, Ptr, 0);
+			continue;
+		}
+		Stream->RecvChunk = Last;
+		Stream->RecvRemaining = PayloadSize;
+	}
+	return false;
+}
+
+// sends ping to server & samples TCP state to update network estimates
+static void RTMP__UpdateStats(SOCKET Socket, RtmpStream* Stream)
+{
+	if (Stream->State < RTMP_STATE_STREAM_CONNECTING)
+	{
+		// no chunks can be sent before handshake is done
+		return;
+	}
+
+	{
+		uint8_t Payload[6];
+		uint8_t* Ptr = Payload;
+		BE_PUT2(Ptr, RTMP_USER_PING_REQUEST);
+		BE_PUT4(Ptr, RTMP__GetMilliseconds(Stream));
+		RTMP__WriteChunk(Stream, RTMP_CHANNEL_CONTROL, RTMP_PACKET_USER_CONTROL, 0, Payload, sizeof(Payload));
+	}
+
+#ifdef _WIN32
+	DWORD Version = 0;
+	TCP_INFO_v0 Info;
+	DWORD InfoSize;
+	if (WSAIoctl(Socket, SIO_TCP_INFO, &Version, sizeof(Version), &Info, sizeof(Info), &InfoSize, NULL, NULL) != 0)
+	{
+		// older Windows versions, only RTT from ping is available
+		return;
+	}
+	uint64_t Delivered = Info.BytesOut - Info.BytesInFlight;
+	uint32_t BytesInFlight = Info.BytesInFlight;
+	uint32_t RttUs = Info.RttUs;
+	uint32_t Cwnd = Info.Cwnd;
+#else
+	struct tcp_info Info;
+	socklen_t InfoSize = sizeof(Info);
+	if (getsockopt(Socket, IPPROTO_TCP, TCP_INFO, &Info, &InfoSize) != 0)
+	{
+		return;
+	}
+	// kernel counts unacknowledged data & congestion window in segments
+	uint64_t Delivered = Info.tcpi_bytes_acked;
+	uint32_t BytesInFlight = Info.tcpi_unacked * Info.tcpi_snd_mss;
+	uint32_t RttUs = Info.tcpi_rtt;
+	uint32_t Cwnd = Info.tcpi_snd_cwnd * Info.tcpi_snd_mss;
+#endif
+
+	LARGE_INTEGER Now;
+	QueryPerformanceCounter(&Now);
+
+	uint64_t Elapsed = Now.QuadPart - Stream->StatsTime;
+	if (Stream->StatsTime != 0 && Elapsed != 0)
+	{
+		uint64_t DeliveryRate = (Delivered - Stream->StatsDelivered) * Stream->Frequency / Elapsed;
+
+		// when there is no data waiting to be sent, delivery rate shows only how much media was sent
+		// then congestion window per RTT shows how much more network could take
+		bool NetworkLimited = Stream->SendActive != 0 || RTMP__IsCommitted(Stream, Stream->MessageSend);
+		uint64_t WindowRate = RttUs ? (uint64_t)Cwnd * 1000000 / RttUs : 0;
+		uint64_t Sample = NetworkLimited ? DeliveryRate : max(DeliveryRate, WindowRate);
+
+		uint64_t Bandwidth = (uint32_t)ReadNoFence(&Stream->Bandwidth);
+		Bandwidth = Bandwidth == 0 ? Sample : (Bandwidth * (RTMP_STATS_SMOOTHING - 1) + Sample) / RTMP_STATS_SMOOTHING;
+		WriteNoFence(&Stream->Bandwidth, (LONG)min(Bandwidth, INT32_MAX));
+	}
+	Stream->StatsTime = Now.QuadPart;
+	Stream->StatsDelivered = Delivered;
+
+	// server Acknowledgement includes bytes still buffered in its socket, so it is preferred over TCP bytes in flight
+	uint32_t InFlight = Stream->AckBytes != 0 ? (uint32_t)Stream->TotalBytesSent - Stream->AckBytes : BytesInFlight;
+
+	WriteNoFence(&Stream->TcpRtt, RttUs);
+	WriteNoFence(&Stream->TcpCwnd, Cwnd);
+	WriteNoFence(&Stream->InFlight, InFlight);
+}
+
+// socket recv handling
+
+// processes Transferred bytes that were just added to Recv ring buffer
+static void RTMP__DoRecv(SOCKET Socket, RtmpStream* Stream, uint32_t Transferred)
+{
+	Stream->TotalByteReceived += Transferred;
+	Stream->BytesReceived += Transferred;
+	if (Stream->BytesReceived > Stream->WindowSize / 2)
+	{
+		uint8_t Payload[4];
+		uint8_t* Ptr = Payload;
+
+		// this truncates total bytes sent to lower 32-bits, spec does not say what to do when total size >4GiB
+		BE_PUT4(Ptr, (uint32_t)Stream->TotalByteReceived);
+
+		RTMP_DEBUG("Sending ACK control message for %u bytes", (uint32_t)Stream->TotalByteReceived);
+
+		if (RTMP__WriteChunk(Stream, RTMP_CHANNEL_CONTROL, RTMP_PACKET_ACK, 0, Payload, sizeof(Payload)))
+		{
+			Stream->BytesReceived = 0;
+		}
+	}
+
+	bool Repeat;
+	do
+	{
+		switch (Stream->State)
+		{
+		case RTMP_STATE_HANDSHAKE:
+			Repeat = RTMP__DoHandshake(Socket, Stream);
+			break;
+		case RTMP_STATE_STREAM_CONNECTING:
+		case RTMP_STATE_STREAM_CREATING:
+		case RTMP_STATE_STREAM_PUBLISHING:
+		case RTMP_STATE_STREAM_READY:
+		case RTMP_STATE_STREAM_DELETED:
+			Repeat = RTMP__DoChunk(Socket, Stream);
+			break;
+		default:
+			// remove all received data
+			RB_EndRead(&Stream->Recv, RB_GetUsed(&Stream->Recv));
+			Repeat = false;
+		}
+	}
+	while (Repeat);
+}
+
+#ifdef _WIN32
+
+static void RTMP__BeginRecv(SOCKET Socket, RtmpStream* Stream)
+{
+	uint32_t Count = RB_GetFree(&Stream->Recv);
+	if (Count == 0)
+	{
+		RTMP_DEBUG("ERROR: cannot receive more data because receive buffer is full");
+		Stream->Disconnect = true;
+		return;
+	}
+
+	WSABUF Buffer = { .buf = RB_BeginWrite(&Stream->Recv), .len = Count };
+	if (Stream->Tls)
+	{
+		// receive ciphertext only as much as decrypted data can fit into Recv ring buffer
+		Assert(Stream->TlsRecvSize < Count);
+		Buffer.buf = Stream->TlsRecv + Stream->TlsRecvSize;
+		Buffer.len = min(RTMP_TLS_RECV_SIZE, Count) - Stream->TlsRecvSize;
+	}
+
+	DWORD Flags = 0;
+	DWORD Transferred;
+	int Error = WSARecv(Socket, &Buffer, 1, &Transferred, &Flags, &Stream->RecvOv, NULL);
+	if (Error == SOCKET_ERROR)
+	{
+		Error = WSAGetLastError();
+		if (Error == WSA_IO_PENDING)
+		{
+			// recv is happening in background
+		}
+		else
+		{
+			RTMP_DEBUG("ERROR: recv failed, error %u", Error);
+			Stream->Disconnect = true;
+			return;
+		}
+	}
+
+	Stream->Receiving = true;
+}
+
+static void RTMP__EndRecv(SOCKET Socket, RtmpStream* Stream)
+{
+	DWORD Transferred;
+	DWORD Flags;
+	BOOL Ok = WSAGetOverlappedResult(Socket, &Stream->RecvOv, &Transferred, TRUE, &Flags);
+	ResetEvent(Stream->RecvOv.hEvent);
+	Stream->Receiving = false;
+
+	if (!Ok || Transferred == 0)
+	{
+		RTMP_DEBUG("ERROR: connection closed");
+		Stream->Disconnect = true;
+		return;
+	}
+
+	if (Stream->Tls)
+	{
+		Stream->TlsRecvSize += Transferred;
+		Transferred = RTMP__TlsDecrypt(Stream);
+	}
+	else
+	{
+		Assert(Transferred <= RB_GetFree(&Stream->Recv));
+		RB_EndWrite(&Stream->Recv, Transferred);
+	}
+
+	RTMP__DoRecv(Socket, Stream, Transferred);
+}
+
+#else
+
+// reads everything nonblocking socket has, same as overlapped recv that is always restarted
+static void RTMP__Recv(SOCKET Socket, RtmpStream* Stream)
+{
+	while (!Stream->Disconnect)
+	{
+		if (RB_IsFull(&Stream->Recv))
+		{
+			RTMP_DEBUG("ERROR: cannot receive more data because receive buffer is full");
+			Stream->Disconnect = true;
+			return;
+		}
+
+		ssize_t Received = recv(Socket, RB_BeginWrite(&Stream->Recv), RB_GetFree(&Stream->Recv), MSG_DONTWAIT);
+		if (Received < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+			{
+				RTMP_DEBUG("ERROR: recv failed, error %d", errno);
+				Stream->Disconnect = true;
+			}
+			return;
+		}
+		if (Received == 0)
+		{
+			RTMP_DEBUG("ERROR: connection closed");
+			Stream->Disconnect = true;
+			return;
+		}
+
+		RB_EndWrite(&Stream->Recv, (uint32_t)Received);
+		RTMP__DoRecv(Socket, Stream, (uint32_t)Received);
+	}
+}
+
+// writes started sends to nonblocking socket in order, each one is finished once socket has taken all of it
+static void RTMP__WriteSends(SOCKET Socket, RtmpStream* Stream)
+{
+	while (!Stream->Disconnect && Stream->SendActive != 0)
+	{
+		RtmpSend* Send = &Stream->Sends[Stream->SendFirst];
+		if (Send->BufferIndex != Send->BufferCount)
+		{
+			struct msghdr Message =
+			{
+				.msg_iov = Send->Buffers + Send->BufferIndex,
+				.msg_iovlen = Send->BufferCount - Send->BufferIndex,
+			};
+
+			Stream->SendCalls++;
+			ssize_t Written = sendmsg(Socket, &Message, MSG_DONTWAIT | MSG_NOSIGNAL);
+			if (Written < 0)
+			{
+				if (errno == EINTR)
+				{
+					continue;
+				}
+				if (errno == EAGAIN || errno == EWOULDBLOCK)
+				{
+					// socket buffer is full, continue once epoll reports it writable
+					Stream->Writable = false;
+					return;
+				}
+				RTMP_DEBUG("ERROR: send failed, error %d", errno);
+				Stream->Disconnect = true;
+				return;
+			}
+
+			// skip fully written buffers, partially written one continues from where socket stopped
+			size_t Size = (size_t)Written;
+			while (Send->BufferIndex != Send->BufferCount && Size >= Send->Buffers[Send->BufferIndex].iov_len)
+			{
+				Size -= Send->Buffers[Send->BufferIndex].iov_len;
+				Send->BufferIndex++;
+			}
+			if (Send->BufferIndex != Send->BufferCount)
+			{
+				struct iovec* Buffer = &Send->Buffers[Send->BufferIndex];
+				Buffer->iov_base = (uint8_t*)Buffer->iov_base + Size;
+				Buffer->iov_len -= Size;
+				continue;
+			}
+		}
+
+		// whole send was taken by socket, messages are released & next sends can be started
+		RTMP__EndSend(Socket, Stream);
+		RTMP__TrySend(Socket, Stream);
+	}
+	Stream->Writable = true;
+}
+
+#endif
+
+// connecting stuff
+
+#define RTMP_MAX_ADDRESSES 32          // max resolved addresses to try
+#define RTMP_MAX_CONNECTS 8            // max connection attempts in progress at same time
+#define RTMP_CONNECT_ATTEMPT_DELAY 250 // msec to wait before starting next connection attempt, RFC 8305
+#define RTMP_ADDRESS_CACHE_TTL 60      // seconds to reuse resolved addresses
+
+#ifdef _WIN32
+typedef ADDRINFOEXW RtmpAddress;
+#else
+typedef struct addrinfo RtmpAddress;
+#endif
+
+// orders addresses for connection attempts alternating address families, returns count
+static uint32_t RTMP__OrderAddresses(RtmpAddress* Addresses, RtmpAddress** Order)
+{
+	// first address family is the one preferred by resolver
+	RtmpAddress* Preferred[RTMP_MAX_ADDRESSES];
+	RtmpAddress* Other[RTMP_MAX_ADDRESSES];
+	uint32_t PreferredCount = 0;
+	uint32_t OtherCount = 0;
+
+	for (RtmpAddress* Address = Addresses; Address != NULL; Address = Address->ai_next)
+	{
+		if (Address->ai_family == Addresses->ai_family)
+		{
+			if (PreferredCount < RTMP_MAX_ADDRESSES)
+			{
+				Preferred[PreferredCount++] = Address;
+			}
+		}
+		else if (OtherCount < RTMP_MAX_ADDRESSES)
+		{
+			Other[OtherCount++] = Address;
+		}
+	}
+
+	uint32_t AddressCount = 0;
+	for (uint32_t i = 0; i < max(PreferredCount, OtherCount); i++)
+	{
+		if (i < PreferredCount)
+		{
+			Order[AddressCount++] = Preferred[i];
+		}
+		if (i < OtherCount)
+		{
+			Order[AddressCount++] = Other[i];
+		}
+	}
+	return AddressCount;
+}
+
+#ifdef _WIN32
+
+// races connection attempts to addresses with staggered starts, alternating address families
+// returns connected socket, or INVALID_SOCKET if all attempts failed or quit was requested
+static SOCKET RTMP__Connect(RtmpStream* Stream, ADDRINFOEXW* Addresses)
+{
+	ADDRINFOEXW* Order[2 * RTMP_MAX_ADDRESSES];
+	uint32_t AddressCount = RTMP__OrderAddresses(Addresses, Order);
+
+	// first event is for quit request, rest are for sockets being connected
+	HANDLE Events[1 + RTMP_MAX_CONNECTS] = { Stream->StopEvent };
+	SOCKET Sockets[RTMP_MAX_CONNECTS];
+	uint32_t Count = 0;
+	uint32_t Next = 0;
+	SOCKET Result = INVALID_SOCKET;
+
+	for (;;)
+	{
+		if (Next < AddressCount && Count < RTMP_MAX_CONNECTS)
+		{
+			ADDRINFOEXW* Address = Order[Next++];
+
+			WCHAR AddressText[256];
+			DWORD AddressTextLength = ARRAYSIZE(AddressText);
+			WSAAddressToStringW(Address->ai_addr, (DWORD)Address->ai_addrlen, NULL, AddressText, &AddressTextLength);
+
+			RTMP_DEBUG(" * trying %S address", AddressText);
+
+			SOCKET Socket = socket(Address->ai_family, Address->ai_socktype, Address->ai_protocol);
+			Assert(Socket != INVALID_SOCKET);
+
+			u_long NonBlocking = 1;
+			int Error = ioctlsocket(Socket, FIONBIO, &NonBlocking);
+			Assert(Error == 0);
+
+			HANDLE Event = CreateEventW(NULL, TRUE, FALSE, NULL);
+			Assert(Event);
+
+			Error = WSAEventSelect(Socket, Event, FD_CONNECT);
+			Assert(Error == 0);
+
+			Error = connect(Socket, Address->ai_addr, (int)Address->ai_addrlen);
+			if (Error == 0 || WSAGetLastError() == WSAEWOULDBLOCK)
+			{
+				// result will be signaled with FD_CONNECT event
+				Sockets[Count] = Socket;
+				Events[1 + Count] = Event;
+				Count++;
+			}
+			else
+			{
+				RTMP_DEBUG(" * failed to start connection");
+				closesocket(Socket);
+				CloseHandle(Event);
+				continue;
+			}
+		}
+
+		if (Count == 0)
+		{
+			// all addresses failed
+			break;
+		}
+
+		// next attempt starts after delay, or right away when some attempt fails
+		DWORD Timeout = Next < AddressCount && Count < RTMP_MAX_CONNECTS ? RTMP_CONNECT_ATTEMPT_DELAY : INFINITE;
+		DWORD Wait = WaitForMultipleObjects(1 + Count, Events, FALSE, Timeout);
+		if (Wait == WAIT_TIMEOUT)
+		{
+			continue;
+		}
+		else if (Wait == WAIT_OBJECT_0)
+		{
+			// quit requested
+			break;
+		}
+
+		uint32_t Index = Wait - WAIT_OBJECT_0 - 1;
+		Assert(Index < Count);
+
+		WSANETWORKEVENTS NetworkEvents;
+		int Error = WSAEnumNetworkEvents(Sockets[Index], Events[1 + Index], &NetworkEvents);
+		Assert(Error == 0);
+
+		if (!(NetworkEvents.lNetworkEvents & FD_CONNECT))
+		{
+			continue;
+		}
+
+		SOCKET Socket = Sockets[Index];
+		HANDLE Event = Events[1 + Index];
+
+		Count--;
+		Sockets[Index] = Sockets[Count];
+		Events[1 + Index] = Events[1 + Count];
+
+		// socket stays non-blocking, but not associated with event anymore
+		WSAEventSelect(Socket, NULL, 0);
+		CloseHandle(Event);
+
+		if (NetworkEvents.iErrorCode[FD_CONNECT_BIT] == 0)
+		{
+			// ok we're connected
+			RTMP_DEBUG(" * OK");
+			Result = Socket;
+			break;
+		}
+
+		// cannot connect this address
+		RTMP_DEBUG(" * connection failed, error %d", NetworkEvents.iErrorCode[FD_CONNECT_BIT]);
+		closesocket(Socket);
+	}
+
+	// cancel all other attempts
+	for (uint32_t i = 0; i < Count; i++)
+	{
+		closesocket(Sockets[i]);
+		CloseHandle(Events[1 + i]);
+	}
+
+	return Result;
+}
+
+#else
+
+// resolver request shared with resolver thread, whichever is done last frees it
+typedef struct {
+	volatile LONG RefCount;
+	HANDLE Event; // signaled once getaddrinfo returns
+	int Error;
+	struct addrinfo* Addresses;
+	char Host[RTMP_MAX_URL_LENGTH];
+	char Port[32];
+} RtmpResolve;
+
+static void RTMP__ResolveRelease(RtmpResolve* Resolve)
+{
+	if (InterlockedDecrement(&Resolve->RefCount) == 0)
+	{
+		if (Resolve->Addresses)
+		{
+			freeaddrinfo(Resolve->Addresses);
+		}
+		CloseHandle(Resolve->Event);
+		free(Resolve);
+	}
+}
+
+static void* RTMP__ResolveThread(void* Arg)
+{
+	RtmpResolve* Resolve = Arg;
+
+	struct addrinfo AddressHints =
+	{
+		.ai_family = AF_UNSPEC,
+		.ai_socktype = SOCK_STREAM,
+		.ai_protocol = IPPROTO_TCP,
+	};
+
+	Resolve->Error = getaddrinfo(Resolve->Host, Resolve->Port, &AddressHints, &Resolve->Addresses);
+	SetEvent(Resolve->Event);
+
+	RTMP__ResolveRelease(Resolve);
+	return NULL;
+}
+
+// getaddrinfo cannot be canceled, it runs on detached thread so quit request does not wait for it
+// returns resolved addresses, or NULL if resolving failed or quit was requested
+static struct addrinfo* RTMP__Resolve(RtmpStream* Stream, const char* UrlHost, const char* UrlPort)
+{
+	RtmpResolve* Resolve = calloc(1, sizeof(*Resolve));
+	Assert(Resolve);
+
+	Resolve->RefCount = 2;
+	Resolve->Event = CreateEventW(NULL, TRUE, FALSE, NULL);
+	StrCpyNA(Resolve->Host, UrlHost, ARRAYSIZE(Resolve->Host));
+	StrCpyNA(Resolve->Port, UrlPort, ARRAYSIZE(Resolve->Port));
+
+	pthread_attr_t Attributes;
+	pthread_attr_init(&Attributes);
+	pthread_attr_setdetachstate(&Attributes, PTHREAD_CREATE_DETACHED);
+
+	pthread_t Thread;
+	int Error = pthread_create(&Thread, &Attributes, &RTMP__ResolveThread, Resolve);
+	pthread_attr_destroy(&Attributes);
+	if (Error != 0)
+	{
+		RTMP_DEBUG("ERROR: cannot start resolver thread, error %d", Error);
+		Resolve->RefCount = 1;
+		RTMP__ResolveRelease(Resolve);
+		return NULL;
+	}
+
+	struct addrinfo* Addresses = NULL;
+
+	HANDLE Events[] = { Resolve->Event, Stream->StopEvent };
+	DWORD Wait = WaitForMultipleObjects(ARRAYSIZE(Events), Events, FALSE, INFINITE);
+	if (Wait == WAIT_OBJECT_0)
+	{
+		if (Resolve->Error == 0)
+		{
+			// take ownership of results
+			Addresses = Resolve->Addresses;
+			Resolve->Addresses = NULL;
+		}
+		else
+		{
+			RTMP_DEBUG("ERROR: getaddrinfo failed, %s", gai_strerror(Resolve->Error));
+		}
+	}
+	else
+	{
+		// quit requested, resolver thread frees everything once getaddrinfo returns
+		Assert(Wait == WAIT_OBJECT_0 + 1);
+	}
+
+	RTMP__ResolveRelease(Resolve);
+	return Addresses;
+}
+
+// races connection attempts to addresses with staggered starts, alternating address families
+// returns connected socket, or INVALID_SOCKET if all attempts failed or quit was requested
+static SOCKET RTMP__Connect(RtmpStream* Stream, struct addrinfo* Addresses)
+{
+	struct addrinfo* Order[2 * RTMP_MAX_ADDRESSES];
+	uint32_t AddressCount = RTMP__OrderAddresses(Addresses, Order);
+
+	// first entry is for quit request, rest are for sockets being connected
+	struct pollfd Fds[1 + RTMP_MAX_CONNECTS] = { { .fd = Stream->StopEvent->Fd, .events = POLLIN } };
+	uint32_t Count = 0;
+	uint32_t Next = 0;
+	SOCKET Result = INVALID_SOCKET;
+
+	for (;;)
+	{
+		if (Next < AddressCount && Count < RTMP_MAX_CONNECTS)
+		{
+			struct addrinfo* Address = Order[Next++];
+
+			char AddressText[INET6_ADDRSTRLEN];
+			getnameinfo(Address->ai_addr, Address->ai_addrlen, AddressText, sizeof(AddressText), NULL, 0, NI_NUMERICHOST);
+
+			RTMP_DEBUG(" * trying %s address", AddressText);
+
+			SOCKET Socket = socket(Address->ai_family, Address->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, Address->ai_protocol);
+			Assert(Socket != INVALID_SOCKET);
+
+			int Error = connect(Socket, Address->ai_addr, Address->ai_addrlen);
+			if (Error == 0 || errno == EINPROGRESS)
+			{
+				// result will be signaled with socket becoming writable
+				Fds[1 + Count] = (struct pollfd){ .fd = Socket, .events = POLLOUT };
+				Count++;
+			}
+			else
+			{
+				RTMP_DEBUG(" * failed to start connection");
+				closesocket(Socket);
+				continue;
+			}
+		}
+
+		if (Count == 0)
+		{
+			// all addresses failed
+			break;
+		}
+
+		// next attempt starts after delay, or right away when some attempt fails
+		int Timeout = Next < AddressCount && Count < RTMP_MAX_CONNECTS ? RTMP_CONNECT_ATTEMPT_DELAY : -1;
+		int Ready = poll(Fds, 1 + Count, Timeout);
+		if (Ready < 0)
+		{
+			Assert(errno == EINTR);
+			continue;
+		}
+		else if (Ready == 0)
+		{
+			continue;
+		}
+		else if (Fds[0].revents & POLLIN)
+		{
+			// quit requested
+			break;
+		}
+
+		uint32_t Index = 0;
+		while (Index < Count && Fds[1 + Index].revents == 0)
+		{
+			Index++;
+		}
+		Assert(Index < Count);
+
+		SOCKET Socket = Fds[1 + Index].fd;
+
+		Count--;
+		Fds[1 + Index] = Fds[1 + Count];
+
+		int SocketError = 0;
+		socklen_t SocketErrorSize = sizeof(SocketError);
+		int Error = getsockopt(Socket, SOL_SOCKET, SO_ERROR, &SocketError, &SocketErrorSize);
+		Assert(Error == 0);
+
+		if (SocketError == 0)
+		{
+			// ok we're connected, socket stays non-blocking
+			RTMP_DEBUG(" * OK");
+			Result = Socket;
+			break;
+		}
+
+		// cannot connect this address
+		RTMP_DEBUG(" * connection failed, error %d", SocketError);
+		closesocket(Socket);
+	}
+
+	// cancel all other attempts
+	for (uint32_t i = 0; i < Count; i++)
+	{
+		closesocket(Fds[1 + i].fd);
+	}
+
+	return Result;
+}
+
+#endif
+
+// background processing thread
+
+#define RTMP_RECONNECT_MIN_DELAY 250    // msec before first reconnect attempt
+#define RTMP_RECONNECT_MAX_DELAY 30000  // msec, upper bound for backoff between attempts
+
+// forgets everything about connection, all queued messages are released & new ones belong to next session
+static void RTMP__ResetSession(RtmpStream* Stream)
+{
+	if (Stream->MessageSent != 0)
+	{
+		// partially sent message cannot be continued on new connection
+		Stream->MessageSend++;
+		Stream->MessageSent = 0;
+	}
+	RTMP__ReleaseMessages(Stream, Stream->MessageSend);
+	Stream->SendFirst = 0;
+	Stream->SendActive = 0;
+	Stream->Blocked = false;
+
+	// messages queued after this will be sent only on next connection
+	WriteRelease(&Stream->Session, Stream->Session + 1);
+
+	CancelWaitableTimer(Stream->PaceTimer);
+	CancelWaitableTimer(Stream->CoalesceTimer);
+	CancelWaitableTimer(Stream->StatsTimer);
+	Stream->PaceWaiting = false;
+	Stream->PeerBandwidth = UINT32_MAX;
+	Stream->PeerLimit = 1;
+
+	Stream->Recv.Read = Stream->Recv.Write = 0;
+	Stream->TotalByteReceived = 0;
+	Stream->BytesReceived = 0;
+	Stream->WindowSize = 1 << 20;
+	Stream->ChunkSize = 128;
+	Stream->SendChunkSize = 128;
+	Stream->SkipVideo = false;
+	ZeroMemory(Stream->SendTimestamp, sizeof(Stream->SendTimestamp));
+	ZeroMemory(Stream->SendExtended, sizeof(Stream->SendExtended));
+	ZeroMemory(Stream->SendHasTimestamp, sizeof(Stream->SendHasTimestamp));
+	ZeroMemory(Stream->RecvChunks, sizeof(Stream->RecvChunks));
+	Stream->RecvChunk = NULL;
+	Stream->RecvRemaining = 0;
+	Stream->Disconnect = false;
+	Stream->Receiving = false;
+
+	Stream->StatsTime = 0;
+	Stream->StatsDelivered = 0;
+	Stream->TotalBytesSent = 0;
+	Stream->AckBytes = 0;
+	WriteNoFence(&Stream->PingRtt, 0);
+	WriteNoFence(&Stream->TcpRtt, 0);
+	WriteNoFence(&Stream->TcpCwnd, 0);
+	WriteNoFence(&Stream->InFlight, 0);
+	WriteNoFence(&Stream->Bandwidth, 0);
+}
+
+// queues RTMP C0+C1 handshake
+static void RTMP__StartHandshake(RtmpStream* Stream)
+{
+	Stream->State = RTMP_STATE_HANDSHAKE;
+	RTMP_DEBUG("State ->  RTMP_STATE_HANDSHAKE");
+
+	uint8_t Handshake[1 + 4 + 4 + RTMP_HANDSHAKE_RANDOM_SIZE];
+	uint32_t HandshakeSize = sizeof(Handshake);
+
+	RTMP_DEBUG("Sending C0+C1 handshake");
+
+	uint8_t* Begin = Handshake;
+	uint8_t* Ptr = Begin;
+
+	// C0
+	BE_PUT1(Ptr, 3); // version
+	// C1
+	BE_PUT4(Ptr, 0); // time
+	BE_PUT4(Ptr, 0); // always zero
+	ZeroMemory(Ptr, RTMP_HANDSHAKE_RANDOM_SIZE); // random bytes, can be zero too!
+	Ptr += RTMP_HANDSHAKE_RANDOM_SIZE;
+
+	Assert(Ptr == Begin + HandshakeSize);
+	bool Ok = RTMP__WriteRaw(Stream, Handshake, HandshakeSize);
+	Assert(Ok);
+}
+
+#ifdef _WIN32
+
+// connects & runs one RTMP session until disconnect or stop, returns true if stream got to publishing state
+static bool RTMP__Session(RtmpStream* Stream, const WCHAR* UrlHost, const WCHAR* UrlPort, bool UseTls)
+{
+	// do hostname resolving
+	// ---------------------------------------------------------------------------
+
+	LARGE_INTEGER Now;
+	QueryPerformanceCounter(&Now);
+
+	PADDRINFOEXW Addresses = Stream->Addresses;
+	if (Addresses && Now.QuadPart - Stream->AddressTime < RTMP_ADDRESS_CACHE_TTL * Stream->Frequency)
+	{
+		RTMP_DEBUG("using cached addresses for '%S' name", UrlHost);
+	}
+	else
+	{
+		if (Addresses)
+		{
+			FreeAddrInfoExW(Addresses);
+			Stream->Addresses = NULL;
+		}
+
+		RTMP_DEBUG("resolving '%S' name", UrlHost);
+
+		Stream->State = RTMP_STATE_RESOLVING;
+		RTMP_DEBUG("State ->  RTMP_STATE_RESOLVING");
+
+		ADDRINFOEXW AddressHints =
+		{
+			.ai_family = AF_UNSPEC,
+			.ai_socktype = SOCK_STREAM,
+			.ai_protocol = IPPROTO_TCP,
+		};
+
+		HANDLE CancelEvent;
+		int Resolve = GetAddrInfoExW(UrlHost, UrlPort, NS_ALL, NULL, &AddressHints, &Addresses, NULL, &Stream->Sends[0].Ov, NULL, &CancelEvent);
+		if (Resolve == WSA_IO_PENDING)
+		{
+			HANDLE Events[] = { Stream->Sends[0].Ov.hEvent, Stream->StopEvent };
+			DWORD Wait = WaitForMultipleObjects(ARRAYSIZE(Events), Events, FALSE, INFINITE);
+			if (Wait == WAIT_OBJECT_0)
+			{
+				// ok results are available now
+				Resolve = GetAddrInfoExOverlappedResult(&Stream->Sends[0].Ov);
+			}
+			else if (Wait == WAIT_OBJECT_0 + 1)
+			{
+				// quit requested
+				GetAddrInfoExCancel(CancelEvent);
+				return false;
+			}
+			else
+			{
+				Assert(false);
+			}
+		}
+
+		if (Resolve != NO_ERROR)
+		{
+			RTMP_DEBUG("ERROR: failed to resolve address");
+			ResetEvent(Stream->Sends[0].Ov.hEvent);
+			return false;
+		}
+
+		ResetEvent(Stream->Sends[0].Ov.hEvent);
+
+		// addresses are kept for reconnecting, freed when they expire or in RTMP_Done
+		Stream->Addresses = Addresses;
+		Stream->AddressTime = Now.QuadPart;
+	}
+
+	WriteNoFence(&Stream->ResolveTime, RTMP__GetStartupTime(Stream));
+
+	// create & connect socket
+	// ---------------------------------------------------------------------------
+
+	RTMP_DEBUG("connecting...");
+
+	Stream->State = RTMP_STATE_CONNECTING;
+	RTMP_DEBUG("State ->  RTMP_STATE_CONNECTING");
+
+	Assert(Addresses);
+	SOCKET Socket = RTMP__Connect(Stream, Addresses);
+	if (Socket == INVALID_SOCKET)
+	{
+		// addresses may be stale, resolve them again next time
+		FreeAddrInfoExW(Stream->Addresses);
+		Stream->Addresses = NULL;
+
+		RTMP_DEBUG("ERROR: failed to connect to hostname in specified url");
+		return false;
+	}
+
+	WriteNoFence(&Stream->ConnectTime, RTMP__GetStartupTime(Stream));
+
+	if (ReadNoFence(&Stream->ZeroCopy))
+	{
+		// without socket send buffer data is sent directly from send ring & referenced payloads, not copied to kernel
+		// overlapped send completes only once kernel is done with memory, which is when messages are released
+		int SendBufferSize = 0;
+		int Error = setsockopt(Socket, SOL_SOCKET, SO_SNDBUF, (const char*)&SendBufferSize, sizeof(SendBufferSize));
+		Assert(Error == 0);
+	}
+
+	if (UseTls)
+	{
+		RTMP_DEBUG("TLS handshake");
+
+		if (!RTMP__TlsConnect(Socket, Stream, UrlHost))
+		{
+			RTMP_DEBUG("ERROR: TLS handshake failed");
+			closesocket(Socket);
+			return false;
+		}
+
+		// in case server sent anything together with end of handshake
+		RTMP__TlsDecrypt(Stream);
+	}
+
+	// ---------------------------------------------------------------------------
+	// send C0+C1 handshake and start reading response
+
+	RTMP__StartHandshake(Stream);
+
+	RTMP__TrySend(Socket, Stream);
+	RTMP__BeginRecv(Socket, Stream);
+
+	LARGE_INTEGER StatsDue = { .QuadPart = -RTMP_STATS_INTERVAL * 10000LL };
+	BOOL StatsOk = SetWaitableTimer(Stream->StatsTimer, &StatsDue, RTMP_STATS_INTERVAL, NULL, NULL, FALSE);
+	Assert(StatsOk);
+
+	while (!Stream->Disconnect)
+	{
+		// only oldest send is waited on, so sends are finished in order
+		HANDLE Events[] = { Stream->Sends[Stream->SendFirst].Ov.hEvent, Stream->RecvOv.hEvent, Stream->DataEvent, Stream->PaceTimer, Stream->CoalesceTimer, Stream->StatsTimer, Stream->StopEvent };
+		DWORD Wait = WaitForMultipleObjects(ARRAYSIZE(Events), Events, FALSE, INFINITE);
+		Stream->Wakeups++;
+		if (Wait == WAIT_OBJECT_0)
+		{
+			RTMP__EndSend(Socket, Stream);
+			RTMP__TrySend(Socket, Stream);
+		}
+		else if (Wait == WAIT_OBJECT_0 + 1)
+		{
+			RTMP__EndRecv(Socket, Stream);
+			RTMP__BeginRecv(Socket, Stream);
+		}
+		else if (Wait == WAIT_OBJECT_0 + 2)
+		{
+			// if all send slots are in use, new messages will be sent once oldest send finishes
+			ResetEvent(Stream->DataEvent);
+			RTMP__QueueConfig(Socket, Stream);
+			RTMP__Flush(Stream);
+			RTMP__TrySend(Socket, Stream);
+		}
+		else if (Wait == WAIT_OBJECT_0 + 3)
+		{
+			// pacer has collected enough tokens
+			RTMP__TrySend(Socket, Stream);
+		}
+		else if (Wait == WAIT_OBJECT_0 + 4)
+		{
+			// coalescing deadline passed
+			RTMP__Flush(Stream);
+			RTMP__TrySend(Socket, Stream);
+		}
+		else if (Wait == WAIT_OBJECT_0 + 5)
+		{
+			// time to ping & measure network
+			RTMP__UpdateStats(Socket, Stream);
+			RTMP__TrySend(Socket, Stream);
+		}
+		else if (Wait == WAIT_OBJECT_0 + 6)
+		{
+			// quit requested
+			break;
+		}
+		else
+		{
+			Assert(false);
+		}
+	}
+
+	// TODO: properly handle stop event by sending deleteStream()
+	// 
+	// RTMP_STATE_STREAM_DELETED
+	// 
+	// invoke RTMP deleteStream method
+	//{
+	//	uint8_t Message[1024];
+
+	//	uint8_t* Ptr = Message;
+	//	AMF_PUT_STRING(Ptr, "deleteStream"); // command name
+	//	AMF_PUT_NUMBER(Ptr, 4);         // transaction id
+	//	AMF_PUT_NULL(Ptr);              // user arguments
+	//	AMF_PUT_NUMBER(Ptr, OutStreamId);
+
+	//	uint32_t MessageSize = (uint32_t)(Ptr - Message);
+
+	//	uint8_t Packet[1024];
+	//	uint32_t PacketSize = RTMP_FullPacket(Packet, RTMP_CHANNEL_MISC, RTMP_PACKET_COMMAND_AMF0, 0, Message, MessageSize);
+	//}
+
+	bool Published = Stream->State == RTMP_STATE_STREAM_READY;
+
+	// TLS stream can be closed gracefully only when stopping & no record was cut in middle
+	bool Graceful = !Stream->Disconnect;
+
+	// wait until kernel is done with all buffers before they are reused
+	CancelIoEx((HANDLE)Socket, NULL);
+	for (uint32_t i = 0; i < Stream->SendActive; i++)
+	{
+		RtmpSend* Send = &Stream->Sends[(Stream->SendFirst + i) % RTMP_MAX_SENDS];
+		DWORD Transferred, Flags;
+		BOOL Ok = WSAGetOverlappedResult(Socket, &Send->Ov, &Transferred, TRUE, &Flags);
+		Graceful = Graceful && Ok && Transferred == Send->Size;
+		ResetEvent(Send->Ov.hEvent);
+	}
+	if (Stream->Receiving)
+	{
+		DWORD Transferred, Flags;
+		WSAGetOverlappedResult(Socket, &Stream->RecvOv, &Transferred, TRUE, &Flags);
+		ResetEvent(Stream->RecvOv.hEvent);
+	}
+
+	RTMP__TlsDone(Socket, Stream, Graceful);
+	closesocket(Socket);
+
+	RTMP__ResetSession(Stream);
+
+	return Published;
+}
+
+#else
+
+#define RTMP_EPOLL_SOCKET   0
+#define RTMP_EPOLL_DATA     1
+#define RTMP_EPOLL_PACE     2
+#define RTMP_EPOLL_COALESCE 3
+#define RTMP_EPOLL_STATS    4
+#define RTMP_EPOLL_STOP     5
+
+static void RTMP__EpollAdd(RtmpStream* Stream, int Fd, uint32_t Events, uint32_t Id)
+{
+	struct epoll_event Event = { .events = Events, .data.u32 = Id };
+	int Error = epoll_ctl(Stream->Epoll, EPOLL_CTL_ADD, Fd, &Event);
+	Assert(Error == 0);
+}
+
+// runs connected session on own epoll loop until disconnect or stop
+static void RTMP__EpollSession(RtmpStream* Stream, SOCKET Socket)
+{
+	// socket is always waited for reading, for writing only while it does not take more data
+	Stream->Epoll = epoll_create1(EPOLL_CLOEXEC);
+	Assert(Stream->Epoll >= 0);
+	RTMP__EpollAdd(Stream, Socket, EPOLLIN, RTMP_EPOLL_SOCKET);
+	RTMP__EpollAdd(Stream, Stream->DataEvent->Fd, EPOLLIN, RTMP_EPOLL_DATA);
+	RTMP__EpollAdd(Stream, Stream->PaceTimer->Fd, EPOLLIN, RTMP_EPOLL_PACE);
+	RTMP__EpollAdd(Stream, Stream->CoalesceTimer->Fd, EPOLLIN, RTMP_EPOLL_COALESCE);
+	RTMP__EpollAdd(Stream, Stream->StatsTimer->Fd, EPOLLIN, RTMP_EPOLL_STATS);
+	RTMP__EpollAdd(Stream, Stream->StopEvent->Fd, EPOLLIN, RTMP_EPOLL_STOP);
+	Stream->Writable = true;
+	bool WaitWritable = false;
+
+	RTMP__TrySend(Socket, Stream);
+
+	bool Stop = false;
+	while (!Stream->Disconnect && !Stop)
+	{
+		// sends started by anything are written here, finished sends start new ones
+		if (Stream->Writable)
+		{
+			RTMP__WriteSends(Socket, Stream);
+		}
+
+		if (WaitWritable != !Stream->Writable)
+		{
+			WaitWritable = !Stream->Writable;
+			struct epoll_event SocketEvent = { .events = EPOLLIN | (WaitWritable ? EPOLLOUT : 0), .data.u32 = RTMP_EPOLL_SOCKET };
+			int Error = epoll_ctl(Stream->Epoll, EPOLL_CTL_MOD, Socket, &SocketEvent);
+			Assert(Error == 0);
+		}
+
+		if (Stream->Disconnect)
+		{
+			break;
+		}
+
+		struct epoll_event Events[8];
+		int Count = epoll_wait(Stream->Epoll, Events, ARRAYSIZE(Events), -1);
+		if (Count < 0)
+		{
+			Assert(errno == EINTR);
+			continue;
+		}
+		Stream->Wakeups++;
+
+		for (int i = 0; i < Count && !Stream->Disconnect; i++)
+		{
+			switch (Events[i].data.u32)
+			{
+			case RTMP_EPOLL_SOCKET:
+				if (Events[i].events & EPOLLOUT)
+				{
+					Stream->Writable = true;
+				}
+				if (Events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+				{
+					RTMP__Recv(Socket, Stream);
+				}
+				break;
+			case RTMP_EPOLL_DATA:
+				// if all send slots are in use, new messages will be sent once oldest send finishes
+				ResetEvent(Stream->DataEvent);
+				RTMP__QueueConfig(Socket, Stream);
+				RTMP__Flush(Stream);
+				RTMP__TrySend(Socket, Stream);
+				break;
+			case RTMP_EPOLL_PACE:
+				// pacer has collected enough tokens
+				if (RTMP__PosixConsume(Stream->PaceTimer))
+				{
+					RTMP__TrySend(Socket, Stream);
+				}
+				break;
+			case RTMP_EPOLL_COALESCE:
+				// coalescing deadline passed
+				if (RTMP__PosixConsume(Stream->CoalesceTimer))
+				{
+					RTMP__Flush(Stream);
+					RTMP__TrySend(Socket, Stream);
+				}
+				break;
+			case RTMP_EPOLL_STATS:
+				// time to ping & measure network
+				if (RTMP__PosixConsume(Stream->StatsTimer))
+				{
+					RTMP__UpdateStats(Socket, Stream);
+					RTMP__TrySend(Socket, Stream);
+				}
+				break;
+			case RTMP_EPOLL_STOP:
+				// quit requested
+				Stop = true;
+				break;
+			default:
+				Assert(false);
+			}
+		}
+	}
+
+	close(Stream->Epoll);
+	Stream->Epoll = -1;
+}
+
+// io_uring engine, one ring thread runs sessions of many streams
+// ---------------------------------------------------------------------------
+
+#define RTMP_RING_STREAM_ENTRIES 16 // submission queue entries per stream, enough for all its operations & cancels
+
+// operations of one session, completion user_data is slot index & operation
+#define RTMP_RING_RECV     0
+#define RTMP_RING_SEND     1
+#define RTMP_RING_DATA     2
+#define RTMP_RING_PACE     3
+#define RTMP_RING_COALESCE 4
+#define RTMP_RING_STATS    5
+#define RTMP_RING_STOP     6
+#define RTMP_RING_CANCEL   7
+
+#define RTMP_RING_USER_DATA(Slot, Op) (((uint64_t)(Slot) << 8) | (Op))
+#define RTMP_RING_WAKE UINT64_MAX
+
+// submits everything queued without waiting for completions
+static void RTMP__RingSubmit(RtmpRing* Ring)
+{
+	while (Ring->Queued != 0)
+	{
+		int Result = (int)syscall(__NR_io_uring_enter, Ring->Fd, Ring->Queued, 0, 0, NULL, 0);
+		if (Result < 0)
+		{
+			Assert(errno == EINTR);
+			continue;
+		}
+		Ring->Queued -= Result;
+		RTMP_STAT_ADD(Ring->Enters, 1);
+	}
+}
+
+// submits queued entries first if submission queue cannot take Count more
+static void RTMP__RingReserve(RtmpRing* Ring, uint32_t Count)
+{
+	uint32_t Used = *Ring->SqTail - __atomic_load_n(Ring->SqHead, __ATOMIC_ACQUIRE);
+	if (Used + Count > Ring->SqEntries)
+	{
+		RTMP__RingSubmit(Ring);
+	}
+}
+
+static struct io_uring_sqe* RTMP__RingGet(RtmpRing* Ring, uint8_t Opcode, int Fd, uint64_t UserData)
+{
+	RTMP__RingReserve(Ring, 1);
+
+	uint32_t Tail = *Ring->SqTail;
+	struct io_uring_sqe* Sqe = &Ring->Sqes[Tail & Ring->SqMask];
+	ZeroMemory(Sqe, sizeof(*Sqe));
+	Sqe->opcode = Opcode;
+	Sqe->fd = Fd;
+	Sqe->user_data = UserData;
+
+	// kernel reads entries only in io_uring_enter, so it is fine to fill it after moving tail
+	__atomic_store_n(Ring->SqTail, Tail + 1, __ATOMIC_RELEASE);
+	Ring->Queued++;
+	RTMP_STAT_ADD(Ring->Submitted, 1);
+	return Sqe;
+}
+
+// replaces Send & Recv ring buffers registered for slot, returns false if they could not be registered
+static bool RTMP__RingRegister(RtmpRing* Ring, uint32_t Slot, struct iovec* Buffers)
+{
+	struct io_uring_rsrc_update2 Update =
+	{
+		.offset = 2 * Slot,
+		.data = (uintptr_t)Buffers,
+		.nr = 2,
+	};
+	int Result = (int)syscall(__NR_io_uring_register, Ring->Fd, IORING_REGISTER_BUFFERS_UPDATE, &Update, sizeof(Update));
+	return Result == 2;
+}
+
+// waits for event or timer & reads its counter, or only polls it when kernel does not wait for nonblocking reads
+static void RTMP__RingArmHandle(RtmpRing* Ring, HANDLE Handle, uint64_t* Value, uint64_t UserData)
+{
+	if (Ring->PollEvents)
+	{
+		struct io_uring_sqe* Sqe = RTMP__RingGet(Ring, IORING_OP_POLL_ADD, Handle->Fd, UserData);
+		Sqe->poll32_events = POLLIN;
+	}
+	else
+	{
+		struct io_uring_sqe* Sqe = RTMP__RingGet(Ring, IORING_OP_READ, Handle->Fd, UserData);
+		Sqe->addr = (uintptr_t)Value;
+		Sqe->len = sizeof(*Value);
+		Sqe->off = (uint64_t)-1;
+	}
+}
+
+// returns true if completed event or timer operation means handle was signaled, consumes it same as wait would
+static bool RTMP__RingSignaled(RtmpRing* Ring, HANDLE Handle, int32_t Result)
+{
+	if (Result == -EAGAIN && !Ring->PollEvents)
+	{
+		// older kernels fail nonblocking eventfd & timerfd reads instead of waiting, switch to poll for all streams
+		RTMP_DEBUG("io_uring does not wait for eventfd reads, polling them");
+		Ring->PollEvents = true;
+		return false;
+	}
+	if (Ring->PollEvents)
+	{
+		if (Result <= 0)
+		{
+			return false;
+		}
+		if (Handle->ManualReset)
+		{
+			ResetEvent(Handle);
+			return true;
+		}
+		return RTMP__PosixConsume(Handle);
+	}
+	return Result == sizeof(uint64_t);
+}
+
+static HANDLE RTMP__RingHandle(RtmpStream* Stream, uint32_t Op)
+{
+	switch (Op)
+	{
+	case RTMP_RING_DATA:     return Stream->DataEvent;
+	case RTMP_RING_PACE:     return Stream->PaceTimer;
+	case RTMP_RING_COALESCE: return Stream->CoalesceTimer;
+	case RTMP_RING_STATS:    return Stream->StatsTimer;
+	}
+	Assert(false);
+	return NULL;
+}
+
+// submits one operation of session, every one of them is armed again after it completes
+static void RTMP__RingArm(RtmpRing* Ring, RtmpStream* Stream, uint32_t Op)
+{
+	uint64_t UserData = RTMP_RING_USER_DATA(Stream->RingSlot, Op);
+	if (Op == RTMP_RING_RECV)
+	{
+		if (RB_IsFull(&Stream->Recv))
+		{
+			RTMP_DEBUG("ERROR: cannot receive more data because receive buffer is full");
+			Stream->Disconnect = true;
+			return;
+		}
+
+		// recv goes directly into free part of receive ring, its mapping is registered once per session
+		struct io_uring_sqe* Sqe = RTMP__RingGet(Ring, Stream->RingFixed ? IORING_OP_READ_FIXED : IORING_OP_READ, Stream->RingSocket, UserData);
+		Sqe->addr = (uintptr_t)RB_BeginWrite(&Stream->Recv);
+		Sqe->len = RB_GetFree(&Stream->Recv);
+		Sqe->off = (uint64_t)-1;
+		Sqe->buf_index = (uint16_t)(2 * Stream->RingSlot + 1);
+	}
+	else if (Op == RTMP_RING_STOP)
+	{
+		// only polled, manual-reset stop event must stay signaled for network thread
+		struct io_uring_sqe* Sqe = RTMP__RingGet(Ring, IORING_OP_POLL_ADD, Stream->StopEvent->Fd, UserData);
+		Sqe->poll32_events = POLLIN;
+	}
+	else
+	{
+		RTMP__RingArmHandle(Ring, RTMP__RingHandle(Stream, Op), &Stream->RingValues[Op - RTMP_RING_DATA], UserData);
+	}
+	Stream->RingArmed |= 1 << Op;
+}
+
+// submits all started sends as one linked chain, each one starts only after previous one has fully completed
+// new sends started meanwhile wait until whole chain is done, so socket takes them in same order as they were started
+static void RTMP__RingSend(RtmpRing* Ring, RtmpStream* Stream)
+{
+	if (Stream->RingSending != 0 || Stream->SendActive == 0)
+	{
+		return;
+	}
+
+	// whole chain must go to kernel in one submission
+	RTMP__RingReserve(Ring, Stream->SendActive);
+
+	uint64_t UserData = RTMP_RING_USER_DATA(Stream->RingSlot, RTMP_RING_SEND);
+	uint8_t* Fixed = Stream->Send.Buffer;
+	for (uint32_t i = 0; i < Stream->SendActive; i++)
+	{
+		RtmpSend* Send = &Stream->Sends[(Stream->SendFirst + i) % RTMP_MAX_SENDS];
+		Assert(Send->BufferIndex == 0);
+
+		struct io_uring_sqe* Sqe;
+		uint8_t* Base = Send->Buffers[0].iov_base;
+		if (Stream->RingFixed && Send->BufferCount == 1 && Base >= Fixed && Base + Send->Size <= Fixed + 2 * (size_t)Stream->Send.Size)
+		{
+			// handshake & other raw data is one piece of send ring, written from registered buffer
+			Sqe = RTMP__RingGet(Ring, IORING_OP_WRITE_FIXED, Stream->RingSocket, UserData);
+			Sqe->addr = (uintptr_t)Base;
+			Sqe->len = Send->Size;
+			Sqe->off = (uint64_t)-1;
+			Sqe->buf_index = (uint16_t)(2 * Stream->RingSlot);
+		}
+		else
+		{
+			// chunk headers & caller-owned payloads are separate buffers, there is no vectored fixed buffer send
+			Send->Message = (struct msghdr)
+			{
+				.msg_iov = Send->Buffers,
+				.msg_iovlen = Send->BufferCount,
+			};
+			Sqe = RTMP__RingGet(Ring, IORING_OP_SENDMSG, Stream->RingSocket, UserData);
+			Sqe->addr = (uintptr_t)&Send->Message;
+			Sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+		}
+		if (i + 1 != Stream->SendActive)
+		{
+			Sqe->flags |= IOSQE_IO_LINK;
+		}
+		Stream->SendCalls++;
+	}
+	Stream->RingSending = Stream->SendActive;
+	Stream->RingArmed |= 1 << RTMP_RING_SEND;
+}
+
+// cancels all armed operations, session ends once every one of them has completed
+static void RTMP__RingCancel(RtmpRing* Ring, RtmpStream* Stream)
+{
+	Stream->RingEnding = true;
+	for (uint32_t Op = 0; Op < RTMP_RING_CANCEL; Op++)
+	{
+		if (Stream->RingArmed & (1 << Op))
+		{
+			struct io_uring_sqe* Sqe = RTMP__RingGet(Ring, IORING_OP_ASYNC_CANCEL, -1, RTMP_RING_USER_DATA(Stream->RingSlot, RTMP_RING_CANCEL));
+			Sqe->addr = RTMP_RING_USER_DATA(Stream->RingSlot, Op);
+			Sqe->cancel_flags = IORING_ASYNC_CANCEL_ALL;
+		}
+	}
+}
+
+// nothing uses socket or buffers anymore, network thread continues with its reconnect loop
+static void RTMP__RingEnd(RtmpRing* Ring, RtmpStream* Stream)
+{
+	if (Stream->RingFixed)
+	{
+		// pages of ring buffers stay pinned while they are registered
+		struct iovec Empty[2] = { 0 };
+		RTMP__RingRegister(Ring, Stream->RingSlot, Empty);
+	}
+	Ring->Streams[Stream->RingSlot] = NULL;
+
+	AcquireSRWLockExclusive(&Ring->Lock);
+	Ring->Active--;
+	ReleaseSRWLockExclusive(&Ring->Lock);
+
+	SetEvent(Stream->RingDone);
+}
+
+// submits sends started by last completion, or starts & finishes ending session
+static void RTMP__RingUpdate(RtmpRing* Ring, RtmpStream* Stream)
+{
+	if (!Stream->RingEnding)
+	{
+		if (Stream->Disconnect)
+		{
+			RTMP__RingCancel(Ring, Stream);
+		}
+		else
+		{
+			RTMP__RingSend(Ring, Stream);
+		}
+	}
+	if (Stream->RingEnding && Stream->RingArmed == 0)
+	{
+		RTMP__RingEnd(Ring, Stream);
+	}
+}
+
+static void RTMP__RingStart(RtmpRing* Ring, RtmpStream* Stream)
+{
+	uint32_t Slot = 0;
+	while (Slot < Ring->MaxStreams && Ring->Streams[Slot])
+	{
+		Slot++;
+	}
+	Assert(Slot < Ring->MaxStreams);
+	Ring->Streams[Slot] = Stream;
+
+	Stream->RingSlot = Slot;
+	Stream->RingArmed = 0;
+	Stream->RingSending = 0;
+	Stream->RingEnding = false;
+
+	// double mapping of each ring is registered, so operations can cross its end
+	struct iovec Buffers[2] =
+	{
+		{ .iov_base = Stream->Send.Buffer, .iov_len = 2 * (size_t)Stream->Send.Size },
+		{ .iov_base = Stream->Recv.Buffer, .iov_len = 2 * (size_t)Stream->Recv.Size },
+	};
+	Stream->RingFixed = RTMP__RingRegister(Ring, Slot, Buffers);
+	if (!Stream->RingFixed)
+	{
+		// memlock limit or no buffer table, plain reads & sendmsg work the same
+		RTMP_DEBUG("ring buffers cannot be registered, using unregistered buffers");
+		struct iovec Empty[2] = { 0 };
+		RTMP__RingRegister(Ring, Slot, Empty);
+	}
+
+	RTMP__RingArm(Ring, Stream, RTMP_RING_RECV);
+	RTMP__RingArm(Ring, Stream, RTMP_RING_DATA);
+	RTMP__RingArm(Ring, Stream, RTMP_RING_PACE);
+	RTMP__RingArm(Ring, Stream, RTMP_RING_COALESCE);
+	RTMP__RingArm(Ring, Stream, RTMP_RING_STATS);
+	RTMP__RingArm(Ring, Stream, RTMP_RING_STOP);
+
+	RTMP__TrySend(Stream->RingSocket, Stream);
+	RTMP__RingUpdate(Ring, Stream);
+}
+
+static void RTMP__RingComplete(RtmpRing* Ring, uint64_t UserData, int32_t Result)
+{
+	if (UserData == RTMP_RING_WAKE)
+	{
+		RTMP__RingSignaled(Ring, Ring->WakeEvent, Result);
+		RTMP__RingArmHandle(Ring, Ring->WakeEvent, &Ring->WakeValue, RTMP_RING_WAKE);
+		return;
+	}
+
+	uint32_t Op = (uint32_t)(UserData & 0xff);
+	if (Op == RTMP_RING_CANCEL)
+	{
+		// result of cancel request itself, cancelled operations complete on their own
+		return;
+	}
+
+	RtmpStream* Stream = Ring->Streams[UserData >> 8];
+	Assert(Stream);
+	SOCKET Socket = Stream->RingSocket;
+	Stream->Wakeups++;
+
+	if (Op == RTMP_RING_SEND)
+	{
+		Stream->RingSending--;
+		if (Stream->RingSending == 0)
+		{
+			Stream->RingArmed &= ~(1 << Op);
+		}
+	}
+	else
+	{
+		Stream->RingArmed &= ~(1 << Op);
+	}
+
+	if (!Stream->RingEnding)
+	{
+		switch (Op)
+		{
+		case RTMP_RING_RECV:
+			if (Result <= 0)
+			{
+				RTMP_DEBUG(Result == 0 ? "ERROR: connection closed" : "ERROR: recv failed, error %d", -Result);
+				Stream->Disconnect = true;
+				break;
+			}
+			RB_EndWrite(&Stream->Recv, (uint32_t)Result);
+			RTMP__DoRecv(Socket, Stream, (uint32_t)Result);
+			if (!Stream->Disconnect)
+			{
+				RTMP__RingArm(Ring, Stream, Op);
+			}
+			break;
+		case RTMP_RING_SEND:
+		{
+			// linked sends after failed one complete with error too
+			RtmpSend* Send = &Stream->Sends[Stream->SendFirst];
+			if (Result != (int32_t)Send->Size)
+			{
+				RTMP_DEBUG("ERROR: send failed, error %d", -Result);
+				Stream->Disconnect = true;
+				break;
+			}
+			Send->BufferIndex = Send->BufferCount;
+			RTMP__EndSend(Socket, Stream);
+			RTMP__TrySend(Socket, Stream);
+			break;
+		}
+		case RTMP_RING_DATA:
+			// if all send slots are in use, new messages will be sent once oldest send finishes
+			if (RTMP__RingSignaled(Ring, Stream->DataEvent, Result))
+			{
+				RTMP__QueueConfig(Socket, Stream);
+				RTMP__Flush(Stream);
+				RTMP__TrySend(Socket, Stream);
+			}
+			RTMP__RingArm(Ring, Stream, Op);
+			break;
+		case RTMP_RING_PACE:
+			// pacer has collected enough tokens
+			if (RTMP__RingSignaled(Ring, Stream->PaceTimer, Result))
+			{
+				RTMP__TrySend(Socket, Stream);
+			}
+			RTMP__RingArm(Ring, Stream, Op);
+			break;
+		case RTMP_RING_COALESCE:
+			// coalescing deadline passed
+			if (RTMP__RingSignaled(Ring, Stream->CoalesceTimer, Result))
+			{
+				RTMP__Flush(Stream);
+				RTMP__TrySend(Socket, Stream);
+			}
+			RTMP__RingArm(Ring, Stream, Op);
+			break;
+		case RTMP_RING_STATS:
+			// time to ping & measure network
+			if (RTMP__RingSignaled(Ring, Stream->StatsTimer, Result))
+			{
+				RTMP__UpdateStats(Socket, Stream);
+				RTMP__TrySend(Socket, Stream);
+			}
+			RTMP__RingArm(Ring, Stream, Op);
+			break;
+		case RTMP_RING_STOP:
+			// quit requested
+			RTMP__RingCancel(Ring, Stream);
+			break;
+		default:
+			Assert(false);
+		}
+	}
+
+	RTMP__RingUpdate(Ring, Stream);
+}
+
+static bool RTMP__RingSetup(RtmpRing* Ring)
+{
+	uint32_t Entries = Ring->MaxStreams * RTMP_RING_STREAM_ENTRIES;
+
+	// only ring thread submits & it waits for completions, so kernel can run completion work in io_uring_enter
+	struct io_uring_params Params = { .flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN };
+	int Fd = (int)syscall(__NR_io_uring_setup, Entries, &Params);
+	if (Fd < 0 && errno == EINVAL)
+	{
+		// kernel older than 6.1
+		Params = (struct io_uring_params){ 0 };
+		Fd = (int)syscall(__NR_io_uring_setup, Entries, &Params);
+	}
+	if (Fd < 0)
+	{
+		RTMP_DEBUG("ERROR: io_uring is not available, error %d", errno);
+		return false;
+	}
+
+	Ring->SqRingSize = Params.sq_off.array + Params.sq_entries * sizeof(uint32_t);
+	Ring->CqRingSize = Params.cq_off.cqes + Params.cq_entries * sizeof(struct io_uring_cqe);
+	if (Params.features & IORING_FEAT_SINGLE_MMAP)
+	{
+		Ring->SqRingSize = Ring->CqRingSize = max(Ring->SqRingSize, Ring->CqRingSize);
+	}
+
+	Ring->SqRing = mmap(NULL, Ring->SqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, Fd, IORING_OFF_SQ_RING);
+	Assert(Ring->SqRing != MAP_FAILED);
+	if (Params.features & IORING_FEAT_SINGLE_MMAP)
+	{
+		Ring->CqRing = Ring->SqRing;
+	}
+	else
+	{
+		Ring->CqRing = mmap(NULL, Ring->CqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, Fd, IORING_OFF_CQ_RING);
+		Assert(Ring->CqRing != MAP_FAILED);
+	}
+	Ring->Sqes = mmap(NULL, Params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, Fd, IORING_OFF_SQES);
+	Assert(Ring->Sqes != MAP_FAILED);
+
+	Ring->SqEntries = Params.sq_entries;
+	Ring->SqHead = (uint32_t*)(Ring->SqRing + Params.sq_off.head);
+	Ring->SqTail = (uint32_t*)(Ring->SqRing + Params.sq_off.tail);
+	Ring->SqArray = (uint32_t*)(Ring->SqRing + Params.sq_off.array);
+	Ring->SqMask = *(uint32_t*)(Ring->SqRing + Params.sq_off.ring_mask);
+	Ring->CqHead = (uint32_t*)(Ring->CqRing + Params.cq_off.head);
+	Ring->CqTail = (uint32_t*)(Ring->CqRing + Params.cq_off.tail);
+	Ring->CqMask = *(uint32_t*)(Ring->CqRing + Params.cq_off.ring_mask);
+	Ring->Cqes = (struct io_uring_cqe*)(Ring->CqRing + Params.cq_off.cqes);
+	Ring->Queued = 0;
+
+	// submission queue entries are always used in order
+	for (uint32_t i = 0; i < Ring->SqEntries; i++)
+	{
+		Ring->SqArray[i] = i;
+	}
+
+	// empty table, slot of each session gets its ring buffers when session starts
+	struct io_uring_rsrc_register Register =
+	{
+		.nr = 2 * Ring->MaxStreams,
+		.flags = IORING_RSRC_REGISTER_SPARSE,
+	};
+	if (syscall(__NR_io_uring_register, Fd, IORING_REGISTER_BUFFERS2, &Register, sizeof(Register)) < 0)
+	{
+		RTMP_DEBUG("io_uring buffer table cannot be registered, error %d", errno);
+	}
+
+	Ring->Fd = Fd;
+	return true;
+}
+
+static DWORD RTMP__RingThread(LPVOID Arg)
+{
+	RtmpRing* Ring = Arg;
+
+	// thread that creates io_uring is only one allowed to submit to it
+	bool Ok = RTMP__RingSetup(Ring);
+	SetEvent(Ring->ReadyEvent);
+	if (!Ok)
+	{
+		return 0;
+	}
+
+	RTMP__RingArmHandle(Ring, Ring->WakeEvent, &Ring->WakeValue, RTMP_RING_WAKE);
+
+	for (;;)
+	{
+		// start sessions handed over since last wakeup
+		bool Stop;
+		for (;;)
+		{
+			AcquireSRWLockExclusive(&Ring->Lock);
+			RtmpStream* Stream = Ring->PendingCount != 0 ? Ring->Pending[--Ring->PendingCount] : NULL;
+			Stop = Ring->Stop && Ring->Active == 0;
+			ReleaseSRWLockExclusive(&Ring->Lock);
+
+			if (!Stream)
+			{
+				break;
+			}
+			RTMP__RingStart(Ring, Stream);
+		}
+		if (Stop)
+		{
+			break;
+		}
+
+		// one call submits everything all sessions queued & waits for next completion
+		int Result = (int)syscall(__NR_io_uring_enter, Ring->Fd, Ring->Queued, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+		if (Result < 0)
+		{
+			Assert(errno == EINTR);
+			continue;
+		}
+		Ring->Queued -= Result;
+		RTMP_STAT_ADD(Ring->Enters, 1);
+
+		uint32_t Head = *Ring->CqHead;
+		uint32_t Tail = __atomic_load_n(Ring->CqTail, __ATOMIC_ACQUIRE);
+		RTMP_STAT_ADD(Ring->Completions, Tail - Head);
+		while (Head != Tail)
+		{
+			// entry can be reused once head moves past it, handling it may submit & reap more
+			struct io_uring_cqe* Cqe = &Ring->Cqes[Head & Ring->CqMask];
+			uint64_t UserData = Cqe->user_data;
+			int32_t CqeResult = Cqe->res;
+			Head++;
+			__atomic_store_n(Ring->CqHead, Head, __ATOMIC_RELEASE);
+
+			RTMP__RingComplete(Ring, UserData, CqeResult);
+		}
+	}
+
+	return 0;
+}
+
+// hands connected socket over to ring thread & waits until session has ended there
+static void RTMP__RingSession(RtmpStream* Stream, SOCKET Socket)
+{
+	RtmpRing* Ring = Stream->Ring;
+
+	// io_uring waits for blocking socket same as for nonblocking one, but partial sends continue in kernel
+	int Flags = fcntl(Socket, F_GETFL);
+	fcntl(Socket, F_SETFL, Flags & ~O_NONBLOCK);
+	Stream->RingSocket = Socket;
+
+	AcquireSRWLockExclusive(&Ring->Lock);
+	bool Ok = !Ring->Stop && Ring->Active < Ring->MaxStreams;
+	if (Ok)
+	{
+		Ring->Pending[Ring->PendingCount++] = Stream;
+		Ring->Active++;
+	}
+	ReleaseSRWLockExclusive(&Ring->Lock);
+
+	if (!Ok)
+	{
+		RTMP_DEBUG("ERROR: all ring slots are in use");
+		return;
+	}
+
+	SetEvent(Ring->WakeEvent);
+	WaitForSingleObject(Stream->RingDone, INFINITE);
+	Stream->RingSocket = INVALID_SOCKET;
+}
+
+// connects & runs one RTMP session until disconnect or stop, returns true if stream got to publishing state
+static bool RTMP__Session(RtmpStream* Stream, const char* UrlHost, const char* UrlPort, bool UseTls)
+{
+	// rtmps urls are rejected when parsing
+	Assert(!UseTls);
+
+	// do hostname resolving
+	// ---------------------------------------------------------------------------
+
+	LARGE_INTEGER Now;
+	QueryPerformanceCounter(&Now);
+
+	struct addrinfo* Addresses = Stream->Addresses;
+	if (Addresses && Now.QuadPart - Stream->AddressTime < RTMP_ADDRESS_CACHE_TTL * Stream->Frequency)
+	{
+		RTMP_DEBUG("using cached addresses for '%s' name", UrlHost);
+	}
+	else
+	{
+		if (Addresses)
+		{
+			freeaddrinfo(Addresses);
+			Stream->Addresses = NULL;
+		}
+
+		RTMP_DEBUG("resolving '%s' name", UrlHost);
+
+		Stream->State = RTMP_STATE_RESOLVING;
+		RTMP_DEBUG("State ->  RTMP_STATE_RESOLVING");
+
+		Addresses = RTMP__Resolve(Stream, UrlHost, UrlPort);
+		if (!Addresses)
+		{
+			RTMP_DEBUG("ERROR: failed to resolve address");
+			return false;
+		}
+
+		// addresses are kept for reconnecting, freed when they expire or in RTMP_Done
+		Stream->Addresses = Addresses;
+		Stream->AddressTime = Now.QuadPart;
+	}
+
+	WriteNoFence(&Stream->ResolveTime, RTMP__GetStartupTime(Stream));
+
+	// create & connect socket
+	// ---------------------------------------------------------------------------
+
+	RTMP_DEBUG("connecting...");
+
+	Stream->State = RTMP_STATE_CONNECTING;
+	RTMP_DEBUG("State ->  RTMP_STATE_CONNECTING");
+
+	SOCKET Socket = RTMP__Connect(Stream, Addresses);
+	if (Socket == INVALID_SOCKET)
+	{
+		// addresses may be stale, resolve them again next time
+		freeaddrinfo(Stream->Addresses);
+		Stream->Addresses = NULL;
+
+		RTMP_DEBUG("ERROR: failed to connect to hostname in specified url");
+		return false;
+	}
+
+	WriteNoFence(&Stream->ConnectTime, RTMP__GetStartupTime(Stream));
+
+	// ---------------------------------------------------------------------------
+	// send C0+C1 handshake and start reading response
+
+	RTMP__StartHandshake(Stream);
+
+	LARGE_INTEGER StatsDue = { .QuadPart = -RTMP_STATS_INTERVAL * 10000LL };
+	BOOL StatsOk = SetWaitableTimer(Stream->StatsTimer, &StatsDue, RTMP_STATS_INTERVAL, NULL, NULL, FALSE);
+	Assert(StatsOk);
+
+	if (Stream->Ring && Stream->Ring->Fd >= 0)
+	{
+		RTMP__RingSession(Stream, Socket);
+	}
+	else
+	{
+		RTMP__EpollSession(Stream, Socket);
+	}
+
+	bool Published = Stream->State == RTMP_STATE_STREAM_READY;
+
+	// kernel has copied everything written so far, buffers can be reused right away
+	closesocket(Socket);
+
+	RTMP__ResetSession(Stream);
+
+	return Published;
+}
+
+#endif
+
+static DWORD RTMP__Thread(LPVOID Arg)
+{
+	RtmpStream* Stream = Arg;
+
+	// parse url to know hostname/port to connect
+	// ---------------------------------------------------------------------------
+
+	RTMP_DEBUG("parsing url");
+
+#ifdef _WIN32
+	WCHAR StreamUrl[RTMP_MAX_URL_LENGTH];
+	int StreamUrlLength = MultiByteToWideChar(CP_UTF8, 0, Stream->StreamUrl, -1, StreamUrl, ARRAYSIZE(StreamUrl));
+
+	WCHAR UrlScheme[32];
+	WCHAR UrlHost[RTMP_MAX_URL_LENGTH];
+	WCHAR UrlPath[RTMP_MAX_URL_LENGTH];
+	URL_COMPONENTSW UrlComponents =
+	{
+		.dwStructSize = sizeof(UrlComponents),
+		.lpszScheme = UrlScheme,
+		.dwSchemeLength = ARRAYSIZE(UrlScheme),
+		.lpszHostName = UrlHost,
+		.dwHostNameLength = ARRAYSIZE(UrlHost),
+		.lpszUrlPath = UrlPath,
+		.dwUrlPathLength = ARRAYSIZE(UrlPath),
+	};
+	if (InternetCrackUrlW(StreamUrl, StreamUrlLength, 0, &UrlComponents) == FALSE || (StrCmpW(UrlScheme, L"rtmp") != 0 && StrCmpW(UrlScheme, L"rtmps") != 0))
+	{
+		RTMP_DEBUG("ERROR: cannot parse url or not a rtmp/rtmps protocol");
+		Stream->State = RTMP_STATE_ERROR;
+		RTMP_DEBUG("State ->  RTMP_STATE_ERROR");
+		return 0;
+	}
+
+	bool UseTls = StrCmpW(UrlScheme, L"rtmps") == 0;
+
+	WCHAR UrlPort[32];
+	wsprintfW(UrlPort, L"%u", UrlComponents.nPort ? UrlComponents.nPort : UseTls ? RTMPS_DEFAULT_PORT : RTMP_DEFAULT_PORT);
+
+	// path includes '/' as first character, don't need it
+	int StreamAppLength = WideCharToMultiByte(CP_UTF8, 0, UrlPath + 1, max((int)UrlComponents.dwUrlPathLength - 1, 0), Stream->StreamApp, sizeof(Stream->StreamApp) - 1, NULL, NULL);
+	Stream->StreamApp[StreamAppLength] = 0;
+
+	RTMP_DEBUG(" * parsed '%S' scheme, '%S' host, %S port, '%S' path", UrlScheme, UrlHost, UrlPort, UrlPath + 1);
+#else
+	// rtmp://host[:port]/path, host can be [ipv6] literal
+	const char* Url = Stream->StreamUrl;
+	const char* Scheme = "rtmp://";
+	if (StrCmpNA(Url, Scheme, (int)strlen(Scheme)) != 0)
+	{
+		RTMP_DEBUG("ERROR: cannot parse url or not a rtmp protocol, rtmps is not supported on this platform");
+		Stream->State = RTMP_STATE_ERROR;
+		RTMP_DEBUG("State ->  RTMP_STATE_ERROR");
+		return 0;
+	}
+	const char* Host = Url + strlen(Scheme);
+	const char* HostEnd;
+	const char* Path = strchr(Host, '/');
+	if (!Path)
+	{
+		Path = Host + strlen(Host);
+	}
+
+	const char* Port = NULL;
+	if (Host[0] == '[')
+	{
+		Host++;
+		HostEnd = memchr(Host, ']', Path - Host);
+		if (HostEnd && HostEnd[1] == ':')
+		{
+			Port = HostEnd + 2;
+		}
+	}
+	else
+	{
+		HostEnd = memchr(Host, ':', Path - Host);
+		if (HostEnd)
+		{
+			Port = HostEnd + 1;
+		}
+		else
+		{
+			HostEnd = Path;
+		}
+	}
+
+	bool UseTls = false;
+
+	char UrlHost[RTMP_MAX_URL_LENGTH];
+	char UrlPort[32];
+	if (!HostEnd || HostEnd == Host || (Port && (Port == Path || Path - Port >= (ptrdiff_t)sizeof(UrlPort))))
+	{
+		RTMP_DEBUG("ERROR: cannot parse url");
+		Stream->State = RTMP_STATE_ERROR;
+		RTMP_DEBUG("State ->  RTMP_STATE_ERROR");
+		return 0;
+	}
+	StrCpyNA(UrlHost, Host, (int)(HostEnd - Host + 1));
+	if (Port)
+	{
+		StrCpyNA(UrlPort, Port, (int)(Path - Port + 1));
+	}
+	else
+	{
+		snprintf(UrlPort, sizeof(UrlPort), "%u", RTMP_DEFAULT_PORT);
+	}
+
+	// path includes '/' as first character, don't need it
+	StrCpyNA(Stream->StreamApp, Path[0] ? Path + 1 : Path, ARRAYSIZE(Stream->StreamApp));
+
+	RTMP_DEBUG(" * parsed '%s' host, %s port, '%s' path", UrlHost, UrlPort, Stream->StreamApp);
+#endif
+
+	// reconnect after any failure with exponential backoff, until stopped
+	// ---------------------------------------------------------------------------
+
+	LARGE_INTEGER StartTime;
+	QueryPerformanceCounter(&StartTime);
+	Stream->StartTime = StartTime.QuadPart;
+
+	DWORD Delay = RTMP_RECONNECT_MIN_DELAY;
+	for (;;)
+	{
+		bool Published = RTMP__Session(Stream, UrlHost, UrlPort, UseTls);
+
+		Stream->State = RTMP_STATE_NOT_CONNECTED;
+		RTMP_DEBUG("State ->  RTMP_STATE_NOT_CONNECTED");
+
+		if (WaitForSingleObject(Stream->StopEvent, 0) == WAIT_OBJECT_0)
+		{
+			break;
+		}
+
+		if (Published)
+		{
+			// connection was working, try again quickly & measure startup times from moment it was lost
+			Delay = RTMP_RECONNECT_MIN_DELAY;
+			QueryPerformanceCounter(&StartTime);
+			Stream->StartTime = StartTime.QuadPart;
+		}
+
+		RTMP_DEBUG("reconnecting in %u msec", Delay);
+		if (WaitForSingleObject(Stream->StopEvent, Delay) == WAIT_OBJECT_0)
+		{
+			break;
+		}
+		Delay = min(Delay * 2, RTMP_RECONNECT_MAX_DELAY);
+
+		// startup times are measured again for next attempt
+		WriteNoFence(&Stream->ResolveTime, 0);
+		WriteNoFence(&Stream->ConnectTime, 0);
+		WriteNoFence(&Stream->HandshakeTime, 0);
+		WriteNoFence(&Stream->PublishTime, 0);
+
+		InterlockedIncrement(&Stream->ReconnectAttempts);
+	}
+
+	return 0;
+}
+
+// everything except starting network thread
+static void RTMP__Init(RtmpStream* Stream, const char* Url, const char* Key, uint32_t BufferSize)
+{
+#ifdef _WIN32
+	WSADATA WsaData;
+	int Startup = WSAStartup(MAKEWORD(2, 2), &WsaData);
+	Assert(Startup == 0);
+#endif
+
+	// manual-reset, so it stays signaled for all waits in background thread
+	Stream->StopEvent = CreateEventW(NULL, TRUE, FALSE, NULL);
+	Assert(Stream->StopEvent);
+
+	Stream->DataEvent = CreateEventW(NULL, TRUE, FALSE, NULL);
+	Assert(Stream->DataEvent);
+
+#ifdef _WIN32
+	ZeroMemory(&Stream->RecvOv, sizeof(Stream->RecvOv));
+	Stream->RecvOv.hEvent = CreateEventW(NULL, TRUE, FALSE, NULL);
+	Assert(Stream->RecvOv.hEvent);
+
+	for (uint32_t i = 0; i < RTMP_MAX_SENDS; i++)
+	{
+		RtmpSend* Send = &Stream->Sends[i];
+		ZeroMemory(&Send->Ov, sizeof(Send->Ov));
+		Send->Ov.hEvent = CreateEventW(NULL, TRUE, FALSE, NULL);
+		Assert(Send->Ov.hEvent);
+	}
+#else
+	Stream->Epoll = -1;
+	Stream->Writable = true;
+	Stream->Ring = NULL;
+	Stream->RingDone = CreateEventW(NULL, FALSE, FALSE, NULL);
+	Assert(Stream->RingDone);
+	Stream->RingSocket = INVALID_SOCKET;
+#endif
+	Stream->SendFirst = 0;
+	Stream->SendActive = 0;
+	Stream->SendLimit = 1;
+	Stream->ZeroCopy = 0;
+	Stream->Tls = false;
+	Stream->Addresses = NULL;
+	Stream->AddressTime = 0;
+	Stream->ResolveTime = 0;
+	Stream->ConnectTime = 0;
+	Stream->HandshakeTime = 0;
+	Stream->PublishTime = 0;
+
+	// auto-reset timer, high resolution is needed to pace with less than 15msec granularity
+	Stream->PaceTimer = CreateWaitableTimerExW(NULL, NULL, CREATE_WAITABLE_TIMER_HIGH_RESOLUTION, TIMER_ALL_ACCESS);
+	Assert(Stream->PaceTimer);
+	Stream->PaceRate = 0;
+	Stream->PaceBurst = 0;
+	Stream->PaceTokens = 0;
+	Stream->PaceTime = 0;
+	Stream->PaceBlocked = 0;
+	Stream->PaceDelay = 0;
+	Stream->Probing = 0;
+	Stream->PaceWaiting = false;
+	Stream->PeerBandwidth = UINT32_MAX;
+	Stream->PeerLimit = 1;
+
+	Stream->CoalesceTimer = CreateWaitableTimerExW(NULL, NULL, CREATE_WAITABLE_TIMER_HIGH_RESOLUTION, TIMER_ALL_ACCESS);
+	Assert(Stream->CoalesceTimer);
+	Stream->CoalesceSize = 0;
+	Stream->CoalesceDelay = 0;
+	Stream->CoalescePending = 0;
+	Stream->MessageFlush = 0;
+	Stream->SendCalls = 0;
+	Stream->Wakeups = 0;
+	Stream->RateSendCalls = 0;
+	Stream->RateWakeups = 0;
+
+	LARGE_INTEGER RateTime;
+	QueryPerformanceCounter(&RateTime);
+	Stream->RateTime = RateTime.QuadPart;
+
+	Stream->StatsTimer = CreateWaitableTimerExW(NULL, NULL, 0, TIMER_ALL_ACCESS);
+	Assert(Stream->StatsTimer);
+	Stream->StatsTime = 0;
+	Stream->StatsDelivered = 0;
+	Stream->TotalBytesSent = 0;
+	Stream->AckBytes = 0;
+	Stream->PingRtt = 0;
+	Stream->TcpRtt = 0;
+	Stream->TcpCwnd = 0;
+	Stream->InFlight = 0;
+	Stream->Bandwidth = 0;
+
+	SYSTEM_INFO SysInfo;
+	GetSystemInfo(&SysInfo);
+
+	// receive buffer, we don't expect to receive much data
+	RB_Init(&Stream->Recv, SysInfo.dwAllocationGranularity);
+	Stream->RecvMessages = VirtualAlloc(NULL, RTMP_MAX_RECV_STREAMS * RTMP_MAX_RECV_MESSAGE, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+	Assert(Stream->RecvMessages);
+
+	// send buffer
+	BufferSize = CEIL_POW2(BufferSize, SysInfo.dwAllocationGranularity);
+	RB_Init(&Stream->Send, BufferSize);
+
+	LARGE_INTEGER Frequency;
+	QueryPerformanceFrequency(&Frequency);
+	Stream->Frequency = Frequency.QuadPart;
+
+	Stream->Messages = VirtualAlloc(NULL, RTMP_MAX_MESSAGES * sizeof(RtmpMessage), MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+	Assert(Stream->Messages);
+	Stream->Session = 1;
+	Stream->ReconnectAttempts = 0;
+	Stream->ConfigSession = 0;
+	Stream->HasConfig = 0;
+	Stream->ReplaySession = 0;
+	Stream->Disconnect = false;
+	Stream->Receiving = false;
+	Stream->HasVideoConfig = false;
+	Stream->HasAudioConfig = false;
+
+	Stream->SendReserve = RTMP_RESERVE(0, 0);
+	Stream->MessageRead = 0;
+	Stream->MessageSend = 0;
+	Stream->MessageSent = 0;
+
+	StrCpyNA(Stream->StreamUrl, Url, ARRAYSIZE(Stream->StreamUrl));
+	StrCpyNA(Stream->StreamKey, Key, ARRAYSIZE(Stream->StreamKey));
+
+	Stream->TotalByteReceived = 0;
+	Stream->BytesReceived = 0;
+	Stream->WindowSize = 1 << 20; // what's the default value for window size? idk
+	Stream->ChunkSize = 128;
+	Stream->SendChunkSize = 128;
+	Stream->State = RTMP_STATE_NOT_CONNECTED;
+	Stream->MaxQueueLatency = 0;
+	Stream->SkipVideo = false;
+	Stream->VideoDrop = RTMP_DROP_NONE;
+	Stream->VideoDropped = 0;
+	ZeroMemory(Stream->Tracks, sizeof(Stream->Tracks));
+	ZeroMemory((void*)Stream->DelayHistogram, sizeof(Stream->DelayHistogram));
+	Stream->SendHighWater = 0;
+	Stream->BlockedTime = 0;
+	Stream->Blocked = false;
+	ZeroMemory(Stream->SendTimestamp, sizeof(Stream->SendTimestamp));
+	ZeroMemory(Stream->SendExtended, sizeof(Stream->SendExtended));
+	ZeroMemory(Stream->SendHasTimestamp, sizeof(Stream->SendHasTimestamp));
+	ZeroMemory(Stream->RecvChunks, sizeof(Stream->RecvChunks));
+	Stream->RecvChunk = NULL;
+	Stream->RecvRemaining = 0;
+	Stream->RecvUse = 0;
+}
+
+void RTMP_Init(RtmpStream* Stream, const char* Url, const char* Key, uint32_t BufferSize)
+{
+	RTMP__Init(Stream, Url, Key, BufferSize);
+
+	Stream->Thread = CreateThread(NULL, 0, &RTMP__Thread, Stream, 0, NULL);
+	Assert(Stream->Thread);
+}
+
+#ifndef _WIN32
+void RTMP_InitRing(RtmpStream* Stream, RtmpRing* Ring, const char* Url, const char* Key, uint32_t BufferSize)
+{
+	RTMP__Init(Stream, Url, Key, BufferSize);
+	Stream->Ring = Ring;
+
+	Stream->Thread = CreateThread(NULL, 0, &RTMP__Thread, Stream, 0, NULL);
+	Assert(Stream->Thread);
+}
+#endif
+
+void RTMP_Done(RtmpStream* Stream)
+{
+	SetEvent(Stream->StopEvent);
+	WaitForSingleObject(Stream->Thread, INFINITE);
+	CloseHandle(Stream->Thread);
+
+	// release any caller-owned data that was not sent
+	RTMP__ReleaseMessages(Stream, RTMP_RESERVE_INDEX(Stream->SendReserve));
+	VirtualFree(Stream->Messages, 0, MEM_RELEASE);
+
+	RB_Done(&Stream->Recv);
+	RB_Done(&Stream->Send);
+	VirtualFree(Stream->RecvMessages, 0, MEM_RELEASE);
+
+#ifdef _WIN32
+	if (Stream->Addresses)
+	{
+		FreeAddrInfoExW(Stream->Addresses);
+	}
+
+	for (uint32_t i = 0; i < RTMP_MAX_SENDS; i++)
+	{
+		CloseHandle(Stream->Sends[i].Ov.hEvent);
+	}
+	CloseHandle(Stream->RecvOv.hEvent);
+#else
+	if (Stream->Addresses)
+	{
+		freeaddrinfo(Stream->Addresses);
+	}
+	CloseHandle(Stream->RingDone);
+#endif
+	CloseHandle(Stream->PaceTimer);
+	CloseHandle(Stream->CoalesceTimer);
+	CloseHandle(Stream->StatsTimer);
+	CloseHandle(Stream->DataEvent);
+	CloseHandle(Stream->StopEvent);
+
+#ifdef _WIN32
+	WSACleanup();
+#endif
+}
+
+#ifndef _WIN32
+void RTMP_RingInit(RtmpRing* Ring, uint32_t MaxStreams)
+{
+	Assert(MaxStreams >= 1 && MaxStreams <= RTMP_MAX_RING_STREAMS);
+
+	Ring->ReadyEvent = CreateEventW(NULL, FALSE, FALSE, NULL);
+	Assert(Ring->ReadyEvent);
+
+	// auto-reset, ring thread reads it through io_uring
+	Ring->WakeEvent = CreateEventW(NULL, FALSE, FALSE, NULL);
+	Assert(Ring->WakeEvent);
+
+	InitializeSRWLock(&Ring->Lock);
+	Ring->Pending = VirtualAlloc(NULL, MaxStreams * sizeof(RtmpStream*), MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+	Assert(Ring->Pending);
+	Ring->PendingCount = 0;
+	Ring->Streams = VirtualAlloc(NULL, MaxStreams * sizeof(RtmpStream*), MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+	Assert(Ring->Streams);
+	Ring->MaxStreams = MaxStreams;
+	Ring->Active = 0;
+	Ring->Stop = false;
+	Ring->PollEvents = false;
+
+	Ring->Fd = -1;
+	Ring->Queued = 0;
+	Ring->Enters = 0;
+	Ring->Submitted = 0;
+	Ring->Completions = 0;
+
+	// io_uring is created by ring thread, streams check Fd only after this returns
+	Ring->Thread = CreateThread(NULL, 0, &RTMP__RingThread, Ring, 0, NULL);
+	Assert(Ring->Thread);
+	WaitForSingleObject(Ring->ReadyEvent, INFINITE);
+}
+
+void RTMP_RingDone(RtmpRing* Ring)
+{
+	AcquireSRWLockExclusive(&Ring->Lock);
+	Ring->Stop = true;
+	ReleaseSRWLockExclusive(&Ring->Lock);
+
+	SetEvent(Ring->WakeEvent);
+	WaitForSingleObject(Ring->Thread, INFINITE);
+	CloseHandle(Ring->Thread);
+
+	if (Ring->Fd >= 0)
+	{
+		munmap(Ring->Sqes, Ring->SqEntries * sizeof(struct io_uring_sqe));
+		if (Ring->CqRing != Ring->SqRing)
+		{
+			munmap(Ring->CqRing, Ring->CqRingSize);
+		}
+		munmap(Ring->SqRing, Ring->SqRingSize);
+		close(Ring->Fd);
+	}
+
+	VirtualFree(Ring->Pending, 0, MEM_RELEASE);
+	VirtualFree(Ring->Streams, 0, MEM_RELEASE);
+	CloseHandle(Ring->WakeEvent);
+	CloseHandle(Ring->ReadyEvent);
+}
+#endif
+
+bool RTMP_IsStreaming(const RtmpStream* Stream)
+{
+	return Stream->State == RTMP_STATE_STREAM_READY;
+}
+
+bool RTMP_IsError(const RtmpStream* Stream)
+{
+	return Stream->State == RTMP_STATE_ERROR;
+}
+
+bool RTMP_IsCongested(const RtmpStream* Stream)
+{
+	if (!RTMP_IsStreaming(Stream))
+	{
+		return false;
+	}
+
+	// same thresholds as drop policy, once it drops until keyframe congestion lasts until usage goes down to resume level
+	uint32_t Usage = RTMP__GetQueueUsage((RtmpStream*)Stream);
+	uint32_t VideoDrop = ReadNoFence((volatile LONG*)&Stream->VideoDrop);
+	return Usage >= RTMP_DROP_GOP_USAGE || (VideoDrop == RTMP_DROP_GOP && Usage > RTMP_DROP_RESUME_USAGE);
+}
+
+void RTMP_SetMaxQueueLatency(RtmpStream* Stream, uint32_t Milliseconds)
+{
+	InterlockedExchange64(&Stream->MaxQueueLatency, (LONG64)(Milliseconds * Stream->Frequency / 1000));
+}
+
+bool RTMP_SetMaxSends(RtmpStream* Stream, uint32_t Count)
+{
+	if (Count < 1 || Count > RTMP_MAX_SENDS)
+	{
+		return false;
+	}
+	if (ReadNoFence(&Stream->ZeroCopy) && Count == 1)
+	{
+		// without socket send buffer single send in progress would be stop-and-wait
+		return false;
+	}
+	InterlockedExchange(&Stream->SendLimit, (LONG)Count);
+	return true;
+}
+
+void RTMP_GetStartupTimes(const RtmpStream* Stream, uint32_t* Resolve, uint32_t* Connect, uint32_t* Handshake, uint32_t* Publish)
+{
+	*Resolve = ReadNoFence((volatile LONG*)&Stream->ResolveTime);
+	*Connect = ReadNoFence((volatile LONG*)&Stream->ConnectTime);
+	*Handshake = ReadNoFence((volatile LONG*)&Stream->HandshakeTime);
+	*Publish = ReadNoFence((volatile LONG*)&Stream->PublishTime);
+}
+
+void RTMP_SetZeroCopy(RtmpStream* Stream, bool Enable)
+{
+	InterlockedExchange(&Stream->ZeroCopy, Enable);
+	if (Enable)
+	{
+		// every send waits for peer to ack it, keep several in progress to not stall uplink
+		InterlockedCompareExchange(&Stream->SendLimit, RTMP_MAX_SENDS, 1);
+	}
+}
+
+void RTMP_SetPacing(RtmpStream* Stream, uint32_t Bitrate, uint32_t RatePercent, uint32_t BurstMilliseconds)
+{
+	uint64_t Rate = (uint64_t)Bitrate * 1000 / 8 * RatePercent / 100;
+	InterlockedExchange(&Stream->PaceBurst, (LONG)min(Rate * BurstMilliseconds / 1000, INT32_MAX));
+	InterlockedExchange64(&Stream->PaceRate, (LONG64)Rate);
+}
+
+void RTMP_GetPacing(const RtmpStream* Stream, uint32_t* Rate, uint32_t* Delay)
+{
+	*Rate = (uint32_t)ReadNoFence64(&Stream->PaceRate);
+	*Delay = (uint32_t)ReadNoFence((volatile LONG*)&Stream->PaceDelay);
+}
+
+void RTMP_SetCoalescing(RtmpStream* Stream, uint32_t Size, uint32_t Microseconds)
+{
+	// wake up network thread so messages queued with previous setting do not wait for new flush point
+	InterlockedExchange(&Stream->CoalesceDelay, (LONG)min(Microseconds, INT32_MAX));
+	InterlockedExchange(&Stream->CoalesceSize, (LONG)min(Size, INT32_MAX));
+	SetEvent(Stream->DataEvent);
+}
+
+void RTMP_GetSendRates(RtmpStream* Stream, uint32_t* SendCalls, uint32_t* Wakeups)
+{
+	LARGE_INTEGER Now;
+	QueryPerformanceCounter(&Now);
+
+	uint64_t Calls = ReadNoFence64((volatile LONG64*)&Stream->SendCalls);
+	uint64_t Wakes = ReadNoFence64((volatile LONG64*)&Stream->Wakeups);
+	uint64_t Elapsed = Now.QuadPart - Stream->RateTime;
+
+	*SendCalls = Elapsed ? (uint32_t)((Calls - Stream->RateSendCalls) * Stream->Frequency / Elapsed) : 0;
+	*Wakeups = Elapsed ? (uint32_t)((Wakes - Stream->RateWakeups) * Stream->Frequency / Elapsed) : 0;
+
+	Stream->RateTime = Now.QuadPart;
+	Stream->RateSendCalls = Calls;
+	Stream->RateWakeups = Wakes;
+}
+
+void RTMP_GetNetworkStats(const RtmpStream* Stream, RtmpNetworkStats* Stats)
+{
+	LONG64 Reserve = ReadNoFence64((volatile LONG64*)&Stream->SendReserve);
+	uint32_t SendRead = (uint32_t)ReadULongPtrAcquire((volatile ULONG_PTR*)&Stream->Send.Read);
+
+	Stats->Rtt = ReadNoFence((volatile LONG*)&Stream->PingRtt);
+	Stats->TcpRtt = ReadNoFence((volatile LONG*)&Stream->TcpRtt);
+	Stats->Cwnd = ReadNoFence((volatile LONG*)&Stream->TcpCwnd);
+	Stats->InFlight = ReadNoFence((volatile LONG*)&Stream->InFlight);
+	Stats->Queued = RTMP_RESERVE_POSITION(Reserve) - SendRead;
+	Stats->Bandwidth = ReadNoFence((volatile LONG*)&Stream->Bandwidth);
+	Stats->QueueUsage = RTMP__GetQueueUsage((RtmpStream*)Stream);
+	Stats->Dropped = ReadNoFence((volatile LONG*)&Stream->VideoDropped);
+
+	// only media messages have queueing time, oldest message can be released & its slot reused meanwhile
+	// then delay is just a bit smaller
+	Stats->QueueDelay = 0;
+	uint32_t MessageRead = ReadAcquire((volatile LONG*)&Stream->MessageRead);
+	if (MessageRead != RTMP_RESERVE_INDEX(Reserve) && RTMP__IsCommitted((RtmpStream*)Stream, MessageRead))
+	{
+		LARGE_INTEGER Now;
+		QueryPerformanceCounter(&Now);
+
+		uint64_t Time = Stream->Messages[MessageRead & (RTMP_MAX_MESSAGES - 1)].Time;
+		if (Time != 0 && (uint64_t)Now.QuadPart > Time)
+		{
+			Stats->QueueDelay = (uint32_t)((Now.QuadPart - Time) * 1000 / Stream->Frequency);
+		}
+	}
+}
+
+// returns upper bound in msec of histogram bucket below which Percent of values are
+static uint32_t RTMP__GetPercentile(const uint64_t* Histogram, uint64_t Total, uint32_t Percent)
+{
+	uint64_t Count = 0;
+	for (uint32_t i = 0; i < RTMP_DELAY_BUCKETS; i++)
+	{
+		Count += Histogram[i];
+		if (Count * 100 >= Total * Percent)
+		{
+			return 1U << i;
+		}
+	}
+	return 1U << (RTMP_DELAY_BUCKETS - 1);
+}
+
+void RTMP_GetStats(const RtmpStream* Stream, RtmpStats* Stats)
+{
+	for (uint32_t t = 0; t < RTMP_TRACK_COUNT; t++)
+	{
+		const RtmpTrackCounters* Track = &Stream->Tracks[t];
+		RtmpTrackStats* Out = &Stats->Tracks[t];
+
+		Out->EnqueuedBytes = ReadNoFence64(&Track->EnqueuedBytes);
+		Out->EnqueuedMessages = ReadNoFence64(&Track->EnqueuedMessages);
+		Out->SentBytes = ReadNoFence64(&Track->SentBytes);
+		Out->SentMessages = ReadNoFence64(&Track->SentMessages);
+		for (uint32_t r = 0; r < RTMP_DROP_REASON_COUNT; r++)
+		{
+			Out->Dropped[r] = ReadNoFence64(&Track->Dropped[r]);
+		}
+	}
+
+	LONG64 Reserve = ReadNoFence64((volatile LONG64*)&Stream->SendReserve);
+	uint32_t SendRead = (uint32_t)ReadULongPtrAcquire((volatile ULONG_PTR*)&Stream->Send.Read);
+
+	Stats->SendSize = (uint32_t)Stream->Send.Size;
+	Stats->SendUsed = RTMP_RESERVE_POSITION(Reserve) - SendRead;
+	Stats->SendHighWater = ReadNoFence((volatile LONG*)&Stream->SendHighWater);
+
+	uint64_t Histogram[RTMP_DELAY_BUCKETS];
+	uint64_t Total = 0;
+	for (uint32_t i = 0; i < RTMP_DELAY_BUCKETS; i++)
+	{
+		Histogram[i] = ReadNoFence64((volatile LONG64*)&Stream->DelayHistogram[i]);
+		Total += Histogram[i];
+	}
+	Stats->DelayP50 = Total ? RTMP__GetPercentile(Histogram, Total, 50) : 0;
+	Stats->DelayP90 = Total ? RTMP__GetPercentile(Histogram, Total, 90) : 0;
+	Stats->DelayP99 = Total ? RTMP__GetPercentile(Histogram, Total, 99) : 0;
+
+	Stats->SendCalls = ReadNoFence64((volatile LONG64*)&Stream->SendCalls);
+	Stats->BlockedTime = ReadNoFence64((volatile LONG64*)&Stream->BlockedTime) * 1000000 / Stream->Frequency;
+
+	// session is incremented on every disconnect, attempts that fail before connection is made do not change it
+	Stats->Reconnects = ReadNoFence((volatile LONG*)&Stream->Session) - 1;
+	Stats->ReconnectAttempts = ReadNoFence((volatile LONG*)&Stream->ReconnectAttempts);
+}
+
+// queues AMF0 data message with name servers do not know, so it is ignored
+static bool RTMP__WritePadding(RtmpStream* Stream, LONG Session, uint32_t Size)
+{
+	RtmpMessage* Entry = RTMP__BeginMessage(Stream, Session, Size);
+	if (Entry)
+	{
+		Entry->ChunkStreamId = RTMP_CHANNEL_MISC;
+		Entry->ChunkFormat = 0;
+		Entry->Timestamp = 0;
+		Entry->MessageType = RTMP_PACKET_DATA_AMF0;
+		Entry->MessageStreamId = Stream->StreamId;
+		Entry->IsPadding = true;
+
+		uint8_t* Begin = RB_GetPointer(&Stream->Send, Entry->Offset);
+		uint8_t* Ptr = Begin;
+		AMF_PUT_STRING_STATIC(Ptr, "onPadding");
+
+		// AMF0 long string
+		uint32_t Length = Size - (uint32_t)(Ptr - Begin) - 5;
+		BE_PUT1(Ptr, 12);
+		BE_PUT4(Ptr, Length);
+		ZeroMemory(Ptr, Length);
+
+		RTMP__EndMessage(Stream, Entry);
+		SetEvent(Stream->DataEvent);
+	}
+	return Entry != NULL;
+}
+
+uint32_t RTMP_ProbeBandwidth(RtmpStream* Stream, uint32_t StartBitrate, uint32_t MaxBitrate, uint32_t Milliseconds)
+{
+	if (Stream->State != RTMP_STATE_STREAM_READY)
+	{
+		return 0;
+	}
+	LONG Session = ReadNoFence(&Stream->Session);
+
+	// pacer would limit rate to current configuration, pacing set meanwhile is not overwritten
+	InterlockedExchange(&Stream->Probing, 1);
+
+	LARGE_INTEGER Start;
+	QueryPerformanceCounter(&Start);
+	uint64_t End = Start.QuadPart + Milliseconds * Stream->Frequency / 1000;
+
+	uint64_t Rate = StartBitrate * 1000ULL / 8; // bytes per second
+	uint64_t MaxRate = MaxBitrate * 1000ULL / 8;
+	uint64_t Measured = 0;
+
+	for (;;)
+	{
+		LARGE_INTEGER StepStart;
+		QueryPerformanceCounter(&StepStart);
+		uint64_t StepEnd = min(StepStart.QuadPart + RTMP_PROBE_STEP * Stream->Frequency / 1000, End);
+		if (StepEnd <= (uint64_t)StepStart.QuadPart)
+		{
+			break;
+		}
+
+		size_t ReadStart = ReadULongPtrAcquire((volatile ULONG_PTR*)&Stream->Send.Read);
+		uint64_t Queued = 0;
+
+		LARGE_INTEGER Now = StepStart;
+		while ((uint64_t)Now.QuadPart < StepEnd)
+		{
+			// queue as much padding as rate allows until now
+			uint64_t Target = Rate * (Now.QuadPart - StepStart.QuadPart) / Stream->Frequency;
+			while (Queued < Target)
+			{
+				uint32_t Size = (uint32_t)min(Target - Queued, RTMP_PROBE_PACKET);
+				Size = max(Size, 64);
+				if (!RTMP__WritePadding(Stream, Session, Size))
+				{
+					// outgoing buffer is full
+					break;
+				}
+				Queued += Size;
+			}
+
+			Sleep(RTMP_PROBE_INTERVAL);
+			QueryPerformanceCounter(&Now);
+		}
+
+		if (Session != ReadNoFence(&Stream->Session))
+		{
+			// connection lost
+			Measured = 0;
+			break;
+		}
+
+		size_t ReadEnd = ReadULongPtrAcquire((volatile ULONG_PTR*)&Stream->Send.Read);
+		uint64_t Drained = ReadEnd - ReadStart;
+		uint64_t DrainRate = Drained * Stream->Frequency / (Now.QuadPart - StepStart.QuadPart);
+		Measured = max(Measured, DrainRate);
+
+		RTMP_DEBUG("Probe: queued %u bytes, sent %u bytes, %u kbit/s", (uint32_t)Queued, (uint32_t)Drained, (uint32_t)(DrainRate * 8 / 1000));
+
+		if (Drained * 100 < Queued * RTMP_PROBE_DRAINED)
+		{
+			// network could not take this rate, what was sent is sustained rate
+			Measured = DrainRate;
+			break;
+		}
+		if (Rate >= MaxRate)
+		{
+			// network can take max rate, no headroom needed
+			Measured = MaxRate * 100 / RTMP_PROBE_HEADROOM;
+			break;
+		}
+		Rate = min(Rate * RTMP_PROBE_GROWTH / 100, MaxRate);
+	}
+
+	// network thread skips padding that is still queued
+	InterlockedExchange(&Stream->Probing, 0);
+	SetEvent(Stream->DataEvent);
+
+	return (uint32_t)min(Measured * 8 / 1000 * RTMP_PROBE_HEADROOM / 100, MaxBitrate);
+}
+
+void RTMP_SendConfig(RtmpStream* Stream, const RtmpVideoConfig* VideoConfig, const RtmpAudioConfig* AudioConfig)
+{
+	if (Stream->State != RTMP_STATE_STREAM_READY)
+	{
+		return;
+	}
+	Assert(ReadNoFence(&Stream->HasConfig) == 0);
+	if (ReadNoFence(&Stream->HasConfig) != 0)
+	{
+		return;
+	}
+
+	// keep copy for sending it again after reconnect, it is never changed after this
+	if (VideoConfig)
+	{
+		Assert(VideoConfig->HeaderSize <= sizeof(Stream->VideoHeader));
+		Stream->VideoConfig = *VideoConfig;
+		Stream->VideoConfig.Header = Stream->VideoHeader;
+		Stream->VideoConfig.HeaderSize = min(VideoConfig->HeaderSize, sizeof(Stream->VideoHeader));
+		CopyMemory(Stream->VideoHeader, VideoConfig->Header, Stream->VideoConfig.HeaderSize);
+	}
+	if (AudioConfig)
+	{
+		Assert(AudioConfig->HeaderSize <= sizeof(Stream->AudioHeader));
+		Stream->AudioConfig = *AudioConfig;
+		Stream->AudioConfig.Header = Stream->AudioHeader;
+		Stream->AudioConfig.HeaderSize = min(AudioConfig->HeaderSize, sizeof(Stream->AudioHeader));
+		CopyMemory(Stream->AudioHeader, AudioConfig->Header, Stream->AudioConfig.HeaderSize);
+	}
+	Stream->HasVideoConfig = VideoConfig != NULL;
+	Stream->HasAudioConfig = AudioConfig != NULL;
+
+	// network thread queues config in its current session, and only then allows media to be queued
+	WriteRelease(&Stream->HasConfig, 1);
+	SetEvent(Stream->DataEvent);
+}
+
+bool RTMP_SendVideo(RtmpStream* Stream, uint64_t DecodeTime, uint64_t PresentTime, uint64_t TimePeriod, const void* VideoData, uint32_t VideoSize, bool IsKeyFrame, bool IsDisposable)
+{
+	return RTMP_SendVideoRef(Stream, DecodeTime, PresentTime, TimePeriod, VideoData, VideoSize, IsKeyFrame, IsDisposable, NULL, NULL);
+}
+
+bool RTMP_SendAudio(RtmpStream* Stream, uint64_t Time, uint64_t TimePeriod, const void* AudioData, uint32_t AudioSize)
+{
+	return RTMP_SendAudioRef(Stream, Time, TimePeriod, AudioData, AudioSize, NULL, NULL);
+}
+
+// video frame was not queued, drop reason is already counted by caller
+static void RTMP__LoseVideo(RtmpStream* Stream, bool IsDisposable)
+{
+	InterlockedIncrement(&Stream->VideoDropped);
+
+	if (!IsDisposable)
+	{
+		// frames after this one would reference it, so drop them too
+		Stream->VideoDrop = RTMP_DROP_GOP;
+	}
+}
+
+// Gop is optional cache that already contains this frame, it is replayed once for each new session
+static bool RTMP__SendVideo(RtmpStream* Stream, const RtmpGopCache* Gop, uint32_t DecodeTimestamp, uint32_t CompositionOffset, const void* VideoData, uint32_t VideoSize, bool IsKeyFrame, bool IsDisposable, RtmpRelease_Callback* Release, void* ReleaseArg)
+{
+	LONG Session = ReadAcquire(&Stream->ConfigSession);
+	if (Session == 0 || Session != ReadNoFence(&Stream->Session))
+	{
+		RTMP__CountDrop(Stream, RTMP_PACKET_VIDEO, RTMP_DROP_REASON_NOT_READY);
+		return false;
+	}
+
+	// config is visible once ConfigSession is set
+	uint8_t Extra[RTMP_VIDEO_MAX_HEADER];
+	uint32_t ExtraSize = RTMP__WriteVideoHeader(Extra, Stream->VideoConfig.Codec, false, IsKeyFrame, CompositionOffset);
+
+	if (Session != Stream->ReplaySession)
+	{
+		// first frame in new session, send whole GOP so far including this frame
+		Stream->ReplaySession = Session;
+		if (Gop && Gop->Valid)
+		{
+			// this frame was queued as copy from cache, or replay failed and it is dropped with rest of GOP
+			bool Replayed = RTMP__ReplayVideo(Stream, Session, Gop);
+			if (Replayed && Release)
+			{
+				Release(ReleaseArg);
+			}
+			return Replayed;
+		}
+		// GOP not available, frames that cannot be decoded are dropped until next keyframe
+		Stream->VideoDrop = RTMP_DROP_GOP;
+	}
+
+	if (RTMP__DropVideo(Stream, IsKeyFrame, IsDisposable))
+	{
+		InterlockedIncrement(&Stream->VideoDropped);
+		RTMP__CountDrop(Stream, RTMP_PACKET_VIDEO, RTMP_DROP_REASON_POLICY);
+		return false;
+	}
+
+	if (RTMP__SendDeltaChunk(Stream, Session, RTMP_CHANNEL_VIDEO, DecodeTimestamp, IsKeyFrame, RTMP_PACKET_VIDEO, Extra, ExtraSize, VideoData, VideoSize, Release, ReleaseArg))
+	{
+		return true;
+	}
+	RTMP__LoseVideo(Stream, IsDisposable);
+	return false;
+}
+
+bool RTMP_SendVideoRef(RtmpStream* Stream, uint64_t DecodeTime, uint64_t PresentTime, uint64_t TimePeriod, const void* VideoData, uint32_t VideoSize, bool IsKeyFrame, bool IsDisposable, RtmpRelease_Callback* Release, void* ReleaseArg)
+{
+	uint32_t DecodeTimestamp = RTMP__GetTimestamp(DecodeTime, TimePeriod);
+	uint32_t PresentTimestamp = RTMP__GetTimestamp(PresentTime, TimePeriod);
+	return RTMP__SendVideo(Stream, NULL, DecodeTimestamp, PresentTimestamp - DecodeTimestamp, VideoData, VideoSize, IsKeyFrame, IsDisposable, Release, ReleaseArg);
+}
+
+bool RTMP_SendAudioRef(RtmpStream* Stream, uint64_t Time, uint64_t TimePeriod, const void* AudioData, uint32_t AudioSize, RtmpRelease_Callback* Release, void* ReleaseArg)
+{
+	LONG Session = ReadAcquire(&Stream->ConfigSession);
+	if (Session == 0 || Session != ReadNoFence(&Stream->Session))
+	{
+		RTMP__CountDrop(Stream, RTMP_PACKET_AUDIO, RTMP_DROP_REASON_NOT_READY);
+		return false;
+	}
 
-		if (Error == 0)
-		{
-			// ok we're connected
-			RTMP_DEBUG(" * OK");
-			break;
-		}
+	uint32_t Timestamp = RTMP__GetTimestamp(Time, TimePeriod);
 
-		// cannot connect address, will try next one
-		Address = Address->ai_next;
+	uint8_t Extra[RTMP_AUDIO_MAX_HEADER];
+	uint32_t ExtraSize = RTMP__WriteAudioHeader(Extra, Stream->AudioConfig.Codec, false);
 
-		closesocket(Socket);
-		Socket = INVALID_SOCKET;
-	}
+	return RTMP__SendDeltaChunk(Stream, Session, RTMP_CHANNEL_AUDIO, Timestamp, false, RTMP_PACKET_AUDIO, Extra, ExtraSize, AudioData, AudioSize, Release, ReleaseArg);
+}
 
-	FreeAddrInfoExW(Addresses);
-	ResetEvent(Stream->SendOv.hEvent);
+static void RTMP__ReleaseShared(void* Arg)
+{
+	RtmpShared* Shared = Arg;
 
-	if (Socket == INVALID_SOCKET)
+	// once count reaches zero, slot can be reused by producer
+	RtmpRelease_Callback* Release = Shared->Release;
+	void* ReleaseArg = Shared->ReleaseArg;
+	if (InterlockedDecrement(&Shared->Count) == 0 && Release)
 	{
-		RTMP_DEBUG("ERROR: failed to connect to hostname in specified url");
-		Stream->State = RTMP_STATE_ERROR;
-		RTMP_DEBUG("State ->  RTMP_STATE_ERROR");
-		return 0;
+		Release(ReleaseArg);
 	}
+}
 
-	// ---------------------------------------------------------------------------
-	// RTMP C0+C1 handshake
+void RTMP_FanoutInit(RtmpFanout* Fanout, RtmpStream** Streams, uint32_t StreamCount)
+{
+	Assert(StreamCount >= 1 && StreamCount <= RTMP_MAX_DESTINATIONS);
+	CopyMemory(Fanout->Streams, Streams, StreamCount * sizeof(*Streams));
+	Fanout->StreamCount = StreamCount;
 
-	Stream->State = RTMP_STATE_HANDSHAKE;
-	RTMP_DEBUG("State ->  RTMP_STATE_HANDSHAKE");
+	// one stream cannot have more messages queued than this, so usually all slots are free when reached again
+	Fanout->Shared = VirtualAlloc(NULL, RTMP_MAX_MESSAGES * sizeof(RtmpShared), MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+	Assert(Fanout->Shared);
+	Fanout->SharedNext = 0;
+
+	Fanout->Gop = (RtmpGopCache){ 0 };
+}
 
+void RTMP_FanoutDone(RtmpFanout* Fanout)
+{
+	VirtualFree(Fanout->Shared, 0, MEM_RELEASE);
+	if (Fanout->Gop.Capacity != 0)
 	{
-		uint32_t HandshakeSize = 1 + 4 + 4 + RTMP_HANDSHAKE_RANDOM_SIZE;
-		Assert(HandshakeSize <= RB_GetFree(&Stream->Send));
+		VirtualFree(Fanout->Gop.Buffer, 0, MEM_RELEASE);
+		VirtualFree(Fanout->Gop.Frames, 0, MEM_RELEASE);
+	}
+}
 
-		RTMP_DEBUG("Sending C0+C1 handshake");
+void RTMP_FanoutSetGopCache(RtmpFanout* Fanout, uint32_t Size)
+{
+	Assert(Fanout->Gop.Capacity == 0 && Size != 0);
 
-		uint8_t* Begin = RB_BeginWrite(&Stream->Send);
-		uint8_t* Ptr = Begin;
+	Fanout->Gop.Buffer = VirtualAlloc(NULL, Size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+	Assert(Fanout->Gop.Buffer);
+	Fanout->Gop.Frames = VirtualAlloc(NULL, RTMP_MAX_GOP_FRAMES * sizeof(RtmpGopFrame), MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+	Assert(Fanout->Gop.Frames);
+	Fanout->Gop.Capacity = Size;
+}
 
-		// C0
-		BE_PUT1(Ptr, 3); // version
-		// C1
-		BE_PUT4(Ptr, 0); // time
-		BE_PUT4(Ptr, 0); // always zero
-		ZeroMemory(Ptr, RTMP_HANDSHAKE_RANDOM_SIZE); // random bytes, can be zero too!
-		Ptr += RTMP_HANDSHAKE_RANDOM_SIZE;
+bool RTMP_FanoutVideoRef(RtmpFanout* Fanout, uint64_t DecodeTime, uint64_t PresentTime, uint64_t TimePeriod, const void* VideoData, uint32_t VideoSize, bool IsKeyFrame, bool IsDisposable, RtmpRelease_Callback* Release, void* ReleaseArg)
+{
+	uint32_t DecodeTimestamp = RTMP__GetTimestamp(DecodeTime, TimePeriod);
+	uint32_t PresentTimestamp = RTMP__GetTimestamp(PresentTime, TimePeriod);
+	uint32_t CompositionOffset = PresentTimestamp - DecodeTimestamp;
 
-		Assert(Ptr == Begin + HandshakeSize);
-		RB_EndWrite(&Stream->Send, HandshakeSize);
+	// GOP is cached once for all destinations, also while they are disconnected so it is up to date once reconnected
+	RtmpGopCache* Gop = Fanout->Gop.Capacity != 0 ? &Fanout->Gop : NULL;
+	if (Gop)
+	{
+		RTMP__CacheVideo(Gop, DecodeTimestamp, CompositionOffset, IsKeyFrame, VideoData, VideoSize);
 	}
 
-	// ---------------------------------------------------------------------------
-	// send C0+C1 handshake and start reading response
-
-	RTMP__BeginSend(Socket, Stream);
-	RTMP__BeginRecv(Socket, Stream);
-
-	HANDLE Events[] = { Stream->SendOv.hEvent, Stream->RecvOv.hEvent, Stream->DataEvent, Stream->StopEvent };
-	for (;;)
+	// slots are released in queue order of each destination, but slow destination can still hold old slot
+	// after faster ones have wrapped around, so skip slots that are in use instead of failing on them
+	RtmpShared* Shared = NULL;
+	for (uint32_t i = 0; i < RTMP_MAX_MESSAGES; i++)
 	{
-		DWORD Wait = WaitForMultipleObjects(ARRAYSIZE(Events), Events, FALSE, INFINITE);
-		if (Wait == WAIT_OBJECT_0)
-		{
-			RTMP__EndSend(Socket, Stream);
-			if (!RB_IsEmpty(&Stream->Send))
-			{
-				RTMP__BeginSend(Socket, Stream);
-			}
-		}
-		else if (Wait == WAIT_OBJECT_0 + 1)
+		RtmpShared* Slot = &Fanout->Shared[Fanout->SharedNext++ % RTMP_MAX_MESSAGES];
+		if (ReadAcquire(&Slot->Count) == 0)
 		{
-			RTMP__EndRecv(Socket, Stream);
-			RTMP__BeginRecv(Socket, Stream);
+			Shared = Slot;
+			break;
 		}
-		else if (Wait == WAIT_OBJECT_0 + 2)
+	}
+
+	if (!Shared)
+	{
+		// every slot is referenced by queued frames, frame is lost for every destination
+		for (uint32_t i = 0; i < Fanout->StreamCount; i++)
 		{
-			// no need to invoke BeginSend if sending operation is already in progress - it will automatically
-			// start sending any new data appended to send buffer once previous send finishes
-			if (!Stream->Sending && !RB_IsEmpty(&Stream->Send))
-			{
-				RTMP__BeginSend(Socket, Stream);
-			}
-			ResetEvent(Stream->DataEvent);
+			RtmpStream* Stream = Fanout->Streams[i];
+			RTMP__CountDrop(Stream, RTMP_PACKET_VIDEO, RTMP_DROP_REASON_FULL);
+			RTMP__LoseVideo(Stream, IsDisposable);
 		}
-		else if (Wait == WAIT_OBJECT_0 + 3)
+		return false;
+	}
+
+	// one extra reference held while queueing, so data is not released before all destinations have it
+	Shared->Release = Release;
+	Shared->ReleaseArg = ReleaseArg;
+	WriteRelease(&Shared->Count, 1);
+
+	uint32_t Queued = 0;
+	for (uint32_t i = 0; i < Fanout->StreamCount; i++)
+	{
+		InterlockedIncrement(&Shared->Count);
+		if (RTMP__SendVideo(Fanout->Streams[i], Gop, DecodeTimestamp, CompositionOffset, VideoData, VideoSize, IsKeyFrame, IsDisposable, &RTMP__ReleaseShared, Shared))
 		{
-			// quit requested
-			break;
+			Queued++;
 		}
 		else
 		{
-			Assert(false);
+			InterlockedDecrement(&Shared->Count);
 		}
 	}
 
-	// TODO: properly handle stop event by sending deleteStream()
-	// 
-	// RTMP_STATE_STREAM_DELETED
-	// 
-	// invoke RTMP deleteStream method
-	//{
-	//	uint8_t Message[1024];
-
-	//	uint8_t* Ptr = Message;
-	//	AMF_PUT_STRING(Ptr, "deleteStream"); // command name
-	//	AMF_PUT_NUMBER(Ptr, 4);         // transaction id
-	//	AMF_PUT_NULL(Ptr);              // user arguments
-	//	AMF_PUT_NUMBER(Ptr, OutStreamId);
-
-	//	uint32_t MessageSize = (uint32_t)(Ptr - Message);
-
-	//	uint8_t Packet[1024];
-	//	uint32_t PacketSize = RTMP_FullPacket(Packet, RTMP_CHANNEL_MISC, RTMP_PACKET_COMMAND_AMF0, 0, Message, MessageSize);
-	//}
-
-	closesocket(Socket);
+	if (Queued == 0)
+	{
+		// nobody references data, caller still owns it
+		WriteRelease(&Shared->Count, 0);
+		return false;
+	}
 
-	return 0;
+	RTMP__ReleaseShared(Shared);
+	return true;
 }
 
-void RTMP_Init(RtmpStream* Stream, const char* Url, const char* Key, uint32_t BufferSize)
+bool RTMP_FanoutAudio(RtmpFanout* Fanout, uint64_t Time, uint64_t TimePeriod, const void* AudioData, uint32_t AudioSize)
 {
-	WSADATA WsaData;
-	int Startup = WSAStartup(MAKEWORD(2, 2), &WsaData);
-	Assert(Startup == 0);
-
-	Stream->StopEvent = CreateEventW(NULL, FALSE, FALSE, NULL);
-	Assert(Stream->StopEvent);
-
-	Stream->DataEvent = CreateEventW(NULL, TRUE, FALSE, NULL);
-	Assert(Stream->DataEvent);
-
-	ZeroMemory(&Stream->RecvOv, sizeof(Stream->RecvOv));
-	Stream->RecvOv.hEvent = CreateEventW(NULL, TRUE, FALSE, NULL);
-	Assert(Stream->RecvOv.hEvent);
-
-	ZeroMemory(&Stream->SendOv, sizeof(Stream->SendOv));
-	Stream->SendOv.hEvent = CreateEventW(NULL, TRUE, FALSE, NULL);
-	Assert(Stream->SendOv.hEvent);
-
-	SYSTEM_INFO SysInfo;
-	GetSystemInfo(&SysInfo);
-
-	// receive buffer, we don't expect to receive much data
-	RB_Init(&Stream->Recv, SysInfo.dwAllocationGranularity);
-
-	// send buffer
-	BufferSize = CEIL_POW2(BufferSize, SysInfo.dwAllocationGranularity);
-	RB_Init(&Stream->Send, BufferSize);
-
-	StrCpyNA(Stream->StreamUrl, Url, ARRAYSIZE(Stream->StreamUrl));
-	StrCpyNA(Stream->StreamKey, Key, ARRAYSIZE(Stream->StreamKey));
-
-	InitializeSRWLock(&Stream->Lock);
-	Stream->TotalByteReceived = 0;
-	Stream->BytesReceived = 0;
-	Stream->WindowSize = 1 << 20; // what's the default value for window size? idk
-	Stream->ChunkSize = 128;
-	Stream->State = RTMP_STATE_NOT_CONNECTED;
-	Stream->Sending = false;
-	Stream->VideoTimestamp = 0;
-	Stream->AudioTimestamp = 0;
-	ZeroMemory(Stream->LastChunk, sizeof(Stream->LastChunk));
-
-	Stream->Thread = CreateThread(NULL, 0, &RTMP__Thread, Stream, 0, NULL);
-	Assert(Stream->Thread);
+	// audio packets are small, each destination gets its own copy
+	bool Queued = false;
+	for (uint32_t i = 0; i < Fanout->StreamCount; i++)
+	{
+		Queued |= RTMP_SendAudio(Fanout->Streams[i], Time, TimePeriod, AudioData, AudioSize);
+	}
+	return Queued;
 }
 
-void RTMP_Done(RtmpStream* Stream)
+bool RTMP_FanoutIsCongested(const RtmpFanout* Fanout)
 {
-	SetEvent(Stream->StopEvent);
-	WaitForSingleObject(Stream->Thread, INFINITE);
-	CloseHandle(Stream->Thread);
-
-	RB_Done(&Stream->Recv);
-	RB_Done(&Stream->Send);
-
-	CloseHandle(Stream->SendOv.hEvent);
-	CloseHandle(Stream->RecvOv.hEvent);
-	CloseHandle(Stream->DataEvent);
-	CloseHandle(Stream->StopEvent);
-
-	WSACleanup();
+	bool Congested = false;
+	for (uint32_t i = 0; i < Fanout->StreamCount; i++)
+	{
+		const RtmpStream* Stream = Fanout->Streams[i];
+		if (RTMP_IsStreaming(Stream))
+		{
+			if (!RTMP_IsCongested(Stream))
+			{
+				return false;
+			}
+			Congested = true;
+		}
+	}
+	return Congested;
 }
 
-bool RTMP_IsStreaming(const RtmpStream* Stream)
+static bool RTMP__MuxHasPacket(RtmpMuxTrack* Track)
 {
-	return Stream->State == RTMP_STATE_STREAM_READY;
+	// Read is written only by mux thread, Write is published by producer after packet is staged
+	return (uint32_t)ReadAcquire(&Track->Write) != (uint32_t)Track->Read;
 }
 
-bool RTMP_IsError(const RtmpStream* Stream)
+// gives packet to fan-out, runs only on mux thread so video is always sent from same thread
+static void RTMP__MuxSend(RtmpMux* Mux, RtmpMuxTrack* Track, uint64_t Now)
 {
-	return Stream->State == RTMP_STATE_ERROR;
-}
+	uint32_t Read = (uint32_t)Track->Read;
+	RtmpMuxPacket* Packet = &Track->Packets[Read % RTMP_MAX_MUX_PACKETS];
 
-void RTMP_SendConfig(RtmpStream* Stream, const RtmpVideoConfig* VideoConfig, const RtmpAudioConfig* AudioConfig)
-{
-	if (Stream->State != RTMP_STATE_STREAM_READY)
+	Track->LastTimestamp = Packet->Timestamp;
+	Track->HasTimestamp = true;
+
+	// packet can be staged after Now was taken for this processing round
+	LONG64 Wait = max((LONG64)Now - (LONG64)Packet->Arrival, 0);
+	InterlockedAddNoFence64(&Mux->WaitTotal, Wait);
+	if (Wait > ReadNoFence64(&Mux->WaitMax))
 	{
-		return;
+		WriteNoFence64(&Mux->WaitMax, Wait);
 	}
+	InterlockedIncrementNoFence(&Mux->WaitCount);
 
-	uint8_t Payload[1024];
-	uint32_t PayloadSize;
-
-	uint8_t* Ptr = Payload;
+	if (Track->IsVideo)
 	{
-		RTMP_DEBUG("Sending @setDataFrame data packet");
+		if (Packet->AfterGap)
+		{
+			// producer dropped frame because stage was full, frames after it cannot be decoded
+			Mux->SkipVideo = true;
+		}
 
-		AMF_PUT_STRING_STATIC(Ptr, "@setDataFrame");
-		AMF_PUT_STRING_STATIC(Ptr, "onMetaData");
-		AMF_OBJ_ARRAY(Ptr, 3 + (VideoConfig ? 5 : 0) + (AudioConfig ? 6 : 0));
-		AMF_PUT_STRING_DATA(Ptr, "duration"); AMF_PUT_NUMBER(Ptr, 0);
-		AMF_PUT_STRING_DATA(Ptr, "filesize"); AMF_PUT_NUMBER(Ptr, 0);
-		AMF_PUT_STRING_DATA(Ptr, "encoder");  AMF_PUT_STRING_STATIC(Ptr, "wstream");
-		if (VideoConfig)
+		if (Mux->SkipVideo && !Packet->IsKeyFrame)
 		{
-			AMF_PUT_STRING_DATA(Ptr, "videocodecid");  AMF_PUT_NUMBER(Ptr, 7); // AVC
-			AMF_PUT_STRING_DATA(Ptr, "videodatarate"); AMF_PUT_NUMBER(Ptr, VideoConfig->Bitrate);
-			AMF_PUT_STRING_DATA(Ptr, "framerate");     AMF_PUT_NUMBER(Ptr, VideoConfig->FrameRate);
-			AMF_PUT_STRING_DATA(Ptr, "width");         AMF_PUT_NUMBER(Ptr, VideoConfig->Width);
-			AMF_PUT_STRING_DATA(Ptr, "height");        AMF_PUT_NUMBER(Ptr, VideoConfig->Height);
+			RTMP_DEBUG("Dropped video frame after interleaving stage overflow");
+			Packet->Release(Packet->ReleaseArg);
 		}
-		if (AudioConfig)
+		else
 		{
-			AMF_PUT_STRING_DATA(Ptr, "audiocodecid");    AMF_PUT_NUMBER(Ptr, 10); // AAC
-			AMF_PUT_STRING_DATA(Ptr, "audiodatarate");   AMF_PUT_NUMBER(Ptr, AudioConfig->Bitrate);
-			AMF_PUT_STRING_DATA(Ptr, "audiosamplerate"); AMF_PUT_NUMBER(Ptr, AudioConfig->SampleRate);
-			AMF_PUT_STRING_DATA(Ptr, "audiosamplesize"); AMF_PUT_NUMBER(Ptr, 16);
-			AMF_PUT_STRING_DATA(Ptr, "audiochannels");   AMF_PUT_NUMBER(Ptr, AudioConfig->Channels);
-			AMF_PUT_STRING_DATA(Ptr, "stereo");          AMF_PUT_BOOL(Ptr, (AudioConfig->Channels == 2));
+			Mux->SkipVideo = false;
+			if (!RTMP_FanoutVideoRef(Mux->Fanout, Packet->DecodeTime, Packet->PresentTime, Packet->TimePeriod, Packet->Data, Packet->Size, Packet->IsKeyFrame, Packet->IsDisposable, Packet->Release, Packet->ReleaseArg))
+			{
+				RTMP_DEBUG("Dropped video frame");
+				Packet->Release(Packet->ReleaseArg);
+			}
 		}
-		AMF_OBJ_END(Ptr);
 	}
-	PayloadSize = (uint32_t)(Ptr - Payload);
-	bool ok = RTMP__WriteChunk(&Stream->Send, RTMP_CHANNEL_MISC, RTMP_PACKET_DATA_AMF0, Stream->StreamId, Payload, PayloadSize);
-	Assert(ok);
+	else
+	{
+		if (!RTMP_FanoutAudio(Mux->Fanout, Packet->DecodeTime, Packet->TimePeriod, Packet->Data, Packet->Size))
+		{
+			RTMP_DEBUG("Dropped audio packet");
+		}
+	}
+
+	// slot & its audio data can be reused by producer only once packet is sent
+	WriteRelease(&Track->Read, (LONG)(Read + 1));
+}
 
-	if (VideoConfig && 1 + 1 + 3 + VideoConfig->HeaderSize <= sizeof(Payload))
+// sends held packets in DTS order while they are ready, or all of them if Force is set
+// returns QPC time when first held packet must be sent even if other track has nothing, 0 if nothing is held
+static uint64_t RTMP__MuxProcess(RtmpMux* Mux, bool Force)
+{
+	LARGE_INTEGER Now;
+	QueryPerformanceCounter(&Now);
+
+	for (;;)
 	{
-		Ptr = Payload;
+		// one snapshot of both tracks per packet, so packet staged meanwhile cannot jump ahead of decision
+		bool HasVideo = RTMP__MuxHasPacket(&Mux->Video);
+		bool HasAudio = RTMP__MuxHasPacket(&Mux->Audio);
+		if (!HasVideo && !HasAudio)
 		{
-			RTMP_DEBUG("Sending video config packet");
+			return 0;
+		}
 
-			uint8_t CodecByte = (1 << 4) | 7;
-			BE_PUT1(Ptr, CodecByte); // AVC codec
-			BE_PUT1(Ptr, 0);         // AVC packet type
-			BE_PUT3(Ptr, 0);         // composition time
-			CopyMemory(Ptr, VideoConfig->Header, VideoConfig->HeaderSize);
-			Ptr += VideoConfig->HeaderSize;
+		const RtmpMuxPacket* Video = &Mux->Video.Packets[(uint32_t)Mux->Video.Read % RTMP_MAX_MUX_PACKETS];
+		const RtmpMuxPacket* Audio = &Mux->Audio.Packets[(uint32_t)Mux->Audio.Read % RTMP_MAX_MUX_PACKETS];
+
+		// track which has packet with earliest DTS
+		bool IsVideo = HasVideo && (!HasAudio || (int32_t)(Video->Timestamp - Audio->Timestamp) <= 0);
+		RtmpMuxTrack* Track = IsVideo ? &Mux->Video : &Mux->Audio;
+		RtmpMuxTrack* Other = IsVideo ? &Mux->Audio : &Mux->Video;
+		const RtmpMuxPacket* Packet = IsVideo ? Video : Audio;
+		uint64_t Deadline = Packet->Arrival + Mux->MaxWait;
+
+		// packet is ready when other track cannot produce anything earlier anymore - either it has packet held
+		// or its clock is already past this one, otherwise wait for it until deadline
+		bool Ready = Force
+			|| (IsVideo ? HasAudio : HasVideo)
+			|| (Other->HasTimestamp && (int32_t)(Packet->Timestamp - Other->LastTimestamp) <= 0)
+			|| (uint64_t)Now.QuadPart >= Deadline;
+		if (!Ready)
+		{
+			return Deadline;
 		}
-		PayloadSize = (uint32_t)(Ptr - Payload);
-		ok = RTMP__WriteChunk(&Stream->Send, RTMP_CHANNEL_VIDEO, RTMP_PACKET_VIDEO, Stream->StreamId, Payload, PayloadSize);
-		Assert(ok);
+
+		RTMP__MuxSend(Mux, Track, Now.QuadPart);
 	}
+}
+
+static DWORD WINAPI RTMP__MuxThread(LPVOID Arg)
+{
+	RtmpMux* Mux = Arg;
 
-	if (AudioConfig && 1 + 1 + AudioConfig->HeaderSize <= sizeof(Payload))
+	HANDLE Events[] = { Mux->StopEvent, Mux->DataEvent, Mux->Timer };
+	for (;;)
 	{
-		Ptr = Payload;
+		uint64_t Deadline = RTMP__MuxProcess(Mux, false);
+		if (Deadline != 0)
 		{
-			RTMP_DEBUG("Sending audio config packet");
+			LARGE_INTEGER Now;
+			QueryPerformanceCounter(&Now);
+			uint64_t Wait = Deadline > (uint64_t)Now.QuadPart ? Deadline - Now.QuadPart : 0;
+
+			// negative due time is relative, in 100nsec units
+			LARGE_INTEGER DueTime = { .QuadPart = -(LONGLONG)(Wait * 10000000 / Mux->Frequency) - 1 };
+			BOOL Ok = SetWaitableTimer(Mux->Timer, &DueTime, 0, NULL, NULL, FALSE);
+			Assert(Ok);
+		}
 
-			uint8_t CodecByte = (10 << 4) | (3 << 2) | (1 << 1) | 1;
-			BE_PUT1(Ptr, CodecByte); // AAC codec
-			BE_PUT1(Ptr, 0);         // AAC packet type
-			CopyMemory(Ptr, AudioConfig->Header, AudioConfig->HeaderSize);
-			Ptr += AudioConfig->HeaderSize;
+		DWORD Wait = WaitForMultipleObjects(ARRAYSIZE(Events), Events, FALSE, INFINITE);
+		if (Wait == WAIT_OBJECT_0)
+		{
+			break;
 		}
-		PayloadSize = (uint32_t)(Ptr - Payload);
-		ok = RTMP__WriteChunk(&Stream->Send, RTMP_CHANNEL_AUDIO, RTMP_PACKET_AUDIO, Stream->StreamId, Payload, PayloadSize);
-		Assert(ok);
+		Assert(Wait == WAIT_OBJECT_0 + 1 || Wait == WAIT_OBJECT_0 + 2);
 	}
 
-	SetEvent(Stream->DataEvent);
+	// producers have stopped, send everything that is still held
+	RTMP__MuxProcess(Mux, true);
+	return 0;
 }
 
-bool RTMP_SendVideo(RtmpStream* Stream, uint64_t DecodeTime, uint64_t PresentTime, uint64_t TimePeriod, const void* VideoData, uint32_t VideoSize, bool IsKeyFrame)
+// reserves slot for new packet at end of track, call with track lock held
+// returns NULL if track is full, packet is dropped then and next staged one is marked
+static RtmpMuxPacket* RTMP__MuxPush(RtmpMuxTrack* Track, uint64_t DecodeTime, uint64_t TimePeriod)
 {
-	if (Stream->State != RTMP_STATE_STREAM_READY)
+	uint32_t Write = (uint32_t)Track->Write;
+	if (Write - (uint32_t)ReadAcquire(&Track->Read) == RTMP_MAX_MUX_PACKETS)
 	{
-		return false;
+		// mux thread is not keeping up, producer never waits for it
+		Track->Gap = true;
+		return NULL;
 	}
 
-	uint64_t DecodeTimestamp = DecodeTime * 1000 / TimePeriod;
-	uint64_t PresentTimestamp = PresentTime * 1000 / TimePeriod;
-	uint32_t CompositionOffset = (uint32_t)(PresentTimestamp - DecodeTimestamp);
-	uint32_t Delta = (uint32_t)(DecodeTimestamp - Stream->VideoTimestamp);
+	LARGE_INTEGER Now;
+	QueryPerformanceCounter(&Now);
+
+	RtmpMuxPacket* Packet = &Track->Packets[Write % RTMP_MAX_MUX_PACKETS];
+	Packet->DecodeTime = DecodeTime;
+	Packet->TimePeriod = TimePeriod;
+	Packet->Arrival = Now.QuadPart;
+	Packet->Timestamp = RTMP__GetTimestamp(DecodeTime, TimePeriod);
+	Packet->AfterGap = Track->Gap;
+	Track->Gap = false;
+	return Packet;
+}
 
-	uint8_t CodecByte = ((IsKeyFrame ? 1 : 2) << 4) | 7;
+// makes staged packet visible to mux thread
+static void RTMP__MuxCommit(RtmpMux* Mux, RtmpMuxTrack* Track)
+{
+	WriteRelease(&Track->Write, (LONG)((uint32_t)Track->Write + 1));
+	SetEvent(Mux->DataEvent);
+}
 
-	uint8_t Extra[1+1+3];
-	uint8_t* Ptr = Extra;
+void RTMP_MuxInit(RtmpMux* Mux, RtmpFanout* Fanout, uint32_t MaxWaitMilliseconds)
+{
+	LARGE_INTEGER Frequency;
+	QueryPerformanceFrequency(&Frequency);
+
+	Mux->Fanout = Fanout;
+	Mux->Video = (RtmpMuxTrack){ .IsVideo = true };
+	Mux->Audio = (RtmpMuxTrack){ .IsVideo = false };
+	InitializeSRWLock(&Mux->Video.Lock);
+	InitializeSRWLock(&Mux->Audio.Lock);
+	Mux->Frequency = Frequency.QuadPart;
+	Mux->MaxWait = MaxWaitMilliseconds * Mux->Frequency / 1000;
+	Mux->SkipVideo = false;
+	Mux->WaitTotal = 0;
+	Mux->WaitMax = 0;
+	Mux->WaitCount = 0;
+
+	Mux->AudioBuffer = VirtualAlloc(NULL, RTMP_MAX_MUX_PACKETS * RTMP_MAX_MUX_AUDIO, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+	Assert(Mux->AudioBuffer);
+
+	Mux->StopEvent = CreateEventW(NULL, TRUE, FALSE, NULL);
+	Assert(Mux->StopEvent);
+
+	Mux->DataEvent = CreateEventW(NULL, FALSE, FALSE, NULL);
+	Assert(Mux->DataEvent);
+
+	Mux->Timer = CreateWaitableTimerExW(NULL, NULL, CREATE_WAITABLE_TIMER_HIGH_RESOLUTION, TIMER_ALL_ACCESS);
+	Assert(Mux->Timer);
+
+	Mux->Thread = CreateThread(NULL, 0, &RTMP__MuxThread, Mux, 0, NULL);
+	Assert(Mux->Thread);
+}
 
-	BE_PUT1(Ptr, CodecByte);         // AVC codec
-	BE_PUT1(Ptr, 1);                 // AVC packet type
-	BE_PUT3(Ptr, CompositionOffset);
+void RTMP_MuxDone(RtmpMux* Mux)
+{
+	// thread sends all held packets before it exits
+	SetEvent(Mux->StopEvent);
+	WaitForSingleObject(Mux->Thread, INFINITE);
+	CloseHandle(Mux->Thread);
 
-	Assert(Ptr == Extra + sizeof(Extra));
-	if (RTMP__SendDeltaChunk(Stream, RTMP_CHANNEL_VIDEO, Delta, RTMP_PACKET_VIDEO, Extra, sizeof(Extra), VideoData, VideoSize))
-	{
-		Stream->VideoTimestamp = PresentTimestamp;
-		return true;
-	}
+	CloseHandle(Mux->Timer);
+	CloseHandle(Mux->DataEvent);
+	CloseHandle(Mux->StopEvent);
 
-	return false;
+	VirtualFree(Mux->AudioBuffer, 0, MEM_RELEASE);
 }
 
-bool RTMP_SendAudio(RtmpStream* Stream, uint64_t Time, uint64_t TimePeriod, const void* AudioData, uint32_t AudioSize)
+void RTMP_MuxVideoRef(RtmpMux* Mux, uint64_t DecodeTime, uint64_t PresentTime, uint64_t TimePeriod, const void* VideoData, uint32_t VideoSize, bool IsKeyFrame, bool IsDisposable, RtmpRelease_Callback* Release, void* ReleaseArg)
 {
-	if (Stream->State != RTMP_STATE_STREAM_READY)
+	Assert(Release);
+
+	RtmpMuxTrack* Track = &Mux->Video;
+	AcquireSRWLockExclusive(&Track->Lock);
+
+	RtmpMuxPacket* Packet = RTMP__MuxPush(Track, DecodeTime, TimePeriod);
+	if (Packet)
 	{
-		return false;
+		Packet->PresentTime = PresentTime;
+		Packet->Size = VideoSize;
+		Packet->Data = VideoData;
+		Packet->IsKeyFrame = IsKeyFrame;
+		Packet->IsDisposable = IsDisposable;
+		Packet->Release = Release;
+		Packet->ReleaseArg = ReleaseArg;
+		RTMP__MuxCommit(Mux, Track);
 	}
 
-	uint64_t Timestamp = Time * 1000 / TimePeriod;
-	uint32_t Delta = (uint32_t)(Timestamp - Stream->AudioTimestamp);
+	ReleaseSRWLockExclusive(&Track->Lock);
+
+	if (!Packet)
+	{
+		RTMP_DEBUG("Dropped video frame, interleaving stage is full");
+		Release(ReleaseArg);
+	}
+}
 
-	uint8_t CodecByte = (10 << 4) | (3 << 2) | (1 << 1) | 1;
-	uint8_t Extra[1+1];
-	uint8_t* Ptr = Extra;
+void RTMP_MuxAudio(RtmpMux* Mux, uint64_t Time, uint64_t TimePeriod, const void* AudioData, uint32_t AudioSize)
+{
+	if (AudioSize > RTMP_MAX_MUX_AUDIO)
+	{
+		RTMP_DEBUG("Dropped audio packet with %u bytes, too large for interleaving stage", AudioSize);
+		return;
+	}
 
-	BE_PUT1(Ptr, CodecByte); // AAC codec
-	BE_PUT1(Ptr, 1);         // AAC packet type
+	RtmpMuxTrack* Track = &Mux->Audio;
+	AcquireSRWLockExclusive(&Track->Lock);
 
-	Assert(Ptr == Extra + sizeof(Extra));
-	if (RTMP__SendDeltaChunk(Stream, RTMP_CHANNEL_AUDIO, Delta, RTMP_PACKET_AUDIO, Extra, sizeof(Extra), AudioData, AudioSize))
+	uint32_t Index = (uint32_t)Track->Write % RTMP_MAX_MUX_PACKETS;
+	RtmpMuxPacket* Packet = RTMP__MuxPush(Track, Time, TimePeriod);
+	if (Packet)
 	{
-		Stream->AudioTimestamp = Timestamp;
-		return true;
+		Assert(Packet == &Track->Packets[Index]);
+
+		uint8_t* Data = Mux->AudioBuffer + Index * RTMP_MAX_MUX_AUDIO;
+		CopyMemory(Data, AudioData, AudioSize);
+		Packet->PresentTime = Time;
+		Packet->Size = AudioSize;
+		Packet->Data = Data;
+		Packet->IsKeyFrame = false;
+		Packet->IsDisposable = false;
+		Packet->Release = NULL;
+		Packet->ReleaseArg = NULL;
+		RTMP__MuxCommit(Mux, Track);
+	}
+	else
+	{
+		RTMP_DEBUG("Dropped audio packet, interleaving stage is full");
 	}
 
-	return false;
+	ReleaseSRWLockExclusive(&Track->Lock);
+}
+
+void RTMP_MuxGetLatency(RtmpMux* Mux, uint32_t* Average, uint32_t* Max)
+{
+	// counters are reset one by one, packet sent meanwhile may be counted in either period
+	uint64_t Total = (uint64_t)InterlockedExchange64(&Mux->WaitTotal, 0);
+	uint64_t WaitMax = (uint64_t)InterlockedExchange64(&Mux->WaitMax, 0);
+	uint32_t Count = (uint32_t)InterlockedExchange(&Mux->WaitCount, 0);
+
+	*Average = Count ? (uint32_t)(Total * 1000000 / Mux->Frequency / Count) : 0;
+	*Max = (uint32_t)(WaitMax * 1000000 / Mux->Frequency);
 }
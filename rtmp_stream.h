@@ -1,7 +1,13 @@
 #pragma once
 
+#ifdef _WIN32
 #include <windows.h>
 #include <wininet.h>
+#define SECURITY_WIN32
+#include <security.h>
+#else
+#include "rtmp_posix.h"
+#endif
 
 #include <stdint.h>
 #include <stddef.h>
@@ -10,6 +16,35 @@
 #define RTMP_MAX_URL_LENGTH 256
 #define RTMP_MAX_KEY_LENGTH 256
 
+#define RTMP_MAX_MESSAGES 1024 // how many messages can be queued in outgoing buffer, must be pow2
+#define RTMP_MAX_SEND_HEADERS 1024 // space for chunk headers generated for one socket send call
+#define RTMP_MAX_SEND_BUFFERS 64 // max buffers passed to one socket send call
+#define RTMP_MAX_SENDS 4 // max socket sends in progress at same time
+#define RTMP_MAX_GOP_FRAMES 1024 // max video frames kept for replaying after reconnect
+#define RTMP_MAX_CONFIG_HEADER 1024 // max size of codec config header
+#define RTMP_MAX_DESTINATIONS 8 // max streams in one fan-out
+#define RTMP_MAX_RECV_STREAMS 16 // incoming chunk streams tracked at same time
+#define RTMP_MAX_RECV_MESSAGE (16 * 1024) // incoming messages larger than this are skipped
+#define RTMP_DELAY_BUCKETS 16 // queue delay histogram, bucket N counts delays below 2^N msec, last one everything above
+
+// tracks & reasons for per-track statistics
+#define RTMP_TRACK_VIDEO 0
+#define RTMP_TRACK_AUDIO 1
+#define RTMP_TRACK_COUNT 2
+
+#define RTMP_DROP_REASON_NOT_READY 0 // no config sent on current connection
+#define RTMP_DROP_REASON_POLICY    1 // video drop policy, outgoing buffer getting full or frame depends on dropped one
+#define RTMP_DROP_REASON_FULL      2 // no space in outgoing buffer
+#define RTMP_DROP_REASON_EXPIRED   3 // evicted from queue because of max queue latency, or depends on evicted frame
+#define RTMP_DROP_REASON_SESSION   4 // queued for connection that was lost before it was sent
+#define RTMP_DROP_REASON_COUNT     5
+
+#define RTMP_MAX_MUX_PACKETS 64 // packets held per track by interleaving stage
+#define RTMP_MAX_MUX_AUDIO 2048 // max size of audio packet copied into interleaving stage
+#define RTMP_MAX_RING_STREAMS 1024 // max sessions on one io_uring engine, each uses 2 registered buffers
+
+typedef void RtmpRelease_Callback(void* Arg);
+
 typedef struct {
 	uint8_t* Buffer;
 	size_t Size;
@@ -17,75 +52,526 @@ typedef struct {
 	size_t Write;
 } RtmpRingBuffer;
 
+// state of incoming chunk stream, message split into multiple chunks is assembled in its own buffer
 typedef struct {
+	uint32_t ChunkStreamId; // 0 when not used
+	uint32_t LastUse;
 	uint32_t Timestamp;
+	uint32_t TimestampDelta;
 	uint32_t MessageLength;
 	uint32_t MessageType;
 	uint32_t MessageStreamId;
+	uint32_t Received;      // bytes of current message received, 0 means next chunk starts new message
+	bool IsExtended;        // last header had extended timestamp, so fmt=3 chunks have it too
 } RtmpChunk;
 
+// queued outgoing message, chunk headers are generated only when message is given to socket
+// payload consists of Size bytes from Send ring buffer, followed by DataSize bytes of Data
+typedef struct {
+	volatile LONG Sequence; // used to know when message is committed by producer
+	uint32_t Offset;        // position in Send ring buffer
+	uint32_t Size;          // bytes stored in Send ring buffer
+	uint32_t DataSize;
+	const uint8_t* Data;    // caller-owned, not copied, released by Release callback when sent
+	LONG Session;           // connection for which message was queued, messages for older connections are not sent
+	uint32_t ChunkStreamId; // 0 means raw bytes without chunk header (handshake)
+	uint32_t ChunkFormat;   // 0 or 1 for first chunk, fmt=1 delta is calculated from previously sent message
+	uint32_t Timestamp;     // milliseconds
+	uint32_t MessageType;
+	uint32_t MessageStreamId;
+	bool IsKeyFrame;
+	bool IsSent;            // sent out of order or evicted, skipped when reached in queue
+	bool IsPadding;         // bandwidth probe data, skipped when reached in queue after probe has finished
+	uint64_t Time;          // QPC value when message was queued
+	RtmpRelease_Callback* Release;
+	void* ReleaseArg;
+} RtmpMessage;
+
+// socket send in progress
+typedef struct {
+#ifdef _WIN32
+	OVERLAPPED Ov;
+#else
+	struct iovec Buffers[RTMP_MAX_SEND_BUFFERS]; // nonblocking socket takes them in pieces, sends are written in order
+	uint32_t BufferCount;
+	uint32_t BufferIndex; // first buffer not yet fully written
+	struct msghdr Message; // io_uring sendmsg arguments, stay valid until send completes
+#endif
+	uint32_t Size;       // bytes given to socket
+	uint32_t MessageEnd; // messages before this are fully sent once this send finishes
+	uint8_t Headers[RTMP_MAX_SEND_HEADERS];
+	uint8_t* Records;    // encrypted TLS records when using rtmps
+} RtmpSend;
+
+// video codecs, everything except AVC is sent with Enhanced RTMP extended video tag header
+#define RTMP_VIDEO_CODEC_AVC  0
+#define RTMP_VIDEO_CODEC_HEVC 1
+#define RTMP_VIDEO_CODEC_AV1  2
+
+typedef struct {
+	uint32_t Codec;     // RTMP_VIDEO_CODEC_*, default is AVC
+	uint32_t Width;
+	uint32_t Height;
+	uint32_t FrameRate;
+	uint32_t Bitrate;   // kbit/s
+	// AVC:  AVCDecoderConfigurationRecord from ISO 14496-15 spec
+	// HEVC: HEVCDecoderConfigurationRecord from ISO 14496-15 spec
+	// AV1:  AV1CodecConfigurationRecord from AV1 ISOBMFF spec
+	const void* Header;
+	size_t HeaderSize;
+} RtmpVideoConfig;
+
+// audio codecs, Opus is sent with Enhanced RTMP extended audio tag header
+#define RTMP_AUDIO_CODEC_AAC  0
+#define RTMP_AUDIO_CODEC_OPUS 1
+
+typedef struct {
+	uint32_t Codec;      // RTMP_AUDIO_CODEC_*, default is AAC
+	uint32_t SampleRate; // Hz, for Opus always 48000
+	uint32_t Bitrate;    // kbit/s
+	uint32_t Channels;   // 1 or 2
+	// AAC:  AudioSpecificConfig from ISO/IEC 14496-3 spec
+	// Opus: OpusHead identification header from RFC 7845
+	const void* Header;
+	size_t HeaderSize;
+} RtmpAudioConfig;
+
+// video frame kept in GOP cache, payload is in cache Buffer
+typedef struct {
+	uint32_t Offset;
+	uint32_t Size;
+	uint32_t Timestamp;
+	uint32_t CompositionOffset;
+	bool IsKeyFrame;
+} RtmpGopFrame;
+
+// most recent GOP, copied once & replayed to every destination that reconnects
+typedef struct {
+	uint8_t* Buffer;
+	uint32_t Capacity;     // 0 when cache is not enabled
+	uint32_t Size;
+	uint32_t Count;
+	bool Valid;            // false when GOP did not fit into cache
+	RtmpGopFrame* Frames;  // RTMP_MAX_GOP_FRAMES entries
+} RtmpGopCache;
+
+// counters are updated with relaxed atomics, producers & network thread never wait on them
+typedef struct {
+	volatile LONG64 EnqueuedBytes;   // written by producers
+	volatile LONG64 EnqueuedMessages;
+	volatile LONG64 SentBytes;       // written only by network thread, counted when given to socket
+	volatile LONG64 SentMessages;
+	volatile LONG64 Dropped[RTMP_DROP_REASON_COUNT]; // NOT_READY, POLICY & FULL by producers, rest by network thread
+} RtmpTrackCounters;
+
 typedef struct {
 	HANDLE Thread;
 	HANDLE StopEvent;
 	HANDLE DataEvent;
 
 	RtmpRingBuffer Recv;
-	RtmpRingBuffer Send;
+	RtmpRingBuffer Send; // Write member is not used, write position is part of SendReserve
+
+	RtmpMessage* Messages;
+	volatile LONG64 SendReserve; // next message index & Send ring buffer position for producers
+	uint32_t MessageRead;  // first message not yet released, sending it may be in progress
+	uint32_t MessageSend;  // first message not yet fully given to socket
+	uint32_t MessageSent;  // payload bytes of MessageSend message already given to socket
+	uint32_t SendTimestamp[64]; // last timestamp sent on each chunk stream
+	uint32_t SendExtended[64];  // extended timestamp of last fmt=0/1 header on each chunk stream, repeated in its fmt=3 chunks, 0 if not used
+	bool SendHasTimestamp[64];  // chunk stream has sent message on this connection, first fmt=1 delta is from zero
+	uint32_t SendChunkSize;     // outgoing chunk size, changes when SetChunkSize message is sent
+	volatile LONG64 MaxQueueLatency; // in QPC units, 0 means no limit, can be changed from any thread
+	uint64_t Frequency;         // QPC frequency
+	bool SkipVideo;             // evicting video frames until next keyframe
+	uint32_t VideoDrop;         // drop policy state for new video frames, used only by RTMP_SendVideo caller
+	volatile LONG VideoDropped; // video frames dropped by drop policy or evicted from queue
+
+	RtmpSend Sends[RTMP_MAX_SENDS]; // first send overlapped event is used also for resolving & connecting
+	uint32_t SendFirst;  // oldest send in progress
+	uint32_t SendActive; // how many sends are in progress
+	volatile LONG SendLimit; // how many sends are allowed to be in progress, can be changed from any thread
+	volatile LONG ZeroCopy;  // socket has no send buffer, read when connecting
+
+	// token bucket pacer between send queue & socket
+	HANDLE PaceTimer;
+	volatile LONG64 PaceRate; // bytes per second, 0 means no pacing, can be changed from any thread
+	volatile LONG PaceBurst;  // max bytes sent at once after idle period, can be changed from any thread
+	int64_t PaceTokens;    // bytes allowed to send, multiplied by QPC frequency
+	uint64_t PaceTime;     // QPC value of last token refill
+	uint64_t PaceBlocked;  // QPC value when pacer started to hold back data
+	volatile LONG PaceDelay; // msec how long pacer held back data last time
+	volatile LONG Probing;   // bandwidth probe in progress, pacer does not limit sending
+	bool PaceWaiting;
+	uint32_t PeerBandwidth; // from SetPeerBandwidth message, limits pacer burst size
+	uint32_t PeerLimit;     // limit type of PeerBandwidth
 
+	// coalescing of small media messages into fewer wakeups & socket sends
+	HANDLE CoalesceTimer;
+	volatile LONG CoalesceSize;  // bytes queued that wake up network thread, 0 means no coalescing, can be changed from any thread
+	volatile LONG CoalesceDelay; // max usec first queued message waits for wakeup
+	volatile LONG CoalescePending; // bytes queued since last flush
+	uint32_t MessageFlush;  // messages before this are allowed to be sent
+
+	volatile LONG64 SendCalls; // socket send calls, written only by network thread
+	volatile LONG64 Wakeups;   // network thread wakeups
+	uint64_t RateTime;         // for RTMP_GetSendRates
+	uint64_t RateSendCalls;
+	uint64_t RateWakeups;
+
+	// statistics since RTMP_Init, see RTMP_GetStats
+	RtmpTrackCounters Tracks[RTMP_TRACK_COUNT];
+	volatile LONG SendHighWater;  // max bytes used in Send ring buffer
+	volatile LONG64 DelayHistogram[RTMP_DELAY_BUCKETS]; // msec media messages waited in queue, written only by network thread
+	volatile LONG64 BlockedTime;  // QPC units all sends were in progress while more data was waiting
+	uint64_t BlockedStart;        // QPC value when sends got blocked
+	bool Blocked;
+
+	// network estimation, updated periodically by network thread
+	HANDLE StatsTimer;
+	uint64_t StatsTime;      // QPC value of last update
+	uint64_t StatsDelivered; // bytes acknowledged by TCP at last update
+	uint64_t TotalBytesSent; // bytes given to socket on this connection
+	uint32_t AckBytes;       // bytes received by server from last Acknowledgement message, 0 if none received yet
+	volatile LONG PingRtt;   // msec
+	volatile LONG TcpRtt;    // usec
+	volatile LONG TcpCwnd;   // bytes
+	volatile LONG InFlight;  // bytes sent but not yet acknowledged
+	volatile LONG Bandwidth; // smoothed estimate, bytes per second
+
+#ifdef _WIN32
 	OVERLAPPED RecvOv;
-	OVERLAPPED SendOv;
+#else
+	int Epoll;            // socket & all events of network thread
+	bool Writable;        // socket took everything written so far, otherwise waiting for EPOLLOUT
+
+	// session running on shared io_uring engine instead of own epoll loop
+	struct RtmpRing* Ring; // NULL when network thread runs session itself
+	HANDLE RingDone;       // signaled by ring thread once session has ended & no operation uses socket or buffers
+	SOCKET RingSocket;
+	uint32_t RingSlot;     // index in ring, registered buffers 2*RingSlot & 2*RingSlot+1 are Send & Recv ring buffers
+	uint32_t RingArmed;    // bit for each operation submitted to ring & not yet completed
+	uint32_t RingSending;  // sends from SendFirst submitted as one linked chain, next chain starts when it is done
+	bool RingFixed;        // ring buffers are registered, recv & single buffer sends use them
+	bool RingEnding;       // operations are being cancelled
+	uint64_t RingValues[4]; // counters read from events & timers
+#endif
+
+	void* Addresses;      // cached ADDRINFOEXW or addrinfo list of resolved addresses
+	uint64_t AddressTime; // QPC value when addresses were resolved
+	uint64_t StartTime;   // QPC value when connecting started
+	volatile LONG ResolveTime;   // msec from start until address is resolved
+	volatile LONG ConnectTime;   // msec from start until socket is connected
+	volatile LONG HandshakeTime; // msec from start until RTMP handshake is done
+	volatile LONG PublishTime;   // msec from start until stream is ready to accept media
+
+	// reconnecting
+	volatile LONG Session;       // incremented on every disconnect
+	volatile LONG ReconnectAttempts; // every attempt after first one, also ones that failed to resolve, connect or handshake
+	volatile LONG ConfigSession; // session in which config was queued, media is accepted only in same session, set only by network thread
+	volatile LONG HasConfig;     // config copy below is written once by RTMP_SendConfig, then handed to network thread
+	bool Disconnect;             // connection failed, network thread will reconnect
+	bool Receiving;              // socket recv in progress
+	bool HasVideoConfig;
+	bool HasAudioConfig;
+	RtmpVideoConfig VideoConfig; // copy of config, sent again after reconnect
+	RtmpAudioConfig AudioConfig;
+	uint8_t VideoHeader[RTMP_MAX_CONFIG_HEADER];
+	uint8_t AudioHeader[RTMP_MAX_CONFIG_HEADER];
+
+	LONG ReplaySession;          // session for which GOP was already replayed, used only by RTMP_SendVideo caller
+
+	// TLS state when using rtmps
+	bool Tls;
+#ifdef _WIN32
+	CredHandle TlsCredentials;
+	CtxtHandle TlsContext;
+	SecPkgContext_StreamSizes TlsSizes;
+	uint8_t* TlsRecv;     // received ciphertext not yet decrypted
+	uint32_t TlsRecvSize;
+#endif
 
-	SRWLOCK Lock;
 	uint64_t TotalByteReceived;
 	uint32_t BytesReceived;
 	uint32_t WindowSize;
 	uint32_t ChunkSize;
 	uint32_t StreamId;
 	uint32_t State;
-	bool Sending;
 
-	RtmpChunk LastChunk[64];
-
-	uint64_t VideoTimestamp;
-	uint64_t AudioTimestamp;
+	RtmpChunk RecvChunks[RTMP_MAX_RECV_STREAMS];
+	RtmpChunk* RecvChunk;   // chunk stream which payload is being received
+	uint32_t RecvRemaining; // payload bytes left in current chunk
+	uint32_t RecvUse;
+	uint8_t* RecvMessages;  // RTMP_MAX_RECV_MESSAGE bytes for each chunk stream
 
 	char StreamUrl[RTMP_MAX_URL_LENGTH];
 	char StreamKey[RTMP_MAX_KEY_LENGTH];
-	URL_COMPONENTSW UrlComponents;
+	char StreamApp[RTMP_MAX_URL_LENGTH]; // url path without leading '/', sent as app name in connect()
 } RtmpStream;
 
-// only H264/AVC codec supported
+// referenced frame shared by multiple streams, released when last stream is done with it
 typedef struct {
-	uint32_t Width;
-	uint32_t Height;
-	uint32_t FrameRate;
-	uint32_t Bitrate;   // kbit/s
-	// AVCDecoderConfigurationRecord from ISO 14496-15 spec
-	const void* Header;
-	size_t HeaderSize;
-} RtmpVideoConfig;
+	volatile LONG Count;
+	RtmpRelease_Callback* Release;
+	void* ReleaseArg;
+} RtmpShared;
 
-// only AAC codec supported
 typedef struct {
-	uint32_t SampleRate; // Hz
-	uint32_t Bitrate;    // kbit/s
-	uint32_t Channels;   // 1 or 2
-	// AudioSpecificConfig from ISO/IEC 14496-3 spec
-	const void* Header;
-	size_t HeaderSize;
-} RtmpAudioConfig;
+	RtmpStream* Streams[RTMP_MAX_DESTINATIONS];
+	uint32_t StreamCount;
+	RtmpShared* Shared; // RTMP_MAX_MESSAGES entries, taken in round-robin order skipping ones still in use
+	uint32_t SharedNext;
+	RtmpGopCache Gop;
+} RtmpFanout;
+
+// packet held by interleaving stage until it can be sent in DTS order
+typedef struct {
+	uint64_t DecodeTime;
+	uint64_t PresentTime;
+	uint64_t TimePeriod;
+	uint64_t Arrival;      // QPC value when packet entered stage
+	uint32_t Timestamp;    // DTS in msec, used for ordering
+	uint32_t Size;
+	const uint8_t* Data;   // video data owned by caller, audio data is copy in AudioBuffer
+	bool IsKeyFrame;
+	bool IsDisposable;
+	bool AfterGap;         // packet before it was dropped because stage was full
+	RtmpRelease_Callback* Release;
+	void* ReleaseArg;
+} RtmpMuxPacket;
+
+// single consumer queue, producers of same track are serialized by Lock, mux thread never takes it
+typedef struct {
+	RtmpMuxPacket Packets[RTMP_MAX_MUX_PACKETS];
+	volatile LONG Read;     // advanced by mux thread once packet is sent
+	volatile LONG Write;    // advanced by producer once packet is staged
+	SRWLOCK Lock;
+	bool Gap;               // producer dropped packet, next staged one is marked
+	uint32_t LastTimestamp; // DTS of last packet taken from stage, packets before it are not expected anymore, used only by mux thread
+	bool HasTimestamp;
+	bool IsVideo;
+} RtmpMuxTrack;
+
+typedef struct {
+	HANDLE Thread;
+	HANDLE StopEvent;
+	HANDLE DataEvent;     // new packet staged
+	HANDLE Timer;         // deadline of earliest held packet
+	RtmpFanout* Fanout;
+	RtmpMuxTrack Video;
+	RtmpMuxTrack Audio;
+	uint8_t* AudioBuffer; // RTMP_MAX_MUX_PACKETS * RTMP_MAX_MUX_AUDIO bytes
+	uint64_t MaxWait;     // in QPC units
+	uint64_t Frequency;
+	bool SkipVideo;       // dropping video until next keyframe after stage overflow, used only by mux thread
+
+	// added latency since last RTMP_MuxGetLatency call
+	volatile LONG64 WaitTotal;
+	volatile LONG64 WaitMax;
+	volatile LONG WaitCount;
+} RtmpMux;
+
+#ifndef _WIN32
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+// io_uring engine that runs network sessions of many streams on one thread, Linux only
+// network thread of each stream still resolves & connects, then hands socket over to ring thread
+typedef struct RtmpRing {
+	HANDLE Thread;
+	HANDLE ReadyEvent;    // ring thread has set up io_uring
+	HANDLE WakeEvent;     // new session handed over or ring is stopping
+	SRWLOCK Lock;         // protects Pending
+	RtmpStream** Pending; // sessions handed over & not yet started by ring thread
+	uint32_t PendingCount;
+	RtmpStream** Streams; // MaxStreams entries indexed by RingSlot, NULL for free slot, used only by ring thread
+	uint32_t MaxStreams;
+	uint32_t Active;      // sessions handed over & running on ring, protected by Lock
+	bool Stop;
+	bool PollEvents;      // kernel does not wait for nonblocking eventfd & timerfd reads, they are polled & then read
+
+	int Fd;               // io_uring instance, -1 when io_uring is not available
+	uint8_t* SqRing;
+	uint8_t* CqRing;
+	size_t SqRingSize;
+	size_t CqRingSize;
+	struct io_uring_sqe* Sqes;
+	uint32_t SqEntries;
+	uint32_t* SqHead;
+	uint32_t* SqTail;
+	uint32_t* SqArray;
+	uint32_t SqMask;
+	uint32_t* CqHead;
+	uint32_t* CqTail;
+	uint32_t CqMask;
+	struct io_uring_cqe* Cqes;
+	uint32_t Queued;      // entries written to submission queue since last io_uring_enter
+	uint64_t WakeValue;
+
+	volatile LONG64 Enters;      // io_uring_enter calls, each one submits all queued entries & waits for completions
+	volatile LONG64 Submitted;   // submission queue entries
+	volatile LONG64 Completions; // completion queue entries
+} RtmpRing;
+#endif
 
 // buffer size is for outgoing buffer - if it will be full then frames will be dropped
+// url can use rtmp:// or rtmps:// scheme, rtmps server certificate is validated by system
+// on Linux only rtmp:// is supported, stream with rtmps:// url goes to error state
 void RTMP_Init(RtmpStream* Stream, const char* Url, const char* Key, uint32_t BufferSize);
 void RTMP_Done(RtmpStream* Stream);
 
+#ifndef _WIN32
+// MaxStreams sessions can run on ring at same time, stream that connects when all are in use reconnects later
+// when io_uring is not available streams using ring run their sessions on own epoll loop
+// call RTMP_RingDone after RTMP_Done for all streams that use ring
+void RTMP_RingInit(RtmpRing* Ring, uint32_t MaxStreams);
+void RTMP_RingDone(RtmpRing* Ring);
+
+// same as RTMP_Init, but connected sessions are run by shared ring thread
+// Send & Recv ring buffers are registered as io_uring fixed buffers, recv stays armed & sends are submitted as linked chains
+void RTMP_InitRing(RtmpStream* Stream, RtmpRing* Ring, const char* Url, const char* Key, uint32_t BufferSize);
+#endif
+
+// when connection fails it is automatically reconnected, IsError is true only for invalid url
 bool RTMP_IsStreaming(const RtmpStream* Stream);
 bool RTMP_IsError(const RtmpStream* Stream);
 
-// send config only once after IsStreaming returns true
+// true when outgoing buffer is so full that new video frames would be dropped until next keyframe
+// capture can use it to skip encoding, after it returns false next encoded frame should be keyframe
+bool RTMP_IsCongested(const RtmpStream* Stream);
+
+// returns msec from start of connecting until each startup step was done, 0 if step is not yet done
+// after disconnect times are measured again from moment of disconnect, so they show how long reconnecting took
+void RTMP_GetStartupTimes(const RtmpStream* Stream, uint32_t* Resolve, uint32_t* Connect, uint32_t* Handshake, uint32_t* Publish);
+
+// media messages that waited in outgoing buffer longer than this are dropped instead of sent, 0 = no limit (default)
+// once video frame is dropped, rest of frames are dropped until next keyframe
+void RTMP_SetMaxQueueLatency(RtmpStream* Stream, uint32_t Milliseconds);
+
+// how many socket sends can be in progress at same time, 1..RTMP_MAX_SENDS, default is 1
+// more sends in progress keep uplink busy on high latency connections, returns false if Count is not allowed
+bool RTMP_SetMaxSends(RtmpStream* Stream, uint32_t Count);
+
+// sends data directly from send buffer memory without copying it into socket buffer, call right after RTMP_Init
+// or it takes effect only after reconnect, each send completes only after kernel is done with its memory
+// so max sends is raised to RTMP_MAX_SENDS if it was 1 and RTMP_SetMaxSends returns false for 1 while zero copy is enabled
+// on Linux nonblocking socket always copies data, so this only changes max sends
+void RTMP_SetZeroCopy(RtmpStream* Stream, bool Enable);
+
+// enables pacing of outgoing data, Bitrate is in kbit/s, RatePercent sets how much faster than bitrate data can be sent
+// BurstMilliseconds limits how much data is sent at once after idle period, server SetPeerBandwidth message limits it further
+// burst is never smaller than one chunk, can be called from any thread while streaming
+void RTMP_SetPacing(RtmpStream* Stream, uint32_t Bitrate, uint32_t RatePercent, uint32_t BurstMilliseconds);
+
+// returns current pacing rate in bytes per second and how many msec pacer held back data last time
+void RTMP_GetPacing(const RtmpStream* Stream, uint32_t* Rate, uint32_t* Delay);
+
+// media messages are sent once Size bytes are queued or once first of them has waited Microseconds
+// control messages are always sent immediately, Size 0 disables coalescing (default), can be called from any thread
+void RTMP_SetCoalescing(RtmpStream* Stream, uint32_t Size, uint32_t Microseconds);
+
+// returns socket send calls & network thread wakeups per second since previous call
+void RTMP_GetSendRates(RtmpStream* Stream, uint32_t* SendCalls, uint32_t* Wakeups);
+
+typedef struct {
+	uint32_t Rtt;       // msec, from RTMP ping request & response, 0 if server does not respond to pings
+	uint32_t TcpRtt;    // usec, smoothed TCP round trip time
+	uint32_t Cwnd;      // bytes, TCP congestion window
+	uint32_t InFlight;  // bytes sent but not acknowledged by server, or by TCP if server does not send Acknowledgement
+	uint32_t Queued;    // bytes waiting in outgoing buffer
+	uint32_t QueueUsage; // percent of outgoing buffer used, same value that drop policy uses
+	uint32_t QueueDelay; // msec oldest message in outgoing buffer has waited
+	uint32_t Dropped;   // video frames dropped since RTMP_Init
+	uint32_t Bandwidth; // bytes per second, smoothed estimate of available uplink bandwidth, 0 if not yet known
+} RtmpNetworkStats;
+
+// network measurements are updated once per second while connected, they are 0 while disconnected
+// queue values are calculated on every call
+// bandwidth estimate can be compared to media bitrate to react before outgoing buffer fills up
+void RTMP_GetNetworkStats(const RtmpStream* Stream, RtmpNetworkStats* Stats);
+
+typedef struct {
+	uint64_t EnqueuedBytes;    // media payload bytes accepted into outgoing buffer
+	uint64_t EnqueuedMessages;
+	uint64_t SentBytes;        // media payload bytes given to socket
+	uint64_t SentMessages;
+	uint64_t Dropped[RTMP_DROP_REASON_COUNT]; // messages not sent, by RTMP_DROP_REASON_*
+} RtmpTrackStats;
+
+typedef struct {
+	RtmpTrackStats Tracks[RTMP_TRACK_COUNT]; // by RTMP_TRACK_*
+	uint32_t SendSize;      // bytes in outgoing buffer
+	uint32_t SendUsed;      // bytes currently used in outgoing buffer
+	uint32_t SendHighWater; // max bytes used in outgoing buffer
+	uint32_t DelayP50;      // msec media messages waited in outgoing buffer before sending, upper bound of histogram bucket
+	uint32_t DelayP90;
+	uint32_t DelayP99;
+	uint64_t SendCalls;     // socket send calls
+	uint64_t BlockedTime;   // usec socket had all allowed sends in progress while more data was waiting
+	uint32_t Reconnects;    // connections lost
+	uint32_t ReconnectAttempts; // connection attempts after first one, including failed ones
+} RtmpStats;
+
+// snapshot of counters since RTMP_Init, can be called from any thread without blocking producers or network thread
+// values are read one by one, so they may be from slightly different moments
+void RTMP_GetStats(const RtmpStream* Stream, RtmpStats* Stats);
+
+// optional bandwidth probe, call after IsStreaming returns true & before RTMP_SendConfig
+// sends padding data at increasing rates from StartBitrate up to MaxBitrate (kbit/s) for at most Milliseconds
+// padding is onPadding data message that servers ignore, so it is valid before metadata & codec config
+// blocks until done, padding not yet sent by then is discarded so it does not delay config & media after it
+// returns recommended initial encoder bitrate in kbit/s, or 0 if connection was lost
+uint32_t RTMP_ProbeBandwidth(RtmpStream* Stream, uint32_t StartBitrate, uint32_t MaxBitrate, uint32_t Milliseconds);
+
+// send config only once after IsStreaming returns true, media is accepted only after network thread has queued it
+// after reconnecting same config is sent again automatically, then video is dropped until next keyframe
+// or when sent through RTMP_Fanout with GOP cache enabled, most recent GOP of video is replayed instead
 void RTMP_SendConfig(RtmpStream* Stream, const RtmpVideoConfig* VideoConfig, const RtmpAudioConfig* AudioConfig);
 
-// these return false is there is no more place in outgoing buffer
-// can be called from different threads
-bool RTMP_SendVideo(RtmpStream* Stream, uint64_t DecodeTime, uint64_t PresentTime, uint64_t TimePeriod, const void* VideoData, uint32_t VideoSize, bool IsKeyFrame);
+// these return false is there is no more place in outgoing buffer, or when stream is not connected
+// can be called from different threads, but video must always be sent from same thread
+// when outgoing buffer is getting full, video is dropped as whole dependency chains - first disposable (B) frames,
+// then everything until next keyframe, audio is not affected by this
+bool RTMP_SendVideo(RtmpStream* Stream, uint64_t DecodeTime, uint64_t PresentTime, uint64_t TimePeriod, const void* VideoData, uint32_t VideoSize, bool IsKeyFrame, bool IsDisposable);
 bool RTMP_SendAudio(RtmpStream* Stream, uint64_t Time, uint64_t TimePeriod, const void* AudioData, uint32_t AudioSize);
+
+// zero-copy variants, data is not copied into outgoing buffer and must stay valid until Release callback is called
+// Release is called from background thread once data is sent, or from RTMP_Done
+// if these return false, then Release is not called and data is still owned by caller
+bool RTMP_SendVideoRef(RtmpStream* Stream, uint64_t DecodeTime, uint64_t PresentTime, uint64_t TimePeriod, const void* VideoData, uint32_t VideoSize, bool IsKeyFrame, bool IsDisposable, RtmpRelease_Callback* Release, void* ReleaseArg);
+bool RTMP_SendAudioRef(RtmpStream* Stream, uint64_t Time, uint64_t TimePeriod, const void* AudioData, uint32_t AudioSize, RtmpRelease_Callback* Release, void* ReleaseArg);
+
+// sends one encoded stream to multiple destinations, each one is separate RtmpStream that is initialized by caller
+// every destination has its own connection, queue, timestamps & drop policy, so slow one does not stall or drop frames for others
+// RTMP_SendConfig must be called for each destination separately, call RTMP_FanoutDone after RTMP_Done for all destinations
+void RTMP_FanoutInit(RtmpFanout* Fanout, RtmpStream** Streams, uint32_t StreamCount);
+void RTMP_FanoutDone(RtmpFanout* Fanout);
+
+// optional, keeps one copy of most recent GOP for all destinations, call right after RTMP_FanoutInit
+// destination that reconnects gets it replayed, so viewers do not wait for next keyframe
+// GOP that does not fit into Size bytes or RTMP_MAX_GOP_FRAMES frames is not replayed
+void RTMP_FanoutSetGopCache(RtmpFanout* Fanout, uint32_t Size);
+
+// these return false if frame was not queued to any destination, same as RTMP_SendVideoRef & RTMP_SendAudio
+// video data is referenced by all destinations without copying, Release is called once after last of them sends it
+bool RTMP_FanoutVideoRef(RtmpFanout* Fanout, uint64_t DecodeTime, uint64_t PresentTime, uint64_t TimePeriod, const void* VideoData, uint32_t VideoSize, bool IsKeyFrame, bool IsDisposable, RtmpRelease_Callback* Release, void* ReleaseArg);
+bool RTMP_FanoutAudio(RtmpFanout* Fanout, uint64_t Time, uint64_t TimePeriod, const void* AudioData, uint32_t AudioSize);
+
+// true only when all streaming destinations are congested, otherwise frames are still needed by some of them
+bool RTMP_FanoutIsCongested(const RtmpFanout* Fanout);
+
+// interleaving stage in front of fan-out, merges audio & video from different threads in DTS order
+// producers only stage packets, own background thread does merging & all fan-out calls
+// packet is released once other track has reached its DTS, or after it has waited MaxWaitMilliseconds
+// call RTMP_MuxDone after producers have stopped & before RTMP_Done for destinations, it sends all packets that are still held
+void RTMP_MuxInit(RtmpMux* Mux, RtmpFanout* Fanout, uint32_t MaxWaitMilliseconds);
+void RTMP_MuxDone(RtmpMux* Mux);
+
+// both tracks must have increasing DTS, video data is referenced and Release is called also when frame is dropped
+// audio data is copied, so it can be released by caller immediately, packets over RTMP_MAX_MUX_AUDIO bytes are dropped
+// if background thread falls behind by RTMP_MAX_MUX_PACKETS, new packets are dropped & video resumes on next keyframe
+void RTMP_MuxVideoRef(RtmpMux* Mux, uint64_t DecodeTime, uint64_t PresentTime, uint64_t TimePeriod, const void* VideoData, uint32_t VideoSize, bool IsKeyFrame, bool IsDisposable, RtmpRelease_Callback* Release, void* ReleaseArg);
+void RTMP_MuxAudio(RtmpMux* Mux, uint64_t Time, uint64_t TimePeriod, const void* AudioData, uint32_t AudioSize);
+
+// returns average & max usec packets waited in interleaving stage since previous call
+void RTMP_MuxGetLatency(RtmpMux* Mux, uint32_t* Average, uint32_t* Max);
@@ -0,0 +1,32 @@
+#!/bin/sh
+# builds & runs tests on Linux, "debug" argument enables asserts & sanitizers, "bench" also runs benchmarks
+set -e
+cd "$(dirname "$0")"
+
+if [ "$1" = "debug" ]; then
+  CFLAGS="-std=gnu11 -O0 -g -D_DEBUG -fsanitize=address,undefined -Wall -Wno-unused-function -Wno-unused-value"
+else
+  CFLAGS="-std=gnu11 -O2 -DNDEBUG -Wall -Wno-unused-function -Wno-unused-value"
+fi
+
+mkdir -p bin
+
+# these use only public API
+for Test in loopback_test throughput_bench contention_bench ring_bench; do
+  cc $CFLAGS $Test.c ../rtmp_stream.c -o bin/$Test -lpthread
+done
+
+# these include source they test, so they can call internal functions
+for Test in chunk_parser_test rate_control_test timestamp_soak_test; do
+  cc $CFLAGS $Test.c -o bin/$Test -lpthread
+done
+
+for Test in loopback_test chunk_parser_test rate_control_test timestamp_soak_test; do
+  ./bin/$Test
+done
+
+if [ "$1" = "bench" ]; then
+  ./bin/throughput_bench
+  ./bin/contention_bench
+  ./bin/ring_bench
+fi
@@ -0,0 +1,418 @@
+// replays recorded-like server chunk streams through RTMP__DoChunk, fed in pieces of different sizes
+// covers split messages, interleaved chunk streams, 2 & 3 byte chunk stream ids, oversized messages & extended timestamps
+
+#include "../rtmp_stream.c"
+#include "test.h"
+
+typedef struct {
+	uint8_t Data[1 << 20];
+	uint32_t Size;
+} Bytes;
+
+static void Put(Bytes* Out, const void* Data, uint32_t Size)
+{
+	memcpy(Out->Data + Out->Size, Data, Size);
+	Out->Size += Size;
+}
+
+static void PutByte(Bytes* Out, uint32_t Value)
+{
+	Out->Data[Out->Size++] = (uint8_t)Value;
+}
+
+static void PutBE(Bytes* Out, uint32_t Value, uint32_t Size)
+{
+	for (uint32_t i = 0; i < Size; i++)
+	{
+		PutByte(Out, Value >> ((Size - 1 - i) * 8));
+	}
+}
+
+static void PutBasic(Bytes* Out, uint32_t Format, uint32_t ChunkStreamId)
+{
+	if (ChunkStreamId < 64)
+	{
+		PutByte(Out, (Format << 6) | ChunkStreamId);
+	}
+	else if (ChunkStreamId < 64 + 256)
+	{
+		PutByte(Out, Format << 6);
+		PutByte(Out, ChunkStreamId - 64);
+	}
+	else
+	{
+		PutByte(Out, (Format << 6) | 1);
+		PutByte(Out, (ChunkStreamId - 64) & 0xff);
+		PutByte(Out, (ChunkStreamId - 64) >> 8);
+	}
+}
+
+// chunk header, Timestamp is absolute for fmt=0 & delta for fmt=1,2, Extended is used for fmt=3
+static void PutHeader(Bytes* Out, uint32_t Format, uint32_t ChunkStreamId, uint32_t Timestamp, uint32_t Length, uint32_t Type, bool Extended)
+{
+	PutBasic(Out, Format, ChunkStreamId);
+	if (Format <= 2)
+	{
+		Extended = Timestamp >= 0xffffff;
+		PutBE(Out, Extended ? 0xffffff : Timestamp, 3);
+	}
+	if (Format <= 1)
+	{
+		PutBE(Out, Length, 3);
+		PutByte(Out, Type);
+	}
+	if (Format == 0)
+	{
+		// message stream id is little endian
+		PutByte(Out, 1); PutByte(Out, 0); PutByte(Out, 0); PutByte(Out, 0);
+	}
+	if (Extended)
+	{
+		PutBE(Out, Timestamp, 4);
+	}
+}
+
+// whole message split into ChunkSize chunks, continuation chunks are fmt=3 & repeat extended timestamp
+static void PutMessage(Bytes* Out, uint32_t Format, uint32_t ChunkStreamId, uint32_t Timestamp, uint32_t Type, const uint8_t* Payload, uint32_t Length, uint32_t ChunkSize)
+{
+	bool Extended = Format != 3 && Timestamp >= 0xffffff;
+	PutHeader(Out, Format, ChunkStreamId, Timestamp, Length, Type, Extended);
+	for (uint32_t Offset = 0; ; )
+	{
+		uint32_t Size = min(Length - Offset, ChunkSize);
+		Put(Out, Payload + Offset, Size);
+		Offset += Size;
+		if (Offset == Length)
+		{
+			break;
+		}
+		PutHeader(Out, 3, ChunkStreamId, Timestamp, 0, 0, Extended);
+	}
+}
+
+static void PutControl(Bytes* Out, uint32_t Type, uint32_t Value, uint32_t ChunkSize)
+{
+	uint8_t Payload[4] = { Value >> 24, Value >> 16, Value >> 8, Value };
+	PutMessage(Out, 0, RTMP_CHANNEL_CONTROL, 0, Type, Payload, 4, ChunkSize);
+}
+
+static uint32_t Command(uint8_t* Payload, const char* Name, double Transaction, double StreamId, uint32_t Size)
+{
+	uint8_t* Ptr = Payload;
+	AMF_PUT_STRING_DYNAMIC(Ptr, (char*)Name);
+	AMF_PUT_NUMBER(Ptr, Transaction);
+	AMF_PUT_NULL(Ptr);
+	AMF_PUT_NUMBER(Ptr, StreamId);
+	uint32_t Used = (uint32_t)(Ptr - Payload);
+	if (Size < Used)
+	{
+		return Used;
+	}
+	// padding after arguments is ignored by client
+	memset(Ptr, 5, Size - Used);
+	return Size;
+}
+
+// stream that was never connected, network thread has exited because of invalid url
+static RtmpStream* Open(uint32_t State)
+{
+	RtmpStream* Stream = calloc(1, sizeof(*Stream));
+	RTMP_Init(Stream, "invalid", "key", 1 << 20);
+	while (!RTMP_IsError(Stream))
+	{
+		Sleep(1);
+	}
+	Stream->State = State;
+	Stream->StartTime = 0;
+	return Stream;
+}
+
+static void Close(RtmpStream* Stream)
+{
+	RTMP_Done(Stream);
+	free(Stream);
+}
+
+// feeds bytes in pieces, parser must not depend on how data arrived from socket
+static void Feed(RtmpStream* Stream, const Bytes* In, uint32_t Piece)
+{
+	for (uint32_t Offset = 0; Offset < In->Size && !Stream->Disconnect; )
+	{
+		uint32_t Size = min(min(Piece, In->Size - Offset), RB_GetFree(&Stream->Recv));
+		CopyMemory(RB_BeginWrite(&Stream->Recv), In->Data + Offset, Size);
+		RB_EndWrite(&Stream->Recv, Size);
+		Offset += Size;
+		RTMP__DoChunk(INVALID_SOCKET, Stream);
+	}
+}
+
+static uint32_t Queued(RtmpStream* Stream)
+{
+	return RTMP_RESERVE_INDEX(Stream->SendReserve);
+}
+
+static const uint32_t Pieces[] = { 1, 2, 3, 7, 128, 129, 4096, 1 << 20 };
+
+// whole publish handshake with 1 byte chunks, every message is split into many chunks
+static void TestSplit(void)
+{
+	Bytes* In = calloc(1, sizeof(*In));
+	uint8_t Payload[256];
+
+	PutControl(In, RTMP_PACKET_SET_CHUNK_SIZE, 1, 128);
+	PutControl(In, RTMP_PACKET_SET_WINDOW_SIZE, 2500000, 1);
+	PutControl(In, RTMP_PACKET_ACK, 12345, 1);
+	PutMessage(In, 0, RTMP_CHANNEL_MISC, 0, RTMP_PACKET_COMMAND_AMF0, Payload, Command(Payload, "_result", 1, 0, 0), 1);
+	PutMessage(In, 1, RTMP_CHANNEL_MISC, 0, RTMP_PACKET_COMMAND_AMF0, Payload, Command(Payload, "_result", 2, 7, 0), 1);
+	PutMessage(In, 1, RTMP_CHANNEL_MISC, 0, RTMP_PACKET_COMMAND_AMF0, Payload, Command(Payload, "onStatus", 0, 0, 0), 1);
+
+	for (uint32_t i = 0; i < ARRAYSIZE(Pieces); i++)
+	{
+		RtmpStream* Stream = Open(RTMP_STATE_STREAM_CONNECTING);
+		Feed(Stream, In, Pieces[i]);
+
+		CHECK(!Stream->Disconnect);
+		CHECK(Stream->ChunkSize == 1);
+		CHECK(Stream->WindowSize == 2500000);
+		CHECK(Stream->AckBytes == 12345);
+		CHECK(Stream->StreamId == 7);
+		CHECK(Stream->State == RTMP_STATE_STREAM_READY);
+		CHECK(RB_GetUsed(&Stream->Recv) == 0);
+		CHECK(Stream->RecvChunk == NULL);
+
+		// createStream & publish were sent
+		CHECK(Queued(Stream) == 2);
+
+		Close(Stream);
+	}
+	free(In);
+}
+
+// control messages on other chunk streams arrive between chunks of large command
+static void TestInterleaved(void)
+{
+	Bytes* In = calloc(1, sizeof(*In));
+	static uint8_t Payload[4000];
+	uint32_t Length = Command(Payload, "_result", 2, 42, sizeof(Payload));
+
+	uint8_t Ping[6] = { 0, RTMP_USER_PING_REQUEST, 0, 0, 0x10, 0x20 };
+	uint8_t PeerBandwidth[5] = { 0, 0x0f, 0x42, 0x40, 0 };
+	uint8_t Ack[4] = { 0, 0, 0x30, 0x39 };
+
+	uint32_t Chunks = 0;
+	for (uint32_t Offset = 0; Offset < Length; Offset += 128, Chunks++)
+	{
+		if (Offset == 0)
+		{
+			PutHeader(In, 0, RTMP_CHANNEL_MISC, 0, Length, RTMP_PACKET_COMMAND_AMF0, false);
+		}
+		else
+		{
+			PutHeader(In, 3, RTMP_CHANNEL_MISC, 0, 0, 0, false);
+		}
+		Put(In, Payload + Offset, min(Length - Offset, 128));
+
+		// ping on control stream, peer bandwidth on 2 byte id, ack on 3 byte id
+		switch (Chunks % 3)
+		{
+		case 0: PutMessage(In, Chunks == 0 ? 0 : 3, RTMP_CHANNEL_CONTROL, 0, RTMP_PACKET_USER_CONTROL, Ping, sizeof(Ping), 128); break;
+		case 1: PutMessage(In, Chunks == 1 ? 0 : 3, 100, 0, RTMP_PACKET_SET_PEER_BW, PeerBandwidth, sizeof(PeerBandwidth), 128); break;
+		case 2: PutMessage(In, Chunks == 2 ? 0 : 3, 300, 0, RTMP_PACKET_ACK, Ack, sizeof(Ack), 128); break;
+		}
+	}
+	uint32_t Pings = (Chunks + 2) / 3;
+
+	for (uint32_t i = 0; i < ARRAYSIZE(Pieces); i++)
+	{
+		RtmpStream* Stream = Open(RTMP_STATE_STREAM_CREATING);
+		Feed(Stream, In, Pieces[i]);
+
+		CHECK(!Stream->Disconnect);
+		CHECK(Stream->StreamId == 42);
+		CHECK(Stream->State == RTMP_STATE_STREAM_PUBLISHING);
+		CHECK(Stream->PeerBandwidth == 1000000);
+		CHECK(Stream->AckBytes == 12345);
+		CHECK(RTMP__GetChunk(Stream, 100, false) != NULL);
+		CHECK(RTMP__GetChunk(Stream, 300, false) != NULL);
+
+		// every ping got response, then publish was sent
+		CHECK(Queued(Stream) == Pings + 1);
+
+		Close(Stream);
+	}
+	free(In);
+}
+
+// messages over RTMP_MAX_RECV_MESSAGE are skipped whether they come in many chunks or in one, parsing continues after them
+static void TestOversized(void)
+{
+	Bytes* In = calloc(1, sizeof(*In));
+	static uint8_t Payload[RTMP_MAX_RECV_MESSAGE + 1000];
+	uint8_t Small[256];
+
+	uint32_t Length = Command(Payload, "_result", 1, 0, sizeof(Payload));
+	PutMessage(In, 0, RTMP_CHANNEL_MISC, 0, RTMP_PACKET_COMMAND_AMF0, Payload, Length, 128);
+	PutControl(In, RTMP_PACKET_SET_CHUNK_SIZE, 65536, 128);
+	PutMessage(In, 0, RTMP_CHANNEL_MISC, 0, RTMP_PACKET_COMMAND_AMF0, Payload, Length, 65536);
+	PutControl(In, RTMP_PACKET_ACK, 777, 65536);
+
+	// message of exactly max size is still processed
+	Length = Command(Payload, "_result", 1, 0, RTMP_MAX_RECV_MESSAGE);
+	PutMessage(In, 0, RTMP_CHANNEL_MISC, 0, RTMP_PACKET_COMMAND_AMF0, Payload, Length, 65536);
+	PutMessage(In, 0, RTMP_CHANNEL_MISC, 0, RTMP_PACKET_COMMAND_AMF0, Small, Command(Small, "_result", 2, 9, 0), 65536);
+
+	for (uint32_t i = 0; i < ARRAYSIZE(Pieces); i++)
+	{
+		RtmpStream* Stream = Open(RTMP_STATE_STREAM_CONNECTING);
+
+		// stop after oversized messages to check they were not processed
+		Bytes* Part = calloc(1, sizeof(*Part));
+		uint32_t Skipped = 0;
+		Skipped += 12 + (sizeof(Payload) + 127) / 128 - 1 + sizeof(Payload);
+		Skipped += 12 + 4;
+		Skipped += 12 + sizeof(Payload) + 12 + 4;
+		Put(Part, In->Data, Skipped);
+		Feed(Stream, Part, Pieces[i]);
+		free(Part);
+
+		CHECK(!Stream->Disconnect);
+		CHECK(Stream->State == RTMP_STATE_STREAM_CONNECTING);
+		CHECK(Stream->ChunkSize == 65536);
+		CHECK(Stream->AckBytes == 777);
+		CHECK(Queued(Stream) == 0);
+
+		Bytes* Rest = calloc(1, sizeof(*Rest));
+		Put(Rest, In->Data + Skipped, In->Size - Skipped);
+		Feed(Stream, Rest, Pieces[i]);
+		free(Rest);
+
+		CHECK(!Stream->Disconnect);
+		CHECK(Stream->State == RTMP_STATE_STREAM_PUBLISHING);
+		CHECK(Stream->StreamId == 9);
+
+		Close(Stream);
+	}
+	free(In);
+}
+
+// extended timestamps in all header formats, fmt=3 chunks repeat extended field of header they continue
+static void TestExtendedTimestamps(void)
+{
+	Bytes* In = calloc(1, sizeof(*In));
+	uint8_t Payload[300] = { 0 };
+	uint32_t Csid = 6;
+
+	struct { uint32_t Format; uint32_t Timestamp; uint32_t Length; uint32_t Expected; bool Extended; } Steps[] =
+	{
+		{ 0, 0x12345678, 300, 0x12345678, true  }, // 3 chunks, both continuations have extended field
+		{ 1, 0x01000000, 4,   0x13345678, true  }, // delta needs extended field too
+		{ 3, 0,          4,   0x14345678, true  }, // new message with same delta, still extended
+		{ 1, 0xfffffe,   300, 0x15345676, false }, // largest delta that fits in 24 bits
+		{ 3, 0,          300, 0x16345674, false }, // fmt=3 message has same length as previous one
+		{ 0, 0xffffff,   4,   0x00ffffff, true  }, // first value that needs extended field
+		{ 0, 0xfffffff0, 300, 0xfffffff0, true  },
+		{ 2, 0x20,       300, 0x00000010, false }, // wraps around 2^32
+		{ 3, 0,          300, 0x00000030, false },
+	};
+
+	uint32_t Ends[ARRAYSIZE(Steps)];
+	for (uint32_t i = 0; i < ARRAYSIZE(Steps); i++)
+	{
+		// fmt=3 message start repeats extended field if previous header had it
+		bool Extended = Steps[i].Format == 3 && i > 0 && Steps[i - 1].Extended;
+		if (Steps[i].Format == 3)
+		{
+			PutHeader(In, 3, Csid, Steps[i - 1].Format == 3 ? 0 : Steps[i - 1].Timestamp, 0, 0, Extended);
+			for (uint32_t Offset = 0; ; )
+			{
+				uint32_t Size = min(Steps[i].Length - Offset, 128);
+				Put(In, Payload + Offset, Size);
+				Offset += Size;
+				if (Offset == Steps[i].Length)
+				{
+					break;
+				}
+				PutHeader(In, 3, Csid, Steps[i - 1].Timestamp, 0, 0, Extended);
+			}
+		}
+		else
+		{
+			PutMessage(In, Steps[i].Format, Csid, Steps[i].Timestamp, RTMP_PACKET_VIDEO, Payload, Steps[i].Length, 128);
+		}
+		Ends[i] = In->Size;
+	}
+	PutControl(In, RTMP_PACKET_ACK, 4242, 128);
+
+	for (uint32_t p = 0; p < ARRAYSIZE(Pieces); p++)
+	{
+		RtmpStream* Stream = Open(RTMP_STATE_STREAM_READY);
+
+		uint32_t Offset = 0;
+		for (uint32_t i = 0; i < ARRAYSIZE(Steps); i++)
+		{
+			Bytes* Part = calloc(1, sizeof(*Part));
+			Put(Part, In->Data + Offset, Ends[i] - Offset);
+			Feed(Stream, Part, Pieces[p]);
+			free(Part);
+			Offset = Ends[i];
+
+			RtmpChunk* Chunk = RTMP__GetChunk(Stream, Csid, false);
+			CHECK(Chunk != NULL);
+			CHECK(!Stream->Disconnect);
+			if (Chunk)
+			{
+				CHECK(Chunk->Timestamp == Steps[i].Expected);
+				CHECK(Chunk->IsExtended == Steps[i].Extended);
+				CHECK(Chunk->Received == 0);
+			}
+		}
+
+		Bytes* Rest = calloc(1, sizeof(*Rest));
+		Put(Rest, In->Data + Offset, In->Size - Offset);
+		Feed(Stream, Rest, Pieces[p]);
+		free(Rest);
+
+		// parser is still aligned with chunk boundaries
+		CHECK(Stream->AckBytes == 4242);
+		CHECK(RB_GetUsed(&Stream->Recv) == 0);
+
+		Close(Stream);
+	}
+	free(In);
+}
+
+// fmt=1,2,3 chunk on unknown chunk stream & new message before previous one is finished are protocol errors
+static void TestErrors(void)
+{
+	Bytes* In = calloc(1, sizeof(*In));
+	PutHeader(In, 1, 10, 0, 4, RTMP_PACKET_ACK, false);
+	Put(In, "\0\0\0\1", 4);
+
+	RtmpStream* Stream = Open(RTMP_STATE_STREAM_READY);
+	Feed(Stream, In, 1 << 20);
+	CHECK(Stream->Disconnect);
+	Close(Stream);
+
+	In->Size = 0;
+	uint8_t Payload[200] = { 0 };
+	PutHeader(In, 0, 10, 0, sizeof(Payload), RTMP_PACKET_VIDEO, false);
+	Put(In, Payload, 128);
+	PutHeader(In, 0, 10, 0, sizeof(Payload), RTMP_PACKET_VIDEO, false);
+
+	Stream = Open(RTMP_STATE_STREAM_READY);
+	Feed(Stream, In, 1 << 20);
+	CHECK(Stream->Disconnect);
+	Close(Stream);
+
+	free(In);
+}
+
+int main(void)
+{
+	TestSplit();
+	TestInterleaved();
+	TestOversized();
+	TestExtendedTimestamps();
+	TestErrors();
+	return TestResult("chunk_parser_test");
+}
@@ -0,0 +1,138 @@
+// enqueue latency of audio producer while video producer keeps outgoing buffer full
+// lock-free queue is compared with same calls serialized by one lock, which is how queue worked before
+
+#include "../rtmp_stream.h"
+#include "test_server.h"
+
+#define AUDIO_FRAMES 2000
+#define AUDIO_PERIOD 2000000 // nsec between audio frames
+#define VIDEO_FRAME (1 << 20)
+
+typedef struct {
+	RtmpStream* Stream;
+	SRWLOCK* Lock;        // NULL for lock-free
+	volatile bool Stop;
+	uint64_t VideoFrames;
+	uint64_t VideoRejected;
+} Producers;
+
+static uint8_t VideoData[VIDEO_FRAME];
+static uint8_t AudioData[512];
+
+static void* VideoThread(void* Arg)
+{
+	Producers* P = Arg;
+	uint32_t Frame = 0;
+	while (!__atomic_load_n(&P->Stop, __ATOMIC_RELAXED))
+	{
+		if (P->Lock)
+		{
+			AcquireSRWLockExclusive(P->Lock);
+		}
+		// every frame is keyframe, so queue is kept full instead of dropping until next keyframe
+		bool Ok = RTMP_SendVideo(P->Stream, Frame * 16, Frame * 16, 1000, VideoData, VIDEO_FRAME, true, false);
+		if (P->Lock)
+		{
+			ReleaseSRWLockExclusive(P->Lock);
+		}
+		P->VideoFrames += Ok;
+		P->VideoRejected += !Ok;
+		Frame++;
+	}
+	return NULL;
+}
+
+static int Compare(const void* A, const void* B)
+{
+	uint64_t a = *(const uint64_t*)A;
+	uint64_t b = *(const uint64_t*)B;
+	return a < b ? -1 : a > b;
+}
+
+static void Run(const char* Name, bool UseLock)
+{
+	TestServer Server;
+	TestServer_Start(&Server);
+
+	char Url[128];
+	snprintf(Url, sizeof(Url), "rtmp://127.0.0.1:%u/live", Server.Port);
+
+	RtmpStream* Stream = calloc(1, sizeof(*Stream));
+	RTMP_Init(Stream, Url, "bench", 8 << 20);
+
+	// pacer drains queue at 200 Mbit/s, video producer is much faster so queue stays full
+	RTMP_SetPacing(Stream, 200000, 100, 50);
+
+	while (!RTMP_IsStreaming(Stream))
+	{
+		Sleep(1);
+	}
+
+	static const uint8_t VideoHeader[] = { 1, 0x64, 0, 0x1f, 0xff, 0xe1, 0, 0 };
+	static const uint8_t AudioHeader[] = { 0x12, 0x10 };
+	RtmpVideoConfig VideoConfig = { .Codec = RTMP_VIDEO_CODEC_AVC, .Header = VideoHeader, .HeaderSize = sizeof(VideoHeader) };
+	RtmpAudioConfig AudioConfig = { .Codec = RTMP_AUDIO_CODEC_AAC, .SampleRate = 48000, .Channels = 2, .Header = AudioHeader, .HeaderSize = sizeof(AudioHeader) };
+	RTMP_SendConfig(Stream, &VideoConfig, &AudioConfig);
+	while (!RTMP_SendAudio(Stream, 0, 1000, AudioData, sizeof(AudioData)))
+	{
+		Sleep(1);
+	}
+
+	SRWLOCK Lock;
+	InitializeSRWLock(&Lock);
+
+	Producers P = { .Stream = Stream, .Lock = UseLock ? &Lock : NULL };
+	pthread_t Video;
+	pthread_create(&Video, NULL, &VideoThread, &P);
+
+	// let video fill queue first
+	Sleep(100);
+
+	static uint64_t Latency[AUDIO_FRAMES];
+	uint32_t AudioRejected = 0;
+	uint64_t Next = TestNow();
+	for (uint32_t i = 0; i < AUDIO_FRAMES; i++)
+	{
+		Next += AUDIO_PERIOD;
+		while (TestNow() < Next)
+		{
+		}
+
+		uint64_t Start = TestNow();
+		if (UseLock)
+		{
+			AcquireSRWLockExclusive(&Lock);
+		}
+		bool Ok = RTMP_SendAudio(Stream, 1 + i * 2, 1000, AudioData, sizeof(AudioData));
+		if (UseLock)
+		{
+			ReleaseSRWLockExclusive(&Lock);
+		}
+		Latency[i] = TestNow() - Start;
+		AudioRejected += !Ok;
+	}
+
+	__atomic_store_n(&P.Stop, true, __ATOMIC_RELAXED);
+	pthread_join(Video, NULL);
+
+	qsort(Latency, AUDIO_FRAMES, sizeof(Latency[0]), &Compare);
+	printf("%-10s audio enqueue p50 %6.2f us, p99 %8.2f us, max %8.2f us, audio rejected %u, video accepted %llu rejected %llu\n",
+		Name,
+		Latency[AUDIO_FRAMES / 2] / 1000.0,
+		Latency[AUDIO_FRAMES * 99 / 100] / 1000.0,
+		Latency[AUDIO_FRAMES - 1] / 1000.0,
+		AudioRejected,
+		(unsigned long long)P.VideoFrames,
+		(unsigned long long)P.VideoRejected);
+
+	RTMP_Done(Stream);
+	free(Stream);
+	TestServer_Stop(&Server);
+}
+
+int main(void)
+{
+	Run("lock-free", false);
+	Run("locked", true);
+	return 0;
+}
@@ -0,0 +1,275 @@
+// publishes to local RTMP server through real sockets & checks that everything queued arrives
+
+#include "../rtmp_stream.h"
+#include "test_server.h"
+
+#define VIDEO_FRAMES 300
+#define AUDIO_FRAMES 600
+
+static bool WaitFor(volatile uint64_t* Value, uint64_t Expected, uint32_t Milliseconds)
+{
+	uint64_t End = TestNow() + Milliseconds * 1000000ULL;
+	while (__atomic_load_n(Value, __ATOMIC_RELAXED) < Expected && TestNow() < End)
+	{
+		Sleep(1);
+	}
+	return __atomic_load_n(Value, __ATOMIC_RELAXED) >= Expected;
+}
+
+static bool WaitStreaming(RtmpStream* Stream, uint32_t Milliseconds)
+{
+	uint64_t End = TestNow() + Milliseconds * 1000000ULL;
+	while (!RTMP_IsStreaming(Stream) && TestNow() < End)
+	{
+		Sleep(1);
+	}
+	return RTMP_IsStreaming(Stream);
+}
+
+static void TestPublish(void)
+{
+	TestServer Server;
+	TestServer_Start(&Server);
+
+	char Url[128];
+	snprintf(Url, sizeof(Url), "rtmp://127.0.0.1:%u/live", Server.Port);
+
+	RtmpStream* Stream = calloc(1, sizeof(*Stream));
+	RTMP_Init(Stream, Url, "loopback", 8 << 20);
+
+	CHECK(WaitStreaming(Stream, 5000));
+	CHECK(Server.Published == 1);
+
+	uint32_t Resolve, Connect, Handshake, Publish;
+	RTMP_GetStartupTimes(Stream, &Resolve, &Connect, &Handshake, &Publish);
+	CHECK(Resolve <= Connect && Connect <= Handshake && Handshake <= Publish);
+
+	static const uint8_t VideoHeader[] = { 1, 0x64, 0, 0x1f, 0xff, 0xe1, 0, 0 };
+	static const uint8_t AudioHeader[] = { 0x12, 0x10 };
+	RtmpVideoConfig VideoConfig = { .Codec = RTMP_VIDEO_CODEC_AVC, .Width = 1280, .Height = 720, .FrameRate = 60, .Bitrate = 6000, .Header = VideoHeader, .HeaderSize = sizeof(VideoHeader) };
+	RtmpAudioConfig AudioConfig = { .Codec = RTMP_AUDIO_CODEC_AAC, .SampleRate = 48000, .Bitrate = 160, .Channels = 2, .Header = AudioHeader, .HeaderSize = sizeof(AudioHeader) };
+	RTMP_SendConfig(Stream, &VideoConfig, &AudioConfig);
+
+	// media is accepted once network thread has queued config
+	static uint8_t Frame[64 << 10];
+	for (uint32_t i = 0; i < sizeof(Frame); i++)
+	{
+		Frame[i] = (uint8_t)(i * 7);
+	}
+	uint64_t End = TestNow() + 5000000000ULL;
+	while (!RTMP_SendVideo(Stream, 0, 0, 1000, Frame, sizeof(Frame), true, false) && TestNow() < End)
+	{
+		Sleep(1);
+	}
+
+	uint32_t VideoSent = 1;
+	uint32_t AudioSent = 0;
+	for (uint32_t i = 1; i < VIDEO_FRAMES; i++)
+	{
+		// frames of different sizes, some smaller & some much larger than chunk size
+		uint32_t Size = 100 + (i * 7919) % (sizeof(Frame) - 100);
+		VideoSent += RTMP_SendVideo(Stream, i * 16, i * 16, 1000, Frame, Size, i % 60 == 0, false);
+
+		for (uint32_t k = 0; k < AUDIO_FRAMES / VIDEO_FRAMES; k++)
+		{
+			AudioSent += RTMP_SendAudio(Stream, i * 16 + k * 8, 1000, Frame, 400);
+		}
+		if (i % 16 == 0)
+		{
+			// let queue drain, so nothing is dropped
+			Sleep(1);
+		}
+	}
+	CHECK(VideoSent == VIDEO_FRAMES);
+	CHECK(AudioSent == AUDIO_FRAMES - AUDIO_FRAMES / VIDEO_FRAMES);
+
+	// codec config messages are sent as media too
+	CHECK(WaitFor(&Server.VideoMessages, 1 + VideoSent, 5000));
+	CHECK(WaitFor(&Server.AudioMessages, 1 + AudioSent, 5000));
+	CHECK(Server.VideoMessages == 1 + VideoSent);
+	CHECK(Server.AudioMessages == 1 + AudioSent);
+	CHECK(Server.LastTimestamp[1] == (VIDEO_FRAMES - 1) * 16);
+
+	RtmpStats Stats;
+	RTMP_GetStats(Stream, &Stats);
+	CHECK(Stats.Tracks[RTMP_TRACK_VIDEO].SentMessages == Stats.Tracks[RTMP_TRACK_VIDEO].EnqueuedMessages);
+	CHECK(Stats.Tracks[RTMP_TRACK_AUDIO].SentMessages == Stats.Tracks[RTMP_TRACK_AUDIO].EnqueuedMessages);
+	CHECK(Stats.Reconnects == 0);
+	CHECK(Stats.SendCalls != 0);
+
+	RTMP_Done(Stream);
+	free(Stream);
+
+	TestServer_Stop(&Server);
+}
+
+static void TestReconnect(void)
+{
+	TestServer Server;
+	TestServer_Start(&Server);
+
+	char Url[128];
+	snprintf(Url, sizeof(Url), "rtmp://localhost:%u/live/app", Server.Port);
+
+	RtmpStream* Stream = calloc(1, sizeof(*Stream));
+	RTMP_Init(Stream, Url, "loopback", 1 << 20);
+	CHECK(WaitStreaming(Stream, 5000));
+
+	// server closes connection, stream reconnects on its own
+	TestServer_Drop(&Server);
+	uint64_t End = TestNow() + 5000000000ULL;
+	while (__atomic_load_n(&Server.Published, __ATOMIC_RELAXED) < 2 && TestNow() < End)
+	{
+		Sleep(1);
+	}
+	CHECK(Server.Published == 2);
+	CHECK(WaitStreaming(Stream, 5000));
+
+	RtmpStats Stats;
+	RTMP_GetStats(Stream, &Stats);
+	CHECK(Stats.Reconnects == 1);
+
+	RTMP_Done(Stream);
+	free(Stream);
+	TestServer_Stop(&Server);
+}
+
+// several streams run their sessions on one io_uring thread, they publish, reconnect & stop independently
+static void TestRing(void)
+{
+	TestServer Server;
+	TestServer_Start(&Server);
+
+	char Url[128];
+	snprintf(Url, sizeof(Url), "rtmp://127.0.0.1:%u/live", Server.Port);
+
+	RtmpRing Ring;
+	RTMP_RingInit(&Ring, 3);
+	CHECK(Ring.Fd >= 0);
+
+	// one stream more than ring has slots, it keeps reconnecting until slot is free
+	RtmpStream* Streams[4];
+	for (uint32_t i = 0; i < ARRAYSIZE(Streams); i++)
+	{
+		Streams[i] = calloc(1, sizeof(*Streams[i]));
+		RTMP_InitRing(Streams[i], &Ring, Url, "ring", 1 << 20);
+		if (i < 3)
+		{
+			CHECK(WaitStreaming(Streams[i], 5000));
+		}
+	}
+	Sleep(100);
+	CHECK(!RTMP_IsStreaming(Streams[3]));
+	CHECK(Server.Published == 3);
+
+	// stopped stream frees its slot for waiting one
+	RTMP_Done(Streams[0]);
+	CHECK(WaitStreaming(Streams[3], 5000));
+	CHECK(Server.Published == 4);
+
+	static const uint8_t VideoHeader[] = { 1, 0x64, 0, 0x1f, 0xff, 0xe1, 0, 0 };
+	RtmpVideoConfig VideoConfig = { .Codec = RTMP_VIDEO_CODEC_AVC, .Header = VideoHeader, .HeaderSize = sizeof(VideoHeader) };
+	static uint8_t Frame[16 << 10];
+	uint32_t VideoSent = 0;
+	for (uint32_t i = 1; i < ARRAYSIZE(Streams); i++)
+	{
+		RTMP_SendConfig(Streams[i], &VideoConfig, NULL);
+		uint64_t End = TestNow() + 5000000000ULL;
+		while (!RTMP_SendVideo(Streams[i], 0, 0, 1000, Frame, sizeof(Frame), true, false) && TestNow() < End)
+		{
+			Sleep(1);
+		}
+		VideoSent++;
+	}
+	for (uint32_t k = 1; k < VIDEO_FRAMES; k++)
+	{
+		for (uint32_t i = 1; i < ARRAYSIZE(Streams); i++)
+		{
+			// 1 byte to 16 KB, so some frames fit into one chunk & others are split into many
+			VideoSent += RTMP_SendVideo(Streams[i], k * 16, k * 16, 1000, Frame, 1 + (k * 7919) % sizeof(Frame), k % 60 == 0, false);
+		}
+		if (k % 16 == 0)
+		{
+			Sleep(1);
+		}
+	}
+	CHECK(VideoSent == 3 * VIDEO_FRAMES);
+	CHECK(WaitFor(&Server.VideoMessages, 3 + VideoSent, 5000));
+	CHECK(Server.VideoMessages == 3 + VideoSent);
+
+	RtmpStats Stats;
+	RTMP_GetStats(Streams[1], &Stats);
+	CHECK(Stats.SendCalls != 0);
+	CHECK(Stats.Tracks[RTMP_TRACK_VIDEO].SentMessages == Stats.Tracks[RTMP_TRACK_VIDEO].EnqueuedMessages);
+	CHECK(Ring.Submitted != 0 && Ring.Completions != 0);
+
+	// server closes all connections, every stream reconnects on ring
+	TestServer_Drop(&Server);
+	uint64_t End = TestNow() + 5000000000ULL;
+	while (__atomic_load_n(&Server.Published, __ATOMIC_RELAXED) < 7 && TestNow() < End)
+	{
+		Sleep(1);
+	}
+	CHECK(Server.Published == 7);
+	for (uint32_t i = 1; i < ARRAYSIZE(Streams); i++)
+	{
+		CHECK(WaitStreaming(Streams[i], 5000));
+		RTMP_GetStats(Streams[i], &Stats);
+		CHECK(i == 3 ? Stats.Reconnects > 1 : Stats.Reconnects == 1);
+	}
+
+	for (uint32_t i = 1; i < ARRAYSIZE(Streams); i++)
+	{
+		RTMP_Done(Streams[i]);
+	}
+	for (uint32_t i = 0; i < ARRAYSIZE(Streams); i++)
+	{
+		free(Streams[i]);
+	}
+	RTMP_RingDone(&Ring);
+
+	TestServer_Stop(&Server);
+}
+
+static void TestUrls(void)
+{
+	static const char* Invalid[] =
+	{
+		"rtmps://127.0.0.1/live", // no TLS on this platform
+		"http://127.0.0.1/live",
+		"rtmp://",
+		"rtmp://:1935/live",
+	};
+
+	for (uint32_t i = 0; i < ARRAYSIZE(Invalid); i++)
+	{
+		RtmpStream* Stream = calloc(1, sizeof(*Stream));
+		RTMP_Init(Stream, Invalid[i], "key", 1 << 20);
+		uint64_t End = TestNow() + 1000000000ULL;
+		while (!RTMP_IsError(Stream) && TestNow() < End)
+		{
+			Sleep(1);
+		}
+		CHECK(RTMP_IsError(Stream));
+		RTMP_Done(Stream);
+		free(Stream);
+	}
+
+	// nothing listens there, stop must not wait for connection attempts
+	RtmpStream* Stream = calloc(1, sizeof(*Stream));
+	RTMP_Init(Stream, "rtmp://127.0.0.1:1/live", "key", 1 << 20);
+	Sleep(50);
+	uint64_t Start = TestNow();
+	RTMP_Done(Stream);
+	CHECK(TestNow() - Start < 1000000000ULL);
+	free(Stream);
+}
+
+int main(void)
+{
+	TestPublish();
+	TestReconnect();
+	TestRing();
+	TestUrls();
+	return TestResult("loopback_test");
+}
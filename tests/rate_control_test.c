@@ -0,0 +1,342 @@
+// drives adaptive bitrate controller with scripted queue traces & simulated link, time is simulated too
+
+#include "../rtmp_stream.h"
+#include "test.h"
+
+static uint64_t FakeTime; // msec
+
+static BOOL FakeQueryPerformanceCounter(LARGE_INTEGER* Counter)
+{
+	// 10MHz same as QueryPerformanceFrequency
+	Counter->QuadPart = (LONGLONG)FakeTime * 10000;
+	return TRUE;
+}
+
+#define QueryPerformanceCounter FakeQueryPerformanceCounter
+#include "../rate_control.c"
+#undef QueryPerformanceCounter
+
+#define STEP 100 // msec between updates, same as wstream stats interval
+
+static const RtmpNetworkStats Congested = { .QueueDelay = 500, .QueueUsage = 10 };
+static const RtmpNetworkStats Clear     = { .QueueDelay = 10,  .QueueUsage = 1 };
+static const RtmpNetworkStats Between   = { .QueueDelay = 200, .QueueUsage = 10 };
+
+static void Start(RateControl* Control, uint32_t Bitrate, uint32_t Min, uint32_t Max)
+{
+	// first update happens long after init, so first decrease is not held back
+	FakeTime = 100000;
+	RateControl_Init(Control, Bitrate, Min, Max);
+}
+
+// returns updates while same stats are repeated for Milliseconds, change times are stored in Times
+static uint32_t Run(RateControl* Control, const RtmpNetworkStats* Stats, uint32_t Milliseconds, uint32_t* Bitrates, uint64_t* Times)
+{
+	uint32_t Count = 0;
+	for (uint32_t Time = 0; Time < Milliseconds; Time += STEP)
+	{
+		FakeTime += STEP;
+		uint32_t Bitrate = RateControl_Update(Control, Stats);
+		if (Bitrate)
+		{
+			Bitrates[Count] = Bitrate;
+			Times[Count] = FakeTime;
+			Count++;
+		}
+	}
+	return Count;
+}
+
+// congested queue decreases bitrate to 75% at most once per second, down to min
+static void TestDecrease(void)
+{
+	RateControl Control;
+	Start(&Control, 8000, 500, 10000);
+
+	uint32_t Bitrates[256];
+	uint64_t Times[256];
+	uint32_t Count = Run(&Control, &Congested, 5000, Bitrates, Times);
+
+	CHECK(Count == 5);
+	uint32_t Expected = 8000;
+	for (uint32_t i = 0; i < Count; i++)
+	{
+		Expected = Expected * 75 / 100;
+		CHECK(Bitrates[i] == Expected);
+		CHECK(i == 0 || Times[i] - Times[i - 1] >= 1000);
+	}
+
+	// first decrease is immediate
+	CHECK(Times[0] == 100000 + STEP);
+
+	// stays at min
+	Count = Run(&Control, &Congested, 20000, Bitrates, Times);
+	CHECK(Control.Bitrate == 500);
+	CHECK(Count > 0 && Bitrates[Count - 1] == 500);
+
+	// drops count as congestion even with clear queue
+	Start(&Control, 4000, 500, 10000);
+	RtmpNetworkStats Drops = Clear;
+	Drops.Dropped = 3;
+	CHECK(Run(&Control, &Drops, STEP, Bitrates, Times) == 1 && Bitrates[0] == 3000);
+	// new drop within one second of previous change waits for interval
+	Drops.Dropped = 4;
+	FakeTime += 400;
+	CHECK(RateControl_Update(&Control, &Drops) == 0);
+	CHECK(Run(&Control, &Congested, 1000, Bitrates, Times) == 1 && Bitrates[0] == 2250);
+	// same counter is not new drop
+	CHECK(Run(&Control, &Drops, 2000, Bitrates, Times) == 0);
+
+	// queue usage alone is congestion
+	Start(&Control, 4000, 500, 10000);
+	RtmpNetworkStats Usage = Clear;
+	Usage.QueueUsage = 20;
+	CHECK(Run(&Control, &Usage, STEP, Bitrates, Times) == 1 && Bitrates[0] == 3000);
+}
+
+// clear queue increases bitrate by 5% (at least 50 kbit/s) once it was clear for 5 sec after last change, up to max
+static void TestIncrease(void)
+{
+	RateControl Control;
+	Start(&Control, 4000, 500, 5000);
+
+	uint32_t Bitrates[256];
+	uint64_t Times[256];
+
+	// one decrease, then clear
+	CHECK(Run(&Control, &Congested, STEP, Bitrates, Times) == 1 && Bitrates[0] == 3000);
+	uint64_t Decreased = Times[0];
+
+	uint32_t Count = Run(&Control, &Clear, 30000, Bitrates, Times);
+	CHECK(Count >= 4);
+	uint32_t Expected = 3000;
+	for (uint32_t i = 0; i < Count; i++)
+	{
+		Expected = min(Expected + max(Expected * 5 / 100, 50), 5000);
+		CHECK(Bitrates[i] == Expected);
+		CHECK(Times[i] - (i == 0 ? Decreased : Times[i - 1]) >= 5000);
+	}
+	CHECK(Times[0] - Decreased < 5000 + 2 * STEP);
+
+	// small bitrates grow by at least 50 kbit/s
+	Start(&Control, 600, 500, 5000);
+	Count = Run(&Control, &Clear, 5000 + STEP, Bitrates, Times);
+	CHECK(Count == 1 && Bitrates[0] == 650);
+
+	// in between clear & congested keeps bitrate & restarts clear period
+	Start(&Control, 3000, 500, 5000);
+	CHECK(Run(&Control, &Clear, 4000, Bitrates, Times) == 0);
+	CHECK(Run(&Control, &Between, 3000, Bitrates, Times) == 0);
+	CHECK(Run(&Control, &Clear, 4900, Bitrates, Times) == 0);
+	CHECK(Run(&Control, &Clear, 2 * STEP, Bitrates, Times) == 1 && Bitrates[0] == 3150);
+
+	// congestion during clear period restarts it
+	CHECK(Run(&Control, &Clear, 3000, Bitrates, Times) == 0);
+	CHECK(Run(&Control, &Congested, STEP, Bitrates, Times) == 1 && Bitrates[0] == 3150 * 75 / 100);
+	CHECK(Run(&Control, &Clear, 4900, Bitrates, Times) == 0);
+}
+
+// bitrate never goes over 85% of bandwidth estimate, also when queue is clear, but never under min
+static void TestBandwidthClamp(void)
+{
+	RateControl Control;
+	Start(&Control, 8000, 500, 10000);
+
+	uint32_t Bitrates[256];
+	uint64_t Times[256];
+
+	// 500 KB/s = 4000 kbit/s, 85% of it is 3400
+	RtmpNetworkStats Stats = Clear;
+	Stats.Bandwidth = 500000;
+	CHECK(Run(&Control, &Stats, STEP, Bitrates, Times) == 1 && Bitrates[0] == 3400);
+
+	// increases stop at clamp
+	CHECK(Run(&Control, &Stats, 60000, Bitrates, Times) == 0);
+	CHECK(Control.Bitrate == 3400);
+
+	// clamp is applied right away, not limited to one change per second
+	Stats.Bandwidth = 250000;
+	CHECK(Run(&Control, &Stats, STEP, Bitrates, Times) == 1 && Bitrates[0] == 1700);
+
+	// congestion decrease below clamp
+	Stats.QueueDelay = Congested.QueueDelay;
+	FakeTime += 1000;
+	CHECK(Run(&Control, &Stats, STEP, Bitrates, Times) == 1 && Bitrates[0] == 1275);
+
+	// estimate lower than min keeps min
+	Stats = Clear;
+	Stats.Bandwidth = 10000;
+	Run(&Control, &Stats, 2000, Bitrates, Times);
+	CHECK(Control.Bitrate == 500);
+
+	// unknown estimate does not limit, queue was clear long enough to increase right away
+	Stats.Bandwidth = 0;
+	FakeTime += 60000;
+	CHECK(Run(&Control, &Stats, STEP, Bitrates, Times) == 1 && Bitrates[0] == 550);
+}
+
+// closed loop with simulated link, capacity changes over time, queue delay & drops come from simple queue model
+static void TestSimulation(void)
+{
+	static const struct { uint32_t Until; uint32_t Capacity; } Trace[] =
+	{
+		{ 30000,  6000 },
+		{ 90000,  2000 }, // uplink degrades
+		{ 120000, 800  },
+		{ 400000, 5000 }, // recovers
+	};
+
+	RateControl Control;
+	Start(&Control, 5000, 300, 8000);
+	uint64_t Begin = FakeTime;
+
+	double Queue = 0;        // kbit waiting in outgoing buffer
+	double QueueSize = 8000; // kbit, like 1MB outgoing buffer
+	uint32_t Dropped = 0;
+	uint32_t Bitrate = Control.Bitrate;
+	uint64_t LastChange = 0;
+	uint64_t LastDecrease = 0;
+	uint32_t Decreases = 0;
+	uint32_t Increases = 0;
+	uint32_t Index = 0;
+
+	FILE* Csv = getenv("RATE_CONTROL_CSV") ? fopen(getenv("RATE_CONTROL_CSV"), "w") : NULL;
+	if (Csv)
+	{
+		fprintf(Csv, "time,capacity,bitrate,delay,dropped\n");
+	}
+
+	for (uint32_t Time = 0; Time < Trace[ARRAYSIZE(Trace) - 1].Until; Time += STEP)
+	{
+		while (Time >= Trace[Index].Until)
+		{
+			Index++;
+		}
+		uint32_t Capacity = Trace[Index].Capacity;
+
+		Queue += (double)((int64_t)Bitrate - Capacity) * STEP / 1000;
+		if (Queue < 0)
+		{
+			Queue = 0;
+		}
+		if (Queue > QueueSize / 2)
+		{
+			// rtmp stream drops video until next keyframe, queue goes down by one GOP
+			Dropped++;
+			Queue -= QueueSize / 4;
+		}
+
+		RtmpNetworkStats Stats =
+		{
+			.QueueDelay = (uint32_t)(Queue * 1000 / Capacity),
+			.QueueUsage = (uint32_t)(Queue * 100 / QueueSize),
+			.Dropped = Dropped,
+			.Bandwidth = Capacity * 1000 / 8,
+		};
+		uint32_t Limit = max(min(Control.MaxBitrate, Stats.Bandwidth * 8 / 1000 * 85 / 100), Control.MinBitrate);
+
+		FakeTime += STEP;
+		uint32_t Previous = Bitrate;
+		uint32_t New = RateControl_Update(&Control, &Stats);
+		if (New)
+		{
+			if (New < Previous && New != Limit)
+			{
+				// congestion decrease
+				CHECK(New == max(Previous * 75 / 100, Control.MinBitrate));
+				CHECK(Decreases == 0 || FakeTime - LastDecrease >= 1000);
+				LastDecrease = FakeTime;
+				Decreases++;
+			}
+			else if (New > Previous)
+			{
+				CHECK(New <= Previous + max(Previous * 5 / 100, 50));
+				CHECK(LastChange == 0 || FakeTime - LastChange >= 5000);
+				Increases++;
+			}
+			LastChange = FakeTime;
+			Bitrate = New;
+		}
+		CHECK(Bitrate <= Limit);
+
+		if (Csv)
+		{
+			fprintf(Csv, "%u,%u,%u,%u,%u\n", (uint32_t)(FakeTime - Begin), Capacity, Bitrate, Stats.QueueDelay, Dropped);
+		}
+	}
+
+	if (Csv)
+	{
+		fclose(Csv);
+	}
+
+	// clamp keeps queue from ever getting to drops, bitrate came back up to clamp after recovery
+	CHECK(Dropped == 0);
+	CHECK(Increases > 0);
+	CHECK(Bitrate == 5000 * 85 / 100);
+
+	// same link without bandwidth estimate, only queue delay & drops drive controller
+	Start(&Control, 5000, 300, 8000);
+	Queue = 0;
+	Dropped = 0;
+	Bitrate = Control.Bitrate;
+	Decreases = 0;
+	LastDecrease = 0;
+	Index = 0;
+	uint32_t DroppedAfterSettle = 0;
+	for (uint32_t Time = 0; Time < Trace[ARRAYSIZE(Trace) - 1].Until; Time += STEP)
+	{
+		while (Time >= Trace[Index].Until)
+		{
+			Index++;
+		}
+		uint32_t Capacity = Trace[Index].Capacity;
+
+		Queue += (double)((int64_t)Bitrate - Capacity) * STEP / 1000;
+		if (Queue < 0)
+		{
+			Queue = 0;
+		}
+		if (Queue > QueueSize / 2)
+		{
+			Dropped++;
+			DroppedAfterSettle += Time > 40000 && Time < 90000;
+			Queue -= QueueSize / 4;
+		}
+
+		RtmpNetworkStats Stats =
+		{
+			.QueueDelay = (uint32_t)(Queue * 1000 / Capacity),
+			.QueueUsage = (uint32_t)(Queue * 100 / QueueSize),
+			.Dropped = Dropped,
+		};
+
+		FakeTime += STEP;
+		uint32_t Previous = Bitrate;
+		uint32_t New = RateControl_Update(&Control, &Stats);
+		if (New)
+		{
+			if (New < Previous)
+			{
+				CHECK(New == max(Previous * 75 / 100, Control.MinBitrate));
+				CHECK(Decreases == 0 || FakeTime - LastDecrease >= 1000);
+				LastDecrease = FakeTime;
+				Decreases++;
+			}
+			Bitrate = New;
+		}
+	}
+
+	// controller settles under capacity, so drops stop once it adapted to degraded link
+	CHECK(Decreases > 0);
+	CHECK(DroppedAfterSettle == 0);
+}
+
+int main(void)
+{
+	TestDecrease();
+	TestIncrease();
+	TestBandwidthClamp();
+	TestSimulation();
+	return TestResult("rate_control_test");
+}
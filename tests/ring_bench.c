@@ -0,0 +1,160 @@
+// many loopback publishers at fixed frame rate, network thread CPU per stream with own epoll loops & with one io_uring ring
+// CPU time is taken from thread clocks of network threads, and of ring thread when streams share ring
+
+#include "../rtmp_stream.h"
+#include "test_server.h"
+
+#include <sched.h>
+
+#define BENCH_SECONDS 3
+#define BENCH_FPS 60
+#define BENCH_AUDIO_PER_FRAME 2 // ~47 AAC frames per second at 48 kHz
+#define BENCH_FRAME (6000 * 1000 / 8 / BENCH_FPS) // 6 Mbit/s video
+
+static uint8_t Frame[BENCH_FRAME];
+static uint8_t Audio[400];
+
+static uint64_t ThreadTime(pthread_t Thread)
+{
+	clockid_t Clock;
+	struct timespec Time;
+	pthread_getcpuclockid(Thread, &Clock);
+	clock_gettime(Clock, &Time);
+	return Time.tv_sec * 1000000000ULL + Time.tv_nsec;
+}
+
+static void Run(uint32_t Count, bool UseRing)
+{
+	TestServer Server;
+	TestServer_Start(&Server);
+
+	char Url[128];
+	snprintf(Url, sizeof(Url), "rtmp://127.0.0.1:%u/live", Server.Port);
+
+	RtmpRing Ring;
+	if (UseRing)
+	{
+		RTMP_RingInit(&Ring, Count);
+	}
+
+	RtmpStream** Streams = calloc(Count, sizeof(*Streams));
+	for (uint32_t i = 0; i < Count; i++)
+	{
+		Streams[i] = calloc(1, sizeof(*Streams[i]));
+		if (UseRing)
+		{
+			RTMP_InitRing(Streams[i], &Ring, Url, "bench", 4 << 20);
+		}
+		else
+		{
+			RTMP_Init(Streams[i], Url, "bench", 4 << 20);
+		}
+	}
+
+	static const uint8_t VideoHeader[] = { 1, 0x64, 0, 0x1f, 0xff, 0xe1, 0, 0 };
+	static const uint8_t AudioHeader[] = { 0x12, 0x10 };
+	RtmpVideoConfig VideoConfig = { .Codec = RTMP_VIDEO_CODEC_AVC, .Header = VideoHeader, .HeaderSize = sizeof(VideoHeader) };
+	RtmpAudioConfig AudioConfig = { .Codec = RTMP_AUDIO_CODEC_AAC, .SampleRate = 48000, .Channels = 2, .Header = AudioHeader, .HeaderSize = sizeof(AudioHeader) };
+	for (uint32_t i = 0; i < Count; i++)
+	{
+		while (!RTMP_IsStreaming(Streams[i]))
+		{
+			Sleep(1);
+		}
+		RTMP_SendConfig(Streams[i], &VideoConfig, &AudioConfig);
+		while (!RTMP_SendVideo(Streams[i], 0, 0, 1000, Frame, 100, true, false))
+		{
+			Sleep(1);
+		}
+	}
+	while (__atomic_load_n(&Server.VideoMessages, __ATOMIC_RELAXED) < 2 * Count)
+	{
+		Sleep(1);
+	}
+
+	// everything that runs sessions, stream threads only wait for ring while it is used
+	uint64_t CpuStart = UseRing ? ThreadTime(Ring.Thread->Thread) : 0;
+	for (uint32_t i = 0; i < Count; i++)
+	{
+		CpuStart += ThreadTime(Streams[i]->Thread->Thread);
+	}
+	uint64_t SendCalls = 0;
+	uint64_t Wakeups = 0;
+	for (uint32_t i = 0; i < Count; i++)
+	{
+		SendCalls -= Streams[i]->SendCalls;
+		Wakeups -= Streams[i]->Wakeups;
+	}
+	uint64_t Enters = UseRing ? Ring.Enters : 0;
+	uint64_t StartMessages = Server.VideoMessages;
+
+	uint64_t Start = TestNow();
+	uint64_t Next = Start;
+	uint32_t Frames = BENCH_SECONDS * BENCH_FPS;
+	uint64_t Dropped = 0;
+	for (uint32_t f = 1; f <= Frames; f++)
+	{
+		Next += 1000000000ULL / BENCH_FPS;
+		while (TestNow() < Next)
+		{
+			Sleep(1);
+		}
+		for (uint32_t i = 0; i < Count; i++)
+		{
+			Dropped += !RTMP_SendVideo(Streams[i], f * 16, f * 16, 1000, Frame, sizeof(Frame), f % BENCH_FPS == 0, false);
+			for (uint32_t k = 0; k < BENCH_AUDIO_PER_FRAME; k++)
+			{
+				Dropped += !RTMP_SendAudio(Streams[i], f * 16 + k * 8, 1000, Audio, sizeof(Audio));
+			}
+		}
+	}
+	uint64_t Expected = StartMessages + (uint64_t)Frames * Count;
+	uint64_t WaitEnd = TestNow() + 5000000000ULL;
+	while (__atomic_load_n(&Server.VideoMessages, __ATOMIC_RELAXED) < Expected && TestNow() < WaitEnd)
+	{
+		sched_yield();
+	}
+	uint64_t Time = TestNow() - Start;
+
+	uint64_t CpuEnd = UseRing ? ThreadTime(Ring.Thread->Thread) : 0;
+	for (uint32_t i = 0; i < Count; i++)
+	{
+		CpuEnd += ThreadTime(Streams[i]->Thread->Thread);
+		SendCalls += Streams[i]->SendCalls;
+		Wakeups += Streams[i]->Wakeups;
+	}
+	Enters = UseRing ? Ring.Enters - Enters : 0;
+	uint64_t FrameCount = (uint64_t)Frames * Count;
+
+	printf("%-5s %3u streams: %6.2f%% of one cpu per stream, %5.2f send calls, %5.2f wakeups, %5.2f io_uring_enter per stream frame, %llu dropped\n",
+		UseRing ? "ring" : "epoll",
+		Count,
+		(double)(CpuEnd - CpuStart) * 100 / Time / Count,
+		(double)SendCalls / FrameCount,
+		(double)Wakeups / FrameCount,
+		(double)Enters / FrameCount,
+		(unsigned long long)Dropped);
+
+	for (uint32_t i = 0; i < Count; i++)
+	{
+		RTMP_Done(Streams[i]);
+		free(Streams[i]);
+	}
+	free(Streams);
+	if (UseRing)
+	{
+		RTMP_RingDone(&Ring);
+	}
+	TestServer_Stop(&Server);
+}
+
+int main(void)
+{
+	static const uint32_t Counts[] = { 1, 16, 128 };
+	for (uint32_t i = 0; i < ARRAYSIZE(Counts); i++)
+	{
+		Run(Counts[i], false);
+		Run(Counts[i], true);
+	}
+	return 0;
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+// shared helpers for tests & benchmarks, each one is single program that includes code it tests
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+
+static uint32_t TestFailures;
+
+#define CHECK(Cond) do {                                                     \
+	if (!(Cond)) {                                                           \
+		fprintf(stderr, "%s:%d: CHECK failed: %s\n", __FILE__, __LINE__, #Cond); \
+		TestFailures++;                                                      \
+	}                                                                        \
+} while (0)
+
+// nanoseconds from monotonic clock
+static inline uint64_t TestNow(void)
+{
+	struct timespec Time;
+	clock_gettime(CLOCK_MONOTONIC, &Time);
+	return (uint64_t)Time.tv_sec * 1000000000 + Time.tv_nsec;
+}
+
+static inline int TestResult(const char* Name)
+{
+	if (TestFailures)
+	{
+		printf("%s: FAILED (%u checks)\n", Name, TestFailures);
+		return 1;
+	}
+	printf("%s: OK\n", Name);
+	return 0;
+}
@@ -0,0 +1,444 @@
+#pragma once
+
+// minimal RTMP server on loopback for tests & benchmarks, every connection is served by its own blocking thread
+// does handshake, answers connect/createStream/publish & counts received media, everything else is ignored
+
+#include "test.h"
+
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#define TEST_SERVER_MAX_MESSAGE (16 << 20)
+#define TEST_SERVER_MAX_CHUNK_STREAMS 64
+#define TEST_SERVER_MAX_CONNECTIONS 1024
+
+typedef struct {
+	int Listen;
+	uint16_t Port;
+	pthread_t Thread;
+
+	int Sockets[TEST_SERVER_MAX_CONNECTIONS];
+	volatile uint32_t Connections;
+	volatile uint32_t Published;
+	volatile uint64_t MediaBytes;   // payload bytes of received audio & video messages
+	volatile uint64_t AudioMessages;
+	volatile uint64_t VideoMessages;
+	volatile uint32_t LastTimestamp[2]; // of last audio & video message
+} TestServer;
+
+typedef struct {
+	uint32_t Id;
+	uint32_t Timestamp;
+	uint32_t Delta;
+	uint32_t Length;
+	uint32_t Type;
+	uint32_t StreamId;
+	bool Extended;
+	uint32_t Received;
+	uint8_t* Data;
+} TestChunk;
+
+typedef struct {
+	TestServer* Server;
+	int Socket;
+	uint32_t ChunkSize;
+	TestChunk Chunks[TEST_SERVER_MAX_CHUNK_STREAMS];
+} TestConnection;
+
+static bool TestServer__Read(int Socket, void* Data, size_t Size)
+{
+	uint8_t* Ptr = Data;
+	while (Size)
+	{
+		ssize_t Read = recv(Socket, Ptr, Size, 0);
+		if (Read <= 0)
+		{
+			return false;
+		}
+		Ptr += Read;
+		Size -= Read;
+	}
+	return true;
+}
+
+static bool TestServer__Write(int Socket, const void* Data, size_t Size)
+{
+	const uint8_t* Ptr = Data;
+	while (Size)
+	{
+		ssize_t Written = send(Socket, Ptr, Size, MSG_NOSIGNAL);
+		if (Written <= 0)
+		{
+			return false;
+		}
+		Ptr += Written;
+		Size -= Written;
+	}
+	return true;
+}
+
+// AMF0 writers
+
+static uint8_t* TestAmf__String(uint8_t* Ptr, const char* Str)
+{
+	size_t Length = strlen(Str);
+	*Ptr++ = 2;
+	*Ptr++ = (uint8_t)(Length >> 8);
+	*Ptr++ = (uint8_t)Length;
+	memcpy(Ptr, Str, Length);
+	return Ptr + Length;
+}
+
+static uint8_t* TestAmf__Key(uint8_t* Ptr, const char* Str)
+{
+	size_t Length = strlen(Str);
+	*Ptr++ = (uint8_t)(Length >> 8);
+	*Ptr++ = (uint8_t)Length;
+	memcpy(Ptr, Str, Length);
+	return Ptr + Length;
+}
+
+static uint8_t* TestAmf__Number(uint8_t* Ptr, double Value)
+{
+	uint64_t Bits;
+	memcpy(&Bits, &Value, sizeof(Bits));
+	*Ptr++ = 0;
+	for (int i = 7; i >= 0; i--)
+	{
+		*Ptr++ = (uint8_t)(Bits >> (i * 8));
+	}
+	return Ptr;
+}
+
+// reads AMF0 string & number that follows it, returns false if message does not start like command
+static bool TestAmf__Command(const uint8_t* Data, uint32_t Size, char* Name, size_t NameSize, double* Transaction)
+{
+	if (Size < 3 || Data[0] != 2)
+	{
+		return false;
+	}
+	uint32_t Length = (Data[1] << 8) | Data[2];
+	if (Size < 3 + Length + 9 || Length >= NameSize || Data[3 + Length] != 0)
+	{
+		return false;
+	}
+	memcpy(Name, Data + 3, Length);
+	Name[Length] = 0;
+
+	uint64_t Bits = 0;
+	for (int i = 0; i < 8; i++)
+	{
+		Bits = (Bits << 8) | Data[3 + Length + 1 + i];
+	}
+	memcpy(Transaction, &Bits, sizeof(*Transaction));
+	return true;
+}
+
+// sends message with default 128 byte chunks on chunk stream 3
+static bool TestServer__Send(TestConnection* Connection, uint32_t Type, uint32_t StreamId, const uint8_t* Data, uint32_t Size)
+{
+	uint8_t Buffer[4096];
+	uint8_t* Ptr = Buffer;
+
+	*Ptr++ = 3;
+	*Ptr++ = 0; *Ptr++ = 0; *Ptr++ = 0;
+	*Ptr++ = (uint8_t)(Size >> 16); *Ptr++ = (uint8_t)(Size >> 8); *Ptr++ = (uint8_t)Size;
+	*Ptr++ = (uint8_t)Type;
+	*Ptr++ = (uint8_t)StreamId; *Ptr++ = (uint8_t)(StreamId >> 8); *Ptr++ = (uint8_t)(StreamId >> 16); *Ptr++ = (uint8_t)(StreamId >> 24);
+
+	for (uint32_t Offset = 0; Offset < Size; Offset += 128)
+	{
+		if (Offset != 0)
+		{
+			*Ptr++ = 0xc3;
+		}
+		uint32_t Count = Size - Offset < 128 ? Size - Offset : 128;
+		memcpy(Ptr, Data + Offset, Count);
+		Ptr += Count;
+	}
+	return TestServer__Write(Connection->Socket, Buffer, Ptr - Buffer);
+}
+
+static bool TestServer__Message(TestConnection* Connection, TestChunk* Chunk)
+{
+	TestServer* Server = Connection->Server;
+
+	if (Chunk->Type == 1 && Chunk->Length == 4)
+	{
+		Connection->ChunkSize = ((Chunk->Data[0] << 24) | (Chunk->Data[1] << 16) | (Chunk->Data[2] << 8) | Chunk->Data[3]) & 0x7fffffff;
+	}
+	else if (Chunk->Type == 8 || Chunk->Type == 9)
+	{
+		__atomic_add_fetch(&Server->MediaBytes, Chunk->Length, __ATOMIC_RELAXED);
+		__atomic_add_fetch(Chunk->Type == 8 ? &Server->AudioMessages : &Server->VideoMessages, 1, __ATOMIC_RELAXED);
+		__atomic_store_n(&Server->LastTimestamp[Chunk->Type - 8], Chunk->Timestamp, __ATOMIC_RELAXED);
+	}
+	else if (Chunk->Type == 20)
+	{
+		char Name[64];
+		double Transaction;
+		if (!TestAmf__Command(Chunk->Data, Chunk->Length, Name, sizeof(Name), &Transaction))
+		{
+			return true;
+		}
+
+		uint8_t Reply[512];
+		uint8_t* Ptr = Reply;
+		if (strcmp(Name, "connect") == 0)
+		{
+			Ptr = TestAmf__String(Ptr, "_result");
+			Ptr = TestAmf__Number(Ptr, Transaction);
+			*Ptr++ = 5;
+			*Ptr++ = 5;
+			return TestServer__Send(Connection, 20, 0, Reply, (uint32_t)(Ptr - Reply));
+		}
+		else if (strcmp(Name, "createStream") == 0)
+		{
+			Ptr = TestAmf__String(Ptr, "_result");
+			Ptr = TestAmf__Number(Ptr, Transaction);
+			*Ptr++ = 5;
+			Ptr = TestAmf__Number(Ptr, 1);
+			return TestServer__Send(Connection, 20, 0, Reply, (uint32_t)(Ptr - Reply));
+		}
+		else if (strcmp(Name, "publish") == 0)
+		{
+			Ptr = TestAmf__String(Ptr, "onStatus");
+			Ptr = TestAmf__Number(Ptr, 0);
+			*Ptr++ = 5;
+			*Ptr++ = 3;
+			Ptr = TestAmf__Key(Ptr, "level");
+			Ptr = TestAmf__String(Ptr, "status");
+			Ptr = TestAmf__Key(Ptr, "code");
+			Ptr = TestAmf__String(Ptr, "NetStream.Publish.Start");
+			*Ptr++ = 0; *Ptr++ = 0; *Ptr++ = 9;
+			__atomic_add_fetch(&Server->Published, 1, __ATOMIC_RELAXED);
+			return TestServer__Send(Connection, 20, 1, Reply, (uint32_t)(Ptr - Reply));
+		}
+	}
+	return true;
+}
+
+static TestChunk* TestServer__GetChunk(TestConnection* Connection, uint32_t Id)
+{
+	TestChunk* Free = NULL;
+	for (uint32_t i = 0; i < TEST_SERVER_MAX_CHUNK_STREAMS; i++)
+	{
+		TestChunk* Chunk = &Connection->Chunks[i];
+		if (Chunk->Data && Chunk->Id == Id)
+		{
+			return Chunk;
+		}
+		if (!Chunk->Data && !Free)
+		{
+			Free = Chunk;
+		}
+	}
+	if (Free)
+	{
+		Free->Id = Id;
+		Free->Data = malloc(TEST_SERVER_MAX_MESSAGE);
+	}
+	return Free;
+}
+
+// parses chunk stream with all header formats & extended timestamps, returns false when connection is done
+static bool TestServer__Chunk(TestConnection* Connection)
+{
+	uint8_t Basic;
+	if (!TestServer__Read(Connection->Socket, &Basic, 1))
+	{
+		return false;
+	}
+
+	uint32_t Format = Basic >> 6;
+	uint32_t Id = Basic & 0x3f;
+	if (Id == 0 || Id == 1)
+	{
+		uint8_t Extra[2] = { 0 };
+		if (!TestServer__Read(Connection->Socket, Extra, Id == 0 ? 1 : 2))
+		{
+			return false;
+		}
+		Id = 64 + Extra[0] + (Id == 1 ? Extra[1] * 256 : 0);
+	}
+
+	TestChunk* Chunk = TestServer__GetChunk(Connection, Id);
+	if (!Chunk)
+	{
+		return false;
+	}
+
+	static const uint32_t HeaderSize[] = { 11, 7, 3, 0 };
+	uint8_t Header[11];
+	if (!TestServer__Read(Connection->Socket, Header, HeaderSize[Format]))
+	{
+		return false;
+	}
+
+	if (Format != 3)
+	{
+		uint32_t Timestamp = (Header[0] << 16) | (Header[1] << 8) | Header[2];
+		Chunk->Extended = Timestamp == 0xffffff;
+		if (Format <= 1)
+		{
+			Chunk->Length = (Header[3] << 16) | (Header[4] << 8) | Header[5];
+			Chunk->Type = Header[6];
+		}
+		if (Format == 0)
+		{
+			Chunk->StreamId = Header[7] | (Header[8] << 8) | (Header[9] << 16) | ((uint32_t)Header[10] << 24);
+		}
+		if (Chunk->Extended)
+		{
+			uint8_t Ext[4];
+			if (!TestServer__Read(Connection->Socket, Ext, 4))
+			{
+				return false;
+			}
+			Timestamp = ((uint32_t)Ext[0] << 24) | (Ext[1] << 16) | (Ext[2] << 8) | Ext[3];
+		}
+		Chunk->Delta = Format == 0 ? 0 : Timestamp;
+		Chunk->Timestamp = Format == 0 ? Timestamp : Chunk->Timestamp + Timestamp;
+	}
+	else
+	{
+		if (Chunk->Extended)
+		{
+			// fmt=3 chunk repeats extended timestamp of previous header
+			uint8_t Ext[4];
+			if (!TestServer__Read(Connection->Socket, Ext, 4))
+			{
+				return false;
+			}
+		}
+		if (Chunk->Received == 0)
+		{
+			// new message with same header as previous one
+			Chunk->Timestamp += Chunk->Delta;
+		}
+	}
+
+	if (Chunk->Length > TEST_SERVER_MAX_MESSAGE)
+	{
+		return false;
+	}
+
+	uint32_t Count = Chunk->Length - Chunk->Received;
+	if (Count > Connection->ChunkSize)
+	{
+		Count = Connection->ChunkSize;
+	}
+	if (!TestServer__Read(Connection->Socket, Chunk->Data + Chunk->Received, Count))
+	{
+		return false;
+	}
+	Chunk->Received += Count;
+
+	if (Chunk->Received == Chunk->Length)
+	{
+		Chunk->Received = 0;
+		return TestServer__Message(Connection, Chunk);
+	}
+	return true;
+}
+
+static void* TestServer__Connection(void* Arg)
+{
+	TestConnection* Connection = Arg;
+	int Socket = Connection->Socket;
+
+	// C0+C1, reply with S0+S1+S2 where S2 echoes C1, then C2
+	uint8_t* Handshake = malloc(1 + 1536 + 1536);
+	if (TestServer__Read(Socket, Handshake, 1 + 1536))
+	{
+		memcpy(Handshake + 1 + 1536, Handshake + 1, 1536);
+		memset(Handshake + 1, 0, 1536);
+		Handshake[0] = 3;
+		if (TestServer__Write(Socket, Handshake, 1 + 1536 + 1536) && TestServer__Read(Socket, Handshake, 1536))
+		{
+			while (TestServer__Chunk(Connection))
+			{
+			}
+		}
+	}
+	free(Handshake);
+
+	for (uint32_t i = 0; i < TEST_SERVER_MAX_CHUNK_STREAMS; i++)
+	{
+		free(Connection->Chunks[i].Data);
+	}
+	close(Socket);
+	free(Connection);
+	return NULL;
+}
+
+static void* TestServer__Accept(void* Arg)
+{
+	TestServer* Server = Arg;
+	for (;;)
+	{
+		int Socket = accept(Server->Listen, NULL, NULL);
+		if (Socket < 0)
+		{
+			// listening socket was shut down
+			break;
+		}
+		uint32_t Index = __atomic_fetch_add(&Server->Connections, 1, __ATOMIC_RELAXED);
+		if (Index < TEST_SERVER_MAX_CONNECTIONS)
+		{
+			Server->Sockets[Index] = Socket;
+		}
+
+		TestConnection* Connection = calloc(1, sizeof(*Connection));
+		Connection->Server = Server;
+		Connection->Socket = Socket;
+		Connection->ChunkSize = 128;
+
+		pthread_t Thread;
+		pthread_create(&Thread, NULL, &TestServer__Connection, Connection);
+		pthread_detach(Thread);
+	}
+	return NULL;
+}
+
+// listens on ephemeral 127.0.0.1 port
+static void TestServer_Start(TestServer* Server)
+{
+	memset(Server, 0, sizeof(*Server));
+
+	Server->Listen = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	struct sockaddr_in Address = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+	socklen_t AddressSize = sizeof(Address);
+	if (bind(Server->Listen, (struct sockaddr*)&Address, sizeof(Address)) != 0 || listen(Server->Listen, 256) != 0)
+	{
+		perror("test server");
+		exit(1);
+	}
+	getsockname(Server->Listen, (struct sockaddr*)&Address, &AddressSize);
+	Server->Port = ntohs(Address.sin_port);
+
+	pthread_create(&Server->Thread, NULL, &TestServer__Accept, Server);
+}
+
+// closes all connections accepted so far, clients see it as lost connection
+static void TestServer_Drop(TestServer* Server)
+{
+	uint32_t Count = __atomic_load_n(&Server->Connections, __ATOMIC_RELAXED);
+	for (uint32_t i = 0; i < Count && i < TEST_SERVER_MAX_CONNECTIONS; i++)
+	{
+		shutdown(Server->Sockets[i], SHUT_RDWR);
+	}
+}
+
+// stops accepting, connections end when clients close them
+static void TestServer_Stop(TestServer* Server)
+{
+	shutdown(Server->Listen, SHUT_RDWR);
+	pthread_join(Server->Thread, NULL);
+	close(Server->Listen);
+}
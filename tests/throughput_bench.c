@@ -0,0 +1,132 @@
+// publishes video as fast as outgoing buffer takes it to local RTMP server & measures delivered throughput
+// plain blocking send() of same bytes to sink over loopback is baseline, it is upper bound for any send loop
+
+#include "../rtmp_stream.h"
+#include "test_server.h"
+
+#include <sched.h>
+
+#define BENCH_BYTES (1024ULL << 20)
+#define BENCH_FRAME (256 << 10)
+
+static uint8_t Frame[BENCH_FRAME];
+
+static void* Sink(void* Arg)
+{
+	int Listen = *(int*)Arg;
+	int Socket = accept(Listen, NULL, NULL);
+	static uint8_t Buffer[1 << 20];
+	while (recv(Socket, Buffer, sizeof(Buffer), 0) > 0)
+	{
+	}
+	close(Socket);
+	return NULL;
+}
+
+static double Baseline(void)
+{
+	int Listen = socket(AF_INET, SOCK_STREAM, 0);
+	struct sockaddr_in Address = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+	socklen_t AddressSize = sizeof(Address);
+	bind(Listen, (struct sockaddr*)&Address, sizeof(Address));
+	listen(Listen, 1);
+	getsockname(Listen, (struct sockaddr*)&Address, &AddressSize);
+
+	pthread_t Thread;
+	pthread_create(&Thread, NULL, &Sink, &Listen);
+
+	int Socket = socket(AF_INET, SOCK_STREAM, 0);
+	connect(Socket, (struct sockaddr*)&Address, sizeof(Address));
+
+	uint64_t Start = TestNow();
+	for (uint64_t Sent = 0; Sent < BENCH_BYTES; Sent += BENCH_FRAME)
+	{
+		TestServer__Write(Socket, Frame, BENCH_FRAME);
+	}
+	close(Socket);
+	pthread_join(Thread, NULL);
+	uint64_t Time = TestNow() - Start;
+
+	close(Listen);
+	return (double)BENCH_BYTES / Time * 1e9 / (1 << 20);
+}
+
+static double Publish(uint32_t MaxSends, uint32_t CoalesceSize, uint32_t* SendCalls)
+{
+	TestServer Server;
+	TestServer_Start(&Server);
+
+	char Url[128];
+	snprintf(Url, sizeof(Url), "rtmp://127.0.0.1:%u/live", Server.Port);
+
+	RtmpStream* Stream = calloc(1, sizeof(*Stream));
+	RTMP_Init(Stream, Url, "bench", 32 << 20);
+	RTMP_SetMaxSends(Stream, MaxSends);
+	RTMP_SetCoalescing(Stream, CoalesceSize, 2000);
+
+	while (!RTMP_IsStreaming(Stream))
+	{
+		Sleep(1);
+	}
+
+	static const uint8_t VideoHeader[] = { 1, 0x64, 0, 0x1f, 0xff, 0xe1, 0, 0 };
+	RtmpVideoConfig VideoConfig = { .Codec = RTMP_VIDEO_CODEC_AVC, .Header = VideoHeader, .HeaderSize = sizeof(VideoHeader) };
+	RTMP_SendConfig(Stream, &VideoConfig, NULL);
+	while (!RTMP_SendVideo(Stream, 0, 0, 1000, Frame, 100, true, false))
+	{
+		Sleep(1);
+	}
+	while (__atomic_load_n(&Server.VideoMessages, __ATOMIC_RELAXED) < 2)
+	{
+		Sleep(1);
+	}
+
+	uint64_t Start = TestNow();
+	uint64_t StartBytes = Server.MediaBytes;
+	uint32_t Count = (uint32_t)(BENCH_BYTES / BENCH_FRAME);
+	for (uint32_t i = 1; i <= Count; i++)
+	{
+		// every frame is keyframe, so frame that did not fit does not cause drops after it
+		while (!RTMP_SendVideo(Stream, i, i, 1000, Frame, BENCH_FRAME, true, false))
+		{
+			sched_yield();
+		}
+	}
+	while (__atomic_load_n(&Server.VideoMessages, __ATOMIC_RELAXED) < 2 + Count)
+	{
+		sched_yield();
+	}
+	uint64_t Time = TestNow() - Start;
+	uint64_t Bytes = Server.MediaBytes - StartBytes;
+
+	RtmpStats Stats;
+	RTMP_GetStats(Stream, &Stats);
+	*SendCalls = (uint32_t)Stats.SendCalls;
+
+	RTMP_Done(Stream);
+	free(Stream);
+	TestServer_Stop(&Server);
+
+	return (double)Bytes / Time * 1e9 / (1 << 20);
+}
+
+int main(void)
+{
+	double Raw = Baseline();
+	printf("baseline blocking send():         %8.1f MiB/s\n", Raw);
+
+	static const struct { uint32_t MaxSends; uint32_t CoalesceSize; } Configs[] =
+	{
+		{ 1, 0 },
+		{ 4, 0 },
+		{ 4, 64 << 10 },
+	};
+	for (uint32_t i = 0; i < ARRAYSIZE(Configs); i++)
+	{
+		uint32_t SendCalls;
+		double Rate = Publish(Configs[i].MaxSends, Configs[i].CoalesceSize, &SendCalls);
+		printf("rtmp sends=%u coalesce=%-6u        %8.1f MiB/s, %5.1f%% of baseline, %u send calls\n",
+			Configs[i].MaxSends, Configs[i].CoalesceSize, Rate, Rate * 100 / Raw, SendCalls);
+	}
+	return 0;
+}
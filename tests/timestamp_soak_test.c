@@ -0,0 +1,268 @@
+// sends messages through RTMP__AddChunk & parses produced chunks back with RTMP__DoChunk
+// covers timestamps & deltas around 0xffffff and 2^32, and simulated 48 hour stream with reconnects
+
+#include "../rtmp_stream.c"
+#include "test.h"
+
+#define CHUNK_SIZE 128
+
+typedef struct {
+	uint8_t Data[1 << 16];
+	uint32_t Size;
+} Bytes;
+
+static uint32_t ExtendedContinuations;
+
+// stream that was never connected, network thread has exited because of invalid url
+static RtmpStream* Open(void)
+{
+	RtmpStream* Stream = calloc(1, sizeof(*Stream));
+	RTMP_Init(Stream, "invalid", "key", 1 << 20);
+	while (!RTMP_IsError(Stream))
+	{
+		Sleep(1);
+	}
+	Stream->State = RTMP_STATE_STREAM_READY;
+	Stream->ChunkSize = CHUNK_SIZE;
+	Stream->SendChunkSize = CHUNK_SIZE;
+	return Stream;
+}
+
+static void Close(RtmpStream* Stream)
+{
+	RTMP_Done(Stream);
+	free(Stream);
+}
+
+// same state as network thread has after reconnecting, server side starts with fresh chunk streams
+static void Reconnect(RtmpStream* Sender, RtmpStream** Receiver)
+{
+	ZeroMemory(Sender->SendTimestamp, sizeof(Sender->SendTimestamp));
+	ZeroMemory(Sender->SendExtended, sizeof(Sender->SendExtended));
+	ZeroMemory(Sender->SendHasTimestamp, sizeof(Sender->SendHasTimestamp));
+
+	Close(*Receiver);
+	*Receiver = Open();
+	RTMP__GetChunk(*Receiver, RTMP_CHANNEL_AUDIO, true);
+	RTMP__GetChunk(*Receiver, RTMP_CHANNEL_VIDEO, true);
+}
+
+// writes all chunks of message & checks that every fmt=3 continuation repeats extended field of first chunk
+static void Write(RtmpStream* Sender, Bytes* Out, uint32_t ChunkStreamId, uint32_t Format, uint32_t Timestamp, uint32_t MessageType, const uint8_t* Payload, uint32_t Size)
+{
+	RtmpMessage Entry =
+	{
+		.ChunkStreamId = ChunkStreamId,
+		.ChunkFormat = Format,
+		.Timestamp = Timestamp,
+		.MessageType = MessageType,
+		.MessageStreamId = 1,
+		.Data = Payload,
+		.DataSize = Size,
+	};
+
+	uint32_t Extended = 0;
+	bool IsExtended = false;
+	for (uint32_t Sent = 0; Sent < Size; )
+	{
+		uint8_t Headers[RTMP_MAX_CHUNK_HEADER];
+		RtmpSendBatch Batch = { .Header = Headers, .HeaderEnd = Headers + sizeof(Headers) };
+		uint32_t Next = RTMP__AddChunk(Sender, &Batch, &Entry, Sent, 0);
+
+		const uint8_t* Header = Batch.Buffers[0].iov_base;
+		uint32_t HeaderSize = (uint32_t)Batch.Buffers[0].iov_len;
+		if (Sent == 0)
+		{
+			uint32_t BaseSize = Format == 0 ? 12 : 8;
+			IsExtended = Header[1] == 0xff && Header[2] == 0xff && Header[3] == 0xff;
+			CHECK(HeaderSize == BaseSize + (IsExtended ? 4 : 0));
+			if (IsExtended)
+			{
+				const uint8_t* Ptr = Header + BaseSize;
+				BE_GET4(Ptr, Extended);
+			}
+		}
+		else
+		{
+			CHECK(Header[0] == ((3 << 6) | ChunkStreamId));
+			CHECK(HeaderSize == 1 + (IsExtended ? 4 : 0));
+			if (IsExtended && HeaderSize == 5)
+			{
+				const uint8_t* Ptr = Header + 1;
+				uint32_t Repeated;
+				BE_GET4(Ptr, Repeated);
+				CHECK(Repeated == Extended);
+				ExtendedContinuations++;
+			}
+		}
+
+		for (uint32_t i = 0; i < Batch.BufferCount; i++)
+		{
+			memcpy(Out->Data + Out->Size, Batch.Buffers[i].iov_base, Batch.Buffers[i].iov_len);
+			Out->Size += (uint32_t)Batch.Buffers[i].iov_len;
+		}
+		Sent = Next;
+	}
+}
+
+static void Feed(RtmpStream* Receiver, const Bytes* In)
+{
+	for (uint32_t Offset = 0; Offset < In->Size && !Receiver->Disconnect; )
+	{
+		uint32_t Size = min(In->Size - Offset, RB_GetFree(&Receiver->Recv));
+		CopyMemory(RB_BeginWrite(&Receiver->Recv), In->Data + Offset, Size);
+		RB_EndWrite(&Receiver->Recv, Size);
+		Offset += Size;
+		RTMP__DoChunk(INVALID_SOCKET, Receiver);
+	}
+}
+
+// sends one message & returns timestamp receiver parsed for it
+static uint32_t Transfer(RtmpStream* Sender, RtmpStream* Receiver, uint32_t ChunkStreamId, uint32_t Format, uint32_t Timestamp, uint32_t MessageType, const uint8_t* Payload, uint32_t Size)
+{
+	static Bytes Out;
+	Out.Size = 0;
+	Write(Sender, &Out, ChunkStreamId, Format, Timestamp, MessageType, Payload, Size);
+	Feed(Receiver, &Out);
+
+	RtmpChunk* Chunk = RTMP__GetChunk(Receiver, ChunkStreamId, false);
+	CHECK(!Receiver->Disconnect);
+	CHECK(Chunk && Chunk->Received == 0);
+	return Chunk ? Chunk->Timestamp : 0;
+}
+
+static uint8_t Payload[4000];
+
+static void TestBoundaries(void)
+{
+	RtmpStream* Sender = Open();
+	RtmpStream* Receiver = Open();
+	uint32_t Csid = RTMP_CHANNEL_VIDEO;
+
+	struct { uint32_t Format; uint32_t Timestamp; uint32_t Expected; uint32_t Size; } Steps[] =
+	{
+		{ 0, 0,          0,          300 },
+		{ 1, 0x12345678, 0x12345678, 300 }, // first delta after reconnecting to long stream
+		{ 1, 0x12345690, 0x12345690, 300 },
+		{ 0, 0x00fffffe, 0x00fffffe, 300 }, // largest value without extended field
+		{ 0, 0x00ffffff, 0x00ffffff, 300 },
+		{ 1, 0x01000010, 0x01000010, 300 },
+		{ 1, 0x02000010, 0x02000010, 300 }, // delta 0x01000000
+		{ 1, 0x02fffffe, 0x02fffffe, 300 }, // delta 0xffffee fits into 24 bits
+		{ 1, 0x03fffffd, 0x03fffffd, 300 }, // delta 0xffffff is extended
+		{ 1, 0x03fffff0, 0x03fffffd, 300 }, // going back is sent with zero delta
+		{ 1, 0x03fffffe, 0x03fffffe, 4   },
+		{ 0, 0xffffffe0, 0xffffffe0, 300 },
+		{ 1, 0xfffffff8, 0xfffffff8, 300 },
+		{ 1, 0x00000010, 0x00000010, 300 }, // wraps around 2^32
+		{ 1, 0x00000018, 0x00000018, 300 },
+		{ 1, 0x80000017, 0x80000017, 300 }, // largest delta that is still forward
+		{ 1, 0x00000018, 0x80000017, 300 }, // half of 2^32 later is treated as going back
+	};
+
+	uint32_t Before = ExtendedContinuations;
+	for (uint32_t i = 0; i < ARRAYSIZE(Steps); i++)
+	{
+		uint32_t Timestamp = Transfer(Sender, Receiver, Csid, Steps[i].Format, Steps[i].Timestamp, RTMP_PACKET_VIDEO, Payload, Steps[i].Size);
+		CHECK(Timestamp == Steps[i].Expected);
+		CHECK(Sender->SendTimestamp[Csid] == Steps[i].Expected);
+	}
+
+	// 300 byte messages have 2 continuations each, 6 of them have extended field
+	CHECK(ExtendedContinuations - Before == 2 * 6);
+
+	Close(Sender);
+	Close(Receiver);
+}
+
+// media time of both tracks is converted from exact sample/frame counters, reconnect every 6 hours,
+// encoder clock starts 48 days in so 32-bit millisecond timestamps wrap around during soak
+static void TestSoak(void)
+{
+	RtmpStream* Sender = Open();
+	RtmpStream* Receiver = Open();
+	Reconnect(Sender, &Receiver);
+
+	const uint64_t AudioPeriod = 48000; // 1024 samples per frame
+	const uint64_t VideoPeriod = 30000; // 1001 units per frame, 29.97 fps
+	const uint64_t Start = 48ULL * 24 * 3600;
+	const uint64_t Duration = 48ULL * 3600;
+	const uint64_t ReconnectInterval = 6ULL * 3600 * 1000;
+
+	uint64_t AudioTime = Start * AudioPeriod;
+	uint64_t VideoTime = Start * VideoPeriod;
+	uint64_t AudioEnd = (Start + Duration) * AudioPeriod;
+	uint64_t VideoEnd = (Start + Duration) * VideoPeriod;
+	uint64_t NextReconnect = Start * 1000 + ReconnectInterval;
+
+	uint64_t Messages = 0;
+	uint32_t Reconnects = 0;
+	uint32_t Wraps = 0;
+	uint32_t LastAudio = 0;
+	uint32_t Mismatches = 0;
+	uint32_t Before = ExtendedContinuations;
+
+	while (AudioTime < AudioEnd || VideoTime < VideoEnd)
+	{
+		// exact time in units of 1/(AudioPeriod*VideoPeriod) second to pick message with lower DTS
+		bool IsAudio = VideoTime >= VideoEnd || (AudioTime < AudioEnd && AudioTime * VideoPeriod <= VideoTime * AudioPeriod);
+		uint64_t Time = IsAudio ? AudioTime : VideoTime;
+		uint64_t Period = IsAudio ? AudioPeriod : VideoPeriod;
+
+		uint64_t Milliseconds = Time * 1000 / Period;
+		if (Milliseconds >= NextReconnect)
+		{
+			Reconnect(Sender, &Receiver);
+			NextReconnect += ReconnectInterval;
+			Reconnects++;
+		}
+
+		uint32_t Timestamp = RTMP__GetTimestamp(Time, Period);
+		uint32_t Received;
+		if (IsAudio)
+		{
+			Received = Transfer(Sender, Receiver, RTMP_CHANNEL_AUDIO, 1, Timestamp, RTMP_PACKET_AUDIO, Payload, 200);
+			Wraps += Timestamp < LastAudio;
+			LastAudio = Timestamp;
+			AudioTime += 1024;
+		}
+		else
+		{
+			// keyframe every 2 seconds is split into many chunks
+			bool IsKeyFrame = VideoTime / 1001 % 60 == 0;
+			Received = Transfer(Sender, Receiver, RTMP_CHANNEL_VIDEO, 1, Timestamp, RTMP_PACKET_VIDEO, Payload, IsKeyFrame ? sizeof(Payload) : 100);
+			VideoTime += 1001;
+		}
+
+		// every received timestamp is exact media time rounded down, so error never accumulates
+		Mismatches += Received != (uint32_t)Milliseconds;
+		Messages++;
+	}
+
+	CHECK(Mismatches == 0);
+	CHECK(Reconnects == 7);
+	CHECK(Wraps == 1);
+	CHECK(Messages == Duration * AudioPeriod / 1024 + Duration * VideoPeriod / 1001 + 1);
+
+	// last timestamps are within 1 msec of exact end time
+	RtmpChunk* Audio = RTMP__GetChunk(Receiver, RTMP_CHANNEL_AUDIO, false);
+	RtmpChunk* Video = RTMP__GetChunk(Receiver, RTMP_CHANNEL_VIDEO, false);
+	uint32_t End = (uint32_t)((Start + Duration) * 1000);
+	CHECK(Audio && End - Audio->Timestamp <= 1024 * 1000 / AudioPeriod + 1);
+	CHECK(Video && End - Video->Timestamp <= 1001 * 1000 / VideoPeriod + 1);
+
+	// first message after each reconnect has full stream time as delta, keyframe split after it repeats it
+	CHECK(ExtendedContinuations > Before);
+
+	printf("soak: %llu messages, %u reconnects, %u extended continuation chunks\n", (unsigned long long)Messages, Reconnects, ExtendedContinuations - Before);
+
+	Close(Sender);
+	Close(Receiver);
+}
+
+int main(void)
+{
+	TestBoundaries();
+	TestSoak();
+	return TestResult("timestamp_soak_test");
+}
@@ -31,6 +31,86 @@
 // why this is not documented anywhere?
 DEFINE_GUID(MF_XVP_PLAYBACK_MODE, 0x3c5d293f, 0xad67, 0x4e29, 0xaf, 0x12, 0xcf, 0x3e, 0x23, 0x8a, 0xcc, 0xe9);
 
+static void VideoEncoder__SetBitrate(VideoEncoder* Encoder, uint32_t Bitrate)
+{
+	ICodecAPI* Codec;
+	HR(IMFTransform_QueryInterface(Encoder->Encoder, &IID_ICodecAPI, &Codec));
+
+	VARIANT Value;
+	Value.vt = VT_UI4;
+	Value.ulVal = Bitrate * 1000;
+
+	// not all encoders support changing bitrate while encoding, then old bitrate stays
+	ICodecAPI_SetValue(Codec, &CODECAPI_AVEncCommonMeanBitRate, &Value);
+
+	ICodecAPI_Release(Codec);
+}
+
+static void VideoEncoder__ForceKeyFrame(VideoEncoder* Encoder)
+{
+	ICodecAPI* Codec;
+	HR(IMFTransform_QueryInterface(Encoder->Encoder, &IID_ICodecAPI, &Codec));
+
+	VARIANT Value;
+	Value.vt = VT_UI4;
+	Value.ulVal = 1;
+
+	// if encoder does not support this, stream recovers on next regular keyframe
+	ICodecAPI_SetValue(Codec, &CODECAPI_AVEncVideoForceKeyFrame, &Value);
+
+	ICodecAPI_Release(Codec);
+}
+
+// frame is disposable when its slices have nal_ref_idc = 0, picture type is not enough
+// with B-pyramid some B-frames are used as reference by other B-frames
+static bool VideoEncoder__IsDisposable(const BYTE* Data, DWORD Size)
+{
+	// encoder outputs Annex B with start codes, length prefixed NAL units are handled too just in case
+	bool IsAnnexB = Size >= 4 && Data[0] == 0 && Data[1] == 0 && (Data[2] == 1 || (Data[2] == 0 && Data[3] == 1));
+
+	DWORD Pos = 0;
+	for (;;)
+	{
+		DWORD Header;
+		if (IsAnnexB)
+		{
+			// emulation prevention bytes guarantee 00 00 01 appears only as start code
+			if (Size - Pos < 4)
+			{
+				return false;
+			}
+			if (Data[Pos] != 0 || Data[Pos + 1] != 0 || Data[Pos + 2] != 1)
+			{
+				Pos++;
+				continue;
+			}
+			Header = Pos + 3;
+			Pos = Header + 1;
+		}
+		else
+		{
+			if (Size - Pos < 5)
+			{
+				return false;
+			}
+			DWORD Length = (Data[Pos] << 24) | (Data[Pos + 1] << 16) | (Data[Pos + 2] << 8) | Data[Pos + 3];
+			Header = Pos + 4;
+			if (Length == 0 || Length > Size - Header)
+			{
+				return false;
+			}
+			Pos = Header + Length;
+		}
+
+		// coded slice NAL units, all slices of one picture have same nal_ref_idc
+		DWORD NalType = Data[Header] & 0x1f;
+		if (NalType >= 1 && NalType <= 5)
+		{
+			return (Data[Header] & 0x60) == 0;
+		}
+	}
+}
+
 static DWORD WINAPI VideoEncoder__Thread(LPVOID Arg)
 {
 	VideoEncoder* Encoder = Arg;
@@ -61,6 +141,18 @@ static DWORD WINAPI VideoEncoder__Thread(LPVOID Arg)
 				size_t Index = Encoder->InputQueuedIndex;
 				Encoder->InputQueuedIndex = (Index + 1) % VIDEO_ENCODER_BUFFER_COUNT;
 
+				// encoder is used only from this thread, so bitrate changes are applied here
+				LONG Bitrate = InterlockedExchange(&Encoder->NewBitrate, 0);
+				if (Bitrate != 0)
+				{
+					VideoEncoder__SetBitrate(Encoder, Bitrate);
+				}
+
+				if (InterlockedExchange(&Encoder->NewKeyFrame, 0))
+				{
+					VideoEncoder__ForceKeyFrame(Encoder);
+				}
+
 				IMFSample* Input = Encoder->EncoderInput[Index];
 				hr = IMFTransform_ProcessInput(Encoder->Encoder, 0, Input, 0);
 				IMFSample_Release(Input);
@@ -100,11 +192,22 @@ static DWORD WINAPI VideoEncoder__Thread(LPVOID Arg)
 						DecodeTime = PresentTime;
 					}
 
-					Encoder->Callback(Encoder, DecodeTime, PresentTime, MF_UNITS_PER_SECOND, Type == eAVEncH264PictureType_IDR, Data, Size);
+					Encoder->OutputBuffer = Buffer;
+					Encoder->OutputData = Data;
+					Encoder->OutputSize = Size;
+					Encoder->Callback(Encoder, DecodeTime, PresentTime, MF_UNITS_PER_SECOND, Type == eAVEncH264PictureType_IDR, VideoEncoder__IsDisposable(Data, Size), Data, Size);
 
-					HR(IMFMediaBuffer_Unlock(Buffer));
+					if (Encoder->OutputBuffer)
+					{
+						HR(IMFMediaBuffer_Unlock(Buffer));
+						IMFMediaBuffer_Release(Buffer);
+					}
+					Encoder->OutputBuffer = NULL;
+				}
+				else
+				{
+					IMFMediaBuffer_Release(Buffer);
 				}
-				IMFMediaBuffer_Release(Buffer);
 			}
 			IMFSample_Release(Output.pSample);
 		}
@@ -375,7 +478,11 @@ void VideoEncoder_Init(VideoEncoder* Encoder, ID3D11Device* Device, const VideoE
 	Encoder->FramerateNum = Config->FramerateNum;
 	Encoder->FramerateDen = Config->FramerateDen;
 
+	Encoder->OutputBuffer = NULL;
+	Encoder->HeldFrames = 0;
 	Encoder->Callback = Callback;
+	Encoder->NewBitrate = 0;
+	Encoder->NewKeyFrame = 0;
 
 	Encoder->Stop = CreateEventW(NULL, FALSE, FALSE, NULL);
 	Assert(Encoder->Stop);
@@ -485,3 +592,60 @@ bool VideoEncoder_Encode(VideoEncoder* Encoder, uint64_t Time, uint64_t TimePeri
 
 	return true;
 }
+
+void VideoEncoder_SetBitrate(VideoEncoder* Encoder, uint32_t Bitrate)
+{
+	Assert(Bitrate != 0);
+	InterlockedExchange(&Encoder->NewBitrate, Bitrate);
+}
+
+void VideoEncoder_ForceKeyFrame(VideoEncoder* Encoder)
+{
+	InterlockedExchange(&Encoder->NewKeyFrame, 1);
+}
+
+typedef struct {
+	VideoEncoder* Encoder;
+	IMFMediaBuffer* Buffer; // NULL when data was copied, then copy follows this header
+} VideoEncoderFrame;
+
+void* VideoEncoder_HoldFrame(VideoEncoder* Encoder, const void** Data)
+{
+	IMFMediaBuffer* Buffer = Encoder->OutputBuffer;
+	Assert(Buffer);
+
+	VideoEncoderFrame* Frame;
+	if (InterlockedIncrement(&Encoder->HeldFrames) <= VIDEO_ENCODER_MAX_HELD)
+	{
+		// buffer stays locked, encoder thread will not unlock & release it after callback returns
+		Frame = HeapAlloc(GetProcessHeap(), 0, sizeof(*Frame));
+		Assert(Frame);
+		Frame->Buffer = Buffer;
+		Encoder->OutputBuffer = NULL;
+	}
+	else
+	{
+		// too many buffers held, encoder would run out of them - encoder thread releases this one as usual
+		InterlockedDecrement(&Encoder->HeldFrames);
+
+		Frame = HeapAlloc(GetProcessHeap(), 0, sizeof(*Frame) + Encoder->OutputSize);
+		Assert(Frame);
+		Frame->Buffer = NULL;
+		CopyMemory(Frame + 1, Encoder->OutputData, Encoder->OutputSize);
+		*Data = Frame + 1;
+	}
+	Frame->Encoder = Encoder;
+	return Frame;
+}
+
+void VideoEncoder_ReleaseFrame(void* Arg)
+{
+	VideoEncoderFrame* Frame = Arg;
+	if (Frame->Buffer)
+	{
+		HR(IMFMediaBuffer_Unlock(Frame->Buffer));
+		IMFMediaBuffer_Release(Frame->Buffer);
+		InterlockedDecrement(&Frame->Encoder->HeldFrames);
+	}
+	HeapFree(GetProcessHeap(), 0, Frame);
+}
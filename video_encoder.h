@@ -8,9 +8,11 @@
 #include <stdbool.h>
 
 #define VIDEO_ENCODER_BUFFER_COUNT 8
+#define VIDEO_ENCODER_MAX_HELD 4 // encoder output buffers held at same time, frames over this are copied
 
 typedef struct VideoEncoder VideoEncoder;
-typedef void VideoEncoder_Callback(VideoEncoder* Encoder, uint64_t DecodeTime, uint64_t PresentTime, uint64_t TimePeriod, bool IsKeyFrame, const void* Data, const uint32_t Size);
+// IsDisposable is set for frames that no other frame uses as reference, from nal_ref_idc of H.264 slices
+typedef void VideoEncoder_Callback(VideoEncoder* Encoder, uint64_t DecodeTime, uint64_t PresentTime, uint64_t TimePeriod, bool IsKeyFrame, bool IsDisposable, const void* Data, const uint32_t Size);
 
 typedef struct VideoEncoder {
 	IMFTransform* Converter;
@@ -37,7 +39,15 @@ typedef struct VideoEncoder {
 	ID3D11DeviceContext* Context;
 	ID3D11Texture2D* InputTexture;
 
+	IMFMediaBuffer* OutputBuffer;
+	const void* OutputData;
+	uint32_t OutputSize;
+	volatile LONG HeldFrames; // output buffers currently held by VideoEncoder_HoldFrame
+
 	VideoEncoder_Callback* Callback;
+
+	volatile LONG NewBitrate; // kbit/s, applied by encoder thread before next input, 0 when there is no change
+	volatile LONG NewKeyFrame; // nonzero when next input should be encoded as keyframe
 } VideoEncoder;
 
 typedef struct {
@@ -54,4 +64,18 @@ void VideoEncoder_Init(VideoEncoder* Encoder, ID3D11Device* Device, const VideoE
 void VideoEncoder_Done(VideoEncoder* Encoder);
 
 uint32_t VideoEncoder_GetHeader(VideoEncoder* Encoder, uint8_t* Header, uint32_t MaxSize);
+
+// changes target bitrate while encoding, takes effect from next encoded frame, can be called from any thread
+void VideoEncoder_SetBitrate(VideoEncoder* Encoder, uint32_t Bitrate);
+
+// next submitted frame will be encoded as keyframe, use after skipping frames so stream can be decoded again
+void VideoEncoder_ForceKeyFrame(VideoEncoder* Encoder);
+
 bool VideoEncoder_Encode(VideoEncoder* Encoder, uint64_t Time, uint64_t TimePeriod, const RECT* Rect, ID3D11Texture2D* Texture);
+
+// call only from inside callback, takes ownership of frame data so it stays valid after callback returns
+// returned frame must be released with VideoEncoder_ReleaseFrame, can be done from any thread
+// hardware encoders can have small pool of output buffers, so only VIDEO_ENCODER_MAX_HELD of them are held
+// after that frame data is copied, Data is updated to point to data that stays valid until frame is released
+void* VideoEncoder_HoldFrame(VideoEncoder* Encoder, const void** Data);
+void VideoEncoder_ReleaseFrame(void* Frame);
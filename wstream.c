@@ -11,6 +11,7 @@
 #include "audio_encoder.h"
 
 #include "rtmp_stream.h"
+#include "rate_control.h"
 
 #include <stddef.h>
 #include <stdarg.h>
@@ -38,18 +39,34 @@
 #define AUDIO_RATE 48000
 
 #define STREAM_BUFFER_SIZE (((VIDEO_BITRATE + AUDIO_BITRATE) * 1000 / 8) * 2)
+#define STREAM_MAX_LATENCY 1000 // msec
+#define STREAM_GOP_CACHE (STREAM_BUFFER_SIZE / 2) // bytes, one copy of last GOP shared by all destinations for replay after reconnect
+#define STREAM_MAX_SENDS 4
+#define STREAM_PACE_RATE 150 // percent of stream bitrate
+#define STREAM_PACE_BURST (2 * 1000 / VIDEO_FRAMERATE) // msec
+#define STREAM_COALESCE_SIZE 4096
+#define STREAM_COALESCE_DELAY 5000 // usec
+#define STREAM_PROBE_TIME 2000 // msec, 0 disables bandwidth probe that picks initial video bitrate
+#define STREAM_PROBE_MIN_BITRATE 500 // kbit/s, lowest video bitrate probe can choose
+#define STREAM_RATE_INTERVAL 250 // msec, how often adaptive bitrate controller checks stream queues, 0 disables it
+#define STREAM_RATE_MIN_BITRATE 300 // kbit/s, lowest video bitrate controller can choose
+#define STREAM_MUX_WAIT 40 // msec, how long audio or video packet can wait for other track to be interleaved in DTS order
+#define STREAM_MUX_REPORT 10000 // msec between printing interleaving latency & stream statistics
 
 typedef struct {
 	VideoCapture VideoCapture;
 	VideoEncoder VideoEncoder;
 	AudioCapture AudioCapture;
 	AudioEncoder AudioEncoder;
-	RtmpStream Stream;
+	RtmpStream Streams[RTMP_MAX_DESTINATIONS];
+	RtmpFanout Fanout;
+	RtmpMux Mux;
 
 	LARGE_INTEGER Freq;
 	uint64_t NextFrame;
 	uint64_t VideoStart;
 	uint64_t AudioStart;
+	bool Congested;
 } WStream;
 
 static void print(const char* msg, ...)
@@ -101,6 +118,26 @@ static void VideoCapture_OnData(VideoCapture* Capture, const VideoCaptureData* D
 		}
 	}
 
+	// backpressure from network, do not waste time encoding frames that would be dropped anyway
+	if (DoEncode)
+	{
+		if (RTMP_FanoutIsCongested(&W->Fanout))
+		{
+			if (!W->Congested)
+			{
+				print("RTMP: congested, skipping video encoding\n");
+				W->Congested = true;
+			}
+			DoEncode = false;
+		}
+		else if (W->Congested)
+		{
+			// previous frames were skipped, so next one must be decodable on its own
+			VideoEncoder_ForceKeyFrame(&W->VideoEncoder);
+			W->Congested = false;
+		}
+	}
+
 	if (DoEncode)
 	{
 		if (!VideoEncoder_Encode(&W->VideoEncoder, Time, W->Freq.QuadPart, &Data->Rect, Data->Texture))
@@ -110,7 +147,7 @@ static void VideoCapture_OnData(VideoCapture* Capture, const VideoCaptureData* D
 	}
 }
 
-static void VideoEncoder_OnFrame(VideoEncoder* Encoder, uint64_t DecodeTime, uint64_t PresentTime, uint64_t TimePeriod, bool IsKeyFrame, const void* Data, const uint32_t Size)
+static void VideoEncoder_OnFrame(VideoEncoder* Encoder, uint64_t DecodeTime, uint64_t PresentTime, uint64_t TimePeriod, bool IsKeyFrame, bool IsDisposable, const void* Data, const uint32_t Size)
 {
 	WStream* W = CONTAINING_RECORD(Encoder, WStream, VideoEncoder);
 
@@ -118,10 +155,10 @@ static void VideoEncoder_OnFrame(VideoEncoder* Encoder, uint64_t DecodeTime, uin
 	uint64_t pts = PresentTime * 1000 / TimePeriod;
 	print("V: dts=%u.%03u pts=%u.%03u (%u bytes) %s\n", (uint32_t)(dts / 1000), (uint32_t)(dts % 1000), (uint32_t)(pts / 1000), (uint32_t)(pts % 1000), Size, IsKeyFrame ? "keyframe" : "");
 
-	if (!RTMP_SendVideo(&W->Stream, DecodeTime, PresentTime, TimePeriod, Data, Size, IsKeyFrame))
-	{
-		print("RTMP: dropped video frame\n");
-	}
+	// encoded data is sent directly from encoder output buffer, or from copy when too many buffers are held, released once it is sent
+	const void* FrameData = Data;
+	void* Frame = VideoEncoder_HoldFrame(Encoder, &FrameData);
+	RTMP_MuxVideoRef(&W->Mux, DecodeTime, PresentTime, TimePeriod, FrameData, Size, IsKeyFrame, IsDisposable, &VideoEncoder_ReleaseFrame, Frame);
 }
 
 static void AudioCapture_OnData(AudioCapture* Capture, const AudioCaptureData* Data)
@@ -143,10 +180,7 @@ static void AudioCapture_OnData(AudioCapture* Capture, const AudioCaptureData* D
 		uint64_t t = EncoderOutput.Time * 1000 / EncoderOutput.TimePeriod;
 		print("A: %u.%03u (%u bytes)\n", (uint32_t)(t / 1000), (uint32_t)(t % 1000), EncoderOutput.Size);
 
-		if (!RTMP_SendAudio(&W->Stream, EncoderOutput.Time, EncoderOutput.TimePeriod, EncoderOutput.Data, EncoderOutput.Size))
-		{
-			print("RTMP: dropped audio packet\n");
-		}
+		RTMP_MuxAudio(&W->Mux, EncoderOutput.Time, EncoderOutput.TimePeriod, EncoderOutput.Data, EncoderOutput.Size);
 
 		AudioEncoder_ReleaseOutput(&W->AudioEncoder);
 	}
@@ -178,29 +212,72 @@ void mainCRTStartup()
 	HMONITOR Monitor = MonitorFromWindow(GetDesktopWindow(), MONITOR_DEFAULTTOPRIMARY);
 	Assert(Monitor);
 
-#if 1
-	// http://server:8080/admin/
-	const char* StreamUrl = "rtmp://server:1935/live";
-	const char* StreamKey = "abc123";
-#elif 0
-	// Twitch URL from https://stream.twitch.tv/ingests/
-	// Twitch key from https://dashboard.twitch.tv/ (Settings -> Stream)
-	const char* StreamUrl = "rtmp://sea.contribute.live-video.net/app"; 
-	const char* StreamKey = "<<PUT_YOUR_TWITCH_KEY_HERE>>";
-#else
-	// YouTube url & key from https://youtube.com/livestreaming/stream
-	const char* StreamUrl = "rtmp://a.rtmp.youtube.com/live2";
-	const char* StreamKey = "<<PUT_YOUR_YOUTUBE_KEY_HERE>>";
+	// same encoded stream is sent to all destinations
+	const char* StreamDestinations[][2] =
+	{
+		// http://server:8080/admin/
+		{ "rtmp://server:1935/live", "abc123" },
+#if 0
+		// Twitch URL from https://stream.twitch.tv/ingests/
+		// Twitch key from https://dashboard.twitch.tv/ (Settings -> Stream)
+		{ "rtmp://sea.contribute.live-video.net/app", "<<PUT_YOUR_TWITCH_KEY_HERE>>" },
 #endif
+#if 0
+		// YouTube url & key from https://youtube.com/livestreaming/stream
+		{ "rtmp://a.rtmp.youtube.com/live2", "<<PUT_YOUR_YOUTUBE_KEY_HERE>>" },
+#endif
+	};
+	const uint32_t StreamCount = (uint32_t)ARRAYSIZE(StreamDestinations);
 
 	WStream W;
 	QueryPerformanceFrequency(&W.Freq);
 	W.NextFrame = 0;
 	W.VideoStart = 0;
 	W.AudioStart = 0;
+	W.Congested = false;
 
-	// start connection to rtmp server
-	RTMP_Init(&W.Stream, StreamUrl, StreamKey, STREAM_BUFFER_SIZE);
+	// start connection to rtmp servers
+	RtmpStream* Streams[ARRAYSIZE(StreamDestinations)];
+	for (uint32_t i = 0; i < StreamCount; i++)
+	{
+		RtmpStream* Stream = &W.Streams[i];
+		RTMP_Init(Stream, StreamDestinations[i][0], StreamDestinations[i][1], STREAM_BUFFER_SIZE);
+		RTMP_SetMaxQueueLatency(Stream, STREAM_MAX_LATENCY);
+		RTMP_SetMaxSends(Stream, STREAM_MAX_SENDS);
+		RTMP_SetPacing(Stream, VIDEO_BITRATE + AUDIO_BITRATE, STREAM_PACE_RATE, STREAM_PACE_BURST);
+		RTMP_SetCoalescing(Stream, STREAM_COALESCE_SIZE, STREAM_COALESCE_DELAY);
+		Streams[i] = Stream;
+	}
+	RTMP_FanoutInit(&W.Fanout, Streams, StreamCount);
+	RTMP_FanoutSetGopCache(&W.Fanout, STREAM_GOP_CACHE);
+	RTMP_MuxInit(&W.Mux, &W.Fanout, STREAM_MUX_WAIT);
+
+	// wait until rtmp protocol finishes handshake with first destination and is ready to accept data
+	RtmpStream* FirstStream = NULL;
+	while (!FirstStream)
+	{
+		for (uint32_t i = 0; i < StreamCount && !FirstStream; i++)
+		{
+			FirstStream = RTMP_IsStreaming(&W.Streams[i]) ? &W.Streams[i] : NULL;
+		}
+		Sleep(1);
+	}
+
+	uint32_t VideoBitrate = VIDEO_BITRATE;
+	if (STREAM_PROBE_TIME)
+	{
+		// weak uplink would start by overflowing outgoing buffer, so measure it first
+		uint32_t Bitrate = RTMP_ProbeBandwidth(FirstStream, STREAM_PROBE_MIN_BITRATE + AUDIO_BITRATE, VIDEO_BITRATE + AUDIO_BITRATE, STREAM_PROBE_TIME);
+		if (Bitrate != 0)
+		{
+			VideoBitrate = max(Bitrate - min(Bitrate, AUDIO_BITRATE), STREAM_PROBE_MIN_BITRATE);
+			for (uint32_t i = 0; i < StreamCount; i++)
+			{
+				RTMP_SetPacing(&W.Streams[i], VideoBitrate + AUDIO_BITRATE, STREAM_PACE_RATE, STREAM_PACE_BURST);
+			}
+		}
+		print("RTMP: probe recommends %u kbit/s, using %u kbit/s for video\n", Bitrate, VideoBitrate);
+	}
 
 	// initialize video capture
 	VideoCapture_Init();
@@ -216,7 +293,7 @@ void mainCRTStartup()
 		.InputHeight = W.VideoCapture.Rect.bottom - W.VideoCapture.Rect.top,
 		.OutputWidth = VIDEO_WIDTH,
 		.OutputHeight = VIDEO_HEIGHT,
-		.Bitrate = VIDEO_BITRATE,
+		.Bitrate = VideoBitrate,
 		.FramerateNum = VIDEO_FRAMERATE,
 		.FramerateDen = 1,
 	};
@@ -236,12 +313,6 @@ void mainCRTStartup()
 	};
 	AudioEncoder_Create(&W.AudioEncoder, &AudioEnc);
 
-	// wait until rtmp protocol finishes handshake and is ready to accept data
-	while (!RTMP_IsStreaming(&W.Stream))
-	{
-		Sleep(1);
-	}
-
 	// start the actual capture
 	VideoCapture_Start(&W.VideoCapture, true);
 	AudioCapture_Start(&W.AudioCapture);
@@ -250,10 +321,11 @@ void mainCRTStartup()
 	uint8_t VideoHeader[1024];
 	RtmpVideoConfig VideoStream =
 	{
+		.Codec = RTMP_VIDEO_CODEC_AVC,
 		.Width = VIDEO_WIDTH,
 		.Height = VIDEO_HEIGHT,
 		.FrameRate = VIDEO_FRAMERATE,
-		.Bitrate = VIDEO_BITRATE,
+		.Bitrate = VideoBitrate,
 		.Header = VideoHeader,
 		.HeaderSize = VideoEncoder_GetHeader(&W.VideoEncoder, VideoHeader, sizeof(VideoHeader)),
 	};
@@ -261,6 +333,7 @@ void mainCRTStartup()
 	uint8_t AudioHeader[1024];
 	RtmpAudioConfig AudioStream =
 	{
+		.Codec = RTMP_AUDIO_CODEC_AAC,
 		.SampleRate = AUDIO_RATE,
 		.Bitrate = AUDIO_BITRATE,
 		.Channels = 2,
@@ -268,16 +341,112 @@ void mainCRTStartup()
 		.HeaderSize = AudioEncoder_GetHeader(&W.AudioEncoder, AudioHeader, sizeof(AudioHeader)),
 	};
 
-	RTMP_SendConfig(&W.Stream, &VideoStream, &AudioStream);
+	// loop to only send config to each destination once it connects - all the capture & encoding & sending happens in background threads from callbacks
+	// after reconnecting, config is sent again by rtmp stream itself
+	bool Configured[ARRAYSIZE(StreamDestinations)] = { 0 };
+
+	// adaptive bitrate controller adjusts video encoder bitrate to state of outgoing queues
+	RateControl Rate;
+	RateControl_Init(&Rate, VideoBitrate, min(STREAM_RATE_MIN_BITRATE, VideoBitrate), VIDEO_BITRATE);
+	uint64_t NextRateUpdate = GetTickCount64() + STREAM_RATE_INTERVAL;
+	uint64_t RateDropped[ARRAYSIZE(StreamDestinations)] = { 0 };
+	uint32_t RateDroppedTotal = 0;
+	uint64_t NextMuxReport = GetTickCount64() + STREAM_MUX_REPORT;
 
-	// loop to do nothing - all the capture & encoding & sending happens in background threads from callbacks
 	for (;;)
 	{
+		for (uint32_t i = 0; i < StreamCount; i++)
+		{
+			if (!Configured[i] && RTMP_IsStreaming(&W.Streams[i]))
+			{
+				RTMP_SendConfig(&W.Streams[i], &VideoStream, &AudioStream);
+				Configured[i] = true;
+			}
+		}
+
+		if (STREAM_RATE_INTERVAL != 0 && GetTickCount64() >= NextRateUpdate)
+		{
+			NextRateUpdate = GetTickCount64() + STREAM_RATE_INTERVAL;
+
+			// with multiple destinations the worst one decides bitrate, as all of them share same encoded stream
+			RtmpNetworkStats Worst = { 0 };
+			bool Streaming = false;
+			for (uint32_t i = 0; i < StreamCount; i++)
+			{
+				RtmpNetworkStats Stats;
+				RTMP_GetNetworkStats(&W.Streams[i], &Stats);
+
+				// only drops caused by congestion count, not frames dropped while destination was not ready or reconnecting
+				RtmpStats Counters;
+				RTMP_GetStats(&W.Streams[i], &Counters);
+				const RtmpTrackStats* Video = &Counters.Tracks[RTMP_TRACK_VIDEO];
+				uint64_t Dropped = Video->Dropped[RTMP_DROP_REASON_POLICY] + Video->Dropped[RTMP_DROP_REASON_EXPIRED];
+
+				uint64_t NewDropped = Dropped - RateDropped[i];
+				RateDropped[i] = Dropped;
+
+				if (RTMP_IsStreaming(&W.Streams[i]))
+				{
+					// running total only grows, so destinations connecting & disconnecting do not look like new drops
+					RateDroppedTotal += (uint32_t)NewDropped;
+					Worst.QueueUsage = max(Worst.QueueUsage, Stats.QueueUsage);
+					Worst.QueueDelay = max(Worst.QueueDelay, Stats.QueueDelay);
+					Worst.Bandwidth = Worst.Bandwidth == 0 ? Stats.Bandwidth : Stats.Bandwidth == 0 ? Worst.Bandwidth : min(Worst.Bandwidth, Stats.Bandwidth);
+					Streaming = true;
+				}
+			}
+
+			Worst.Dropped = RateDroppedTotal;
+			uint32_t Bitrate = Streaming ? RateControl_Update(&Rate, &Worst) : 0;
+			if (Bitrate != 0)
+			{
+				print("RTMP: changing video bitrate to %u kbit/s\n", Bitrate);
+				VideoEncoder_SetBitrate(&W.VideoEncoder, Bitrate);
+				for (uint32_t i = 0; i < StreamCount; i++)
+				{
+					RTMP_SetPacing(&W.Streams[i], Bitrate + AUDIO_BITRATE, STREAM_PACE_RATE, STREAM_PACE_BURST);
+				}
+			}
+		}
+
+		if (GetTickCount64() >= NextMuxReport)
+		{
+			NextMuxReport = GetTickCount64() + STREAM_MUX_REPORT;
+
+			uint32_t Average, Max;
+			RTMP_MuxGetLatency(&W.Mux, &Average, &Max);
+			print("RTMP: interleaving latency avg=%u.%03u max=%u.%03u msec\n", Average / 1000, Average % 1000, Max / 1000, Max % 1000);
+
+			// outgoing buffer high-water mark shows how much of STREAM_BUFFER_SIZE is really needed
+			for (uint32_t i = 0; i < StreamCount; i++)
+			{
+				RtmpStats Stats;
+				RTMP_GetStats(&W.Streams[i], &Stats);
+
+				uint64_t VideoDropped = 0;
+				uint64_t AudioDropped = 0;
+				for (uint32_t r = 0; r < RTMP_DROP_REASON_COUNT; r++)
+				{
+					VideoDropped += Stats.Tracks[RTMP_TRACK_VIDEO].Dropped[r];
+					AudioDropped += Stats.Tracks[RTMP_TRACK_AUDIO].Dropped[r];
+				}
+
+				print("RTMP[%u]: buffer max=%u/%u KiB, delay p50=%u p99=%u msec, dropped video=%u audio=%u, blocked=%u msec, reconnects=%u (%u attempts)\n",
+					i, Stats.SendHighWater / 1024, Stats.SendSize / 1024, Stats.DelayP50, Stats.DelayP99,
+					(uint32_t)VideoDropped, (uint32_t)AudioDropped, (uint32_t)(Stats.BlockedTime / 1000), Stats.Reconnects, Stats.ReconnectAttempts);
+			}
+		}
+
 		Sleep(1);
 	}
 
 	// TODO: proper shutdown
-	RTMP_Done(&W.Stream);
+	RTMP_MuxDone(&W.Mux);
+	for (uint32_t i = 0; i < StreamCount; i++)
+	{
+		RTMP_Done(&W.Streams[i]);
+	}
+	RTMP_FanoutDone(&W.Fanout);
 
 	AudioEncoder_Destroy(&W.AudioEncoder);
 